@@ -27,7 +27,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include "..\opblib.h"
+#include "../opblib.h"
 
 void GetFilename(char* path, char* result, size_t maxLen) {
     int lastSlash = -1;
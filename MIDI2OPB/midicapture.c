@@ -0,0 +1,387 @@
+/*
+//  MIT License
+//
+//  Copyright (c) 2023 Eniko Fox/Emma Maassen
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//  SOFTWARE.
+*/
+#ifdef _WIN32
+#define _CRT_SECURE_NO_DEPRECATE
+#define strdup _strdup
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "midicapture.h"
+
+// route every register write opl.h makes to CaptureRegisterWrite instead of the emulator
+#define OPL_IMPLEMENTATION
+#define OPL_REGWR_HOOK CaptureRegisterWrite
+#include "../OPB2WAV/opl.h"
+
+#define DEFAULT_TEMPO 500000 // microseconds per quarter note (120 bpm)
+
+static void Log(const char* message) {
+    if (OPB_Log) OPB_Log(message);
+}
+
+// CaptureStream is a simple dynamic array which doubles in size when it runs out of capacity
+typedef struct CaptureStream {
+    size_t Count;
+    size_t Capacity;
+    OPB_Command* Stream;
+    double Time;
+    bool OutOfMemory;
+} CaptureStream;
+
+// the capture target is passed to opl_create_regwr so each opl_t writes to its own stream
+void CaptureRegisterWrite(opl_t* opl, uint16_t reg, uint8_t data) {
+    CaptureStream* capture = (CaptureStream*)opl_regwr_data(opl);
+    if (capture == NULL || capture->OutOfMemory) {
+        return;
+    }
+
+    if (capture->Count >= capture->Capacity) {
+        size_t newCapacity = capture->Capacity < 1024 ? 1024 : capture->Capacity * 2;
+        OPB_Command* newStream = (OPB_Command*)realloc(capture->Stream, newCapacity * sizeof(OPB_Command));
+        if (newStream == NULL) {
+            capture->OutOfMemory = true;
+            return;
+        }
+        capture->Stream = newStream;
+        capture->Capacity = newCapacity;
+    }
+
+    OPB_Command cmd = { reg, data, capture->Time };
+    capture->Stream[capture->Count++] = cmd;
+}
+
+typedef struct MidiEvent {
+    uint32_t Tick;
+    uint32_t Order;     // position in file, keeps events with the same tick in their original order
+    uint32_t Tempo;     // only used by tempo events
+    uint8_t Status;     // 0xFF for tempo events
+    uint8_t Data1;
+    uint8_t Data2;
+} MidiEvent;
+
+typedef struct MidiEvents {
+    size_t Count;
+    size_t Capacity;
+    MidiEvent* Events;
+} MidiEvents;
+
+static bool MidiEvents_Add(MidiEvents* events, MidiEvent ev) {
+    if (events->Count >= events->Capacity) {
+        size_t newCapacity = events->Capacity < 256 ? 256 : events->Capacity * 2;
+        MidiEvent* newEvents = (MidiEvent*)realloc(events->Events, newCapacity * sizeof(MidiEvent));
+        if (newEvents == NULL) {
+            return false;
+        }
+        events->Events = newEvents;
+        events->Capacity = newCapacity;
+    }
+    ev.Order = (uint32_t)events->Count;
+    events->Events[events->Count++] = ev;
+    return true;
+}
+
+static int SortEvents(const void* a, const void* b) {
+    const MidiEvent* evA = (const MidiEvent*)a;
+    const MidiEvent* evB = (const MidiEvent*)b;
+    if (evA->Tick != evB->Tick) {
+        return evA->Tick < evB->Tick ? -1 : 1;
+    }
+    return evA->Order < evB->Order ? -1 : (evA->Order > evB->Order ? 1 : 0);
+}
+
+static inline uint32_t ReadBE32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint16_t ReadBE16(const uint8_t* p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+// reads a MIDI variable length quantity, returns false if it runs past the end of the data
+static bool ReadVarLen(const uint8_t* data, size_t size, size_t* pos, uint32_t* value) {
+    uint32_t result = 0;
+    for (int i = 0; i < 4; i++) {
+        if (*pos >= size) return false;
+        uint8_t b = data[(*pos)++];
+        result = (result << 7) | (b & 0x7F);
+        if ((b & 0x80) == 0) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+static int ParseTrack(MidiEvents* events, const uint8_t* data, size_t size, uint32_t startTick, uint32_t* endTick) {
+    size_t pos = 0;
+    uint32_t tick = startTick;
+    uint8_t running = 0;
+
+    while (pos < size) {
+        uint32_t delta;
+        if (!ReadVarLen(data, size, &pos, &delta) || pos >= size) {
+            Log("Error reading MIDI file: track data truncated\n");
+            return OPBERR_LOGGED;
+        }
+        tick += delta;
+
+        uint8_t status = data[pos];
+        if (status & 0x80) {
+            pos++;
+        }
+        else if (running != 0) {
+            status = running;
+        }
+        else {
+            Log("Error reading MIDI file: data byte without running status\n");
+            return OPBERR_LOGGED;
+        }
+
+        if (status == 0xFF) {
+            uint32_t len;
+            if (pos >= size) return OPBERR_READ_ERROR;
+            uint8_t type = data[pos++];
+            if (!ReadVarLen(data, size, &pos, &len) || len > size - pos) {
+                Log("Error reading MIDI file: meta event truncated\n");
+                return OPBERR_LOGGED;
+            }
+
+            if (type == 0x51 && len == 3) {
+                MidiEvent ev = { tick, 0, ((uint32_t)data[pos] << 16) | ((uint32_t)data[pos + 1] << 8) | data[pos + 2], 0xFF };
+                if (!MidiEvents_Add(events, ev)) return OPBERR_BUFFER_ERROR;
+            }
+            pos += len;
+
+            if (type == 0x2F) {
+                break; // end of track
+            }
+        }
+        else if (status == 0xF0 || status == 0xF7) {
+            uint32_t len;
+            if (!ReadVarLen(data, size, &pos, &len) || len > size - pos) {
+                Log("Error reading MIDI file: sysex event truncated\n");
+                return OPBERR_LOGGED;
+            }
+            pos += len;
+            running = 0;
+        }
+        else {
+            int type = status & 0xF0;
+            size_t argCount = (type == 0xC0 || type == 0xD0) ? 1 : 2;
+            if (argCount > size - pos) {
+                Log("Error reading MIDI file: channel event truncated\n");
+                return OPBERR_LOGGED;
+            }
+
+            MidiEvent ev = { tick, 0, 0, status, data[pos], argCount > 1 ? data[pos + 1] : 0 };
+            if (!MidiEvents_Add(events, ev)) return OPBERR_BUFFER_ERROR;
+
+            pos += argCount;
+            running = status;
+        }
+    }
+
+    *endTick = tick;
+    return 0;
+}
+
+static int ParseMidi(MidiEvents* events, const uint8_t* data, size_t size, uint16_t* division) {
+    if (size < 14 || memcmp(data, "MThd", 4) || ReadBE32(data + 4) < 6) {
+        Log("Error reading MIDI file: not a standard MIDI file\n");
+        return OPBERR_LOGGED;
+    }
+
+    uint16_t format = ReadBE16(data + 8);
+    uint16_t trackCount = ReadBE16(data + 10);
+    *division = ReadBE16(data + 12);
+
+    if (*division == 0) {
+        Log("Error reading MIDI file: invalid time division\n");
+        return OPBERR_LOGGED;
+    }
+
+    size_t pos = 8 + ReadBE32(data + 4);
+    uint32_t startTick = 0;
+
+    for (int track = 0; track < trackCount && pos <= size - 8; ) {
+        uint32_t chunkSize = ReadBE32(data + pos + 4);
+        const uint8_t* chunk = data + pos + 8;
+        bool isTrack = !memcmp(data + pos, "MTrk", 4);
+
+        pos += 8;
+        if (chunkSize > size - pos) {
+            chunkSize = (uint32_t)(size - pos);
+        }
+        pos += chunkSize;
+
+        if (!isTrack) {
+            continue; // skip unknown chunks
+        }
+
+        uint32_t endTick;
+        int ret = ParseTrack(events, chunk, chunkSize, startTick, &endTick);
+        if (ret) return ret;
+
+        // format 2 files contain sequential tracks, the others play all tracks at once
+        if (format == 2) {
+            startTick = endTick;
+        }
+        track++;
+    }
+
+    qsort(events->Events, events->Count, sizeof(MidiEvent), SortEvents);
+    return 0;
+}
+
+// plays the MIDI events through opl.h and captures all register writes
+static int CaptureMidi(const uint8_t* midiData, size_t midiSize, const void* bankData, size_t bankSize, const char* ibkFile, CaptureStream* capture) {
+    MidiEvents events = { 0 };
+    uint16_t division;
+
+    int ret = ParseMidi(&events, midiData, midiSize, &division);
+    if (ret) {
+        free(events.Events);
+        return ret;
+    }
+
+    capture->Time = 0;
+
+    opl_t* opl = opl_create_regwr(capture);
+    if (opl == NULL) {
+        free(events.Events);
+        return OPBERR_BUFFER_ERROR;
+    }
+
+    if ((bankData != NULL && opl_loadbank_op2(opl, bankData, (int)bankSize)) ||
+        (ibkFile != NULL && opl_loadbank_ibk(opl, ibkFile))) {
+        Log("Error loading instrument bank\n");
+        ret = OPBERR_LOGGED;
+    }
+
+    uint32_t tempo = DEFAULT_TEMPO;
+    uint32_t lastTick = 0;
+    double time = 0;
+
+    for (size_t i = 0; i < events.Count && !ret; i++) {
+        MidiEvent* ev = events.Events + i;
+
+        if (division & 0x8000) {
+            // SMPTE time division: frames per second times ticks per frame
+            int framesPerSecond = -(int8_t)(division >> 8);
+            int ticksPerFrame = division & 0xFF;
+            time += (ev->Tick - lastTick) / (double)(framesPerSecond * ticksPerFrame);
+        }
+        else {
+            time += (ev->Tick - lastTick) * (tempo / 1000000.0) / division;
+        }
+        lastTick = ev->Tick;
+        capture->Time = time;
+
+        int channel = ev->Status & 0x0F;
+        switch (ev->Status & 0xF0) {
+        case 0x80:
+            opl_midi_noteoff(opl, channel, ev->Data1);
+            break;
+        case 0x90:
+            opl_midi_noteon(opl, channel, ev->Data1, ev->Data2);
+            break;
+        case 0xB0:
+            opl_midi_controller(opl, channel, ev->Data1, ev->Data2);
+            break;
+        case 0xC0:
+            opl_midi_changeprog(opl, channel, ev->Data1);
+            break;
+        case 0xE0:
+            // opl.h expects the pitch wheel to be in the range -128 to 127
+            opl_midi_pitchwheel(opl, channel, (((ev->Data2 << 7) | ev->Data1) - 8192) / 64);
+            break;
+        case 0xF0:
+            if (ev->Status == 0xFF) {
+                tempo = ev->Tempo;
+            }
+            break;
+        }
+    }
+
+    // silence all channels at the end of the song
+    opl_clear(opl);
+
+    free(opl);
+    free(events.Events);
+
+    if (!ret && capture->OutOfMemory) {
+        Log("Out of memory capturing OPL command stream\n");
+        ret = OPBERR_LOGGED;
+    }
+    return ret;
+}
+
+int MidiToBinary(OPB_Format format, const void* midiData, size_t midiSize, const void* bankData, size_t bankSize,
+    OPB_StreamWriter write, OPB_StreamSeeker seek, OPB_StreamTeller tell, void* userData) {
+    CaptureStream capture = { 0 };
+
+    int ret = CaptureMidi((const uint8_t*)midiData, midiSize, bankData, bankSize, NULL, &capture);
+    if (!ret) {
+        ret = OPB_OplToStream(format, capture.Stream, capture.Count, write, userData);
+    }
+
+    free(capture.Stream);
+    return ret;
+}
+
+static bool IsIbkFile(const char* file) {
+    size_t len = strlen(file);
+    return len >= 4 && file[len - 4] == '.' &&
+        (file[len - 3] == 'i' || file[len - 3] == 'I') &&
+        (file[len - 2] == 'b' || file[len - 2] == 'B') &&
+        (file[len - 1] == 'k' || file[len - 1] == 'K');
+}
+
+int MidiFileToFile(OPB_Format format, const char* midiFile, const char* bankFile, const char* opbFile) {
+    void* midiData = NULL;
+    void* bankData = NULL;
+    size_t midiSize, bankSize = 0;
+
+    int ret = OPB_ReadFile(midiFile, &midiData, &midiSize);
+    if (ret) return ret;
+
+    if (bankFile != NULL && !IsIbkFile(bankFile) && (ret = OPB_ReadFile(bankFile, &bankData, &bankSize))) {
+        free(midiData);
+        return ret;
+    }
+
+    CaptureStream capture = { 0 };
+    ret = CaptureMidi((const uint8_t*)midiData, midiSize, bankData, bankSize, bankFile != NULL && IsIbkFile(bankFile) ? bankFile : NULL, &capture);
+    if (!ret) {
+        ret = OPB_OplToFile(format, capture.Stream, capture.Count, opbFile);
+    }
+
+    free(capture.Stream);
+    free(bankData);
+    free(midiData);
+    return ret;
+}
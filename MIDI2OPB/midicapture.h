@@ -0,0 +1,48 @@
+/*
+//  MIT License
+//
+//  Copyright (c) 2023 Eniko Fox/Emma Maassen
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//  SOFTWARE.
+*/
+#pragma once
+#include <stddef.h>
+#include "../opblib.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // These belong to the MIDI2OPB tool rather than to opblib, which would otherwise have to carry opl.h and its
+    // register write hook. Each call captures through its own opl_t, so conversions can run on several threads.
+
+    // Standard MIDI File to OPB binary. The MIDI events are played through opl.h's MIDI layer without rendering
+    // any audio, and every OPL register write it makes is captured with its timestamp and sent to the OPB encoder.
+    // bankData may point to an OP2 (#OPL_II#) bank, or be NULL to use opl.h's default General MIDI bank.
+    // seek and tell are not used and may be NULL. Returns 0 if successful.
+    int MidiToBinary(OPB_Format format, const void* midiData, size_t midiSize, const void* bankData, size_t bankSize,
+        OPB_StreamWriter write, OPB_StreamSeeker seek, OPB_StreamTeller tell, void* userData);
+
+    // Standard MIDI File to OPB file. bankFile may be an OP2 or IBK bank, or NULL to use the default bank.
+    // Returns 0 if successful.
+    int MidiFileToFile(OPB_Format format, const char* midiFile, const char* bankFile, const char* opbFile);
+
+#ifdef __cplusplus
+}
+#endif
@@ -30,7 +30,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
-#include "..\opblib.h"
+#include "../opblib.h"
 
 #define OPL_IMPLEMENTATION
 #include "opl.h"
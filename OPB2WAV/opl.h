@@ -49,6 +49,13 @@ typedef struct opl_t opl_t;
  * Returns 0 for OPL2 initialization, or 1 if OPL3 has been detected */
 opl_t* opl_create( void );
 
+/* same as opl_create, storing a pointer for OPL_REGWR_HOOK before the first
+ * register write; the hook reads it back with opl_regwr_data */
+opl_t* opl_create_regwr( void* regwr_data );
+
+/* returns the pointer passed to opl_create_regwr, or NULL */
+void* opl_regwr_data( opl_t* opl );
+
 /* close OPL device */
 void opl_destroy( opl_t* opl );
 
@@ -1863,11 +1870,23 @@ struct opl_t {
   struct opl_timbre_t opl_gmtimbres_voice2[ 256 ]; /* second voice included in OP2 format */
   int is_op2; /* true if OP2 soundbank */
   enum op2_flags_t op2_flags[ 256 ]; /* OP2 format flags */
+  int voicescount; /* number of melodic voices: 9 (OPL2) or 18 (OPL3) */
+  void* regwr_data; /* user data for OPL_REGWR_HOOK */
 };
 
 
+/* define OPL_REGWR_HOOK as the name of a function to receive every register
+ * write instead of the emulator, for capturing the OPL command stream */
+#ifdef OPL_REGWR_HOOK
+void OPL_REGWR_HOOK( opl_t* opl, uint16_t reg, uint8_t data );
+#endif
+
 void oplregwr( opl_t* opl, uint16_t reg, uint8_t data ) {
+#ifdef OPL_REGWR_HOOK
+    OPL_REGWR_HOOK( opl, reg, data );
+#else
     opl_emu_write( &opl->opl_emu, reg, data );
+#endif
 }
 
 
@@ -2255,10 +2274,6 @@ static struct opl_timbre_t opl_gmtimbres_default[ 256 ] = {
 const unsigned short op1offsets[18] = {0x00,0x01,0x02,0x08,0x09,0x0a,0x10,0x11,0x12,0x100,0x101,0x102,0x108,0x109,0x10a,0x110,0x111,0x112};
 const unsigned short op2offsets[18] = {0x03,0x04,0x05,0x0b,0x0c,0x0d,0x13,0x14,0x15,0x103,0x104,0x105,0x10b,0x10c,0x10d,0x113,0x114,0x115};
 
-/* number of melodic voices: 9 by default (OPL2), can go up to 18 (OPL3) */
-static int voicescount = 9;
-
-
 /* 'volume' is in range 0..127 - take care to change only the 'attenuation'
  * part of the register, and never touch the KSL bits */
 static void calc_vol(unsigned char *regbyte, int volume) {
@@ -2287,9 +2302,15 @@ static void calc_vol(unsigned char *regbyte, int volume) {
 /* Initialize hardware upon startup - positive on success, negative otherwise
  * Returns 0 for OPL2 initialization, or 1 if OPL3 has been detected */
 opl_t* opl_create(void) {
+  return opl_create_regwr(NULL);
+}
+
+
+opl_t* opl_create_regwr(void* regwr_data) {
   /* init memory */
   struct opl_t* opl = (struct opl_t*)calloc(1, sizeof(struct opl_t));
   if (opl == NULL) return NULL;
+  opl->regwr_data = regwr_data;
   memcpy( opl->opl_gmtimbres, opl_gmtimbres_default, sizeof( opl_gmtimbres_default ) );
   opl_emu_init( &opl->opl_emu );
 
@@ -2318,13 +2339,13 @@ opl_t* opl_create(void) {
   /*if ((inp(port) & 0x06) == 0) */opl->opl3 = 1;
 
   /* init the hardware */
-  voicescount = 9; /* OPL2 provides 9 melodic voices */
+  opl->voicescount = 9; /* OPL2 provides 9 melodic voices */
 
   /* enable OPL3 (if detected) and put it into 36 operators mode */
   if (opl->opl3 != 0) {
     oplregwr(opl, 0x105, 1);  /* enable OPL3 mode (36 operators) */
     oplregwr(opl, 0x104, 0);  /* disable four-operator voices */
-    voicescount = 18;          /* OPL3 provides 18 melodic channels */
+    opl->voicescount = 18;     /* OPL3 provides 18 melodic channels */
 
     /* Init the secondary OPL chip
      * NOTE: this I don't do anymore, it turns my Aztech Waverider mute! */
@@ -2338,7 +2359,7 @@ opl_t* opl_create(void) {
   oplregwr(opl, 0x08, 0x40);  /* turn off CSW mode and activate FM synth mode */
   oplregwr(opl, 0xBD, 0x00);  /* set vibrato/tremolo depth to low, set melodic mode */
 
-  for (int x = 0; x < voicescount; x++) {
+  for (int x = 0; x < opl->voicescount; x++) {
     oplregwr(opl, 0x20 + op1offsets[x], 0x1);     /* set the modulator's multiple to 1 */
     oplregwr(opl, 0x20 + op2offsets[x], 0x1);     /* set the modulator's multiple to 1 */
     oplregwr(opl, 0x40 + op1offsets[x], 0x10);    /* set volume of all channels to about 40 dB */
@@ -2359,7 +2380,7 @@ void opl_destroy(opl_t* opl) {
   opl_clear(opl);
 
   /* set volume to lowest level on all voices */
-  for (x = 0; x < voicescount; x++) {
+  for (x = 0; x < opl->voicescount; x++) {
     oplregwr(opl, 0x40 + op1offsets[x], 0x1f);
     oplregwr(opl, 0x40 + op2offsets[x], 0x1f);
   }
@@ -2372,6 +2393,11 @@ void opl_destroy(opl_t* opl) {
   opl = NULL;
 }
 
+
+void* opl_regwr_data(opl_t* opl) {
+  return opl->regwr_data;
+}
+
 void opl_noteoff(opl_t* opl, unsigned short voice) {
   /* if voice is one of the OPL3 set, adjust it and route over secondary OPL port */
   if (voice >= 9) {
@@ -2414,13 +2440,13 @@ void opl_noteon(opl_t* opl, unsigned short voice, unsigned int note, int pitch)
 /* turns off all notes */
 void opl_clear(opl_t* opl) {
   int x, y;
-  for (x = 0; x < voicescount; x++) opl_noteoff(opl, x);
+  for (x = 0; x < opl->voicescount; x++) opl_noteoff(opl, x);
 
   /* reset the percussion bits at the 0xBD register */
   oplregwr(opl, 0xBD, 0);
 
   /* mark all voices as unused */
-  for (x = 0; x < voicescount; x++) {
+  for (x = 0; x < opl->voicescount; x++) {
     opl->voices2notes[x].channel = -1;
     opl->voices2notes[x].note = -1;
     opl->voices2notes[x].timbreid = -1;
@@ -2451,7 +2477,7 @@ void opl_midi_pitchwheel(opl_t* opl, int channel, int pitchwheel) {
 //  opl->channelpitch[channel] = pitchwheel;
   /* check all active voices to see who is playing on given channel now, and
    * recompute all playing notes for this channel with the new pitch TODO */
-  for (x = 0; x < voicescount; x++) {
+  for (x = 0; x < opl->voicescount; x++) {
     if (opl->voices2notes[x].channel != channel) continue;
     
     opl_timbre_t* timbre = opl->voices2notes[x].voiceindex == 0
@@ -2471,7 +2497,7 @@ void opl_midi_controller(opl_t* opl, int channel, int id, int value) {
       break;
     case 123: /* 'all notes off' */
     case 120: /* 'all sound off' - I map it to 'all notes off' for now, not perfect but better than not handling it at all */
-      for (x = 0; x < voicescount; x++) {
+      for (x = 0; x < opl->voicescount; x++) {
         if (opl->voices2notes[x].channel != channel) continue;
         opl_midi_noteoff(opl, channel, opl->voices2notes[x].note);
       }
@@ -2573,7 +2599,7 @@ void opl_midi_noteon_op2(opl_t* opl, int channel, int note, int velocity, int vi
     voice = opl->notes2voices[channel][note][vindex];
   } else {
     /* else find a free voice, possibly with the right timbre, or at least locate the oldest note */
-    for (x = 0; x < voicescount; x++) {
+    for (x = 0; x < opl->voicescount; x++) {
       if (opl->voices2notes[x].channel < 0) {
         voice = x; /* preselect this voice, but continue looking */
         /* if the instrument is right, do not look further */
@@ -2634,7 +2660,7 @@ void opl_midi_noteon_op2(opl_t* opl, int channel, int note, int velocity, int vi
   }
 
   /* reajust all priorities */
-  for (x = 0; x < voicescount; x++) {
+  for (x = 0; x < opl->voicescount; x++) {
     if (opl->voices2notes[x].priority > 0) opl->voices2notes[x].priority -= 1;
   }
 }
@@ -0,0 +1,1144 @@
+/*
+//  MIT License
+//
+//  Copyright (c) 2023 Eniko Fox/Emma Maassen
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//  SOFTWARE.
+*/
+#ifdef _WIN32
+#define _CRT_SECURE_NO_DEPRECATE
+#define WIN32_LEAN_AND_MEAN
+#define strdup _strdup
+#include <windows.h>
+#include <direct.h>
+#else
+#define _POSIX_C_SOURCE 200809L
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "../opblib.h"
+
+#define OPL_IMPLEMENTATION
+#include "../OPB2WAV/opl.h"
+
+// Converts many files at once: VGM/VGZ files and OPB files (raw captures included) to OPB, or OPB files to WAV.
+// Files are spread over a pool of worker threads. Every worker starts with its own queue of files and steals from
+// the other queues once it runs out, so a few long songs don't leave the other threads idle at the end of a run.
+// Each worker converts one file at a time with its own buffers, which bounds memory to the worker count times the
+// largest file.
+//
+// With --make-dictionary a first pass over the inputs collects the instruments their OPB output would store, and the
+// ones shared by several files go into an instrument dictionary that the second pass encodes against.
+//
+// In archive mode the inputs are encoded to memory against such a dictionary and stored in a single archive file,
+// each track named after its input's path without the extension.
+
+#define SAMPLE_RATE 44100
+#define MAX_SAMPLES 44100
+#define DEFAULT_MAX_SIZE_MB 256
+#define DEFAULT_SLOWEST 5
+#define DICTIONARY_MIN_FILES 2
+
+// threads
+#ifdef _WIN32
+typedef HANDLE Thread;
+typedef CRITICAL_SECTION Mutex;
+#define Mutex_Init(m) InitializeCriticalSection(m)
+#define Mutex_Destroy(m) DeleteCriticalSection(m)
+#define Mutex_Lock(m) EnterCriticalSection(m)
+#define Mutex_Unlock(m) LeaveCriticalSection(m)
+#else
+typedef pthread_t Thread;
+typedef pthread_mutex_t Mutex;
+#define Mutex_Init(m) pthread_mutex_init(m, NULL)
+#define Mutex_Destroy(m) pthread_mutex_destroy(m)
+#define Mutex_Lock(m) pthread_mutex_lock(m)
+#define Mutex_Unlock(m) pthread_mutex_unlock(m)
+#endif
+
+static int CpuCount(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+static double Now(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+typedef enum BatchMode {
+    BatchMode_Opb,  // VGM, VGZ or OPB to OPB
+    BatchMode_Wav,  // OPB to WAV
+    BatchMode_Archive, // VGM, VGZ or OPB to tracks of a single OPB archive
+    BatchMode_Dictionary, // count instruments for --make-dictionary, writes no files
+} BatchMode;
+
+typedef struct BatchOptions {
+    BatchMode Mode;
+    OPB_Format Format;
+    const char* OutputDir;          // the archive file in archive mode
+    int Threads;
+    uint64_t MaxSize;
+    int Slowest;
+    bool Verbose;
+    const char* DictionaryFile;
+    bool MakeDictionary;            // build DictionaryFile from the inputs instead of loading it
+    OPB_Dictionary* Dictionary;
+    bool BackReferences;
+    uint32_t TimeBase;
+    double CoalesceWindow;
+    bool VoiceCommands;
+    bool GroupInstruments;
+    bool DeltaFrequencies;
+    int InstrumentEffort;
+} BatchOptions;
+
+#define ERR_TOO_LARGE -1
+#define ERR_UNKNOWN_INPUT -2
+#define ERR_OUT_OF_MEMORY -3
+#define ERR_OUTPUT -4
+#define ERR_DUPLICATE_OUTPUT -5
+
+static const char* GetBatchErrorMessage(int error) {
+    switch (error) {
+    case ERR_TOO_LARGE:
+        return "File is larger than --max-size";
+    case ERR_UNKNOWN_INPUT:
+        return "Not a VGM, VGZ or OPB file";
+    case ERR_OUT_OF_MEMORY:
+        return "Out of memory";
+    case ERR_OUTPUT:
+        return "Couldn't write output file";
+    case ERR_DUPLICATE_OUTPUT:
+        return "Another input converts to the same output file";
+    default:
+        return OPB_GetErrorMessage(error);
+    }
+}
+
+// jobs
+typedef struct Job {
+    char* Input;
+    char* Output;
+    uint64_t Size;
+    double Seconds;
+    int Error;
+    uint8_t* Data;          // encoded track in archive mode
+    size_t DataSize;
+} Job;
+
+typedef struct JobList {
+    size_t Count;
+    size_t Capacity;
+    Job* Jobs;
+} JobList;
+
+static char* JoinPath(const char* a, const char* b) {
+    size_t lengthA = strlen(a), lengthB = strlen(b);
+    char* result = (char*)malloc(lengthA + lengthB + 2);
+    if (result == NULL) return NULL;
+
+    memcpy(result, a, lengthA);
+    size_t pos = lengthA;
+    if (pos > 0 && a[pos - 1] != '/' && a[pos - 1] != '\\') result[pos++] = '/';
+    memcpy(result + pos, b, lengthB + 1);
+    return result;
+}
+
+static const char* GetExtension(const char* path) {
+    const char* dot = NULL;
+    for (const char* p = path; *p; p++) {
+        if (*p == '.') dot = p;
+        else if (*p == '/' || *p == '\\') dot = NULL;
+    }
+    return dot != NULL ? dot : path + strlen(path);
+}
+
+static bool HasExtension(const char* path, const char* ext) {
+    const char* actual = GetExtension(path);
+    while (*actual && *ext) {
+        char c = *actual++;
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        if (c != *ext++) return false;
+    }
+    return *actual == '\0' && *ext == '\0';
+}
+
+static bool IsAcceptedInput(const BatchOptions* options, const char* path) {
+    if (options->Mode == BatchMode_Wav) {
+        return HasExtension(path, ".opb");
+    }
+    return HasExtension(path, ".opb") || HasExtension(path, ".vgm") || HasExtension(path, ".vgz");
+}
+
+// relative is the part of the input path that's kept below the output directory
+static int AddJob(JobList* list, const BatchOptions* options, const char* input, const char* relative, uint64_t size) {
+    if (list->Count >= list->Capacity) {
+        size_t newCapacity = list->Capacity < 64 ? 64 : list->Capacity * 2;
+        Job* newJobs = (Job*)realloc(list->Jobs, newCapacity * sizeof(Job));
+        if (newJobs == NULL) return ERR_OUT_OF_MEMORY;
+        list->Jobs = newJobs;
+        list->Capacity = newCapacity;
+    }
+
+    // archive tracks are named after the relative path without an extension
+    const char* ext = options->Mode == BatchMode_Wav ? ".wav" : (options->Mode == BatchMode_Archive ? "" : ".opb");
+    size_t stem = (size_t)(GetExtension(relative) - relative);
+
+    char* name = (char*)malloc(stem + strlen(ext) + 1);
+    if (name == NULL) return ERR_OUT_OF_MEMORY;
+    memcpy(name, relative, stem);
+    strcpy(name + stem, ext);
+
+    Job job = { 0 };
+    job.Input = strdup(input);
+    job.Size = size;
+    if (options->Mode == BatchMode_Archive) {
+        job.Output = name;
+    }
+    else {
+        job.Output = JoinPath(options->OutputDir, name);
+        free(name);
+    }
+
+    if (job.Input == NULL || job.Output == NULL) {
+        free(job.Input);
+        free(job.Output);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    list->Jobs[list->Count++] = job;
+    return 0;
+}
+
+static void JobList_Free(JobList* list) {
+    for (size_t i = 0; i < list->Count; i++) {
+        free(list->Jobs[i].Input);
+        free(list->Jobs[i].Output);
+        free(list->Jobs[i].Data);
+    }
+    free(list->Jobs);
+}
+
+// file system
+static bool GetFileInfo(const char* path, bool* isDir, uint64_t* size) {
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &data)) return false;
+    *isDir = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+    *size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+#else
+    struct stat st;
+    if (stat(path, &st)) return false;
+    *isDir = S_ISDIR(st.st_mode);
+    *size = (uint64_t)st.st_size;
+#endif
+    return true;
+}
+
+static int MakeDirectory(const char* path) {
+#ifdef _WIN32
+    return _mkdir(path) == 0 || GetLastError() == ERROR_ALREADY_EXISTS ? 0 : -1;
+#else
+    return mkdir(path, 0777) == 0 || errno == EEXIST ? 0 : -1;
+#endif
+}
+
+// creates every directory leading up to the file at path
+static int MakeParentDirectories(const char* path) {
+    char* dir = strdup(path);
+    if (dir == NULL) return -1;
+
+    int ret = 0;
+    for (char* p = dir + 1; *p && !ret; p++) {
+        if (*p != '/' && *p != '\\') continue;
+        char sep = *p;
+        *p = '\0';
+        if (p[-1] != ':') ret = MakeDirectory(dir); // skip drive letters
+        *p = sep;
+    }
+
+    free(dir);
+    return ret;
+}
+
+// adds every accepted file below dir, relative names start at root
+static int AddDirectory(JobList* list, const BatchOptions* options, const char* dir, size_t rootLength) {
+    int ret = 0;
+
+#ifdef _WIN32
+    char* pattern = JoinPath(dir, "*");
+    if (pattern == NULL) return ERR_OUT_OF_MEMORY;
+
+    WIN32_FIND_DATAA entry;
+    HANDLE find = FindFirstFileA(pattern, &entry);
+    free(pattern);
+    if (find == INVALID_HANDLE_VALUE) return 0;
+
+    do {
+        const char* name = entry.cFileName;
+#else
+    DIR* handle = opendir(dir);
+    if (handle == NULL) {
+        fprintf(stderr, "Couldn't open directory '%s'\n", dir);
+        return 0;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(handle)) != NULL && !ret) {
+        const char* name = entry->d_name;
+#endif
+        if (!strcmp(name, ".") || !strcmp(name, "..")) continue;
+
+        char* path = JoinPath(dir, name);
+        if (path == NULL) {
+            ret = ERR_OUT_OF_MEMORY;
+            break;
+        }
+
+        bool isDir;
+        uint64_t size;
+        if (GetFileInfo(path, &isDir, &size)) {
+            if (isDir) ret = AddDirectory(list, options, path, rootLength);
+            else if (IsAcceptedInput(options, path)) ret = AddJob(list, options, path, path + rootLength, size);
+        }
+        free(path);
+#ifdef _WIN32
+    } while (!ret && FindNextFileA(find, &entry));
+    FindClose(find);
+#else
+    }
+    closedir(handle);
+#endif
+
+    return ret;
+}
+
+static int AddInput(JobList* list, const BatchOptions* options, const char* input);
+
+// manifests list one input per line, relative to the working directory. empty lines and lines starting with # are skipped
+static int AddManifest(JobList* list, const BatchOptions* options, const char* manifest) {
+    FILE* file = fopen(manifest, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Couldn't open manifest '%s'\n", manifest);
+        return ERR_UNKNOWN_INPUT;
+    }
+
+    char line[4096];
+    int ret = 0;
+    while (!ret && fgets(line, sizeof(line), file) != NULL) {
+        size_t length = strlen(line);
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r' || line[length - 1] == ' ' || line[length - 1] == '\t')) {
+            line[--length] = '\0';
+        }
+
+        const char* path = line;
+        while (*path == ' ' || *path == '\t') path++;
+        if (*path == '\0' || *path == '#') continue;
+
+        ret = AddInput(list, options, path);
+    }
+
+    fclose(file);
+    return ret;
+}
+
+static int AddInput(JobList* list, const BatchOptions* options, const char* input) {
+    if (input[0] == '@') {
+        return AddManifest(list, options, input + 1);
+    }
+
+    bool isDir;
+    uint64_t size;
+    if (!GetFileInfo(input, &isDir, &size)) {
+        fprintf(stderr, "Couldn't find '%s'\n", input);
+        return ERR_UNKNOWN_INPUT;
+    }
+
+    if (isDir) {
+        // keep the directory structure below the input directory
+        size_t rootLength = strlen(input);
+        while (input[rootLength] == '\0' && rootLength > 0 && (input[rootLength - 1] == '/' || input[rootLength - 1] == '\\')) rootLength--;
+        return AddDirectory(list, options, input, rootLength + 1);
+    }
+
+    const char* name = input;
+    for (const char* p = input; *p; p++) {
+        if (*p == '/' || *p == '\\') name = p + 1;
+    }
+    return AddJob(list, options, input, name, size);
+}
+
+// per worker conversion state, reused from one file to the next
+typedef struct CommandStream {
+    size_t Count;
+    size_t Capacity;
+    OPB_Command* Stream;
+} CommandStream;
+
+static int ReceiveOpbBuffer(OPB_Command* commandStream, size_t commandCount, void* context) {
+    CommandStream* cmds = (CommandStream*)context;
+
+    if (cmds->Count + commandCount > cmds->Capacity) {
+        size_t newCapacity = cmds->Capacity < 256 ? 256 : cmds->Capacity;
+        while (newCapacity < cmds->Count + commandCount) newCapacity *= 2;
+
+        OPB_Command* newStream = (OPB_Command*)realloc(cmds->Stream, newCapacity * sizeof(OPB_Command));
+        if (newStream == NULL) return -1;
+        cmds->Stream = newStream;
+        cmds->Capacity = newCapacity;
+    }
+
+    memcpy(cmds->Stream + cmds->Count, commandStream, commandCount * sizeof(OPB_Command));
+    cmds->Count += commandCount;
+    return 0;
+}
+
+// renders commands as they're decoded, so WAV output never needs the whole song in memory
+typedef struct WavWriter {
+    FILE* File;
+    opl_t* Opl;
+    short* Buffer;
+    double Time;
+    uint64_t DataLength;
+} WavWriter;
+
+static int RenderOpbBuffer(OPB_Command* commandStream, size_t commandCount, void* context) {
+    WavWriter* wav = (WavWriter*)context;
+
+    for (size_t i = 0; i < commandCount; i++) {
+        OPB_Command cmd = commandStream[i];
+
+        if (cmd.Time > wav->Time) {
+            // same sample count per gap as OPB2WAV, so both produce identical files
+            int samples = (int)((cmd.Time - wav->Time) * SAMPLE_RATE);
+            wav->Time = cmd.Time;
+
+            while (samples > 0) {
+                int count = samples <= MAX_SAMPLES ? samples : MAX_SAMPLES;
+                opl_render(wav->Opl, wav->Buffer, count, 0.95f);
+                if (fwrite(wav->Buffer, sizeof(short), (size_t)count * 2, wav->File) != (size_t)count * 2) return -1;
+                wav->DataLength += (uint64_t)count * 4;
+                samples -= count;
+            }
+        }
+
+        opl_write(wav->Opl, 1, &cmd.Addr, &cmd.Data);
+    }
+    return 0;
+}
+
+static bool WriteWavHeader(FILE* file, uint32_t dataLength) {
+    uint32_t fields[] = {
+        0x46464952, 36 + dataLength, 0x45564157, // "RIFF", file length - 8, "WAVE"
+        0x20746D66, 16, 0x00020001, SAMPLE_RATE, SAMPLE_RATE * 4, 0x00100004, // "fmt ", PCM stereo, 16 bits
+        0x61746164, dataLength, // "data"
+    };
+    return fwrite(fields, sizeof(fields), 1, file) == 1;
+}
+
+typedef struct Worker {
+    struct Pool* Pool;
+    int Index;
+    CommandStream Commands;
+    short* RenderBuffer;
+    size_t Stolen;
+    Mutex* DictionaryLock;  // held while adding instruments to the shared dictionary
+} Worker;
+
+static int ReadInput(const BatchOptions* options, const Job* job, uint8_t** data, size_t* size) {
+    if (job->Size > options->MaxSize) return ERR_TOO_LARGE;
+
+    FILE* file = fopen(job->Input, "rb");
+    if (file == NULL) return OPBERR_READ_ERROR;
+
+    *size = (size_t)job->Size;
+    *data = (uint8_t*)malloc(*size > 0 ? *size : 1);
+
+    int ret = 0;
+    if (*data == NULL) ret = ERR_OUT_OF_MEMORY;
+    else if (fread(*data, 1, *size, file) != *size) ret = OPBERR_READ_ERROR;
+
+    fclose(file);
+    if (ret) {
+        free(*data);
+        *data = NULL;
+    }
+    return ret;
+}
+
+static size_t WriteToFile(const void* buffer, size_t elementSize, size_t elementCount, void* context) {
+    return fwrite(buffer, elementSize, elementCount, (FILE*)context);
+}
+
+// growable buffer for OPB output that is only needed in memory
+typedef struct OutputBuffer {
+    uint8_t* Data;
+    size_t Size;
+    size_t Capacity;
+} OutputBuffer;
+
+static size_t WriteToBuffer(const void* buffer, size_t elementSize, size_t elementCount, void* context) {
+    OutputBuffer* output = (OutputBuffer*)context;
+    size_t length = elementSize * elementCount;
+
+    if (output->Size + length > output->Capacity) {
+        size_t newCapacity = output->Capacity < 4096 ? 4096 : output->Capacity;
+        while (newCapacity < output->Size + length) newCapacity *= 2;
+
+        uint8_t* newData = (uint8_t*)realloc(output->Data, newCapacity);
+        if (newData == NULL) return 0;
+        output->Data = newData;
+        output->Capacity = newCapacity;
+    }
+
+    memcpy(output->Data + output->Size, buffer, length);
+    output->Size += length;
+    return elementCount;
+}
+
+static bool IsVgm(const uint8_t* data, size_t size) {
+    return (size >= 4 && !memcmp(data, "Vgm ", 4)) || (size >= 2 && data[0] == 0x1F && data[1] == 0x8B);
+}
+
+// decodes an OPB input into the worker's command stream. validating first rejects corrupt files without decoding them
+static int DecodeInput(Worker* worker, OPB_Dictionary* dictionary, const uint8_t* data, size_t size) {
+    int ret = OPB_Validate(data, size, NULL);
+    if (ret) return ret == OPBERR_NOT_AN_OPB_FILE ? ERR_UNKNOWN_INPUT : ret;
+
+    OPB_DecodeOptions decodeOptions = { 0 };
+    decodeOptions.Dictionary = dictionary;
+
+    worker->Commands.Count = 0;
+    return OPB_MemoryToOplEx(data, size, ReceiveOpbBuffer, &worker->Commands, &decodeOptions);
+}
+
+// encodes an input to OPB the same way ConvertToOpb would without a dictionary and counts its instruments
+static int CollectInstruments(Worker* worker, const BatchOptions* options, const uint8_t* data, size_t size) {
+    OutputBuffer output = { 0 };
+    int ret;
+
+    if (IsVgm(data, size)) {
+        ret = OPB_VgmToStreamEx(OPB_Format_Default, data, size, WriteToBuffer, &output, NULL);
+    }
+    // the dictionary is still being built by the other workers, and no input can have been encoded against it
+    else if (!(ret = DecodeInput(worker, NULL, data, size))) {
+        ret = OPB_OplToStreamEx(OPB_Format_Default, worker->Commands.Stream, worker->Commands.Count,
+            WriteToBuffer, &output, NULL);
+    }
+
+    if (!ret) {
+        Mutex_Lock(worker->DictionaryLock);
+        ret = OPB_DictionaryAddBinary(options->Dictionary, output.Data, output.Size);
+        Mutex_Unlock(worker->DictionaryLock);
+    }
+
+    free(output.Data);
+    return ret;
+}
+
+static int ConvertToOpb(Worker* worker, const BatchOptions* options, Job* job, const uint8_t* data, size_t size) {
+    OPB_EncodeOptions encodeOptions = { 0 };
+    encodeOptions.Dictionary = options->Dictionary;
+    encodeOptions.BackReferences = options->BackReferences;
+    encodeOptions.TimeBase = options->TimeBase;
+    encodeOptions.CoalesceWindow = options->CoalesceWindow;
+    encodeOptions.VoiceCommands = options->VoiceCommands;
+    encodeOptions.GroupInstruments = options->GroupInstruments;
+    encodeOptions.DeltaFrequencies = options->DeltaFrequencies;
+    encodeOptions.InstrumentEffort = options->InstrumentEffort;
+
+    // everything that isn't VGM is re-encoded, which turns raw captures into the default format or applies new options
+    int ret = 0;
+    if (!IsVgm(data, size) && (ret = DecodeInput(worker, options->Dictionary, data, size))) {
+        return ret;
+    }
+
+    // archive tracks are kept in memory until every input is done
+    OutputBuffer buffer = { 0 };
+    OPB_StreamWriter write = WriteToBuffer;
+    void* out = &buffer;
+
+    if (options->Mode != BatchMode_Archive) {
+        if ((out = fopen(job->Output, "wb")) == NULL) return ERR_OUTPUT;
+        write = WriteToFile;
+    }
+
+    if (IsVgm(data, size)) {
+        ret = OPB_VgmToStreamEx(options->Format, data, size, write, out, &encodeOptions);
+    }
+    else {
+        ret = OPB_OplToStreamEx(options->Format, worker->Commands.Stream, worker->Commands.Count,
+            write, out, &encodeOptions);
+    }
+
+    if (options->Mode != BatchMode_Archive) {
+        if (fclose((FILE*)out) && !ret) ret = ERR_OUTPUT;
+    }
+    else if (ret) {
+        free(buffer.Data);
+    }
+    else {
+        job->Data = buffer.Data;
+        job->DataSize = buffer.Size;
+    }
+    return ret;
+}
+
+static int ConvertToWav(Worker* worker, const BatchOptions* options, const Job* job, const uint8_t* data, size_t size) {
+    int ret = OPB_Validate(data, size, NULL);
+    if (ret) return ret == OPBERR_NOT_AN_OPB_FILE ? ERR_UNKNOWN_INPUT : ret;
+
+    WavWriter wav = { 0 };
+    wav.Buffer = worker->RenderBuffer;
+    if ((wav.File = fopen(job->Output, "wb")) == NULL) return ERR_OUTPUT;
+    if ((wav.Opl = opl_create()) == NULL) {
+        fclose(wav.File);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    if (!WriteWavHeader(wav.File, 0)) ret = ERR_OUTPUT;
+    if (!ret) {
+        OPB_DecodeOptions decodeOptions = { 0 };
+        decodeOptions.Dictionary = options->Dictionary;
+        ret = OPB_MemoryToOplEx(data, size, RenderOpbBuffer, &wav, &decodeOptions);
+    }
+
+    // fill in the lengths now that they're known
+    if (!ret && (fseek(wav.File, 0, SEEK_SET) || !WriteWavHeader(wav.File, (uint32_t)wav.DataLength))) ret = ERR_OUTPUT;
+    if (fclose(wav.File) && !ret) ret = ERR_OUTPUT;
+
+    opl_destroy(wav.Opl);
+    return ret;
+}
+
+static int ConvertJob(Worker* worker, const BatchOptions* options, Job* job) {
+    uint8_t* data;
+    size_t size;
+
+    int ret = ReadInput(options, job, &data, &size);
+    if (ret) return ret;
+
+    if (options->Mode == BatchMode_Dictionary) ret = CollectInstruments(worker, options, data, size);
+    else if (options->Mode == BatchMode_Archive) ret = ConvertToOpb(worker, options, job, data, size);
+    else if (MakeParentDirectories(job->Output)) ret = ERR_OUTPUT;
+    else if (options->Mode == BatchMode_Wav) ret = ConvertToWav(worker, options, job, data, size);
+    else ret = ConvertToOpb(worker, options, job, data, size);
+
+    free(data);
+    return ret;
+}
+
+// work stealing pool
+// jobs are dealt round-robin, largest first, into one queue per worker. owners take from the front of their own
+// queue and thieves from the back of someone else's, so the two rarely contend for the same end
+typedef struct WorkQueue {
+    Mutex Lock;
+    size_t* Jobs;   // indices into the job list
+    size_t Head;
+    size_t Tail;
+} WorkQueue;
+
+typedef struct Pool {
+    JobList* Jobs;
+    WorkQueue* Queues;
+    Worker* Workers;
+    int WorkerCount;
+    const BatchOptions* Options;
+    Mutex OutputLock;
+    Mutex DictionaryLock;
+} Pool;
+
+static bool TakeJob(WorkQueue* queue, bool steal, size_t* job) {
+    bool found = false;
+    Mutex_Lock(&queue->Lock);
+    if (queue->Head < queue->Tail) {
+        *job = steal ? queue->Jobs[--queue->Tail] : queue->Jobs[queue->Head++];
+        found = true;
+    }
+    Mutex_Unlock(&queue->Lock);
+    return found;
+}
+
+static bool NextJob(Worker* worker, size_t* job) {
+    Pool* pool = worker->Pool;
+    if (TakeJob(pool->Queues + worker->Index, false, job)) return true;
+
+    // no new jobs are ever added, so once every queue has been found empty the worker is done
+    for (int i = 1; i < pool->WorkerCount; i++) {
+        if (TakeJob(pool->Queues + (worker->Index + i) % pool->WorkerCount, true, job)) {
+            worker->Stolen++;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void RunWorker(Worker* worker) {
+    Pool* pool = worker->Pool;
+    const BatchOptions* options = pool->Options;
+    size_t index;
+
+    while (NextJob(worker, &index)) {
+        Job* job = pool->Jobs->Jobs + index;
+        if (job->Error) continue;
+
+        double start = Now();
+        job->Error = ConvertJob(worker, options, job);
+        job->Seconds = Now() - start;
+
+        if (job->Error || options->Verbose) {
+            Mutex_Lock(&pool->OutputLock);
+            if (job->Error) fprintf(stderr, "Error converting '%s': %s\n", job->Input, GetBatchErrorMessage(job->Error));
+            else if (options->Mode == BatchMode_Dictionary) printf("%s counted (%.3f s)\n", job->Input, job->Seconds);
+            else printf("%s -> %s (%.3f s)\n", job->Input, job->Output, job->Seconds);
+            Mutex_Unlock(&pool->OutputLock);
+        }
+    }
+}
+
+#ifdef _WIN32
+static DWORD WINAPI WorkerThread(LPVOID arg) {
+    RunWorker((Worker*)arg);
+    return 0;
+}
+#else
+static void* WorkerThread(void* arg) {
+    RunWorker((Worker*)arg);
+    return NULL;
+}
+#endif
+
+static int CompareJobSize(const void* a, const void* b) {
+    uint64_t sizeA = ((const Job*)a)->Size;
+    uint64_t sizeB = ((const Job*)b)->Size;
+    return sizeA < sizeB ? 1 : (sizeA > sizeB ? -1 : 0);
+}
+
+static int CompareJobOutput(const void* a, const void* b) {
+    return strcmp((*(const Job* const*)a)->Output, (*(const Job* const*)b)->Output);
+}
+
+// inputs like song.vgm and song.vgz map to the same output, so all but the first are failed before any work starts
+static int MarkDuplicateOutputs(JobList* jobs) {
+    if (jobs->Count < 2) return 0;
+
+    Job** byOutput = (Job**)malloc(jobs->Count * sizeof(Job*));
+    if (byOutput == NULL) return ERR_OUT_OF_MEMORY;
+
+    for (size_t i = 0; i < jobs->Count; i++) byOutput[i] = jobs->Jobs + i;
+    qsort(byOutput, jobs->Count, sizeof(Job*), CompareJobOutput);
+
+    for (size_t i = 1; i < jobs->Count; i++) {
+        if (!strcmp(byOutput[i]->Output, byOutput[i - 1]->Output)) {
+            byOutput[i]->Error = ERR_DUPLICATE_OUTPUT;
+            fprintf(stderr, "Error converting '%s': %s\n", byOutput[i]->Input, GetBatchErrorMessage(ERR_DUPLICATE_OUTPUT));
+        }
+    }
+
+    free(byOutput);
+    return 0;
+}
+
+static int RunPool(JobList* jobs, const BatchOptions* options, size_t* stolen) {
+    int workerCount = options->Threads;
+    if ((size_t)workerCount > jobs->Count) workerCount = jobs->Count > 0 ? (int)jobs->Count : 1;
+
+    qsort(jobs->Jobs, jobs->Count, sizeof(Job), CompareJobSize);
+
+    Pool pool = { 0 };
+    pool.Jobs = jobs;
+    pool.Options = options;
+    pool.WorkerCount = workerCount;
+    pool.Queues = (WorkQueue*)calloc(workerCount, sizeof(WorkQueue));
+    pool.Workers = (Worker*)calloc(workerCount, sizeof(Worker));
+    Thread* threads = (Thread*)calloc(workerCount, sizeof(Thread));
+    size_t* indices = (size_t*)malloc((jobs->Count > 0 ? jobs->Count : 1) * sizeof(size_t));
+    short* buffers = options->Mode == BatchMode_Wav ? (short*)malloc((size_t)workerCount * MAX_SAMPLES * 2 * sizeof(short)) : NULL;
+
+    if (pool.Queues == NULL || pool.Workers == NULL || threads == NULL || indices == NULL ||
+        (options->Mode == BatchMode_Wav && buffers == NULL)) {
+        free(pool.Queues);
+        free(pool.Workers);
+        free(threads);
+        free(indices);
+        free(buffers);
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    // queue i holds jobs i, i + workerCount, i + 2 * workerCount and so on, stored contiguously
+    size_t start = 0;
+    for (int i = 0; i < workerCount; i++) {
+        WorkQueue* queue = pool.Queues + i;
+        Mutex_Init(&queue->Lock);
+        queue->Jobs = indices + start;
+        for (size_t j = i; j < jobs->Count; j += workerCount) {
+            queue->Jobs[queue->Tail++] = j;
+        }
+        start += queue->Tail;
+
+        Worker* worker = pool.Workers + i;
+        worker->Pool = &pool;
+        worker->Index = i;
+        worker->RenderBuffer = buffers != NULL ? buffers + (size_t)i * MAX_SAMPLES * 2 : NULL;
+        worker->DictionaryLock = &pool.DictionaryLock;
+    }
+    Mutex_Init(&pool.OutputLock);
+    Mutex_Init(&pool.DictionaryLock);
+
+    // the calling thread works as the first worker
+    int started = 1;
+    for (int i = 1; i < workerCount; i++, started++) {
+#ifdef _WIN32
+        if ((threads[i] = CreateThread(NULL, 0, WorkerThread, pool.Workers + i, 0, NULL)) == NULL) break;
+#else
+        if (pthread_create(threads + i, NULL, WorkerThread, pool.Workers + i)) break;
+#endif
+    }
+    RunWorker(pool.Workers);
+
+    for (int i = 1; i < started; i++) {
+#ifdef _WIN32
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], NULL);
+#endif
+    }
+
+    // queues can only be torn down once nobody can steal from them anymore
+    *stolen = 0;
+    for (int i = 0; i < workerCount; i++) {
+        *stolen += pool.Workers[i].Stolen;
+        free(pool.Workers[i].Commands.Stream);
+        Mutex_Destroy(&pool.Queues[i].Lock);
+    }
+    Mutex_Destroy(&pool.OutputLock);
+    Mutex_Destroy(&pool.DictionaryLock);
+
+    free(pool.Queues);
+    free(pool.Workers);
+    free(threads);
+    free(indices);
+    free(buffers);
+    return 0;
+}
+
+static int CompareJobTime(const void* a, const void* b) {
+    double timeA = (*(const Job* const*)a)->Seconds;
+    double timeB = (*(const Job* const*)b)->Seconds;
+    return timeA < timeB ? 1 : (timeA > timeB ? -1 : 0);
+}
+
+static void PrintReport(const JobList* jobs, const BatchOptions* options, double seconds, size_t stolen) {
+    size_t failed = 0;
+    uint64_t bytesIn = 0, bytesOut = 0;
+
+    Job** byTime = (Job**)malloc((jobs->Count > 0 ? jobs->Count : 1) * sizeof(Job*));
+
+    for (size_t i = 0; i < jobs->Count; i++) {
+        Job* job = jobs->Jobs + i;
+        if (byTime != NULL) byTime[i] = job;
+        if (job->Error) {
+            failed++;
+            continue;
+        }
+
+        bool isDir;
+        uint64_t size;
+        bytesIn += job->Size;
+        if (options->Mode == BatchMode_Archive) bytesOut += job->DataSize;
+        else if (GetFileInfo(job->Output, &isDir, &size)) bytesOut += size;
+    }
+
+    int threads = (size_t)options->Threads < jobs->Count ? options->Threads : (int)jobs->Count;
+    printf("Converted %zu files (%zu failed) in %.3f s with %d threads, %zu stolen\n",
+        jobs->Count - failed, failed, seconds, threads, stolen);
+    if (seconds > 0) {
+        printf("%.1f files/s, %.2f MB/s read, %.2f MB/s written\n",
+            jobs->Count / seconds, bytesIn / 1e6 / seconds, bytesOut / 1e6 / seconds);
+    }
+
+    if (byTime != NULL && options->Slowest > 0 && jobs->Count > 0) {
+        qsort(byTime, jobs->Count, sizeof(Job*), CompareJobTime);
+        size_t count = (size_t)options->Slowest < jobs->Count ? (size_t)options->Slowest : jobs->Count;
+
+        printf("Slowest files:\n");
+        for (size_t i = 0; i < count; i++) {
+            printf("  %8.3f s  %8.2f MB  %s\n", byTime[i]->Seconds, byTime[i]->Size / 1e6, byTime[i]->Input);
+        }
+    }
+
+    free(byTime);
+}
+
+// used to get the exe's name when printing usage directions
+void GetFilename(char* path, char* result, size_t maxLen) {
+    int lastSlash = -1;
+    int i = 0;
+    while (path[i] != '\0') {
+        if (path[i] == '/' || path[i] == '\\') lastSlash = i;
+        i++;
+    }
+
+    if (lastSlash >= 0) strncpy(result, path + lastSlash + 1, (size_t)(maxLen - 1));
+    else strncpy(result, path, (size_t)(maxLen - 1));
+    result[maxLen - 1] = '\0';
+}
+
+static void PrintUsage(char* path) {
+    char filename[128];
+    GetFilename(path, filename, 128);
+
+    printf("Usage: %s <opb|wav|archive> -o <dir> [options] <input> ...\n\n", filename);
+    printf("Modes:\n");
+    printf("  opb                convert VGM/VGZ files and re-encode OPB files (including raw captures) to OPB\n");
+    printf("  wav                render OPB files to WAV\n");
+    printf("  archive            convert the same inputs as opb mode into tracks of a single archive file, which\n");
+    printf("                     -o names. Tracks share an instrument dictionary unless --format raw is used\n\n");
+    printf("Inputs are files, directories which are searched recursively for .vgm, .vgz and .opb files,\n");
+    printf("or @manifest files listing one input per line. The directory structure below input directories\n");
+    printf("is kept in the output directory, other files are written directly to it.\n\n");
+    printf("Options:\n");
+    printf("  -o <dir>           output directory, or the archive file in archive mode\n");
+    printf("  -j <threads>       worker threads (default: number of CPUs)\n");
+    printf("  --format <name>    OPB format to write in opb mode, default, raw or compressed (default: default)\n");
+    printf("  --max-size <MB>    skip inputs larger than this, which bounds memory per worker (default %d)\n", DEFAULT_MAX_SIZE_MB);
+    printf("  --slowest <n>      number of slowest files to report (default %d)\n", DEFAULT_SLOWEST);
+    printf("  --dictionary <file>       instrument dictionary to encode against in opb mode, or to decode with\n");
+    printf("  --make-dictionary <file>  opb and archive mode: first build a dictionary of the instruments shared by\n");
+    printf("                            at least %d inputs, save it to file and encode against it\n", DICTIONARY_MIN_FILES);
+    printf("  --back-references  opb and archive mode: replace repeated chunks with references to earlier ones\n");
+    printf("  --time-base <hz>   opb and archive mode: chunk time units per second, such as %d to keep VGM sample\n", OPB_TIMEBASE_VGM);
+    printf("                     timing or %d for OPL output samples (default: %d, milliseconds)\n", OPB_TIMEBASE_OPL, OPB_TIMEBASE_MS);
+    printf("  --coalesce <ms>    opb and archive mode: merge writes this close after the first write of an event into\n");
+    printf("                     its chunk, for captures of real-time players (default: 0, exact times)\n");
+    printf("  --voices           opb and archive mode: combine 4-op pair and rhythm drum writes into commands of their own\n");
+    printf("  --groups           opb and archive mode: set the same instrument on several channels with one command\n");
+    printf("  --deltas           opb and archive mode: store small frequency changes as deltas to the previous one\n");
+    printf("  --effort <0-3>     opb and archive mode: choose a smaller instrument table before encoding, higher levels\n");
+    printf("                     try harder and take longer (default: 0, instruments made as they're first needed)\n");
+    printf("  -v                 print every converted file\n");
+}
+
+// dictionaries
+static int LoadDictionary(BatchOptions* options) {
+    bool isDir;
+    uint64_t size;
+    if (!GetFileInfo(options->DictionaryFile, &isDir, &size) || isDir) return OPBERR_READ_ERROR;
+
+    Job job = { 0 };
+    job.Input = (char*)options->DictionaryFile;
+    job.Size = size;
+
+    uint8_t* data;
+    size_t length;
+    int ret = ReadInput(options, &job, &data, &length);
+    if (ret) return ret;
+
+    ret = OPB_DictionaryFromMemory(data, length, &options->Dictionary);
+    free(data);
+    return ret;
+}
+
+// runs the instrument counting pass over every input, then saves the dictionary for the conversion pass
+static int MakeDictionary(JobList* jobs, BatchOptions* options, size_t* stolen) {
+    int ret = OPB_NewDictionary(&options->Dictionary);
+    if (ret) return ret;
+
+    BatchOptions collect = *options;
+    collect.Mode = BatchMode_Dictionary;
+    if ((ret = RunPool(jobs, &collect, stolen))) return ret;
+    if ((ret = OPB_FinishDictionary(options->Dictionary, DICTIONARY_MIN_FILES))) return ret;
+
+    // archives store the dictionary themselves, so it's only saved when asked for
+    if (options->DictionaryFile == NULL) return 0;
+
+    void* data;
+    size_t size;
+    if ((ret = OPB_DictionaryToMemory(options->Dictionary, &data, &size))) return ret;
+
+    FILE* file = fopen(options->DictionaryFile, "wb");
+    if (file == NULL) ret = ERR_OUTPUT;
+    else {
+        if (fwrite(data, 1, size, file) != size) ret = ERR_OUTPUT;
+        if (fclose(file) && !ret) ret = ERR_OUTPUT;
+    }
+    free(data);
+
+    if (!ret) {
+        printf("Dictionary of %zu instruments (%zu bytes) written to '%s'\n",
+            OPB_DictionaryCount(options->Dictionary), size, options->DictionaryFile);
+    }
+    return ret;
+}
+
+// archives
+static int WriteArchive(const JobList* jobs, const BatchOptions* options) {
+    OPB_ArchiveEntry* entries = (OPB_ArchiveEntry*)malloc((jobs->Count > 0 ? jobs->Count : 1) * sizeof(OPB_ArchiveEntry));
+    if (entries == NULL) return ERR_OUT_OF_MEMORY;
+
+    size_t count = 0;
+    for (size_t i = 0; i < jobs->Count; i++) {
+        const Job* job = jobs->Jobs + i;
+        if (job->Error) continue;
+
+        OPB_ArchiveEntry entry = { job->Output, job->Data, job->DataSize, OPB_NO_LOOP };
+        entries[count++] = entry;
+    }
+
+    int ret = 0;
+    FILE* file;
+    if (MakeParentDirectories(options->OutputDir) || (file = fopen(options->OutputDir, "wb")) == NULL) ret = ERR_OUTPUT;
+    else {
+        ret = OPB_WriteArchive(entries, count, options->Dictionary, WriteToFile, file);
+        if (fclose(file) && !ret) ret = ERR_OUTPUT;
+    }
+    free(entries);
+
+    if (!ret) {
+        printf("Archive of %zu tracks written to '%s'\n", count, options->OutputDir);
+    }
+    return ret;
+}
+
+int main(int argc, char* argv[]) {
+    BatchOptions options = { 0 };
+    options.Threads = CpuCount();
+    options.MaxSize = (uint64_t)DEFAULT_MAX_SIZE_MB * 1000000;
+    options.Slowest = DEFAULT_SLOWEST;
+
+    if (argc < 2 || (strcmp(argv[1], "opb") && strcmp(argv[1], "wav") && strcmp(argv[1], "archive"))) {
+        PrintUsage(argv[0]);
+        return argc >= 2 && (!strcmp(argv[1], "-h") || !strcmp(argv[1], "--help")) ? 0 : EXIT_FAILURE;
+    }
+    options.Mode = !strcmp(argv[1], "wav") ? BatchMode_Wav : (!strcmp(argv[1], "archive") ? BatchMode_Archive : BatchMode_Opb);
+
+    const char** inputs = (const char**)malloc(argc * sizeof(char*));
+    int inputCount = 0;
+    if (inputs == NULL) return EXIT_FAILURE;
+
+    for (int i = 2; i < argc; i++) {
+        const char* arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) { PrintUsage(argv[0]); return 0; }
+        else if (!strcmp(arg, "-v")) options.Verbose = true;
+        else if (!strcmp(arg, "-o") && hasValue) options.OutputDir = argv[++i];
+        else if (!strcmp(arg, "-j") && hasValue) options.Threads = atoi(argv[++i]);
+        else if (!strcmp(arg, "--max-size") && hasValue) options.MaxSize = (uint64_t)(atof(argv[++i]) * 1e6);
+        else if (!strcmp(arg, "--slowest") && hasValue) options.Slowest = atoi(argv[++i]);
+        else if (!strcmp(arg, "--dictionary") && hasValue) options.DictionaryFile = argv[++i];
+        else if (!strcmp(arg, "--make-dictionary") && hasValue && options.Mode != BatchMode_Wav) {
+            options.DictionaryFile = argv[++i];
+            options.MakeDictionary = true;
+        }
+        else if (!strcmp(arg, "--back-references")) options.BackReferences = true;
+        else if (!strcmp(arg, "--time-base") && hasValue) options.TimeBase = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(arg, "--coalesce") && hasValue) options.CoalesceWindow = atof(argv[++i]) / 1000;
+        else if (!strcmp(arg, "--voices")) options.VoiceCommands = true;
+        else if (!strcmp(arg, "--groups")) options.GroupInstruments = true;
+        else if (!strcmp(arg, "--deltas")) options.DeltaFrequencies = true;
+        else if (!strcmp(arg, "--effort") && hasValue) options.InstrumentEffort = atoi(argv[++i]);
+        else if (!strcmp(arg, "--format") && hasValue) {
+            const char* format = argv[++i];
+            if (!strcmp(format, "default")) options.Format = OPB_Format_Default;
+            else if (!strcmp(format, "raw")) options.Format = OPB_Format_Raw;
+            else if (!strcmp(format, "compressed")) options.Format = OPB_Format_Compressed;
+            else { PrintUsage(argv[0]); return EXIT_FAILURE; }
+        }
+        else if (arg[0] == '-') { PrintUsage(argv[0]); return EXIT_FAILURE; }
+        else inputs[inputCount++] = arg;
+    }
+
+    if (options.OutputDir == NULL || inputCount == 0) {
+        PrintUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (options.Threads < 1) options.Threads = 1;
+
+    // raw tracks store no instruments, otherwise an archive always gets a dictionary for its tracks to share
+    if (options.Mode == BatchMode_Archive && options.Format != OPB_Format_Raw && options.DictionaryFile == NULL) {
+        options.MakeDictionary = true;
+    }
+
+    JobList jobs = { 0 };
+    int ret = 0;
+    for (int i = 0; i < inputCount && !ret; i++) {
+        ret = AddInput(&jobs, &options, inputs[i]);
+    }
+    free(inputs);
+
+    if (ret) {
+        if (ret == ERR_OUT_OF_MEMORY) fprintf(stderr, "%s\n", GetBatchErrorMessage(ret));
+        JobList_Free(&jobs);
+        return EXIT_FAILURE;
+    }
+
+    double start = Now();
+    size_t stolen = 0, dictionaryStolen = 0;
+
+    if (!(ret = MarkDuplicateOutputs(&jobs)) && (options.DictionaryFile != NULL || options.MakeDictionary)) {
+        ret = options.MakeDictionary ? MakeDictionary(&jobs, &options, &dictionaryStolen) : LoadDictionary(&options);
+        if (ret && options.DictionaryFile != NULL) fprintf(stderr, "Dictionary '%s': ", options.DictionaryFile);
+    }
+    if (ret || (ret = RunPool(&jobs, &options, &stolen)) ||
+        (options.Mode == BatchMode_Archive && (ret = WriteArchive(&jobs, &options)))) {
+        fprintf(stderr, "%s\n", GetBatchErrorMessage(ret));
+        OPB_FreeDictionary(options.Dictionary);
+        JobList_Free(&jobs);
+        return EXIT_FAILURE;
+    }
+    double seconds = Now() - start;
+    stolen += dictionaryStolen;
+
+    PrintReport(&jobs, &options, seconds, stolen);
+
+    bool failed = false;
+    for (size_t i = 0; i < jobs.Count; i++) {
+        if (jobs.Jobs[i].Error) failed = true;
+    }
+
+    OPB_FreeDictionary(options.Dictionary);
+    JobList_Free(&jobs);
+    return failed ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,1318 @@
+/*
+//  MIT License
+//
+//  Copyright (c) 2023 Eniko Fox/Emma Maassen
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in all
+//  copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+//  SOFTWARE.
+*/
+#ifdef _WIN32
+#define _CRT_SECURE_NO_DEPRECATE
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#define _POSIX_C_SOURCE 200809L
+#include <time.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "../opblib.h"
+
+#define OPL_IMPLEMENTATION
+#include "../OPB2WAV/opl.h"
+
+#ifndef OPB_FIXTURE_DIR
+#define OPB_FIXTURE_DIR ".."
+#endif
+
+#define SAMPLE_RATE 44100
+#define RENDER_SAMPLES 4096
+#define MAX_FIXTURES 16
+
+// Benchmarks the OPB encoder, decoder and the OPB2WAV render path and writes the results as JSON.
+// Every case runs a number of iterations and reports the fastest, which is the least noisy figure
+// for tracking regressions between builds.
+
+typedef struct CommandStream {
+    size_t Count;
+    size_t Capacity;
+    OPB_Command* Stream;
+} CommandStream;
+
+static int CommandStream_Add(CommandStream* cmds, uint16_t addr, uint8_t data, double time) {
+    if (cmds->Count >= cmds->Capacity) {
+        size_t newCapacity = cmds->Capacity < 256 ? 256 : cmds->Capacity * 2;
+        OPB_Command* newStream = (OPB_Command*)realloc(cmds->Stream, newCapacity * sizeof(OPB_Command));
+        if (newStream == NULL) {
+            return -1;
+        }
+        cmds->Stream = newStream;
+        cmds->Capacity = newCapacity;
+    }
+
+    OPB_Command cmd = { addr, data, time };
+    cmds->Stream[cmds->Count++] = cmd;
+    return 0;
+}
+
+static int ReceiveOpbBuffer(OPB_Command* commandStream, size_t commandCount, void* context) {
+    CommandStream* cmds = (CommandStream*)context;
+    for (size_t i = 0; i < commandCount; i++) {
+        if (CommandStream_Add(cmds, commandStream[i].Addr, commandStream[i].Data, commandStream[i].Time)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int CountOpbBuffer(OPB_Command* commandStream, size_t commandCount, void* context) {
+    *(size_t*)context += commandCount;
+    return 0;
+}
+
+static int CountTickBuffer(OPB_TickCommand* commandStream, size_t commandCount, void* context) {
+    *(size_t*)context += commandCount;
+    return 0;
+}
+
+typedef struct MemoryReader {
+    const uint8_t* Buffer;
+    size_t Size;
+    size_t Position;
+} MemoryReader;
+
+static size_t ReadFromMemory(void* buffer, size_t elementSize, size_t elementCount, void* context) {
+    MemoryReader* reader = (MemoryReader*)context;
+    size_t available = (reader->Size - reader->Position) / elementSize;
+    if (elementCount > available) {
+        elementCount = available;
+    }
+
+    memcpy(buffer, reader->Buffer + reader->Position, elementCount * elementSize);
+    reader->Position += elementCount * elementSize;
+    return elementCount;
+}
+
+static double Now(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+// synthetic OPL stream generator
+// produces a deterministic song for a given seed, so runs on different builds encode identical input
+typedef struct SynthParams {
+    uint32_t Seed;
+    int Channels;       // number of melodic channels in use (1-18)
+    int ChordSize;      // notes started per event
+    double Churn;       // chance that a note switches its channel to a different instrument (0-1)
+    double EventRate;   // note events per second
+    double Duration;    // song length in seconds
+    double Jitter;      // seconds over which the writes of an event are spread, like a real-time player's capture
+    bool FourOp;        // play 4-op voices on the channel pairs instead of 2-op ones
+    bool Rhythm;        // play rhythm mode drums alongside the melodic channels, which then leave out channels 6-8
+    bool ChordInstrument; // play every note of an event with one instrument, like a MIDI player spreading a chord
+                        // over free channels, with Churn as the chance that the instrument changes between events
+    double SlideRate;   // frequency writes per second of every playing note between events, which slide or vibrate
+                        // its pitch a few units at a time like a tracker's effects do. 0 for none
+    int Palette;        // values each instrument register is drawn from, so instruments share some of them and a
+                        // channel that changes instrument only writes the registers that differ, like drivers that
+                        // cache register values do. 0 draws every value freely and writes whole instruments
+} SynthParams;
+
+#define SYNTH_INSTRUMENTS 32
+
+static uint32_t NextRandom(uint32_t* state) {
+    // xorshift32
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static double NextUnit(uint32_t* state) {
+    return (NextRandom(state) >> 8) / 16777216.0;
+}
+
+// operator register offsets for the modulator of each of the 9 channels in a register bank
+static const uint8_t ModulatorOffsets[9] = { 0x00, 0x01, 0x02, 0x08, 0x09, 0x0A, 0x10, 0x11, 0x12 };
+
+// only the registers that differ from the previous instrument are written, unless it's NULL
+static int WriteSynthInstrument(CommandStream* cmds, int channel, const uint8_t* instr, const uint8_t* previous,
+    double time) {
+    static const uint8_t opRegs[5] = { 0x20, 0x40, 0x60, 0x80, 0xE0 };
+    uint16_t bank = channel >= 9 ? 0x100 : 0;
+    int ch = channel % 9;
+
+    for (int i = 0; i < 5; i++) {
+        if ((previous == NULL || previous[i] != instr[i]) &&
+            CommandStream_Add(cmds, bank + opRegs[i] + ModulatorOffsets[ch], instr[i], time)) return -1;
+        if ((previous == NULL || previous[5 + i] != instr[5 + i]) &&
+            CommandStream_Add(cmds, bank + opRegs[i] + ModulatorOffsets[ch] + 3, instr[5 + i], time)) return -1;
+    }
+    if (previous != NULL && previous[10] == instr[10]) {
+        return 0;
+    }
+    return CommandStream_Add(cmds, bank + 0xC0 + ch, instr[10], time);
+}
+
+// 4-op instruments are written one register at a time for all four operators, the way drivers that set up the
+// whole voice in one loop do
+static int WriteSynthFourOp(CommandStream* cmds, int channel, const uint8_t* first, const uint8_t* second, double time) {
+    static const uint8_t opRegs[5] = { 0x20, 0x40, 0x60, 0x80, 0xE0 };
+    uint16_t bank = channel >= 9 ? 0x100 : 0;
+    int ch = channel % 9;
+
+    for (int i = 0; i < 5; i++) {
+        if (CommandStream_Add(cmds, bank + opRegs[i] + ModulatorOffsets[ch], first[i], time)) return -1;
+        if (CommandStream_Add(cmds, bank + opRegs[i] + ModulatorOffsets[ch] + 3, first[5 + i], time)) return -1;
+        if (CommandStream_Add(cmds, bank + opRegs[i] + ModulatorOffsets[ch + 3], second[i], time)) return -1;
+        if (CommandStream_Add(cmds, bank + opRegs[i] + ModulatorOffsets[ch + 3] + 3, second[5 + i], time)) return -1;
+    }
+    if (CommandStream_Add(cmds, bank + 0xC0 + ch, first[10], time)) return -1;
+    return CommandStream_Add(cmds, bank + 0xC3 + ch, second[10], time);
+}
+
+// rhythm mode drums: bass drum, snare, tom, cymbal and hi-hat. each is set up through one operator, except for the
+// bass drum which uses both operators of channel 6, and keyed by its bit in 0xBD
+#define SYNTH_DRUMS 5
+static const uint8_t DrumOffsets[SYNTH_DRUMS] = { 0x13, 0x14, 0x12, 0x15, 0x11 };
+static const uint8_t DrumChannels[SYNTH_DRUMS] = { 6, 7, 8, 8, 7 };
+static const uint8_t DrumBits[SYNTH_DRUMS] = { 0x10, 0x08, 0x04, 0x02, 0x01 };
+
+static int WriteSynthDrum(CommandStream* cmds, int drum, const uint8_t* instr, double time) {
+    static const uint8_t opRegs[5] = { 0x20, 0x40, 0x60, 0x80, 0xE0 };
+
+    if (drum == 0) {
+        return WriteSynthInstrument(cmds, DrumChannels[drum], instr, NULL, time);
+    }
+    for (int i = 0; i < 5; i++) {
+        if (CommandStream_Add(cmds, opRegs[i] + DrumOffsets[drum], instr[i], time)) return -1;
+    }
+    return 0;
+}
+
+// spreads the writes that share a time over up to jitter seconds, in order, the way a player that writes one
+// register after another would
+static void SpreadSynthEvents(CommandStream* cmds, double jitter, uint32_t* rng) {
+    double eventTime = -1;
+    double offset = 0;
+    for (size_t i = 0; i < cmds->Count; i++) {
+        double time = cmds->Stream[i].Time;
+        if (time != eventTime) {
+            eventTime = time;
+            offset = 0;
+            continue;
+        }
+
+        offset += NextUnit(rng) * jitter / 16;
+        if (offset > jitter) offset = jitter;
+        cmds->Stream[i].Time = time + offset;
+    }
+}
+
+static int KeyOffSynth(CommandStream* cmds, int channel, uint8_t* channelNote, double t) {
+    if (channelNote[channel]) {
+        uint16_t bank = channel >= 9 ? 0x100 : 0;
+        if (CommandStream_Add(cmds, bank + 0xB0 + channel % 9, channelNote[channel] & 0x1F, t)) return -1;
+        channelNote[channel] = 0;
+    }
+    return 0;
+}
+
+// moves the frequency of every playing note by its slide, which vibrato turns around every few writes
+static int SlideSynth(CommandStream* cmds, uint8_t* channelNote, uint16_t* channelFnum, const int* channelSlide,
+    int* channelTicks, double t) {
+    for (int channel = 0; channel < 18; channel++) {
+        if (!channelNote[channel]) continue;
+
+        int slide = channelSlide[channel];
+        if (slide > 4) {
+            slide = (channelTicks[channel]++ / 3) % 2 ? 4 - slide : slide - 4;
+        }
+
+        int fnum = channelFnum[channel] + slide;
+        channelFnum[channel] = (uint16_t)(fnum < 0x100 ? 0x100 : (fnum > 0x3FF ? 0x3FF : fnum));
+        channelNote[channel] = (channelNote[channel] & 0xFC) | (uint8_t)(channelFnum[channel] >> 8);
+
+        uint16_t bank = channel >= 9 ? 0x100 : 0;
+        if (CommandStream_Add(cmds, bank + 0xA0 + channel % 9, (uint8_t)channelFnum[channel], t)) return -1;
+        if (CommandStream_Add(cmds, bank + 0xB0 + channel % 9, channelNote[channel], t)) return -1;
+    }
+    return 0;
+}
+
+static int GenerateSynthetic(const SynthParams* params, CommandStream* cmds) {
+    uint32_t rng = params->Seed ? params->Seed : 1;
+    int channels = params->Channels < 1 ? 1 : (params->Channels > 18 ? 18 : params->Channels);
+
+    // 4-op voices are played on the first channel of each pair
+    int melodic[18];
+    int melodicCount = 0;
+    for (int i = 0; i < channels; i++) {
+        if ((params->FourOp && i % 9 >= 3) || (params->Rhythm && i >= 6 && i <= 8)) continue;
+        melodic[melodicCount++] = i;
+    }
+    if (melodicCount == 0) {
+        melodic[melodicCount++] = 0;
+    }
+    int chordSize = params->ChordSize < 1 ? 1 : (params->ChordSize > melodicCount ? melodicCount : params->ChordSize);
+
+    uint8_t palette[11][SYNTH_INSTRUMENTS];
+    int paletteSize = params->Palette > SYNTH_INSTRUMENTS ? SYNTH_INSTRUMENTS : params->Palette;
+    for (int i = 0; i < paletteSize; i++) {
+        for (int j = 0; j < 11; j++) {
+            palette[j][i] = (uint8_t)NextRandom(&rng);
+        }
+    }
+
+    uint8_t instruments[SYNTH_INSTRUMENTS][11];
+    for (int i = 0; i < SYNTH_INSTRUMENTS; i++) {
+        for (int j = 0; j < 11; j++) {
+            instruments[i][j] = paletteSize > 0 ? palette[j][NextRandom(&rng) % (uint32_t)paletteSize] : (uint8_t)NextRandom(&rng);
+        }
+        instruments[i][1] &= 0x3F; // keep the modulator audible
+        instruments[i][6] &= 0x1F; // and the carrier loud
+        instruments[i][4] &= 0x07;
+        instruments[i][9] &= 0x07;
+        instruments[i][10] = (instruments[i][10] & 0x0F) | 0x30;
+    }
+
+    int channelInstr[18];
+    uint8_t channelNote[18] = { 0 };
+    uint16_t channelFnum[18] = { 0 };
+    int channelSlide[18] = { 0 };   // -4 to 4 slides, 5 to 8 vibrato of 1 to 4 units
+    int channelTicks[18] = { 0 };
+    for (int i = 0; i < 18; i++) {
+        channelInstr[i] = -1;
+    }
+    int drumInstr[SYNTH_DRUMS];
+    for (int i = 0; i < SYNTH_DRUMS; i++) {
+        drumInstr[i] = -1;
+    }
+
+    // enable OPL3 mode and waveform select
+    if (CommandStream_Add(cmds, 0x105, 0x01, 0)) return -1;
+    if (CommandStream_Add(cmds, 0x001, 0x20, 0)) return -1;
+    if (params->FourOp && CommandStream_Add(cmds, 0x104, 0x3F, 0)) return -1;
+    if (params->Rhythm && CommandStream_Add(cmds, 0x0BD, 0x20, 0)) return -1;
+
+    int chordInstr = -1;
+    int chord[18];
+
+    double step = params->EventRate > 0 ? 1.0 / params->EventRate : 0.1;
+    for (double time = 0; time < params->Duration; time += step) {
+        // round to whole milliseconds like a real capture would
+        double t = (int64_t)(time * 1000) / 1000.0;
+
+        // a chord of one instrument releases all its channels before it starts any of them
+        if (params->ChordInstrument) {
+            if (chordInstr < 0 || NextUnit(&rng) < params->Churn) {
+                chordInstr = (int)(NextRandom(&rng) % SYNTH_INSTRUMENTS);
+            }
+            for (int n = 0; n < chordSize; n++) {
+                chord[n] = melodic[NextRandom(&rng) % (uint32_t)melodicCount];
+                if (KeyOffSynth(cmds, chord[n], channelNote, t)) return -1;
+            }
+        }
+
+        for (int n = 0; n < chordSize; n++) {
+            int channel = params->ChordInstrument ? chord[n] : melodic[NextRandom(&rng) % (uint32_t)melodicCount];
+            uint16_t bank = channel >= 9 ? 0x100 : 0;
+            int ch = channel % 9;
+
+            // key off whatever the channel was playing
+            if (KeyOffSynth(cmds, channel, channelNote, t)) return -1;
+
+            bool change = params->ChordInstrument ? channelInstr[channel] != chordInstr :
+                channelInstr[channel] < 0 || NextUnit(&rng) < params->Churn;
+            if (change) {
+                const uint8_t* previous = channelInstr[channel] >= 0 && paletteSize > 0 ? instruments[channelInstr[channel]] : NULL;
+                channelInstr[channel] = params->ChordInstrument ? chordInstr : (int)(NextRandom(&rng) % SYNTH_INSTRUMENTS);
+                const uint8_t* instr = instruments[channelInstr[channel]];
+                int ret = params->FourOp ?
+                    WriteSynthFourOp(cmds, channel, instr, instruments[(channelInstr[channel] + 1) % SYNTH_INSTRUMENTS], t) :
+                    WriteSynthInstrument(cmds, channel, instr, previous, t);
+                if (ret) return -1;
+            }
+            else if (NextUnit(&rng) < 0.5) {
+                // velocity change, on the last carrier of 4-op voices
+                uint8_t level = (instruments[channelInstr[channel]][6] & 0xC0) | (uint8_t)(NextRandom(&rng) & 0x1F);
+                int op = ModulatorOffsets[params->FourOp ? ch + 3 : ch] + 3;
+                if (CommandStream_Add(cmds, bank + 0x40 + op, level, t)) return -1;
+            }
+
+            uint16_t fnum = 0x157 + (uint16_t)(NextRandom(&rng) % 0x130);
+            uint8_t block = (uint8_t)(2 + NextRandom(&rng) % 4);
+            channelNote[channel] = 0x20 | (block << 2) | (uint8_t)(fnum >> 8);
+            channelFnum[channel] = fnum;
+            if (params->SlideRate > 0) {
+                channelSlide[channel] = (int)(NextRandom(&rng) % 13) - 4;
+                channelTicks[channel] = 0;
+            }
+
+            if (CommandStream_Add(cmds, bank + 0xA0 + ch, (uint8_t)fnum, t)) return -1;
+            if (CommandStream_Add(cmds, bank + 0xB0 + ch, channelNote[channel], t)) return -1;
+        }
+
+        if (params->Rhythm && NextUnit(&rng) < 0.75) {
+            int drum = (int)(NextRandom(&rng) % SYNTH_DRUMS);
+            int ch = DrumChannels[drum];
+
+            // release the drums, set up the one that's hit and key it
+            if (CommandStream_Add(cmds, 0x0BD, 0x20, t)) return -1;
+            if (drumInstr[drum] < 0 || NextUnit(&rng) < params->Churn) {
+                drumInstr[drum] = (int)(NextRandom(&rng) % SYNTH_INSTRUMENTS);
+                if (WriteSynthDrum(cmds, drum, instruments[drumInstr[drum]], t)) return -1;
+            }
+            else {
+                uint8_t level = (uint8_t)(NextRandom(&rng) & 0x3F);
+                if (CommandStream_Add(cmds, 0x40 + DrumOffsets[drum], level, t)) return -1;
+            }
+            if (NextUnit(&rng) < 0.5) {
+                uint16_t fnum = 0x157 + (uint16_t)(NextRandom(&rng) % 0x130);
+                if (CommandStream_Add(cmds, 0xA0 + ch, (uint8_t)fnum, t)) return -1;
+                if (CommandStream_Add(cmds, 0xB0 + ch, (uint8_t)(0x08 | (fnum >> 8)), t)) return -1;
+            }
+            if (CommandStream_Add(cmds, 0x0BD, 0x20 | DrumBits[drum], t)) return -1;
+        }
+
+        if (params->SlideRate > 0) {
+            double tick = 1.0 / params->SlideRate;
+            for (double slide = time + tick; slide < time + step && slide < params->Duration; slide += tick) {
+                if (SlideSynth(cmds, channelNote, channelFnum, channelSlide, channelTicks, (int64_t)(slide * 1000) / 1000.0)) return -1;
+            }
+        }
+    }
+
+    for (int channel = 0; channel < channels; channel++) {
+        if (channelNote[channel]) {
+            uint16_t bank = channel >= 9 ? 0x100 : 0;
+            if (CommandStream_Add(cmds, bank + 0xB0 + channel % 9, channelNote[channel] & 0x1F, params->Duration)) return -1;
+        }
+    }
+
+    if (params->Jitter > 0) {
+        SpreadSynthEvents(cmds, params->Jitter, &rng);
+    }
+    return 0;
+}
+
+// benchmark cases
+#define BENCH_FORMATS 3
+
+// indexed by OPB_Format, which is also the order the formats are benchmarked in
+static const char* FormatNames[BENCH_FORMATS] = { "default", "raw", "compressed" };
+
+typedef struct FormatResult {
+    OPB_Format Format;
+    size_t Bytes;
+    size_t DecodedCommands; // the default format drops redundant writes, so this can be lower than the input count
+    double EncodeSeconds;
+    double DecodeSeconds;
+    double MemoryDecodeSeconds; // OPB_MemoryToOpl instead of a reader callback
+    double ValidateSeconds;
+    double TickDecodeSeconds;   // OPB_RawMemoryToTicks, raw format only
+    OPB_EncodeStats Stats;  // from the fastest encode
+    OPB_DecodeStats DecodeStats; // from a separate untimed decode, collecting them adds per-command overhead
+} FormatResult;
+
+typedef struct CaseResult {
+    const char* Name;
+    size_t Commands;
+    double Duration;
+    FormatResult Formats[BENCH_FORMATS];
+    size_t RenderSamples;
+    double RenderSeconds;
+    size_t CoalescedBytes;      // default format with the coalescing window, if one was given
+    OPB_EncodeStats Coalesced;
+} CaseResult;
+
+static int BenchFormat(const CommandStream* cmds, OPB_Format format, int iterations, size_t batchSize, bool voices,
+    bool groups, bool deltas, int effort, FormatResult* result) {
+    result->Format = format;
+    result->EncodeSeconds = 1e30;
+    result->DecodeSeconds = 1e30;
+    result->MemoryDecodeSeconds = 1e30;
+    result->ValidateSeconds = 1e30;
+    result->TickDecodeSeconds = 1e30;
+
+    OPB_DecodeOptions batchOptions = { 0 };
+    batchOptions.BatchSize = batchSize;
+
+    void* opb = NULL;
+    size_t size = 0;
+    int ret;
+
+    OPB_EncodeStats stats;
+    OPB_EncodeOptions options = { 0 };
+    options.Stats = &stats;
+    options.VoiceCommands = voices;
+    options.GroupInstruments = groups;
+    options.DeltaFrequencies = deltas;
+    options.InstrumentEffort = effort;
+
+    for (int i = 0; i < iterations; i++) {
+        if (opb != NULL) free(opb);
+
+        double start = Now();
+        ret = OPB_OplToMemoryEx(format, cmds->Stream, cmds->Count, &opb, &size, &options);
+        double elapsed = Now() - start;
+
+        if (ret) {
+            fprintf(stderr, "Encode failed: %s\n", OPB_GetErrorMessage(ret));
+            return ret;
+        }
+        if (elapsed < result->EncodeSeconds) {
+            result->EncodeSeconds = elapsed;
+            result->Stats = stats;
+        }
+    }
+    result->Bytes = size;
+
+    for (int i = 0; i < iterations; i++) {
+        MemoryReader reader = { (const uint8_t*)opb, size, 0 };
+        size_t decoded = 0;
+
+        double start = Now();
+        ret = OPB_BinaryToOpl(ReadFromMemory, &reader, CountOpbBuffer, &decoded);
+        double elapsed = Now() - start;
+
+        if (ret) {
+            fprintf(stderr, "Decode failed: %s\n", OPB_GetErrorMessage(ret));
+            free(opb);
+            return ret;
+        }
+        if (elapsed < result->DecodeSeconds) result->DecodeSeconds = elapsed;
+        result->DecodedCommands = decoded;
+    }
+
+    for (int i = 0; i < iterations; i++) {
+        size_t decoded = 0;
+
+        double start = Now();
+        ret = OPB_MemoryToOplEx(opb, size, CountOpbBuffer, &decoded, &batchOptions);
+        double elapsed = Now() - start;
+
+        if (ret || decoded != result->DecodedCommands) {
+            fprintf(stderr, "Memory decode failed: %s\n", OPB_GetErrorMessage(ret));
+            free(opb);
+            return ret ? ret : OPBERR_LOGGED;
+        }
+        if (elapsed < result->MemoryDecodeSeconds) result->MemoryDecodeSeconds = elapsed;
+    }
+
+    for (int i = 0; i < iterations && format == OPB_Format_Raw; i++) {
+        size_t decoded = 0;
+
+        double start = Now();
+        ret = OPB_RawMemoryToTicks(opb, size, CountTickBuffer, &decoded, &batchOptions);
+        double elapsed = Now() - start;
+
+        if (ret || decoded != result->DecodedCommands) {
+            fprintf(stderr, "Tick decode failed: %s\n", OPB_GetErrorMessage(ret));
+            free(opb);
+            return ret ? ret : OPBERR_LOGGED;
+        }
+        if (elapsed < result->TickDecodeSeconds) result->TickDecodeSeconds = elapsed;
+    }
+
+    for (int i = 0; i < iterations; i++) {
+        double start = Now();
+        ret = OPB_Validate(opb, size, NULL);
+        double elapsed = Now() - start;
+
+        if (ret) {
+            fprintf(stderr, "Validation failed: %s\n", OPB_GetErrorMessage(ret));
+            free(opb);
+            return ret;
+        }
+        if (elapsed < result->ValidateSeconds) result->ValidateSeconds = elapsed;
+    }
+
+    {
+        MemoryReader reader = { (const uint8_t*)opb, size, 0 };
+        size_t decoded = 0;
+
+        OPB_DecodeOptions decodeOptions = { 0 };
+        decodeOptions.Stats = &result->DecodeStats;
+
+        if ((ret = OPB_BinaryToOplEx(ReadFromMemory, &reader, CountOpbBuffer, &decoded, &decodeOptions))) {
+            fprintf(stderr, "Decode failed: %s\n", OPB_GetErrorMessage(ret));
+            free(opb);
+            return ret;
+        }
+    }
+
+    free(opb);
+    return 0;
+}
+
+// renders the stream the same way OPB2WAV does, minus the file output
+static void BenchRender(const CommandStream* cmds, CaseResult* result) {
+    static short buffer[RENDER_SAMPLES * 2];
+    opl_t* opl = opl_create();
+    double time = 0;
+    size_t total = 0;
+
+    double start = Now();
+    for (size_t i = 0; i < cmds->Count; i++) {
+        OPB_Command cmd = cmds->Stream[i];
+
+        if (cmd.Time > time) {
+            int samples = (int)((cmd.Time - time) * SAMPLE_RATE);
+            time = cmd.Time;
+
+            while (samples > 0) {
+                int count = samples <= RENDER_SAMPLES ? samples : RENDER_SAMPLES;
+                opl_render(opl, buffer, count, 0.95f);
+                samples -= count;
+                total += count;
+            }
+        }
+
+        opl_write(opl, 1, &cmd.Addr, &cmd.Data);
+    }
+    result->RenderSeconds = Now() - start;
+    result->RenderSamples = total;
+
+    opl_destroy(opl);
+}
+
+// encodes once more with the coalescing window to see how many chunks and bytes merging nearby writes saves
+static int BenchCoalesce(const CommandStream* cmds, double window, CaseResult* result) {
+    OPB_EncodeOptions options = { 0 };
+    options.CoalesceWindow = window;
+    options.Stats = &result->Coalesced;
+
+    void* data;
+    int ret = OPB_OplToMemoryEx(OPB_Format_Default, cmds->Stream, cmds->Count, &data, &result->CoalescedBytes, &options);
+    if (ret) {
+        fprintf(stderr, "Coalesced encode failed: %s\n", OPB_GetErrorMessage(ret));
+        return ret;
+    }
+    free(data);
+    return 0;
+}
+
+static int BenchCase(const char* name, const CommandStream* cmds, int iterations, size_t batchSize, bool render,
+    bool voices, bool groups, bool deltas, int effort, double coalesceWindow, CaseResult* result) {
+    memset(result, 0, sizeof(CaseResult));
+    result->Name = name;
+    result->Commands = cmds->Count;
+    result->Duration = cmds->Count > 0 ? cmds->Stream[cmds->Count - 1].Time : 0;
+
+    fprintf(stderr, "Benchmarking %s (%zu commands)\n", name, cmds->Count);
+
+    int ret;
+    for (int i = 0; i < BENCH_FORMATS; i++) {
+        if ((ret = BenchFormat(cmds, (OPB_Format)i, iterations, batchSize, voices, groups, deltas, effort, &result->Formats[i]))) return ret;
+    }
+    if (coalesceWindow > 0 && (ret = BenchCoalesce(cmds, coalesceWindow, result))) {
+        return ret;
+    }
+
+    if (render) {
+        BenchRender(cmds, result);
+    }
+    return 0;
+}
+
+// JSON output
+static void WriteJsonString(FILE* out, const char* s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fputc('\\', out);
+        if ((unsigned char)*s < 0x20) fprintf(out, "\\u%04x", *s);
+        else fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+static const char* KindNames[OPB_CommandKind_Count] = {
+    "plain", "set_instrument", "play_instrument", "combined_note", "back_reference", "four_op_instrument", "rhythm_instrument",
+    "group_instrument", "delta_frequency"
+};
+
+static double Rate(double amount, double seconds) {
+    return seconds > 0 ? amount / seconds : 0;
+}
+
+static void WriteJson(FILE* out, const SynthParams* synth, int iterations, size_t batchSize, bool voices, bool groups,
+    bool deltas, int effort, double coalesceWindow, const CaseResult* results, int count) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"benchmark\": \"opb_bench\",\n");
+    fprintf(out, "  \"iterations\": %d,\n", iterations);
+    fprintf(out, "  \"raw_batch_size\": %zu,\n", batchSize);
+    fprintf(out, "  \"voice_commands\": %s,\n", voices ? "true" : "false");
+    fprintf(out, "  \"group_instruments\": %s,\n", groups ? "true" : "false");
+    fprintf(out, "  \"delta_frequencies\": %s,\n", deltas ? "true" : "false");
+    fprintf(out, "  \"instrument_effort\": %d,\n", effort);
+    fprintf(out, "  \"synthetic\": { \"seed\": %u, \"channels\": %d, \"chord_size\": %d, \"churn\": %g, \"event_rate\": %g, \"duration_s\": %g, \"jitter_ms\": %g, "
+        "\"four_op\": %s, \"rhythm\": %s, \"chord_instrument\": %s, \"slide_rate\": %g, "
+        "\"palette\": %d },\n",
+        synth->Seed, synth->Channels, synth->ChordSize, synth->Churn, synth->EventRate, synth->Duration, synth->Jitter * 1000,
+        synth->FourOp ? "true" : "false", synth->Rhythm ? "true" : "false", synth->ChordInstrument ? "true" : "false", synth->SlideRate,
+        synth->Palette);
+    fprintf(out, "  \"cases\": [\n");
+
+    for (int i = 0; i < count; i++) {
+        const CaseResult* r = results + i;
+        double inputMb = r->Commands * sizeof(OPB_Command) / 1e6;
+
+        fprintf(out, "    {\n      \"name\": ");
+        WriteJsonString(out, r->Name);
+        fprintf(out, ",\n      \"commands\": %zu,\n      \"duration_s\": %.3f,\n", r->Commands, r->Duration);
+        if (r->RenderSeconds > 0) {
+            fprintf(out, "      \"render_samples_per_s\": %.0f,\n", Rate((double)r->RenderSamples, r->RenderSeconds));
+        }
+        if (coalesceWindow > 0) {
+            // ratios under 1 mean the window saved chunks or bytes over the default format's exact times
+            const FormatResult* d = r->Formats + OPB_Format_Default;
+            fprintf(out, "      \"coalesce\": { \"window_ms\": %g, \"commands_moved\": %zu, \"chunks\": %zu, \"bytes\": %zu, "
+                "\"vs_default\": { \"chunks\": %.4f, \"bytes\": %.4f } },\n",
+                coalesceWindow * 1000, r->Coalesced.CommandsCoalesced, r->Coalesced.ChunkCount, r->CoalescedBytes,
+                Rate((double)r->Coalesced.ChunkCount, (double)d->Stats.ChunkCount), Rate((double)r->CoalescedBytes, (double)d->Bytes));
+        }
+        fprintf(out, "      \"formats\": [\n");
+
+        for (int j = 0; j < BENCH_FORMATS; j++) {
+            const FormatResult* f = r->Formats + j;
+            const OPB_EncodeStats* st = &f->Stats;
+            fprintf(out, "        { \"format\": \"%s\", \"bytes\": %zu, \"bytes_per_command\": %.4f, "
+                "\"encode_mb_per_s\": %.3f, \"encode_commands_per_s\": %.0f, \"decode_commands_per_s\": %.0f, \"memory_decode_commands_per_s\": %.0f, \"validate_mb_per_s\": %.3f,",
+                FormatNames[j], f->Bytes, r->Commands > 0 ? (double)f->Bytes / r->Commands : 0,
+                Rate(inputMb, f->EncodeSeconds), Rate((double)r->Commands, f->EncodeSeconds), Rate((double)f->DecodedCommands, f->DecodeSeconds),
+                Rate((double)f->DecodedCommands, f->MemoryDecodeSeconds), Rate(f->Bytes / 1e6, f->ValidateSeconds));
+            if (f->Format == OPB_Format_Raw) {
+                fprintf(out, " \"tick_decode_commands_per_s\": %.0f,", Rate((double)f->DecodedCommands, f->TickDecodeSeconds));
+            }
+            if (f->Format != OPB_Format_Default) {
+                // ratios over 1 mean larger or slower than the default format
+                const FormatResult* d = r->Formats + OPB_Format_Default;
+                fprintf(out, " \"vs_default\": { \"bytes\": %.4f, \"decode_time\": %.4f, \"memory_decode_time\": %.4f },",
+                    d->Bytes > 0 ? (double)f->Bytes / d->Bytes : 0, Rate(f->DecodeSeconds, d->DecodeSeconds),
+                    Rate(f->MemoryDecodeSeconds, d->MemoryDecodeSeconds));
+            }
+            fprintf(out, "\n");
+
+            double processTime = 0;
+            for (int k = 0; k < 19; k++) processTime += st->ProcessTime[k];
+
+            fprintf(out, "          \"encode_stats\": { \"separate_s\": %.6f, \"optimize_s\": %.6f, \"process_s\": %.6f, \"sort_s\": %.6f, \"measure_s\": %.6f, "
+                "\"instruments_s\": %.6f, \"chunks_s\": %.6f, \"entropy_s\": %.6f, \"allocations\": %zu, \"instruments\": %zu, "
+                "\"chunks\": %zu, \"chunk_header_bytes\": %zu, \"entropy_bytes\": %zu, \"commands\": { ",
+                st->SeparateTime, st->OptimizeTime, processTime, st->SortTime, st->MeasureTime, st->InstrumentTime, st->ChunkTime, st->EntropyTime,
+                st->Allocations, st->InstrumentCount, st->ChunkCount, st->ChunkHeaderBytes, st->EntropyBytes);
+
+            for (int k = 0; k < OPB_CommandKind_Count; k++) {
+                fprintf(out, "\"%s\": [%zu, %zu]%s", KindNames[k], st->Commands[k].Count, st->Commands[k].Bytes,
+                    k < OPB_CommandKind_Count - 1 ? ", " : "");
+            }
+            fprintf(out, " } },\n");
+
+            const OPB_DecodeStats* ds = &f->DecodeStats;
+            fprintf(out, "          \"decode_stats\": { \"read_calls\": %zu, \"bytes_read\": %zu, \"submissions\": %zu, \"chunks\": %zu, "
+                "\"max_chunk_commands\": %zu, \"max_chunk_us\": %.3f, \"emitted\": { ",
+                ds->ReadCalls, ds->BytesRead, ds->Submissions, ds->ChunksRead, ds->MaxChunkCommands, ds->MaxChunkTime * 1e6);
+            for (int k = 0; k < OPB_CommandKind_Count; k++) {
+                fprintf(out, "\"%s\": %zu%s", KindNames[k], ds->Emitted[k], k < OPB_CommandKind_Count - 1 ? ", " : "");
+            }
+            fprintf(out, " } } }%s\n", j < BENCH_FORMATS - 1 ? "," : "");
+        }
+
+        fprintf(out, "      ]\n    }%s\n", i < count - 1 ? "," : "");
+    }
+
+    fprintf(out, "  ]\n}\n");
+}
+
+// runs the library's uint7+ decoder check over every encodable value, in slices so progress can be shown
+static int VerifyUint7(void) {
+    const uint32_t count = 1u << 29;
+    const uint32_t slice = 1u << 24;
+
+    double start = Now();
+    for (uint32_t first = 0; first < count; first += slice) {
+        int ret = OPB_VerifyUint7(first, first + slice - 1);
+        if (ret) {
+            printf("{ \"verify_uint7\": \"failed\", \"first_value\": %u }\n", first);
+            return EXIT_FAILURE;
+        }
+        fprintf(stderr, "Verified uint7+ values up to %u\n", first + slice - 1);
+    }
+
+    printf("{ \"verify_uint7\": \"ok\", \"values\": %u, \"seconds\": %.3f }\n", count, Now() - start);
+    return 0;
+}
+
+// fuzzing
+// mutates encoded streams and checks that OPB_Validate never accepts data the decoder fails on. every mutated
+// input, valid or not, goes through the memory and reader decoders with and without the dictionary, and is copied
+// to an allocation of exactly its size, so a build with -fsanitize=address also catches reads past the end of the
+// data. the unmutated streams must decode back to the register writes they were encoded from
+#define FUZZ_SYNTH_DURATION 10
+#define FUZZ_MAX_GROWTH 8
+#define FUZZ_FAILURE_FILE "opb_fuzz_failure.opb"
+
+typedef struct FuzzInput {
+    void* Data;
+    size_t Size;
+} FuzzInput;
+
+static const uint8_t FuzzValues[] = { 0x00, 0x01, 0x7F, 0x80, 0xFF, 0xD0, 0xD1, 0xD7, 0xDF, 0x12 };
+
+static size_t Mutate(uint32_t* rng, const FuzzInput* source, uint8_t* out) {
+    size_t size = source->Size;
+    memcpy(out, source->Data, size);
+
+    int mutations = 1 + (int)(NextRandom(rng) % 4);
+    for (int i = 0; i < mutations && size > 0; i++) {
+        // a quarter of the mutations target the header and instrument table, which are small next to the chunks
+        size_t range = (NextRandom(rng) & 3) == 0 && size > 64 ? 64 : size;
+        size_t pos = NextRandom(rng) % range;
+
+        switch (NextRandom(rng) % 6) {
+        case 0:
+            out[pos] ^= (uint8_t)(1 << (NextRandom(rng) % 8));
+            break;
+        case 1:
+            out[pos] = (uint8_t)NextRandom(rng);
+            break;
+        case 2:
+            out[pos] = FuzzValues[NextRandom(rng) % sizeof(FuzzValues)];
+            break;
+        case 3:
+            size = pos;
+            break;
+        case 4:
+            if (size < source->Size + FUZZ_MAX_GROWTH) {
+                memmove(out + pos + 1, out + pos, size - pos);
+                out[pos] = (uint8_t)NextRandom(rng);
+                size++;
+            }
+            break;
+        case 5:
+            memmove(out + pos, out + pos + 1, size - pos - 1);
+            size--;
+            break;
+        }
+    }
+
+    return size;
+}
+
+// the encoder may drop redundant writes and reorder the writes of one moment, so streams are compared by the
+// register state after every millisecond that has writes. the fuzzed streams only have whole millisecond times
+#define FUZZ_REGISTERS 0x200
+
+static int64_t FuzzMilliseconds(double time) {
+    return (int64_t)(time * 1000 + 0.5);
+}
+
+static bool SameRegisterState(const CommandStream* a, const CommandStream* b) {
+    uint8_t stateA[FUZZ_REGISTERS] = { 0 };
+    uint8_t stateB[FUZZ_REGISTERS] = { 0 };
+    size_t i = 0;
+    size_t j = 0;
+
+    while (i < a->Count || j < b->Count) {
+        int64_t time = i < a->Count ? FuzzMilliseconds(a->Stream[i].Time) : INT64_MAX;
+        if (j < b->Count && FuzzMilliseconds(b->Stream[j].Time) < time) {
+            time = FuzzMilliseconds(b->Stream[j].Time);
+        }
+
+        for (; i < a->Count && FuzzMilliseconds(a->Stream[i].Time) == time; i++) {
+            stateA[a->Stream[i].Addr % FUZZ_REGISTERS] = a->Stream[i].Data;
+        }
+        for (; j < b->Count && FuzzMilliseconds(b->Stream[j].Time) == time; j++) {
+            stateB[b->Stream[j].Addr % FUZZ_REGISTERS] = b->Stream[j].Data;
+        }
+        if (memcmp(stateA, stateB, FUZZ_REGISTERS)) {
+            fprintf(stderr, "Register state differs at %.3f seconds\n", time / 1000.0);
+            return false;
+        }
+    }
+    return true;
+}
+
+static int AddFuzzInput(const CommandStream* cmds, OPB_Format format, const OPB_EncodeOptions* options,
+    FuzzInput* inputs, int* count) {
+    FuzzInput* input = inputs + (*count)++;
+    int ret = OPB_OplToMemoryEx(format, cmds->Stream, cmds->Count, &input->Data, &input->Size, options);
+    if (ret) {
+        fprintf(stderr, "Encode failed: %s\n", OPB_GetErrorMessage(ret));
+        return ret;
+    }
+    if ((ret = OPB_Validate(input->Data, input->Size, NULL))) {
+        fprintf(stderr, "Unmodified %s stream failed validation: %s\n", OPB_GetFormatName(format), OPB_GetErrorMessage(ret));
+        return ret;
+    }
+
+    OPB_DecodeOptions decodeOptions = { 0 };
+    decodeOptions.Dictionary = options != NULL ? options->Dictionary : NULL;
+    CommandStream decoded = { 0 };
+    ret = OPB_MemoryToOplEx(input->Data, input->Size, ReceiveOpbBuffer, &decoded, &decodeOptions);
+    if (ret) {
+        fprintf(stderr, "Unmodified %s stream failed to decode: %s\n", OPB_GetFormatName(format), OPB_GetErrorMessage(ret));
+    }
+    else if (!SameRegisterState(cmds, &decoded)) {
+        fprintf(stderr, "Unmodified %s stream doesn't decode to the commands it was encoded from\n", OPB_GetFormatName(format));
+        ret = -1;
+    }
+    free(decoded.Stream);
+    return ret;
+}
+
+static void PutUint32(uint8_t* out, uint32_t value) {
+    out[0] = (uint8_t)(value >> 24);
+    out[1] = (uint8_t)(value >> 16);
+    out[2] = (uint8_t)(value >> 8);
+    out[3] = (uint8_t)value;
+}
+
+// rewrites a version 1 default format input to claim a dictionary of no instruments. it uses no dictionary
+// instruments, so it validates and has to decode with or without a dictionary
+#define FUZZ_VERSION_INDEX 5
+#define FUZZ_FLAG_DICTIONARY 0x1
+#define FUZZ_V1_HEADER_END 20           // id, format, size, instrument count and chunk count
+#define FUZZ_V2_HEADER_END 32           // the same with flags, dictionary count and dictionary id
+
+static int AddEmptyDictionaryInput(const FuzzInput* source, FuzzInput* inputs, int* count) {
+    const uint8_t* data = (const uint8_t*)source->Data;
+    size_t size = source->Size - FUZZ_V1_HEADER_END + FUZZ_V2_HEADER_END;
+    uint8_t* out = (uint8_t*)malloc(size);
+    if (out == NULL) return -1;
+
+    memcpy(out, data, 8);
+    out[FUZZ_VERSION_INDEX] = '2';
+    PutUint32(out + 8, (uint32_t)size);
+    PutUint32(out + 12, FUZZ_FLAG_DICTIONARY);
+    memcpy(out + 16, data + 12, 8);
+    PutUint32(out + 24, 0);
+    PutUint32(out + 28, 0);
+    memcpy(out + FUZZ_V2_HEADER_END, data + FUZZ_V1_HEADER_END, source->Size - FUZZ_V1_HEADER_END);
+
+    FuzzInput* input = inputs + (*count)++;
+    input->Data = out;
+    input->Size = size;
+
+    int ret = OPB_Validate(out, size, NULL);
+    if (ret) {
+        fprintf(stderr, "Empty dictionary stream failed validation: %s\n", OPB_GetErrorMessage(ret));
+    }
+    return ret;
+}
+
+// back reference bomb: one register write, then back references that each repeat every chunk played so far. if
+// back references could repeat what others played, its 26 references would play 2^26 chunks, so it has to be
+// rejected by both the validator and the decoder
+#define FUZZ_BOMB_REFERENCES 26
+#define FUZZ_FLAG_BACKREF 0x2
+#define FUZZ_BOMB_HEADER_END 28         // id, format, size, flags, instrument count, chunk count and window
+#define FUZZ_BOMB_WINDOW 65536
+#define FUZZ_CMD_BACKREF 0xD2
+
+static size_t PutUint7(uint8_t* out, uint32_t value) {
+    size_t length = 0;
+    for (; length < 3 && value >= 128; length++, value >>= 7) {
+        out[length] = (uint8_t)(value | 0x80);
+    }
+    out[length++] = (uint8_t)value;
+    return length;
+}
+
+static int AddBackReferenceBombInput(FuzzInput* inputs, int* count) {
+    uint8_t* out = (uint8_t*)malloc(FUZZ_BOMB_HEADER_END + 5 + FUZZ_BOMB_REFERENCES * 12);
+    if (out == NULL) return -1;
+
+    memcpy(out, "OPBin2", 7);
+    out[7] = OPB_Format_Default;
+    PutUint32(out + 12, FUZZ_FLAG_BACKREF);
+    PutUint32(out + 16, 0);
+    PutUint32(out + 20, FUZZ_BOMB_REFERENCES + 1);
+    PutUint32(out + 24, FUZZ_BOMB_WINDOW);
+
+    size_t size = FUZZ_BOMB_HEADER_END;
+    const uint8_t write[5] = { 0, 1, 0, 0x20, 0x01 };
+    memcpy(out + size, write, sizeof(write));
+    size += sizeof(write);
+
+    for (uint32_t i = 0, played = 1; i < FUZZ_BOMB_REFERENCES; i++, played *= 2) {
+        const uint8_t header[4] = { 0, 1, 0, FUZZ_CMD_BACKREF };
+        memcpy(out + size, header, sizeof(header));
+        size += sizeof(header);
+        size += PutUint7(out + size, played);
+        size += PutUint7(out + size, played << 1);
+    }
+    PutUint32(out + 8, (uint32_t)size);
+
+    FuzzInput* input = inputs + (*count)++;
+    input->Data = out;
+    input->Size = size;
+
+    size_t commands = 0;
+    if (OPB_Validate(out, size, NULL) != OPBERR_INVALID_DATA || !OPB_MemoryToOpl(out, size, CountOpbBuffer, &commands)) {
+        fprintf(stderr, "Back reference bomb wasn't rejected\n");
+        return -1;
+    }
+    return 0;
+}
+
+// memory and reader decodes of a fuzzed input, first with the dictionary and then without
+#define FUZZ_DECODES 4
+
+static const char* FuzzDecodeNames[FUZZ_DECODES] = {
+    "memory decode", "reader decode", "memory decode without dictionary", "reader decode without dictionary"
+};
+
+typedef struct FuzzDecode {
+    int Result;
+    size_t Commands;
+} FuzzDecode;
+
+static void DecodeFuzzInput(const uint8_t* data, size_t size, const OPB_Dictionary* dictionary, FuzzDecode* decodes) {
+    for (int i = 0; i < FUZZ_DECODES; i++) {
+        OPB_DecodeOptions options = { 0 };
+        options.Dictionary = i < 2 ? dictionary : NULL;
+        decodes[i].Commands = 0;
+
+        if (i % 2 == 0) {
+            decodes[i].Result = OPB_MemoryToOplEx(data, size, CountOpbBuffer, &decodes[i].Commands, &options);
+        }
+        else {
+            MemoryReader reader = { data, size, 0 };
+            decodes[i].Result = OPB_BinaryToOplEx(ReadFromMemory, &reader, CountOpbBuffer, &decodes[i].Commands, &options);
+        }
+    }
+}
+
+// every stream is fuzzed in the default and raw formats, encoded against a dictionary built from them, with back
+// references, voice commands, instrument groups and delta frequencies in the default and compressed formats, and with
+// chunk times in OPL samples. the dictionary and OPL sample encodes also choose their instrument tables ahead. a
+// second synthetic song plays 4-op voices and drums for the voice commands to combine, chords of one instrument to
+// group, slides for the deltas and instruments that share register values for the instrument optimizer. the
+// first stream is also fuzzed with a header that claims an empty dictionary, and a back reference bomb is fuzzed too
+static int Fuzz(const char** fixtures, int fixtureCount, const SynthParams* synth, uint32_t iterations) {
+    CommandStream streams[MAX_FIXTURES + 2] = { 0 };
+    FuzzInput inputs[(MAX_FIXTURES + 2) * 6 + 2];
+    OPB_Dictionary* dictionary = NULL;
+    int streamCount = 0;
+    int inputCount = 0;
+    int ret = 0;
+
+    for (int i = 0; i < fixtureCount && !ret; i++) {
+        if ((ret = OPB_FileToOpl(fixtures[i], ReceiveOpbBuffer, streams + streamCount++))) {
+            fprintf(stderr, "Couldn't load fixture '%s': %s\n", fixtures[i], OPB_GetErrorMessage(ret));
+        }
+    }
+
+    if (!ret) {
+        // a short synthetic song keeps iterations fast while still covering every kind of command
+        SynthParams params = *synth;
+        if (params.Duration > FUZZ_SYNTH_DURATION) params.Duration = FUZZ_SYNTH_DURATION;
+        params.Jitter = 0;
+        ret = GenerateSynthetic(&params, streams + streamCount++) ? -1 : 0;
+
+        params.FourOp = params.Rhythm = params.ChordInstrument = true;
+        params.SlideRate = 50;
+        params.Palette = 3;
+        if (!ret) ret = GenerateSynthetic(&params, streams + streamCount++) ? -1 : 0;
+    }
+
+    for (int i = 0; i < streamCount && !ret; i++) {
+        if (!(ret = AddFuzzInput(streams + i, OPB_Format_Default, NULL, inputs, &inputCount))) {
+            ret = AddFuzzInput(streams + i, OPB_Format_Raw, NULL, inputs, &inputCount);
+        }
+    }
+
+    if (!ret && !(ret = OPB_NewDictionary(&dictionary))) {
+        for (int i = 0; i < inputCount && !ret; i += 2) {
+            ret = OPB_DictionaryAddBinary(dictionary, inputs[i].Data, inputs[i].Size);
+        }
+        if (!ret) ret = OPB_FinishDictionary(dictionary, 1);
+    }
+
+    OPB_EncodeOptions dictionaryOptions = { 0 };
+    dictionaryOptions.Dictionary = dictionary;
+    dictionaryOptions.InstrumentEffort = 2;
+    OPB_EncodeOptions backReferenceOptions = { 0 };
+    backReferenceOptions.BackReferences = 1;
+    backReferenceOptions.VoiceCommands = 1;
+    backReferenceOptions.GroupInstruments = 1;
+    backReferenceOptions.DeltaFrequencies = 1;
+    OPB_EncodeOptions timeBaseOptions = { 0 };
+    timeBaseOptions.TimeBase = OPB_TIMEBASE_OPL;
+    timeBaseOptions.VoiceCommands = 1;
+    timeBaseOptions.GroupInstruments = 1;
+    timeBaseOptions.DeltaFrequencies = 1;
+    timeBaseOptions.InstrumentEffort = 3;
+    for (int i = 0; i < streamCount && !ret; i++) {
+        if (!(ret = AddFuzzInput(streams + i, OPB_Format_Default, &dictionaryOptions, inputs, &inputCount)) &&
+            !(ret = AddFuzzInput(streams + i, OPB_Format_Default, &backReferenceOptions, inputs, &inputCount)) &&
+            !(ret = AddFuzzInput(streams + i, OPB_Format_Compressed, &backReferenceOptions, inputs, &inputCount))) {
+            ret = AddFuzzInput(streams + i, OPB_Format_Default, &timeBaseOptions, inputs, &inputCount);
+        }
+    }
+    if (!ret) ret = AddEmptyDictionaryInput(inputs, inputs, &inputCount);
+    if (!ret) ret = AddBackReferenceBombInput(inputs, &inputCount);
+
+    for (int i = 0; i < streamCount; i++) free(streams[i].Stream);
+
+    size_t maxSize = 0;
+    for (int i = 0; i < inputCount; i++) {
+        if (inputs[i].Size > maxSize) maxSize = inputs[i].Size;
+    }
+
+    uint8_t* mutated = (uint8_t*)malloc(maxSize + FUZZ_MAX_GROWTH);
+    if (ret || mutated == NULL) {
+        for (int i = 0; i < inputCount; i++) free(inputs[i].Data);
+        free(mutated);
+        OPB_FreeDictionary(dictionary);
+        return EXIT_FAILURE;
+    }
+
+    uint32_t rng = synth->Seed ? synth->Seed : 1;
+    size_t accepted = 0;
+    double start = Now();
+    int result = 0;
+
+    for (uint32_t i = 0; i < iterations; i++) {
+        size_t size = Mutate(&rng, inputs + i % inputCount, mutated);
+
+        uint8_t* data = (uint8_t*)malloc(size > 0 ? size : 1);
+        if (data == NULL) {
+            result = EXIT_FAILURE;
+            break;
+        }
+        memcpy(data, mutated, size);
+
+        FuzzDecode decodes[FUZZ_DECODES];
+        DecodeFuzzInput(data, size, dictionary, decodes);
+
+        if (OPB_Validate(data, size, NULL) == 0) {
+            accepted++;
+
+            // the validator can't know which dictionary the data needs, so only the decoder can reject a changed id.
+            // past that every decode of valid data has to succeed and emit the same commands
+            const char* check = NULL;
+            int error = 0;
+            for (int j = 0; j < FUZZ_DECODES && check == NULL; j++) {
+                error = decodes[j].Result;
+                if (error && error != OPBERR_DICTIONARY_MISMATCH) {
+                    check = FuzzDecodeNames[j];
+                }
+                else if (j % 2 == 1 && (error != decodes[j - 1].Result || decodes[j].Commands != decodes[j - 1].Commands)) {
+                    check = "reader and memory decodes differ";
+                }
+                else if (j >= 2 && !error && !decodes[j - 2].Result && decodes[j].Commands != decodes[j - 2].Commands) {
+                    check = "decodes with and without the dictionary differ";
+                }
+            }
+
+            if (check != NULL) {
+                FILE* out = fopen(FUZZ_FAILURE_FILE, "wb");
+                if (out != NULL) {
+                    fwrite(data, 1, size, out);
+                    fclose(out);
+                }
+                printf("{ \"fuzz\": \"failed\", \"iteration\": %u, \"check\": ", i);
+                WriteJsonString(stdout, check);
+                printf(", \"error\": %d, \"message\": ", error);
+                WriteJsonString(stdout, OPB_GetErrorMessage(error));
+                printf(", \"input\": \"%s\" }\n", FUZZ_FAILURE_FILE);
+                result = EXIT_FAILURE;
+            }
+        }
+
+        free(data);
+        if (result) break;
+
+        if ((i + 1) % 100000 == 0) {
+            fprintf(stderr, "Fuzzed %u inputs\n", i + 1);
+        }
+    }
+
+    if (!result) {
+        printf("{ \"fuzz\": \"ok\", \"seed\": %u, \"iterations\": %u, \"inputs\": %d, \"accepted\": %zu, \"seconds\": %.3f }\n",
+            synth->Seed, iterations, inputCount, accepted, Now() - start);
+    }
+
+    for (int i = 0; i < inputCount; i++) free(inputs[i].Data);
+    free(mutated);
+    OPB_FreeDictionary(dictionary);
+    return result;
+}
+
+// used to get the exe's name when printing usage directions
+void GetFilename(char* path, char* result, size_t maxLen) {
+    int lastSlash = -1;
+    int i = 0;
+    while (path[i] != '\0') {
+        if (path[i] == '/' || path[i] == '\\') lastSlash = i;
+        i++;
+    }
+
+    if (lastSlash >= 0) strncpy(result, path + lastSlash + 1, (size_t)(maxLen - 1));
+    else strncpy(result, path, (size_t)(maxLen - 1));
+    result[maxLen - 1] = '\0';
+}
+
+static void PrintUsage(char* path) {
+    char filename[128];
+    GetFilename(path, filename, 128);
+
+    printf("Usage: %s [options] [fixture.opb ...]\n\n", filename);
+    printf("Options:\n");
+    printf("  -o <file>          write JSON results to file instead of stdout\n");
+    printf("  -n <count>         iterations per measurement, fastest is reported (default 5)\n");
+    printf("  --no-render        skip the render benchmark\n");
+    printf("  --batch <n>        raw format entries per receiver call when decoding from memory (default 256)\n");
+    printf("  --verify-uint7     check the fast uint7+ decoders against the reference for all 2^29 values and exit\n");
+    printf("  --fuzz <count>     validate and decode count mutated copies of the encoded fixtures and exit\n");
+    printf("  --seed <n>         synthetic stream seed (default 1)\n");
+    printf("  --channels <n>     synthetic melodic channels, 1-18 (default 18)\n");
+    printf("  --chord <n>        synthetic notes per event (default 3)\n");
+    printf("  --churn <0-1>      synthetic instrument change chance per note (default 0.25)\n");
+    printf("  --rate <n>         synthetic events per second (default 8)\n");
+    printf("  --duration <s>     synthetic song length in seconds (default 600)\n");
+    printf("  --jitter <ms>      spread the writes of each synthetic event over up to this long (default 0)\n");
+    printf("  --coalesce <ms>    also encode with this coalescing window and report the chunks and bytes it saves\n");
+    printf("  --four-op          play 4-op voices on the synthetic channel pairs\n");
+    printf("  --rhythm           play rhythm mode drums in the synthetic stream\n");
+    printf("  --voices           encode with the 4-op and rhythm instrument commands\n");
+    printf("  --chord-instrument play every note of a synthetic event with the same instrument\n");
+    printf("  --groups           encode with instrument commands that set several channels at once\n");
+    printf("  --slides <n>       synthetic pitch slide and vibrato writes per second of every playing note (default 0)\n");
+    printf("  --deltas           encode with delta frequency commands\n");
+    printf("  --palette <n>      synthetic values per instrument register, only changed registers written (default 0)\n");
+    printf("  --effort <0-3>     choose the instrument table before encoding with this effort (default 0)\n");
+    printf("\nWithout fixtures OPB2WAV/doom.opb and DumpOPL/test.opb from the source tree are used.\n");
+}
+
+int main(int argc, char* argv[]) {
+    SynthParams synth = { 1, 18, 3, 0.25, 8, 600, 0, false, false, false, 0, 0 };
+    double coalesceWindow = 0;
+    bool voices = false;
+    bool groups = false;
+    bool deltas = false;
+    int effort = 0;
+    int iterations = 5;
+    size_t batchSize = 256;
+    bool render = true;
+    const char* outPath = NULL;
+    const char* fixtures[MAX_FIXTURES];
+    int fixtureCount = 0;
+    uint32_t fuzzIterations = 0;
+
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (!strcmp(arg, "-h") || !strcmp(arg, "--help")) { PrintUsage(argv[0]); return 0; }
+        else if (!strcmp(arg, "--no-render")) render = false;
+        else if (!strcmp(arg, "--verify-uint7")) return VerifyUint7();
+        else if (!strcmp(arg, "--fuzz") && hasValue) fuzzIterations = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(arg, "-o") && hasValue) outPath = argv[++i];
+        else if (!strcmp(arg, "-n") && hasValue) iterations = atoi(argv[++i]);
+        else if (!strcmp(arg, "--batch") && hasValue) batchSize = (size_t)strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(arg, "--seed") && hasValue) synth.Seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+        else if (!strcmp(arg, "--channels") && hasValue) synth.Channels = atoi(argv[++i]);
+        else if (!strcmp(arg, "--chord") && hasValue) synth.ChordSize = atoi(argv[++i]);
+        else if (!strcmp(arg, "--churn") && hasValue) synth.Churn = atof(argv[++i]);
+        else if (!strcmp(arg, "--rate") && hasValue) synth.EventRate = atof(argv[++i]);
+        else if (!strcmp(arg, "--duration") && hasValue) synth.Duration = atof(argv[++i]);
+        else if (!strcmp(arg, "--jitter") && hasValue) synth.Jitter = atof(argv[++i]) / 1000;
+        else if (!strcmp(arg, "--coalesce") && hasValue) coalesceWindow = atof(argv[++i]) / 1000;
+        else if (!strcmp(arg, "--four-op")) synth.FourOp = true;
+        else if (!strcmp(arg, "--rhythm")) synth.Rhythm = true;
+        else if (!strcmp(arg, "--voices")) voices = true;
+        else if (!strcmp(arg, "--chord-instrument")) synth.ChordInstrument = true;
+        else if (!strcmp(arg, "--groups")) groups = true;
+        else if (!strcmp(arg, "--slides") && hasValue) synth.SlideRate = atof(argv[++i]);
+        else if (!strcmp(arg, "--deltas")) deltas = true;
+        else if (!strcmp(arg, "--palette") && hasValue) synth.Palette = atoi(argv[++i]);
+        else if (!strcmp(arg, "--effort") && hasValue) effort = atoi(argv[++i]);
+        else if (arg[0] == '-') { PrintUsage(argv[0]); return EXIT_FAILURE; }
+        else if (fixtureCount < MAX_FIXTURES) fixtures[fixtureCount++] = arg;
+    }
+
+    if (iterations < 1) iterations = 1;
+
+    if (fixtureCount == 0) {
+        fixtures[fixtureCount++] = OPB_FIXTURE_DIR "/OPB2WAV/doom.opb";
+        fixtures[fixtureCount++] = OPB_FIXTURE_DIR "/DumpOPL/test.opb";
+    }
+
+    if (fuzzIterations > 0) {
+        return Fuzz(fixtures, fixtureCount, &synth, fuzzIterations);
+    }
+
+    CaseResult results[MAX_FIXTURES + 1];
+    int resultCount = 0;
+    int ret;
+
+    for (int i = 0; i < fixtureCount; i++) {
+        CommandStream cmds = { 0 };
+        if ((ret = OPB_FileToOpl(fixtures[i], ReceiveOpbBuffer, &cmds))) {
+            fprintf(stderr, "Couldn't load fixture '%s': %s\n", fixtures[i], OPB_GetErrorMessage(ret));
+            return EXIT_FAILURE;
+        }
+
+        const char* name = strrchr(fixtures[i], '/');
+        ret = BenchCase(name != NULL ? name + 1 : fixtures[i], &cmds, iterations, batchSize, render, voices, groups, deltas, effort, coalesceWindow, &results[resultCount++]);
+        free(cmds.Stream);
+        if (ret) return EXIT_FAILURE;
+    }
+
+    {
+        CommandStream cmds = { 0 };
+        if (GenerateSynthetic(&synth, &cmds)) {
+            fprintf(stderr, "Out of memory generating synthetic stream\n");
+            return EXIT_FAILURE;
+        }
+
+        ret = BenchCase("synthetic", &cmds, iterations, batchSize, render, voices, groups, deltas, effort, coalesceWindow, &results[resultCount++]);
+        free(cmds.Stream);
+        if (ret) return EXIT_FAILURE;
+    }
+
+    FILE* out = stdout;
+    if (outPath != NULL && (out = fopen(outPath, "w")) == NULL) {
+        fprintf(stderr, "Couldn't open file '%s' for writing\n", outPath);
+        return EXIT_FAILURE;
+    }
+
+    WriteJson(out, &synth, iterations, batchSize, voices, groups, deltas, effort, coalesceWindow, results, resultCount);
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}
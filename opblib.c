@@ -23,6 +23,20 @@
 */
 #ifdef _WIN32
 #define _CRT_SECURE_NO_DEPRECATE
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#else
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 199309L
+#endif
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,9 +45,28 @@
 #include <string.h>
 #include "opblib.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define OPB_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(__BMI2__)
+#define OPB_BMI2
+#include <immintrin.h>
+#endif
+
 #define OPB_HEADER_SIZE 7
 // OPBin1\0
 const char OPB_Header[OPB_HEADER_SIZE] = { 'O', 'P', 'B', 'i', 'n', '1', '\0' };
+// version 2 is only written for data that uses a feature version 1 decoders can't read, and says which in its flags
+#define OPB_VERSION_INDEX 5
+#define OPB_FLAG_DICTIONARY 0x1 // instrument indices below the dictionary count refer to a shared dictionary
+#define OPB_FLAG_BACKREF 0x2    // 0xD2 is a back reference to earlier chunks instead of a register write
+#define OPB_FLAG_TIMEBASE 0x4   // chunk times count units of the header's time base instead of milliseconds
+#define OPB_FLAG_VOICES 0x8     // 0xD3-0xD6 are 4-op pair and rhythm instrument commands instead of register writes
+#define OPB_FLAG_GROUPS 0x10    // 0xD0 and 0xD1 with channel 31 set an instrument on a group of channels
+#define OPB_FLAG_DELTAFREQ 0x20 // 0xF6-0xFE move a channel's frequency by a delta instead of writing to registers
+#define OPB_KNOWN_FLAGS (OPB_FLAG_DICTIONARY | OPB_FLAG_BACKREF | OPB_FLAG_TIMEBASE | OPB_FLAG_VOICES | OPB_FLAG_GROUPS | \
+    OPB_FLAG_DELTAFREQ)
 
 #define VECTOR_MIN_CAPACITY 8
 #define VECTOR_PTR(vector, index) (void*)((uint8_t*)((vector)->Storage) + (index) * vector->ElementSize)
@@ -45,6 +78,7 @@ typedef struct Vector {
     size_t Capacity;
     size_t ElementSize;
     void* Storage;
+    size_t Allocations; // number of times storage was allocated, for encoder statistics
 } Vector;
 
 Vector Vector_New(size_t elementSize) {
@@ -96,6 +130,7 @@ static int Vector_Add(Vector* v, void* item) {
         if (newStorage == NULL) {
             return -1;
         }
+        v->Allocations++;
 
         if (v->Storage != NULL) {
             memcpy(newStorage, v->Storage, v->Count * v->ElementSize);
@@ -123,6 +158,25 @@ static int Vector_AddRange(Vector* v, void* items, size_t count) {
     return 0;
 }
 
+static int Vector_Reserve(Vector* v, size_t capacity) {
+    if (v->ElementSize <= 0) {
+        return -1;
+    }
+    if (capacity <= v->Capacity) {
+        return 0;
+    }
+
+    void* newStorage = realloc(v->Storage, capacity * v->ElementSize);
+    if (newStorage == NULL) {
+        return -1;
+    }
+    v->Allocations++;
+
+    v->Storage = newStorage;
+    v->Capacity = capacity;
+    return 0;
+}
+
 typedef int(*VectorSortFunc)(const void* a, const void* b);
 
 static void Vector_Clear(Vector* v, bool keepStorage) {
@@ -169,20 +223,8 @@ static const char* GetSourceFilename(void) {
         return OPBERR_WRITE_ERROR; \
     }
 
-#define SEEK(context, offset, origin) \
-    if (context->Seek(context->UserData, offset, origin)) { \
-        Log("OPB seek error occurred in '%s' at line %d\n", GetSourceFilename(), __LINE__); \
-        return OPBERR_SEEK_ERROR; \
-    }
-#define TELL(context, var) \
-    var = context->Tell(context->UserData); \
-    if (var == -1L) { \
-        Log("OPB file position error occurred in '%s' at line %d\n", GetSourceFilename(), __LINE__); \
-        return OPBERR_TELL_ERROR; \
-    }
-
 #define READ(buffer, size, count, context) \
-    if (context->Read(buffer, size, count, context->UserData) != count) { \
+    if (ReadBytes(context, buffer, size, count) != count) { \
         Log("OPB read error occurred in '%s' at line %d\n", GetSourceFilename(), __LINE__); \
         return OPBERR_READ_ERROR; \
     }
@@ -195,31 +237,374 @@ static const char* GetSourceFilename(void) {
 #define SUBMIT(stream, count, context) \
     if (context->Submit(stream, count, context->ReceiverData)) return OPBERR_BUFFER_ERROR
 
+#define RAW_ENTRY_SIZE 5
+
+// encoder time is stored as integer ticks, fine enough to keep timestamps that differ in the source stream apart
+#define TICKS_PER_SECOND 1000000
+#define TICKS_PER_MS (TICKS_PER_SECOND / 1000)
+
+// the encoder's command stream is stored as a structure of arrays to keep it compact and cache-friendly.
+// a command's position in these arrays is also its order index
+typedef struct CommandStream {
+    size_t Count;
+    size_t Capacity;
+    uint16_t* Addr;
+    uint8_t* Data;
+    int64_t* Time;
+    size_t Allocations;
+} CommandStream;
+
+static void CommandStream_Free(CommandStream* stream) {
+    free(stream->Addr);
+    free(stream->Data);
+    free(stream->Time);
+    memset(stream, 0, sizeof(CommandStream));
+}
+
+static int CommandStream_Reserve(CommandStream* stream, size_t capacity) {
+    if (capacity <= stream->Capacity) {
+        return 0;
+    }
+
+    uint16_t* addr = (uint16_t*)realloc(stream->Addr, capacity * sizeof(uint16_t));
+    if (addr == NULL) return -1;
+    stream->Addr = addr;
+
+    uint8_t* data = (uint8_t*)realloc(stream->Data, capacity * sizeof(uint8_t));
+    if (data == NULL) return -1;
+    stream->Data = data;
+
+    int64_t* time = (int64_t*)realloc(stream->Time, capacity * sizeof(int64_t));
+    if (time == NULL) return -1;
+    stream->Time = time;
+
+    stream->Capacity = capacity;
+    stream->Allocations += 3;
+    return 0;
+}
+
+static int CommandStream_Add(CommandStream* stream, uint16_t addr, uint8_t data, int64_t time) {
+    if (stream->Count >= stream->Capacity) {
+        size_t newCapacity = stream->Capacity * 2;
+        if (newCapacity < VECTOR_MIN_CAPACITY) newCapacity = VECTOR_MIN_CAPACITY;
+        if (CommandStream_Reserve(stream, newCapacity)) return -1;
+    }
+
+    stream->Addr[stream->Count] = addr;
+    stream->Data[stream->Count] = data;
+    stream->Time[stream->Count] = time;
+    stream->Count++;
+    return 0;
+}
+
+static inline int64_t SecondsToTicks(double time) {
+    return time >= 0 ? (int64_t)(time * TICKS_PER_SECOND + 0.5) : -(int64_t)(-time * TICKS_PER_SECOND + 0.5);
+}
+
 typedef struct Context Context;
 typedef struct Command Command;
+typedef struct InstrumentSlots InstrumentSlots;
 typedef struct OpbData OpbData;
 typedef struct Instrument Instrument;
 
+// a run of Length chunks starting at Chunk that repeats the commands of the chunks Distance chunks earlier
+typedef struct BackReference {
+    uint32_t Chunk;
+    uint32_t Distance;
+    uint32_t Length;
+    bool ExplicitTimes;     // the run's elapsed times differ from the repeated chunks' and are stored with it
+    uint32_t Size;          // bytes the back reference takes up, including its chunk header
+} BackReference;
+
+// a chunk read from the data, or a back reference together with the chunks it played. only chunks read from the data
+// can be repeated, so nothing is kept of what a back reference played
+typedef struct HistoryChunk {
+    uint64_t Index;             // chunks played before this one
+    uint64_t Time;              // time base units from the start of the data to this chunk
+    size_t Start;               // decoder only, index of the chunk's first command in the decoder's History
+    uint32_t BackReferences;    // back references before this one, so a run without any is found with one comparison
+    uint32_t Played;            // chunks played by a back reference, 0 for a chunk read from the data
+} HistoryChunk;
+
+// the chunks back references can still reach, oldest first
+typedef struct ChunkHistory {
+    VectorT(HistoryChunk) Chunks;
+    uint64_t Played;            // chunks played so far, including the ones back references played
+    uint32_t BackReferences;    // back references read so far
+    uint32_t Window;            // chunks a back reference can reach back at most, from the header
+} ChunkHistory;
+
+// an instrument command of one channel that may be stored together with those of other channels
+typedef struct GroupCandidate {
+    int64_t Time;
+    int64_t Previous;       // order of the channel's last write before the command, or -1 if there is none
+    uint32_t Order;         // order of the first write the command takes the place of
+    uint32_t Instrument;
+    uint32_t Slots;         // slots the command writes
+    uint8_t Channel;
+    uint8_t Frequency;      // the values of the slots that aren't part of the instrument, if they're in Slots
+    uint8_t Note;
+    uint8_t ModLevel;
+    uint8_t CarLevel;
+    bool Grouped;           // already stored, either in a group or on its own
+} GroupCandidate;
+
+// entropy coding
+// the compressed format codes the bytes of the default format's chunks with static canonical huffman codes, read
+// lowest bit first. which of the three models a byte is coded with follows from the chunk grammar, so the decoder
+// always knows the model of the next byte it reads without any extra data
+#define ENTROPY_MODEL_REGISTER 0    // the register byte that starts each command
+#define ENTROPY_MODEL_DATA 1        // register data and the fixed size arguments of special commands
+#define ENTROPY_MODEL_UINT7 2       // chunk headers and every other uint7+ value
+#define ENTROPY_MODELS 3
+#define ENTROPY_MAX_CODE_LENGTH 11
+#define ENTROPY_LOOKUP_SIZE (1 << ENTROPY_MAX_CODE_LENGTH)
+#define ENTROPY_LENGTHS_SIZE 128    // code lengths of one model are stored as 4 bits per byte value
+#define ENTROPY_TABLE_SIZE (ENTROPY_MODELS * ENTROPY_LENGTHS_SIZE)
+#define ENTROPY_READ_SIZE 256
+
+typedef struct EntropyEncoder {
+    uint8_t* Chunks;            // the chunks as the default format writes them
+    size_t ChunksSize;
+    uint32_t ChunkCount;
+    uint32_t Counts[ENTROPY_MODELS][256];
+    uint8_t Lengths[ENTROPY_MODELS][256];
+    uint16_t Codes[ENTROPY_MODELS][256];    // bit reversed, so they can be written lowest bit first
+    uint64_t Bits;              // size of all coded chunks in bits
+} EntropyEncoder;
+
+// only uses fixed size storage, so decoding compressed data allocates nothing more than the default format does
+typedef struct EntropyDecoder {
+    uint16_t Lookup[ENTROPY_MODELS][ENTROPY_LOOKUP_SIZE]; // symbol << 4 | code length by the next code bits, 0 if unused
+    uint64_t Bits;              // bits read ahead, the next code starts at the lowest bit
+    int BitCount;
+    const uint8_t* Next;        // input that hasn't been moved into Bits yet
+    const uint8_t* End;
+    OPB_StreamReader Read;      // refills Buffer when the input isn't in memory
+    void* ReadData;
+    size_t Remaining;           // bytes Read may still deliver, which keeps it from reading past the data
+    uint8_t Buffer[ENTROPY_READ_SIZE];
+} EntropyDecoder;
+
+static inline uint32_t ReverseBits(uint32_t code, int length) {
+    uint32_t reversed = 0;
+    for (int i = 0; i < length; i++) {
+        reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+    return reversed;
+}
+
+// assigns canonical codes to code lengths. returns false if the lengths don't form a prefix code
+static bool CanonicalCodes(const uint8_t* lengths, uint16_t* codes) {
+    uint32_t lengthCounts[ENTROPY_MAX_CODE_LENGTH + 1] = { 0 };
+    for (int i = 0; i < 256; i++) {
+        if (lengths[i] > ENTROPY_MAX_CODE_LENGTH) return false;
+        lengthCounts[lengths[i]]++;
+    }
+    lengthCounts[0] = 0;
+
+    uint32_t used = 0;
+    for (int i = 1; i <= ENTROPY_MAX_CODE_LENGTH; i++) {
+        used += lengthCounts[i] << (ENTROPY_MAX_CODE_LENGTH - i);
+    }
+    if (used > ENTROPY_LOOKUP_SIZE) return false;
+
+    uint32_t nextCode[ENTROPY_MAX_CODE_LENGTH + 1];
+    uint32_t code = 0;
+    for (int i = 1; i <= ENTROPY_MAX_CODE_LENGTH; i++) {
+        code = (code + lengthCounts[i - 1]) << 1;
+        nextCode[i] = code;
+    }
+
+    for (int i = 0; i < 256; i++) {
+        codes[i] = lengths[i] != 0 ? (uint16_t)ReverseBits(nextCode[lengths[i]]++, lengths[i]) : 0;
+    }
+    return true;
+}
+
+static inline void UnpackCodeLengths(const uint8_t* stored, uint8_t* lengths) {
+    for (int i = 0; i < ENTROPY_LENGTHS_SIZE; i++) {
+        lengths[i * 2] = stored[i] & 0xF;
+        lengths[i * 2 + 1] = stored[i] >> 4;
+    }
+}
+
+// builds the lookup tables from stored code lengths. codes that are left unused decode as errors
+static bool InitEntropyDecoder(EntropyDecoder* decoder, const uint8_t* stored) {
+    memset(decoder, 0, sizeof(EntropyDecoder));
+
+    for (int model = 0; model < ENTROPY_MODELS; model++) {
+        uint8_t lengths[256];
+        uint16_t codes[256];
+        UnpackCodeLengths(stored + model * ENTROPY_LENGTHS_SIZE, lengths);
+        if (!CanonicalCodes(lengths, codes)) return false;
+
+        uint16_t* lookup = decoder->Lookup[model];
+        for (int i = 0; i < 256; i++) {
+            for (uint32_t j = codes[i]; lengths[i] != 0 && j < ENTROPY_LOOKUP_SIZE; j += 1u << lengths[i]) {
+                lookup[j] = (uint16_t)((i << 4) | lengths[i]);
+            }
+        }
+    }
+    return true;
+}
+
+static inline uint64_t Load64LE(const uint8_t* p) {
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+        ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static void RefillEntropyBits(EntropyDecoder* decoder) {
+    // with 8 bytes at hand a single load tops the bits up to at least 56. the bits it loads past that belong to bytes
+    // that are loaded again later at the same position, so they never have to be cleared
+    if (decoder->End - decoder->Next >= 8) {
+        decoder->Bits |= Load64LE(decoder->Next) << decoder->BitCount;
+        decoder->Next += (63 - decoder->BitCount) >> 3;
+        decoder->BitCount |= 56;
+        return;
+    }
+
+    while (decoder->BitCount <= 56) {
+        if (decoder->Next == decoder->End) {
+            size_t count = decoder->Remaining < ENTROPY_READ_SIZE ? decoder->Remaining : ENTROPY_READ_SIZE;
+            if (count == 0 || (count = decoder->Read(decoder->Buffer, 1, count, decoder->ReadData)) == 0) return;
+            decoder->Remaining -= count;
+            decoder->Next = decoder->Buffer;
+            decoder->End = decoder->Buffer + count;
+        }
+        decoder->Bits |= (uint64_t)*decoder->Next++ << decoder->BitCount;
+        decoder->BitCount += 8;
+    }
+}
+
+// returns the next byte, or -1 for an unused code or the end of the data
+static inline int DecodeEntropyByte(EntropyDecoder* decoder, int model) {
+    if (decoder->BitCount < ENTROPY_MAX_CODE_LENGTH) {
+        RefillEntropyBits(decoder);
+    }
+
+    uint32_t entry = decoder->Lookup[model][decoder->Bits & (ENTROPY_LOOKUP_SIZE - 1)];
+    int length = entry & 0xF;
+    if (length == 0 || length > decoder->BitCount) {
+        return -1;
+    }
+
+    decoder->Bits >>= length;
+    decoder->BitCount -= length;
+    return (int)(entry >> 4);
+}
+
+static size_t ReadEntropyBytes(EntropyDecoder* decoder, uint8_t* buffer, size_t count, int model) {
+    for (size_t i = 0; i < count; i++) {
+        int value = DecodeEntropyByte(decoder, model);
+        if (value < 0) return i;
+        buffer[i] = (uint8_t)value;
+    }
+    return count;
+}
+
 typedef struct Context {
-    VectorT(Command) CommandStream;
+    CommandStream CommandStream;
     OPB_StreamWriter Write;
-    OPB_StreamSeeker Seek;
-    OPB_StreamTeller Tell;
     OPB_StreamReader Read;
     OPB_BufferReceiver Submit;
+    OPB_TickReceiver SubmitTicks;           // decoder only, set when decoding raw data to integer times
     OPB_Format Format;
     VectorT(OpbData) DataMap;
     VectorT(Instrument) Instruments;
-    VectorT(Command) Tracks[NUM_TRACKS];
+    const uint8_t* InstrumentTable;         // decoder only, the instruments stored in the data, INSTRUMENT_SIZE bytes
+                                            // each. points into the memory input or InstrumentData
+    uint32_t InstrumentCount;               // decoder only, entries of InstrumentTable
+    VectorT(uint8_t) InstrumentData;        // decoder only, holds the instrument table of reader input
+    VectorT(uint32_t) Tracks[NUM_TRACKS];   // indices into CommandStream for each channel
+    VectorT(uint32_t) Output;               // processed command references, see COMMAND_REF_DATA
+    VectorT(Command) Range;                 // scratch buffer for the range being processed
+    VectorT(BackReference) BackReferences;  // encoder only, runs of chunks written as back references
+    VectorT(GroupCandidate) Groups;         // encoder only, instrument commands that may be grouped across channels
+    VectorT(Instrument) InstrumentRequests; // encoder only, property sets requested while CollectInstruments is set
+    VectorT(uint32_t) History;              // decoder only, commands of the chunks in HistoryChunks as addr << 8 | data
+    ChunkHistory HistoryChunks;             // decoder only, the chunks back references can still repeat
+    EntropyEncoder* EntropyEncoder;         // compressed format encoder only
+    EntropyDecoder* EntropyDecoder;         // compressed format decoder only, set once the chunks are reached
+    uint8_t ReadModel;                      // entropy model of the bytes the decoder reads next
+    OPB_EncodeStats* Stats;
+    bool RawDelayRecords;                   // see OPB_EncodeOptions
+    bool UseBackReferences;                 // see OPB_EncodeOptions
+    bool UseVoiceCommands;                  // see OPB_EncodeOptions
+    bool UseGroupCommands;                  // see OPB_EncodeOptions
+    bool UseDeltaFrequencies;               // see OPB_EncodeOptions
+    int InstrumentEffort;                   // see OPB_EncodeOptions
+    bool CollectInstruments;                // encoder only, set while the instrument optimizer gathers property sets
+    uint32_t PairTracks;                    // see TrackState
+    int64_t CoalesceWindow;                 // encoder ticks, see OPB_EncodeOptions
+    const OPB_Dictionary* Dictionary;       // see OPB_EncodeOptions and OPB_DecodeOptions
+    uint32_t FormatFlags;                   // OPB_FLAG_* of the data being encoded or decoded
+    uint32_t TimeBase;                      // chunk time units per second of the data being encoded or decoded
+    uint32_t SharedInstruments;             // leading entries of the instrument table that come from the dictionary
+    uint32_t BackReferenceWindow;           // encoder only, largest back reference distance, stored in the header
+    double StartTime;
+    size_t Allocations;                     // allocations made outside of vectors
+    const OPB_DecodeOptions* DecodeOptions; // only set when decoding with statistics
+    OPB_StreamReader SourceRead;            // reader and receiver wrapped by the decoder's statistics
+    void* SourceData;
+    OPB_BufferReceiver SourceSubmit;
+    void* SourceReceiverData;
+    uint8_t LastCommand;                    // base address of the last command read by the decoder
+    bool LastGroup;                         // decoder only, the last command read was an instrument group
+    bool Replaying;                         // decoder only, set while a back reference plays earlier chunks
+    uint8_t Registers[0x200];               // decoder only, last value written to every register, which delta
+                                            // frequency commands are relative to
+    int ChunkCommands;                      // number of commands in the chunk being decoded
+    const uint8_t* Memory;                  // decoder input when decoding from memory instead of a reader
+    size_t MemorySize;
+    size_t MemoryPosition;
+    uint32_t ChunksSinceSample;
+    size_t BatchSize;                       // raw format records per receiver call
     double Time;
+    int64_t TimeUnits;                      // decoder only, the same time counted in units of TimeBase
+    VectorT(OPB_TickCommand) TickBuffer;    // decoder only, allocated when decoding chunks to integer times
+    bool RawTicksOnly;                      // see OPB_RawMemoryToTicks
     void* UserData;
     void* ReceiverData;
 } Context;
 
+// reads through the entropy decoder for compressed chunks, otherwise from the decoder's memory input if it has one
+// or its reader
+static inline size_t ReadBytes(Context* context, void* buffer, size_t elementSize, size_t elementCount) {
+    if (context->EntropyDecoder != NULL) {
+        size_t size = ReadEntropyBytes(context->EntropyDecoder, (uint8_t*)buffer, elementSize * elementCount, context->ReadModel);
+        return size / elementSize;
+    }
+    if (context->Memory != NULL) {
+        size_t available = (context->MemorySize - context->MemoryPosition) / elementSize;
+        if (elementCount > available) {
+            elementCount = available;
+        }
+        memcpy(buffer, context->Memory + context->MemoryPosition, elementCount * elementSize);
+        context->MemoryPosition += elementCount * elementSize;
+        return elementCount;
+    }
+    return context->Read(buffer, elementSize, elementCount, context->UserData);
+}
+
 static void Context_Free(Context* context) {
-    if (context->CommandStream.Storage != NULL) { Vector_Free(&context->CommandStream); }
+    CommandStream_Free(&context->CommandStream);
     if (context->Instruments.Storage != NULL) { Vector_Free(&context->Instruments); }
+    if (context->InstrumentData.Storage != NULL) { Vector_Free(&context->InstrumentData); }
     if (context->DataMap.Storage != NULL) { Vector_Free(&context->DataMap); }
+    if (context->Output.Storage != NULL) { Vector_Free(&context->Output); }
+    if (context->Range.Storage != NULL) { Vector_Free(&context->Range); }
+    if (context->BackReferences.Storage != NULL) { Vector_Free(&context->BackReferences); }
+    if (context->Groups.Storage != NULL) { Vector_Free(&context->Groups); }
+    if (context->InstrumentRequests.Storage != NULL) { Vector_Free(&context->InstrumentRequests); }
+    if (context->History.Storage != NULL) { Vector_Free(&context->History); }
+    if (context->HistoryChunks.Chunks.Storage != NULL) { Vector_Free(&context->HistoryChunks.Chunks); }
+    if (context->TickBuffer.Storage != NULL) { Vector_Free(&context->TickBuffer); }
+    if (context->EntropyEncoder != NULL) {
+        free(context->EntropyEncoder->Chunks);
+        free(context->EntropyEncoder);
+        context->EntropyEncoder = NULL;
+    }
     for (int i = 0; i < NUM_TRACKS; i++) {
         if (context->Tracks[i].Storage != NULL) { Vector_Free(&context->Tracks[i]); }
     }
@@ -227,12 +612,23 @@ static void Context_Free(Context* context) {
 
 OPB_LogHandler OPB_Log;
 
-static inline size_t BufferSize(const char* format, ...) {
-    va_list args;
-    va_start(args, format);
-    size_t result = vsnprintf(NULL, 0, format, args);
-    va_end(args);
-    return (size_t)(result + 1); // safe byte for \0
+// wall clock time in seconds, only used for statistics
+static double GetClock(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+static inline size_t BufferSize(const char* format, va_list args) {
+    int result = vsnprintf(NULL, 0, format, args);
+    return result < 0 ? 0 : (size_t)result + 1; // safe byte for \0
 }
 
 static void Log(const char* format, ...) {
@@ -268,6 +664,8 @@ const char* OPB_GetFormatName(OPB_Format fmt) {
         return "Default";
     case OPB_Format_Raw:
         return "Raw";
+    case OPB_Format_Compressed:
+        return "Compressed";
     }
 }
 
@@ -303,17 +701,33 @@ static size_t Uint7Size(uint32_t value) {
     }
 }
 
+// 32-bit FNV-1a, used for dictionary ids, archive names and chunk matching
+#define FNV_OFFSET_BASIS 2166136261u
+
+static uint32_t Fnv1a(const uint8_t* data, size_t length, uint32_t hash) {
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// a command from the range currently being processed, copied out of the command stream
 typedef struct Command {
     uint16_t Addr;
     uint8_t Data;
-    double Time;
-    int OrderIndex;
-    int DataIndex;
+    uint32_t Index; // index into the command stream, which is also the order index
 } Command;
 
+// processed commands are stored as 32-bit references. plain register writes refer to their index in the
+// command stream, OPB commands have this bit set and refer to their index in the data map instead
+#define COMMAND_REF_DATA 0x80000000u
+#define COMMAND_REF_INDEX(ref) ((ref) & ~COMMAND_REF_DATA)
+
 typedef struct OpbData {
-    uint32_t Count;
-    uint8_t Args[16];
+    uint16_t Addr;      // OPB command register
+    uint8_t Count;
+    uint8_t Args[44];   // a group of 9 channels playing with both levels, the longest, takes up to 44
+    uint32_t Order;     // order index of the command stream entry this command takes the place of
 } OpbData;
 
 static void OpbData_WriteUint7(OpbData* data, uint32_t value) {
@@ -354,27 +768,137 @@ static void OpbData_WriteU8(OpbData* data, uint32_t value) {
 
 #define OPB_CMD_SETINSTRUMENT 0xD0
 #define OPB_CMD_PLAYINSTRUMENT 0xD1
+#define OPB_CMD_BACKREF 0xD2
+#define OPB_CMD_SETFOUROP 0xD3
+#define OPB_CMD_PLAYFOUROP 0xD4
+#define OPB_CMD_SETRHYTHM 0xD5
+#define OPB_CMD_PLAYRHYTHM 0xD6
 #define OPB_CMD_NOTEON 0xD7
+#define OPB_CMD_DELTAFREQ 0xF6
+
+// channel of 0xD0 and 0xD1 commands that set an instrument on a group of channels
+#define GROUP_CHANNEL 31
 
 static inline bool IsSpecialCommand(int addr) {
     addr = addr & 0xFF;
     return addr >= 0xD0 && addr <= 0xDF;
 }
 
-#define NUM_OPERATORS 36
-static int OperatorOffsets[NUM_OPERATORS] = {
-    0x0, 0x1, 0x2, 0x3, 0x4, 0x5, 0x8, 0x9, 0xA, 0xB, 0xC, 0xD, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15,
-    0x100, 0x101, 0x102, 0x103, 0x104, 0x105, 0x108, 0x109, 0x10A, 0x10B, 0x10C, 0x10D, 0x110, 0x111, 0x112, 0x113, 0x114, 0x115,
-};
+// 0xD3-0xD6 are only instrument commands in data with the voices flag. the 4-op commands hold the arguments of
+// 0xD0/0xD1 for both channels of a pair, the rhythm commands those of 0xD0/0xD1 followed by a write to 0xBD
+static inline bool IsInstrumentCommand(int baseAddr, uint32_t flags) {
+    return baseAddr == OPB_CMD_SETINSTRUMENT || baseAddr == OPB_CMD_PLAYINSTRUMENT ||
+        (baseAddr >= OPB_CMD_SETFOUROP && baseAddr <= OPB_CMD_PLAYRHYTHM && (flags & OPB_FLAG_VOICES));
+}
 
-static int ChannelToOp[NUM_CHANNELS] = {
-    0, 1, 2, 6, 7, 8, 12, 13, 14, 18, 19, 20, 24, 25, 26, 30, 31, 32,
-};
+static inline bool IsPlayCommand(int baseAddr) {
+    return baseAddr == OPB_CMD_PLAYINSTRUMENT || baseAddr == OPB_CMD_PLAYFOUROP || baseAddr == OPB_CMD_PLAYRHYTHM;
+}
 
-static int ChannelToOffset[NUM_CHANNELS] = {
-    0, 1, 2, 3, 4, 5, 6, 7, 8,
-    0x100, 0x101, 0x102, 0x103, 0x104, 0x105, 0x106, 0x107, 0x108,
-};
+static inline bool IsFourOpCommand(int baseAddr) {
+    return baseAddr == OPB_CMD_SETFOUROP || baseAddr == OPB_CMD_PLAYFOUROP;
+}
+
+static inline bool IsRhythmCommand(int baseAddr) {
+    return baseAddr == OPB_CMD_SETRHYTHM || baseAddr == OPB_CMD_PLAYRHYTHM;
+}
+
+// 0xF6-0xFE are unused by the OPL3 and only delta frequency commands in data with the delta frequency flag
+static inline bool IsDeltaCommand(int baseAddr, uint32_t flags) {
+    return baseAddr >= OPB_CMD_DELTAFREQ && baseAddr <= OPB_CMD_DELTAFREQ + 8 && (flags & OPB_FLAG_DELTAFREQ);
+}
+
+static inline int CountBits(uint32_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcount(value);
+#else
+    int count = 0;
+    for (; value != 0; value &= value - 1) {
+        count++;
+    }
+    return count;
+#endif
+}
+
+// supplies the next chunk byte of a model while walking the chunks, or returns -1 to stop
+typedef int(*EntropyByteFunc)(void* state, int model);
+
+static bool WalkUint7(EntropyByteFunc next, void* state, uint32_t* value) {
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        int b = next(state, ENTROPY_MODEL_UINT7);
+        if (b < 0) return false;
+        *value |= (uint32_t)(i < 3 ? b & 0x7F : b) << (7 * i);
+        if (b < 128) break;
+    }
+    return true;
+}
+
+// walks the bytes of a command after its register byte, in the order the decoder reads them. nothing is checked
+// beyond what's needed to find the next byte
+static bool WalkEntropyCommand(int baseAddr, uint32_t flags, EntropyByteFunc next, void* state) {
+    uint32_t value;
+    int dataCount = 1;
+
+    if (baseAddr == OPB_CMD_BACKREF && (flags & OPB_FLAG_BACKREF)) {
+        uint32_t lengthField;
+        if (!WalkUint7(next, state, &value) || !WalkUint7(next, state, &lengthField)) return false;
+        for (uint32_t k = 1; (lengthField & 1) && k < (lengthField >> 1); k++) {
+            if (!WalkUint7(next, state, &value)) return false;
+        }
+        return true;
+    }
+    else if (IsInstrumentCommand(baseAddr, flags)) {
+        // the second channel of a 4-op pair follows all arguments of the first
+        int channels = IsFourOpCommand(baseAddr) ? 2 : 1;
+        for (int c = 0; c < channels; c++) {
+            if (!WalkUint7(next, state, &value)) return false;
+            int channelMask = next(state, ENTROPY_MODEL_DATA);
+            if (channelMask < 0 || next(state, ENTROPY_MODEL_DATA) < 0) return false;
+
+            // a group's channels come after the masks, each with its own arguments
+            int channelCount = 1;
+            if ((channelMask & 0b00011111) == GROUP_CHANNEL && (flags & OPB_FLAG_GROUPS)) {
+                if (!WalkUint7(next, state, &value)) return false;
+                channelCount = CountBits(value);
+            }
+
+            int argCount = channelCount * ((c == 0 && IsPlayCommand(baseAddr) ? 2 : 0) + ((channelMask >> 5) & 1) + ((channelMask >> 6) & 1));
+            for (int k = 0; k < argCount; k++) {
+                if (next(state, ENTROPY_MODEL_DATA) < 0) return false;
+            }
+        }
+        dataCount = IsRhythmCommand(baseAddr) ? 1 : 0;
+    }
+    else if (baseAddr >= OPB_CMD_NOTEON && baseAddr <= OPB_CMD_NOTEON + 8) {
+        if (next(state, ENTROPY_MODEL_DATA) < 0) return false;
+        int note = next(state, ENTROPY_MODEL_DATA);
+        if (note < 0) return false;
+        dataCount = ((note >> 6) & 1) + (note >> 7);
+    }
+
+    for (int k = 0; k < dataCount; k++) {
+        if (next(state, ENTROPY_MODEL_DATA) < 0) return false;
+    }
+    return true;
+}
+
+// walks the chunks in the order the decoder reads them, which is what ties every byte to its model
+static bool WalkEntropyChunks(uint32_t chunkCount, uint32_t flags, EntropyByteFunc next, void* state) {
+    for (uint32_t i = 0; i < chunkCount; i++) {
+        uint32_t header[3];
+        for (int j = 0; j < 3; j++) {
+            if (!WalkUint7(next, state, header + j)) return false;
+        }
+
+        uint64_t commandCount = (uint64_t)header[1] + header[2];
+        for (uint64_t j = 0; j < commandCount; j++) {
+            int baseAddr = next(state, ENTROPY_MODEL_REGISTER);
+            if (baseAddr < 0 || !WalkEntropyCommand(baseAddr, flags, next, state)) return false;
+        }
+    }
+    return true;
+}
 
 static int RegisterOffsetToChannel(uint32_t offset) {
     uint32_t baseoff = offset & 0xFF;
@@ -404,6 +928,100 @@ static int RegisterOffsetToOpIndex(uint32_t offset) {
 #define REG_WAVE 0xE0
 #define REG_FREQUENCY 0xA0
 #define REG_NOTE 0xB0
+#define REG_RHYTHM 0xBD
+#define REG_FOUROP 0x104
+
+// 4-op mode pairs channels 0-2 with 3-5 and 9-11 with 12-14. this is the bit of 0x104 that enables the pair a
+// channel belongs to, or -1 if it's never part of one
+static inline int FourOpBit(int channel) {
+    int index = channel % 9;
+    return index < 6 ? index % 3 + (channel >= 9 ? 3 : 0) : -1;
+}
+
+static inline bool IsFourOpFirst(int channel) {
+    return channel >= 0 && channel < NUM_CHANNELS && channel % 9 < 3;
+}
+
+// rhythm mode turns channels 6-8 into the drums keyed by 0xBD
+static inline bool IsRhythmChannel(int channel) {
+    return channel >= 6 && channel <= 8;
+}
+
+// the decoder expands instrument commands into register writes in this order. each slot has a bit in a slot mask
+#define SLOT_FEEDCONN 0
+#define SLOT_MODCHAR 1
+#define SLOT_MODLEVEL 2
+#define SLOT_MODATTACK 3
+#define SLOT_MODSUSTAIN 4
+#define SLOT_MODWAVE 5
+#define SLOT_CARCHAR 6
+#define SLOT_CARLEVEL 7
+#define SLOT_CARATTACK 8
+#define SLOT_CARSUSTAIN 9
+#define SLOT_CARWAVE 10
+#define SLOT_FREQUENCY 11
+#define SLOT_NOTE 12
+#define NUM_SLOTS 13
+
+// register address of every slot for each channel
+static const uint16_t ChannelSlotRegisters[NUM_CHANNELS][NUM_SLOTS] = {
+    { 0x0C0, 0x020, 0x040, 0x060, 0x080, 0x0E0, 0x023, 0x043, 0x063, 0x083, 0x0E3, 0x0A0, 0x0B0 },
+    { 0x0C1, 0x021, 0x041, 0x061, 0x081, 0x0E1, 0x024, 0x044, 0x064, 0x084, 0x0E4, 0x0A1, 0x0B1 },
+    { 0x0C2, 0x022, 0x042, 0x062, 0x082, 0x0E2, 0x025, 0x045, 0x065, 0x085, 0x0E5, 0x0A2, 0x0B2 },
+    { 0x0C3, 0x028, 0x048, 0x068, 0x088, 0x0E8, 0x02B, 0x04B, 0x06B, 0x08B, 0x0EB, 0x0A3, 0x0B3 },
+    { 0x0C4, 0x029, 0x049, 0x069, 0x089, 0x0E9, 0x02C, 0x04C, 0x06C, 0x08C, 0x0EC, 0x0A4, 0x0B4 },
+    { 0x0C5, 0x02A, 0x04A, 0x06A, 0x08A, 0x0EA, 0x02D, 0x04D, 0x06D, 0x08D, 0x0ED, 0x0A5, 0x0B5 },
+    { 0x0C6, 0x030, 0x050, 0x070, 0x090, 0x0F0, 0x033, 0x053, 0x073, 0x093, 0x0F3, 0x0A6, 0x0B6 },
+    { 0x0C7, 0x031, 0x051, 0x071, 0x091, 0x0F1, 0x034, 0x054, 0x074, 0x094, 0x0F4, 0x0A7, 0x0B7 },
+    { 0x0C8, 0x032, 0x052, 0x072, 0x092, 0x0F2, 0x035, 0x055, 0x075, 0x095, 0x0F5, 0x0A8, 0x0B8 },
+    { 0x1C0, 0x120, 0x140, 0x160, 0x180, 0x1E0, 0x123, 0x143, 0x163, 0x183, 0x1E3, 0x1A0, 0x1B0 },
+    { 0x1C1, 0x121, 0x141, 0x161, 0x181, 0x1E1, 0x124, 0x144, 0x164, 0x184, 0x1E4, 0x1A1, 0x1B1 },
+    { 0x1C2, 0x122, 0x142, 0x162, 0x182, 0x1E2, 0x125, 0x145, 0x165, 0x185, 0x1E5, 0x1A2, 0x1B2 },
+    { 0x1C3, 0x128, 0x148, 0x168, 0x188, 0x1E8, 0x12B, 0x14B, 0x16B, 0x18B, 0x1EB, 0x1A3, 0x1B3 },
+    { 0x1C4, 0x129, 0x149, 0x169, 0x189, 0x1E9, 0x12C, 0x14C, 0x16C, 0x18C, 0x1EC, 0x1A4, 0x1B4 },
+    { 0x1C5, 0x12A, 0x14A, 0x16A, 0x18A, 0x1EA, 0x12D, 0x14D, 0x16D, 0x18D, 0x1ED, 0x1A5, 0x1B5 },
+    { 0x1C6, 0x130, 0x150, 0x170, 0x190, 0x1F0, 0x133, 0x153, 0x173, 0x193, 0x1F3, 0x1A6, 0x1B6 },
+    { 0x1C7, 0x131, 0x151, 0x171, 0x191, 0x1F1, 0x134, 0x154, 0x174, 0x194, 0x1F4, 0x1A7, 0x1B7 },
+    { 0x1C8, 0x132, 0x152, 0x172, 0x192, 0x1F2, 0x135, 0x155, 0x175, 0x195, 0x1F5, 0x1A8, 0x1B8 },
+};
+
+// spreads the property bits of an instrument command's second channel mask byte
+// (mod chr/atk/sus/wav, car chr/atk/sus/wav) out over their slots, leaving room for the level slots
+static inline uint32_t ExpandPropertyMask(uint8_t mask) {
+    return ((mask & 0x01u) << 1) | ((mask & 0x1Eu) << 2) | ((mask & 0xE0u) << 3);
+}
+
+// moves the mod level, car level and feedconn flags in the first channel mask byte to their slots
+static inline uint32_t ExpandChannelFlags(uint8_t channel) {
+    return ((channel & 0x20u) >> 3) | ((channel & 0x40u) << 1) | ((channel & 0x80u) >> 7);
+}
+
+// the encoder's inverse of ExpandPropertyMask, from a mask of written slots
+static inline uint8_t PackPropertyMask(uint32_t slots) {
+    return (uint8_t)(((slots >> 1) & 0x01u) | ((slots >> 2) & 0x1Eu) | ((slots >> 3) & 0xE0u));
+}
+
+// the encoder's inverse of ExpandChannelFlags
+static inline uint8_t PackChannelFlags(uint32_t slots) {
+    return (uint8_t)(((slots & 0x04u) << 3) | ((slots & 0x80u) >> 1) | ((slots & 0x01u) << 7));
+}
+
+static inline int CountTrailingZeros(uint32_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(value);
+#elif defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return (int)index;
+#else
+    int count = 0;
+    while ((value & 1) == 0) {
+        value >>= 1;
+        count++;
+    }
+    return count;
+#endif
+}
 
 typedef struct Operator {
     int16_t Characteristic;
@@ -419,15 +1037,108 @@ typedef struct Instrument {
     int Index;
 } Instrument;
 
+// an instrument's register values laid out by slot, so the decoder can copy them straight into the output
+typedef struct InstrumentSlots {
+    uint8_t Values[16];
+} InstrumentSlots;
+
+// instruments are stored as 9 bytes: feedback/connection, then characteristic, attack/decay, sustain/release and
+// wave select for the modulator and the carrier
+#define INSTRUMENT_SIZE 9
+
+static inline void UnpackSlots(const uint8_t* buffer, InstrumentSlots* slots) {
+    memset(slots, 0, sizeof(InstrumentSlots));
+    slots->Values[SLOT_FEEDCONN] = buffer[0];
+    slots->Values[SLOT_MODCHAR] = buffer[1];
+    slots->Values[SLOT_MODATTACK] = buffer[2];
+    slots->Values[SLOT_MODSUSTAIN] = buffer[3];
+    slots->Values[SLOT_MODWAVE] = buffer[4];
+    slots->Values[SLOT_CARCHAR] = buffer[5];
+    slots->Values[SLOT_CARATTACK] = buffer[6];
+    slots->Values[SLOT_CARSUSTAIN] = buffer[7];
+    slots->Values[SLOT_CARWAVE] = buffer[8];
+}
+
+static void UnpackInstrument(const uint8_t* buffer, int index, Instrument* instr, InstrumentSlots* slots) {
+    UnpackSlots(buffer, slots);
+
+    *instr = (Instrument) {
+        buffer[0], // feedconn
+        {
+            buffer[1], // modulator characteristic
+            buffer[2], // modulator attack/decay
+            buffer[3], // modulator sustain/release
+            buffer[4], // modulator wave select
+        },
+        {
+            buffer[5], // carrier characteristic
+            buffer[6], // carrier attack/decay
+            buffer[7], // carrier sustain/release
+            buffer[8], // carrier wave select
+        },
+        index
+    };
+}
+
+// the header that follows the format byte. version 2 adds format flags and, for data encoded with a dictionary,
+// the instrument count and id of that dictionary
+typedef struct OpbHeader {
+    uint32_t Size;
+    uint32_t Flags;
+    uint32_t InstrumentCount;   // instruments stored in the data itself
+    uint32_t ChunkCount;
+    uint32_t DictionaryCount;
+    uint32_t DictionaryId;
+    uint32_t BackReferenceWindow;   // chunks back references reach back at most, 0 unless the data has them
+    uint32_t TimeBase;          // chunk time units per second, OPB_TIMEBASE_MS unless the header stores another
+} OpbHeader;
+
+static inline char OpbVersion(uint32_t flags) {
+    return flags != 0 ? '2' : '1';
+}
+
+static size_t OpbHeaderSize(char version, uint32_t flags) {
+    if (version == '1') {
+        return 12;
+    }
+    return 16 + ((flags & OPB_FLAG_DICTIONARY) ? 8 : 0) + ((flags & OPB_FLAG_BACKREF) ? 4 : 0) +
+        ((flags & OPB_FLAG_TIMEBASE) ? 4 : 0);
+}
+
+typedef struct DictionaryCandidate {
+    uint8_t Values[INSTRUMENT_SIZE];
+    uint32_t Files;             // number of added files that store this instrument
+} DictionaryCandidate;
+
+// instruments shared by a set of files. both the encoder's and the decoder's view of them are kept, so neither
+// has to convert the dictionary for every file
+struct OPB_Dictionary {
+    VectorT(Instrument) Instruments;
+    VectorT(InstrumentSlots) Slots;
+    VectorT(DictionaryCandidate) Candidates; // counted by OPB_DictionaryAddBinary, sorted by value
+    uint32_t Id;                // hash of the instruments, stored in the data so a different dictionary is rejected
+};
+
+static inline uint32_t DictionaryCount(const OPB_Dictionary* dictionary) {
+    return dictionary != NULL ? (uint32_t)dictionary->Instruments.Count : 0;
+}
+
 static Context Context_New(void) {
     Context context = { 0 };
 
-    context.CommandStream = Vector_New(sizeof(Command));
     context.Instruments = Vector_New(sizeof(Instrument));
     context.DataMap = Vector_New(sizeof(OpbData));
+    context.Output = Vector_New(sizeof(uint32_t));
+    context.Range = Vector_New(sizeof(Command));
+    context.BackReferences = Vector_New(sizeof(BackReference));
+    context.Groups = Vector_New(sizeof(GroupCandidate));
+    context.InstrumentRequests = Vector_New(sizeof(Instrument));
+    context.History = Vector_New(sizeof(uint32_t));
+    context.HistoryChunks.Chunks = Vector_New(sizeof(HistoryChunk));
     for (int i = 0; i < NUM_TRACKS; i++) {
-        context.Tracks[i] = Vector_New(sizeof(Command));
+        context.Tracks[i] = Vector_New(sizeof(uint32_t));
     }
+    context.TimeBase = OPB_TIMEBASE_MS;
 
     return context;
 }
@@ -443,7 +1154,7 @@ static bool CanCombineInstrument(Instrument* instr, Command* feedconn,
         (carChar == NULL || instr->Carrier.Characteristic == carChar->Data || instr->Carrier.Characteristic < 0) &&
         (carAttack == NULL || instr->Carrier.AttackDecay == carAttack->Data || instr->Carrier.AttackDecay < 0) &&
         (carSustain == NULL || instr->Carrier.SustainRelease == carSustain->Data || instr->Carrier.SustainRelease < 0) &&
-        (carWave == NULL || instr->Carrier.WaveSelect == carWave->Data) || instr->Carrier.WaveSelect < 0) {
+        (carWave == NULL || instr->Carrier.WaveSelect == carWave->Data || instr->Carrier.WaveSelect < 0)) {
         instr->FeedConn = feedconn != NULL ? feedconn->Data : instr->FeedConn;
         instr->Modulator.Characteristic = modChar != NULL ? modChar->Data : instr->Modulator.Characteristic;
         instr->Modulator.AttackDecay = modAttack != NULL ? modAttack->Data : instr->Modulator.AttackDecay;
@@ -461,8 +1172,8 @@ static bool CanCombineInstrument(Instrument* instr, Command* feedconn,
 static Instrument GetInstrument(Context* context, Command* feedconn,
     Command* modChar, Command* modAttack, Command* modSustain, Command* modWave,
     Command* carChar, Command* carAttack, Command* carSustain, Command* carWave) {
-    // find a matching instrument
-    for (int i = 0; i < context->Instruments.Count; i++) {
+    // find a matching instrument. while the instrument optimizer gathers property sets every set is kept as it is
+    for (int i = 0; i < context->Instruments.Count && !context->CollectInstruments; i++) {
         Instrument* instr = Vector_GetT(Instrument, &context->Instruments, i);
         if (CanCombineInstrument(instr, feedconn, modChar, modAttack, modSustain, modWave, carChar, carAttack, carSustain, carWave)) {
             return *instr;
@@ -486,31 +1197,36 @@ static Instrument GetInstrument(Context* context, Command* feedconn,
         },
         (int)context->Instruments.Count
     };
+
+    // the instrument optimizer remembers the order sets are requested in, and gives the encoder the smallest index
+    if (context->CollectInstruments) {
+        instr.Index = (int)context->InstrumentRequests.Count;
+        Vector_Add(&context->InstrumentRequests, &instr);
+        instr.Index = 0;
+        return instr;
+    }
+
     Vector_Add(&context->Instruments, &instr);
     return instr;
 }
 
-static int WriteInstrument(Context* context, const Instrument* instr) {
-    uint8_t feedConn = (uint8_t)(instr->FeedConn >= 0 ? instr->FeedConn : 0);
-    uint8_t modChr = (uint8_t)(instr->Modulator.Characteristic >= 0 ? instr->Modulator.Characteristic : 0);
-    uint8_t modAtk = (uint8_t)(instr->Modulator.AttackDecay >= 0 ? instr->Modulator.AttackDecay : 0);
-    uint8_t modSus = (uint8_t)(instr->Modulator.SustainRelease >= 0 ? instr->Modulator.SustainRelease : 0);
-    uint8_t modWav = (uint8_t)(instr->Modulator.WaveSelect >= 0 ? instr->Modulator.WaveSelect : 0);
-    uint8_t carChr = (uint8_t)(instr->Carrier.Characteristic >= 0 ? instr->Carrier.Characteristic : 0);
-    uint8_t carAtk = (uint8_t)(instr->Carrier.AttackDecay >= 0 ? instr->Carrier.AttackDecay : 0);
-    uint8_t carSus = (uint8_t)(instr->Carrier.SustainRelease >= 0 ? instr->Carrier.SustainRelease : 0);
-    uint8_t carWav = (uint8_t)(instr->Carrier.WaveSelect >= 0 ? instr->Carrier.WaveSelect : 0);
-
-    WRITE(&feedConn, sizeof(uint8_t), 1, context);
-    WRITE(&modChr, sizeof(uint8_t), 1, context);
-    WRITE(&modAtk, sizeof(uint8_t), 1, context);
-    WRITE(&modSus, sizeof(uint8_t), 1, context);
-    WRITE(&modWav, sizeof(uint8_t), 1, context);
-    WRITE(&carChr, sizeof(uint8_t), 1, context);
-    WRITE(&carAtk, sizeof(uint8_t), 1, context);
-    WRITE(&carSus, sizeof(uint8_t), 1, context);
-    WRITE(&carWav, sizeof(uint8_t), 1, context);
+// properties the encoder never set are stored as 0
+static void PackInstrument(const Instrument* instr, uint8_t* buffer) {
+    buffer[0] = (uint8_t)(instr->FeedConn >= 0 ? instr->FeedConn : 0);
+    buffer[1] = (uint8_t)(instr->Modulator.Characteristic >= 0 ? instr->Modulator.Characteristic : 0);
+    buffer[2] = (uint8_t)(instr->Modulator.AttackDecay >= 0 ? instr->Modulator.AttackDecay : 0);
+    buffer[3] = (uint8_t)(instr->Modulator.SustainRelease >= 0 ? instr->Modulator.SustainRelease : 0);
+    buffer[4] = (uint8_t)(instr->Modulator.WaveSelect >= 0 ? instr->Modulator.WaveSelect : 0);
+    buffer[5] = (uint8_t)(instr->Carrier.Characteristic >= 0 ? instr->Carrier.Characteristic : 0);
+    buffer[6] = (uint8_t)(instr->Carrier.AttackDecay >= 0 ? instr->Carrier.AttackDecay : 0);
+    buffer[7] = (uint8_t)(instr->Carrier.SustainRelease >= 0 ? instr->Carrier.SustainRelease : 0);
+    buffer[8] = (uint8_t)(instr->Carrier.WaveSelect >= 0 ? instr->Carrier.WaveSelect : 0);
+}
 
+static int WriteInstrument(Context* context, const Instrument* instr) {
+    uint8_t buffer[INSTRUMENT_SIZE];
+    PackInstrument(instr, buffer);
+    WRITE(buffer, sizeof(uint8_t), INSTRUMENT_SIZE, context);
     return 0;
 }
 
@@ -608,335 +1324,611 @@ static int RegisterToOpIndex(int reg) {
     return -1;
 }
 
-static void SeparateTracks(Context* context) {
-    for (int i = 0; i < context->CommandStream.Count; i++) {
-        Command* cmd = Vector_GetT(Command, &context->CommandStream, i);
-
-        int channel = ChannelFromRegister(cmd->Addr);
-        if (channel < 0) channel = NUM_TRACKS - 1;
+static inline int TrackFromRegister(int reg) {
+    int channel = ChannelFromRegister(reg);
+    return channel < 0 ? NUM_TRACKS - 1 : channel;
+}
 
-        Vector_Add(&context->Tracks[channel], cmd);
+// the 4-op and rhythm mode state at the write being separated
+typedef struct TrackState {
+    uint8_t FourOp;     // last value written to 0x104
+    int LastTrack;      // track of the previous write
+    uint32_t PairTracks; // tracks that were given writes of a 4-op pair's second channel
+} TrackState;
+
+// writes to the second channel of a 4-op pair go to the first channel's track while 0x104 enables the pair, so the
+// whole voice is combined at once. a write to 0xBD that leaves rhythm mode on joins a drum channel written just
+// before it at the same time, since that's usually the drum it keys
+static inline int NextTrack(TrackState* state, const CommandStream* stream, size_t index) {
+    int addr = stream->Addr[index];
+    int track = TrackFromRegister(addr);
+
+    if (addr == REG_FOUROP) {
+        state->FourOp = stream->Data[index];
+    }
+    else if (addr == REG_RHYTHM) {
+        if ((stream->Data[index] & 0x20) && IsRhythmChannel(state->LastTrack) && stream->Time[index - 1] == stream->Time[index]) {
+            track = state->LastTrack;
+        }
+    }
+    else if (state->FourOp != 0 && track < NUM_CHANNELS && !IsFourOpFirst(track) && FourOpBit(track) >= 0 &&
+        (state->FourOp & (1 << FourOpBit(track)))) {
+        track -= 3;
+        state->PairTracks |= 1u << track;
     }
-}
 
-static int CountInstrumentChanges(Command* feedconn,
-    Command* modChar, Command* modAttack, Command* modSustain, Command* modWave,
-    Command* carChar, Command* carAttack, Command* carSustain, Command* carWave) {
-    int count = 0;
-    if (feedconn != NULL) count++;
-    if (modChar != NULL) count++;
-    if (modAttack != NULL) count++;
-    if (modSustain != NULL) count++;
-    if (modWave != NULL) count++;
-    if (carChar != NULL) count++;
-    if (carAttack != NULL) count++;
-    if (carSustain != NULL) count++;
-    if (carWave != NULL) count++;
-    return count;
+    state->LastTrack = track;
+    return track;
 }
 
-static int ProcessRange(Context* context, int channel, double time, Command* commands, int cmdCount, Vector* range, 
-    int _debug_start, int _debug_end // these last two are only for logging in case of error
-) {
-    for (int i = 0; i < cmdCount; i++) {
-        Command* cmd = commands + i;
+static int SeparateTracks(Context* context) {
+    CommandStream* stream = &context->CommandStream;
 
-        if (cmd->Time != time) {
-            int timeMs = (int)(time * 1000);
-            Log("A timing error occurred at %d ms on channel %d in range %d-%d\n", timeMs, channel, _debug_start, _debug_end);
-            return OPBERR_LOGGED;
+    // count first so every track's index list is allocated exactly once
+    size_t counts[NUM_TRACKS] = { 0 };
+    TrackState state = { 0, -1, 0 };
+    for (size_t i = 0; i < stream->Count; i++) {
+        counts[NextTrack(&state, stream, i)]++;
+    }
+    for (int i = 0; i < NUM_TRACKS; i++) {
+        if (Vector_Reserve(&context->Tracks[i], counts[i])) return OPBERR_BUFFER_ERROR;
+    }
+
+    state = (TrackState) { 0, -1, 0 };
+    for (size_t i = 0; i < stream->Count; i++) {
+        uint32_t index = (uint32_t)i;
+        Vector_Add(&context->Tracks[NextTrack(&state, stream, i)], &index);
+    }
+    context->PairTracks = state.PairTracks;
+    return 0;
+}
+
+// the slot a register write fills, or -1 for registers that aren't part of a channel's instrument or note
+static int RegisterToSlot(int reg) {
+    int baseAddr = reg & 0xFF;
+    int op;
+
+    if ((op = RegisterToOpIndex(reg)) > -1) {
+        // command affects modulator or carrier
+        int slot;
+        switch (baseAddr & 0xE0) {
+            case REG_CHARACTER: slot = SLOT_MODCHAR; break;
+            case REG_LEVELS: slot = SLOT_MODLEVEL; break;
+            case REG_ATTACK: slot = SLOT_MODATTACK; break;
+            case REG_SUSTAIN: slot = SLOT_MODSUSTAIN; break;
+            default: slot = SLOT_MODWAVE; break;
         }
+        return slot + op * (SLOT_CARCHAR - SLOT_MODCHAR);
     }
+    if (baseAddr >= 0xA0 && baseAddr <= 0xA8) return SLOT_FREQUENCY;
+    if (baseAddr >= 0xB0 && baseAddr <= 0xB8) return SLOT_NOTE;
+    if (baseAddr >= 0xC0 && baseAddr <= 0xC8) return SLOT_FEEDCONN;
+    return -1;
+}
 
-    Command* modChar = NULL, * modLevel = NULL, * modAttack = NULL, * modSustain = NULL, * modWave = NULL;
-    Command* carChar = NULL, * carLevel = NULL, * carAttack = NULL, * carSustain = NULL, * carWave = NULL;
-    Command* freq = NULL, * note = NULL, * feedconn = NULL;
+#define LEVEL_SLOTS ((1u << SLOT_MODLEVEL) | (1u << SLOT_CARLEVEL))
+#define NOTE_SLOTS ((1u << SLOT_FREQUENCY) | (1u << SLOT_NOTE))
+#define INSTRUMENT_SLOTS (((1u << (SLOT_CARWAVE + 1)) - 1) & ~LEVEL_SLOTS) // levels aren't stored in instruments
 
-    for (int i = 0; i < cmdCount; i++) {
-        Command* cmd = commands + i;
+// the writes of a range that belong to one channel. only the slots in Mask are set
+typedef struct ChannelWrites {
+    uint32_t Mask;
+    Command* Slots[NUM_SLOTS];
+} ChannelWrites;
 
-        int baseAddr = cmd->Addr & 0xFF;
-        int op;
+static inline Command* GetSlot(const ChannelWrites* writes, int slot) {
+    return (writes->Mask & (1u << slot)) ? writes->Slots[slot] : NULL;
+}
 
-        if ((op = RegisterToOpIndex(cmd->Addr)) > -1) {
-            // command affects modulator or carrier
-            if (op == 0) {
-                if (baseAddr >= 0x20 && baseAddr <= 0x35)
-                    modChar = cmd;
-                else if (baseAddr >= 0x40 && baseAddr <= 0x55)
-                    modLevel = cmd;
-                else if (baseAddr >= 0x60 && baseAddr <= 0x75)
-                    modAttack = cmd;
-                else if (baseAddr >= 0x80 && baseAddr <= 0x95)
-                    modSustain = cmd;
-                else if (baseAddr >= 0xE0 && baseAddr <= 0xF5)
-                    modWave = cmd;
-            }
-            else {
-                if (baseAddr >= 0x20 && baseAddr <= 0x35)
-                    carChar = cmd;
-                else if (baseAddr >= 0x40 && baseAddr <= 0x55)
-                    carLevel = cmd;
-                else if (baseAddr >= 0x60 && baseAddr <= 0x75)
-                    carAttack = cmd;
-                else if (baseAddr >= 0x80 && baseAddr <= 0x95)
-                    carSustain = cmd;
-                else if (baseAddr >= 0xE0 && baseAddr <= 0xF5)
-                    carWave = cmd;
-            }
-        }
-        else {
-            if (baseAddr >= 0xA0 && baseAddr <= 0xA8)
-                freq = cmd;
-            else if (baseAddr >= 0xB0 && baseAddr <= 0xB8) {
-                if (note != NULL) {
-                    int timeMs = (int)(time * 1000);
-                    Log("A decoding error occurred at %d ms on channel %d in range %d-%d\n", timeMs, channel, _debug_start, _debug_end);
-                    return OPBERR_LOGGED;
-                }
-                note = cmd;
-            }
-            else if (baseAddr >= 0xC0 && baseAddr <= 0xC8)
-                feedconn = cmd;
-            else {
-                Vector_Add(range, cmd);
-            }
-        }
+static inline Instrument GetChannelInstrument(Context* context, const ChannelWrites* writes) {
+    return GetInstrument(context, GetSlot(writes, SLOT_FEEDCONN),
+        GetSlot(writes, SLOT_MODCHAR), GetSlot(writes, SLOT_MODATTACK), GetSlot(writes, SLOT_MODSUSTAIN), GetSlot(writes, SLOT_MODWAVE),
+        GetSlot(writes, SLOT_CARCHAR), GetSlot(writes, SLOT_CARATTACK), GetSlot(writes, SLOT_CARSUSTAIN), GetSlot(writes, SLOT_CARWAVE));
+}
+
+// writes the arguments 0xD0 and 0xD1 take for a channel, which every instrument command is built from, and clears
+// the writes they stand in for
+static void WriteInstrumentArgs(OpbData* data, const Instrument* instr, int channel, ChannelWrites* writes, bool play) {
+    uint32_t mask = writes->Mask;
+    OpbData_WriteUint7(data, instr->Index);
+    OpbData_WriteU8(data, channel | PackChannelFlags(mask));
+    OpbData_WriteU8(data, PackPropertyMask(mask));
+
+    if (play) {
+        OpbData_WriteU8(data, writes->Slots[SLOT_FREQUENCY]->Data);
+        OpbData_WriteU8(data, writes->Slots[SLOT_NOTE]->Data);
+        mask &= ~NOTE_SLOTS;
     }
 
-    // combine instrument data
-    int instrChanges;
-    if ((instrChanges = CountInstrumentChanges(feedconn, modChar, modAttack, modSustain, modWave, carChar, carAttack, carSustain, carWave)) > 0) {
-        Instrument instr = GetInstrument(context, feedconn, modChar, modAttack, modSustain, modWave, carChar, carAttack, carSustain, carWave);
+    if (mask & (1u << SLOT_MODLEVEL)) OpbData_WriteU8(data, writes->Slots[SLOT_MODLEVEL]->Data);
+    if (mask & (1u << SLOT_CARLEVEL)) OpbData_WriteU8(data, writes->Slots[SLOT_CARLEVEL]->Data);
 
-        size_t size = Uint7Size(instr.Index) + 3;
+    writes->Mask = mask & ~(INSTRUMENT_SLOTS | LEVEL_SLOTS);
+}
 
-        if (modLevel != NULL) {
-            size++;
-            instrChanges++;
-        }
-        if (carLevel != NULL) {
-            size++;
-            instrChanges++;
-        }
+static inline void AddOutput(Context* context, const Command* cmd) {
+    Vector_Add(&context->Output, (void*)&cmd->Index);
+}
+
+static void AddOpbCommand(Context* context, OpbData* data, int reg, uint32_t order) {
+    data->Addr = (uint16_t)reg;
+    data->Order = order;
+
+    uint32_t ref = (uint32_t)context->DataMap.Count | COMMAND_REF_DATA;
+    Vector_Add(&context->DataMap, data);
+    Vector_Add(&context->Output, &ref);
+}
+
+// order of a range's previous write on its track, for instrument commands that can't be grouped across channels
+#define UNGROUPED -2
+
+// keeps an instrument command for GroupInstruments instead of adding it, and clears the writes it stands in for
+static void AddGroupCandidate(Context* context, const Instrument* instr, int channel, ChannelWrites* writes, bool play,
+    uint32_t order, int64_t previous) {
+    GroupCandidate candidate = { 0 };
+    candidate.Time = context->CommandStream.Time[order];
+    candidate.Previous = previous;
+    candidate.Order = order;
+    candidate.Instrument = (uint32_t)instr->Index;
+    candidate.Slots = writes->Mask & (INSTRUMENT_SLOTS | LEVEL_SLOTS | (play ? NOTE_SLOTS : 0));
+    candidate.Channel = (uint8_t)channel;
+
+    if (play) {
+        candidate.Frequency = writes->Slots[SLOT_FREQUENCY]->Data;
+        candidate.Note = writes->Slots[SLOT_NOTE]->Data;
+    }
+    if (candidate.Slots & (1u << SLOT_MODLEVEL)) candidate.ModLevel = writes->Slots[SLOT_MODLEVEL]->Data;
+    if (candidate.Slots & (1u << SLOT_CARLEVEL)) candidate.CarLevel = writes->Slots[SLOT_CARLEVEL]->Data;
+
+    Vector_Add(&context->Groups, &candidate);
+    writes->Mask &= ~candidate.Slots;
+}
+
+// combines a channel's writes into instrument and note commands and adds the rest as they are. a write to 0xBD is
+// only passed in for drum channels with voice commands enabled, it keys the drums after the instrument is set.
+// previous is the order of the channel's last write before the range, which decides which other channels' instrument
+// commands this one's can be grouped with
+static void ProcessChannel(Context* context, int channel, ChannelWrites* writes, Command* rhythm, uint32_t order,
+    int64_t previous) {
+    // combine instrument data
+    int instrChanges;
+    if ((instrChanges = CountBits(writes->Mask & INSTRUMENT_SLOTS)) > 0) {
+        Instrument instr = GetChannelInstrument(context, writes);
+
+        int levels = CountBits(writes->Mask & LEVEL_SLOTS);
+        size_t size = Uint7Size(instr.Index) + 3 + levels;
+        instrChanges += levels;
 
         // combine with frequency and note command if present
-        if (freq != NULL && note != NULL) {
+        bool play = (writes->Mask & NOTE_SLOTS) == NOTE_SLOTS;
+        if (play) {
             size += 2;
             instrChanges += 2;
         }
+        if (rhythm != NULL) {
+            size++;
+            instrChanges++;
+        }
 
-        if ((int)size < instrChanges * 2) {
+        if ((int)size < instrChanges * 2 && rhythm == NULL && previous != UNGROUPED && context->UseGroupCommands) {
+            AddGroupCandidate(context, &instr, channel, writes, play, order, previous);
+        }
+        else if ((int)size < instrChanges * 2) {
             OpbData data = { 0 };
-            OpbData_WriteUint7(&data, instr.Index);
-
-            uint8_t channelMask = channel |
-                (modLevel != NULL ? 0b00100000 : 0) |
-                (carLevel != NULL ? 0b01000000 : 0) |
-                (feedconn != NULL ? 0b10000000 : 0);
-            OpbData_WriteU8(&data, channelMask);
-
-            int mask =
-                (modChar != NULL ? 0b00000001 : 0) |
-                (modAttack != NULL ? 0b00000010 : 0) |
-                (modSustain != NULL ? 0b00000100 : 0) |
-                (modWave != NULL ? 0b00001000 : 0) |
-                (carChar != NULL ? 0b00010000 : 0) |
-                (carAttack != NULL ? 0b00100000 : 0) |
-                (carSustain != NULL ? 0b01000000 : 0) |
-                (carWave != NULL ? 0b10000000 : 0);
-            OpbData_WriteU8(&data, mask);
-
-            // instrument command is 0xD0
-            int reg = OPB_CMD_SETINSTRUMENT;
-
-            if (freq != NULL && note != NULL) {
-                OpbData_WriteU8(&data, freq->Data);
-                OpbData_WriteU8(&data, note->Data);
-
-                // play command is 0xD1
-                reg = OPB_CMD_PLAYINSTRUMENT;
-            }
-
-            if (modLevel != NULL) OpbData_WriteU8(&data, modLevel->Data);
-            if (carLevel != NULL) OpbData_WriteU8(&data, carLevel->Data);
-
-            int opbIndex = (int32_t)context->DataMap.Count + 1;
-            Vector_Add(&context->DataMap, &data);
-
-            Command cmd = {
-                (uint16_t)(reg + (channel >= 9 ? 0x100 : 0)), // register
-                0, // data
-                time,
-                commands[0].OrderIndex,
-                opbIndex
-            };
+            WriteInstrumentArgs(&data, &instr, channel, writes, play);
 
-            Vector_Add(range, &cmd);
-            feedconn = modChar = modLevel = modAttack = modSustain = modWave = carChar = carLevel = carAttack = carSustain = carWave = NULL;
+            // instrument command is 0xD0, play command is 0xD1
+            int reg = play ? OPB_CMD_PLAYINSTRUMENT : OPB_CMD_SETINSTRUMENT;
 
-            if (freq != NULL && note != NULL) {
-                freq = note = NULL;
+            if (rhythm != NULL) {
+                OpbData_WriteU8(&data, rhythm->Data);
+                reg = play ? OPB_CMD_PLAYRHYTHM : OPB_CMD_SETRHYTHM;
+                context->FormatFlags |= OPB_FLAG_VOICES;
+                rhythm = NULL;
             }
+
+            AddOpbCommand(context, &data, reg + (channel >= 9 ? 0x100 : 0), order);
         }
     }
 
     // combine frequency/note and modulator and carrier level data
-    if (freq != NULL && note != NULL) {
+    if ((writes->Mask & NOTE_SLOTS) == NOTE_SLOTS) {
+        Command* note = writes->Slots[SLOT_NOTE];
+
         // note on command is 0xD7 through 0xDF (and 0x1D7 through 0x1DF for channels 10-18)
         int reg = OPB_CMD_NOTEON + (channel % 9) + (channel >= 9 ? 0x100 : 0);
 
         OpbData data = { 0 };
-        OpbData_WriteU8(&data, freq->Data);
-
-        int noteLevels = note->Data & 0b00111111;
+        OpbData_WriteU8(&data, writes->Slots[SLOT_FREQUENCY]->Data);
 
         // encode modulator and carrier levels data in the note data's upper 2 (unused) bits
-        if (modLevel != NULL) {
-            noteLevels |= 0b01000000;
-        }
-        if (carLevel != NULL) {
-            noteLevels |= 0b10000000;
-        }
+        uint32_t levels = writes->Mask & LEVEL_SLOTS;
+        OpbData_WriteU8(&data, (note->Data & 0b00111111) | PackChannelFlags(levels) << 1);
 
-        OpbData_WriteU8(&data, noteLevels);
+        if (levels & (1u << SLOT_MODLEVEL)) OpbData_WriteU8(&data, writes->Slots[SLOT_MODLEVEL]->Data);
+        if (levels & (1u << SLOT_CARLEVEL)) OpbData_WriteU8(&data, writes->Slots[SLOT_CARLEVEL]->Data);
 
-        if (modLevel != NULL) {
-            OpbData_WriteU8(&data, modLevel->Data);
-        }
-        if (carLevel != NULL) {
-            OpbData_WriteU8(&data, carLevel->Data);
-        }
+        AddOpbCommand(context, &data, reg, note->Index);
+        writes->Mask &= ~(NOTE_SLOTS | LEVEL_SLOTS);
+    }
 
-        int opbIndex = (int32_t)context->DataMap.Count + 1;
-        Vector_Add(&context->DataMap, &data);
+    for (uint32_t mask = writes->Mask; mask != 0; mask &= mask - 1) {
+        AddOutput(context, writes->Slots[CountTrailingZeros(mask)]);
+    }
+    if (rhythm != NULL) AddOutput(context, rhythm);
+}
+
+// combines the instrument changes of both channels of a 4-op pair into one command, which saves a register byte over
+// an instrument command for each. when either channel only changes levels its own commands are as small or smaller
+static void ProcessFourOp(Context* context, int channel, ChannelWrites* writes, uint32_t order) {
+    int changes[2] = { CountBits(writes[0].Mask & INSTRUMENT_SLOTS), CountBits(writes[1].Mask & INSTRUMENT_SLOTS) };
+    if (changes[0] == 0 || changes[1] == 0) {
+        return;
+    }
 
-        Command cmd = {
-            (uint16_t)reg, // register
-            0, // data
-            time,
-            note->OrderIndex,
-            opbIndex
-        };
+    Instrument instr[2] = { GetChannelInstrument(context, writes), GetChannelInstrument(context, writes + 1) };
+    bool play = (writes[0].Mask & NOTE_SLOTS) == NOTE_SLOTS;
 
-        Vector_Add(range, &cmd);
-        freq = note = modLevel = carLevel = NULL;
+    int levels = CountBits(writes[0].Mask & LEVEL_SLOTS) + CountBits(writes[1].Mask & LEVEL_SLOTS);
+    size_t size = Uint7Size(instr[0].Index) + Uint7Size(instr[1].Index) + 5 + levels + (play ? 2 : 0);
+    int replaced = changes[0] + changes[1] + levels + (play ? 2 : 0);
+    if ((int)size >= replaced * 2) {
+        return;
     }
 
-    if (modChar != NULL) Vector_Add(range, modChar);
-    if (modLevel != NULL) Vector_Add(range, modLevel);
-    if (modAttack != NULL) Vector_Add(range, modAttack);
-    if (modSustain != NULL) Vector_Add(range, modSustain);
-    if (modWave != NULL) Vector_Add(range, modWave);
+    OpbData data = { 0 };
+    WriteInstrumentArgs(&data, &instr[0], channel, writes, play);
+    WriteInstrumentArgs(&data, &instr[1], channel + 3, writes + 1, false);
+
+    int reg = play ? OPB_CMD_PLAYFOUROP : OPB_CMD_SETFOUROP;
+    AddOpbCommand(context, &data, reg + (channel >= 9 ? 0x100 : 0), order);
+    context->FormatFlags |= OPB_FLAG_VOICES;
+}
+
+static int ProcessRange(Context* context, int channel, int64_t time, int64_t previous, Command* commands, int cmdCount,
+    int _debug_start, int _debug_end // these last two are only for logging in case of error
+) {
+    // the second set of writes belongs to the other channel of a 4-op pair, which only shares the track of the first
+    // while 0x104 enables the pair
+    ChannelWrites writes[2];
+    writes[0].Mask = writes[1].Mask = 0;
+    bool pairTrack = (context->PairTracks & (1u << channel)) != 0;
+    Command* rhythm = NULL;
+
+    for (int i = 0; i < cmdCount; i++) {
+        Command* cmd = commands + i;
+        int slot = RegisterToSlot(cmd->Addr);
+
+        if (slot < 0) {
+            if (cmd->Addr == REG_RHYTHM && IsRhythmChannel(channel) && context->UseVoiceCommands)
+                rhythm = cmd;
+            else
+                AddOutput(context, cmd);
+            continue;
+        }
 
-    if (carChar != NULL) Vector_Add(range, carChar);
-    if (carLevel != NULL) Vector_Add(range, carLevel);
-    if (carAttack != NULL) Vector_Add(range, carAttack);
-    if (carSustain != NULL) Vector_Add(range, carSustain);
-    if (carWave != NULL) Vector_Add(range, carWave);
+        ChannelWrites* w = writes + (pairTrack && ChannelFromRegister(cmd->Addr) != channel);
+        if (slot == SLOT_NOTE && w == writes && (w->Mask & (1u << SLOT_NOTE))) {
+            int timeMs = (int)(time / TICKS_PER_MS);
+            Log("A decoding error occurred at %d ms on channel %d in range %d-%d\n", timeMs, channel, _debug_start, _debug_end);
+            return OPBERR_LOGGED;
+        }
+        w->Slots[slot] = cmd;
+        w->Mask |= 1u << slot;
+    }
 
-    if (feedconn != NULL) Vector_Add(range, feedconn);
-    if (freq != NULL) Vector_Add(range, freq);
-    if (note != NULL) Vector_Add(range, note);
+    // instrument commands take the place of the range's first write
+    uint32_t order = commands[0].Index;
+    if (writes[1].Mask != 0) {
+        if (context->UseVoiceCommands) {
+            ProcessFourOp(context, channel, writes, order);
+        }
+        ProcessChannel(context, channel + 3, writes + 1, NULL, order, UNGROUPED);
+    }
+    ProcessChannel(context, channel, writes, rhythm, order, previous);
 
     return 0;
 }
 
-static int ProcessTrack(Context* context, int channel, Vector* chOut) {
-    Vector* commands = &context->Tracks[channel];
+static int ProcessTrack(Context* context, int channel) {
+    VectorT(uint32_t)* indices = &context->Tracks[channel];
+    CommandStream* stream = &context->CommandStream;
 
-    if (commands->Count == 0) {
+    if (indices->Count == 0) {
         return 0;
     }
 
-    int lastOrder = Vector_GetT(Command, commands, 0)->OrderIndex;
-    int i = 0;
+    uint32_t* track = (uint32_t*)indices->Storage;
+    uint32_t lastOrder = track[0];
+    size_t i = 0;
+
+    while (i < indices->Count) {
+        int64_t time = stream->Time[track[i]];
 
-    while (i < commands->Count) {
-        double time = Vector_GetT(Command, commands, i)->Time;
+        Vector_Clear(&context->Range, true);
 
-        int start = i;
+        int start = (int)i;
         // sequences must be all in the same time block and in order
-        // sequences are capped by a note command (write to register B0-B8 or 1B0-1B8)
-        while (i < commands->Count && Vector_GetT(Command, commands, i)->Time <= time && (Vector_GetT(Command, commands, i)->OrderIndex - lastOrder) <= 1) {
-            Command* cmd = Vector_GetT(Command, commands, i);
+        // sequences are capped by a note command (write to register B0-B8 or 1B0-1B8), or by a write to 0xBD on drum
+        // channels. a note directly followed by the drum channel's write to 0xBD stays in the same sequence
+        while (i < indices->Count && stream->Time[track[i]] <= time && (track[i] - lastOrder) <= 1) {
+            uint32_t index = track[i];
+
+            if (stream->Time[index] != time) {
+                int timeMs = (int)(time / TICKS_PER_MS);
+                Log("A timing error occurred at %d ms on channel %d in range %d-%d\n", timeMs, channel, start, (int)i);
+                return OPBERR_LOGGED;
+            }
 
-            lastOrder = cmd->OrderIndex;
+            Command cmd = { stream->Addr[index], stream->Data[index], index };
+            Vector_Add(&context->Range, &cmd);
+
+            lastOrder = index;
             i++;
 
-            if (IsChannelNoteEvent(cmd->Addr, channel)) {
+            if (cmd.Addr == REG_RHYTHM) {
+                break;
+            }
+            if (IsChannelNoteEvent(cmd.Addr, channel) &&
+                !(i < indices->Count && track[i] == index + 1 && stream->Addr[track[i]] == REG_RHYTHM)) {
                 break;
             }
         }
-        int end = i;
+        int end = (int)i;
 
-        VectorT(Command) range = Vector_New(sizeof(Command));
-        int ret = ProcessRange(context, channel, time, Vector_GetT(Command, commands, start), end - start, &range, start, end);
-        if (ret) {
-            Vector_Free(&range);
-            return ret;
-        }
-        
-        Vector_AddRange(chOut, range.Storage, range.Count);
-        Vector_Free(&range);
+        int64_t previous = start > 0 ? track[start - 1] : -1;
+        int ret = ProcessRange(context, channel, time, previous, (Command*)context->Range.Storage, end - start, start, end);
+        if (ret) return ret;
 
-        if (i < commands->Count) {
-            lastOrder = Vector_GetT(Command, commands, i)->OrderIndex;
+        if (i < indices->Count) {
+            lastOrder = track[i];
         }
     }
 
     return 0;
 }
 
-static int WriteChunk(Context* context, double elapsed, int start, int count) {
-    uint32_t elapsedMs = (uint32_t)((elapsed * 1000) + 0.5);
-    int loCount = 0;
-    int hiCount = 0;
+static int CompareGroupCandidates(const void* a, const void* b) {
+    const GroupCandidate* x = (const GroupCandidate*)a;
+    const GroupCandidate* y = (const GroupCandidate*)b;
+    if (x->Time != y->Time) return x->Time < y->Time ? -1 : 1;
+    if ((x->Channel >= 9) != (y->Channel >= 9)) return x->Channel >= 9 ? 1 : -1;
+    if (x->Instrument != y->Instrument) return x->Instrument < y->Instrument ? -1 : 1;
+    if (x->Slots != y->Slots) return x->Slots < y->Slots ? -1 : 1;
+    return x->Order < y->Order ? -1 : (x->Order > y->Order ? 1 : 0);
+}
+
+static inline bool CanGroup(const GroupCandidate* a, const GroupCandidate* b) {
+    return a->Time == b->Time && (a->Channel >= 9) == (b->Channel >= 9) && a->Instrument == b->Instrument && a->Slots == b->Slots;
+}
+
+// adds the instrument command of a group, or a regular one for a group of one channel. members holds the group's
+// commands by channel within its half of the chip
+static void AddGroupCommand(Context* context, const GroupCandidate* first, GroupCandidate** members, uint32_t channels) {
+    uint32_t slots = first->Slots;
+    bool play = (slots & NOTE_SLOTS) != 0;
+    bool group = (channels & (channels - 1)) != 0;
+
+    OpbData data = { 0 };
+    OpbData_WriteUint7(&data, first->Instrument);
+    OpbData_WriteU8(&data, (group ? GROUP_CHANNEL : first->Channel) | PackChannelFlags(slots));
+    OpbData_WriteU8(&data, PackPropertyMask(slots));
+
+    if (group) {
+        OpbData_WriteUint7(&data, channels);
+        context->FormatFlags |= OPB_FLAG_GROUPS;
+    }
+
+    // the rest of the arguments follow for each channel in ascending order
+    for (uint32_t mask = channels; mask != 0; mask &= mask - 1) {
+        const GroupCandidate* member = members[CountTrailingZeros(mask)];
+        if (play) {
+            OpbData_WriteU8(&data, member->Frequency);
+            OpbData_WriteU8(&data, member->Note);
+        }
+        if (slots & (1u << SLOT_MODLEVEL)) OpbData_WriteU8(&data, member->ModLevel);
+        if (slots & (1u << SLOT_CARLEVEL)) OpbData_WriteU8(&data, member->CarLevel);
+    }
+
+    int reg = play ? OPB_CMD_PLAYINSTRUMENT : OPB_CMD_SETINSTRUMENT;
+    AddOpbCommand(context, &data, reg + (first->Channel >= 9 ? 0x100 : 0), first->Order);
+}
+
+// candidates are only looked for this far after the first command of a group, which bounds the work on songs that
+// set the same instrument on one channel over and over at the same time
+#define GROUP_SEARCH_LIMIT 64
+
+// stores the instrument commands of channels in the same half of the chip that set the same instrument slots to the
+// same instrument at the same time as one group command, which takes the place of the first of them. a channel can
+// only join a group when none of its writes come between the group and its own command, since the group is played
+// before them
+static void GroupInstruments(Context* context) {
+    GroupCandidate* candidates = (GroupCandidate*)context->Groups.Storage;
+    size_t count = context->Groups.Count;
+    if (count == 0) {
+        return;
+    }
+    qsort(candidates, count, sizeof(GroupCandidate), CompareGroupCandidates);
+
+    size_t start = 0;
+    while (start < count) {
+        size_t end = start + 1;
+        while (end < count && CanGroup(candidates + start, candidates + end)) {
+            end++;
+        }
+
+        for (size_t i = start; i < end; i++) {
+            GroupCandidate* first = candidates + i;
+            if (first->Grouped) {
+                continue;
+            }
+
+            GroupCandidate* members[9];
+            uint32_t channels = 1u << (first->Channel % 9);
+            members[first->Channel % 9] = first;
+            first->Grouped = true;
+
+            for (size_t j = i + 1; j < end && j <= i + GROUP_SEARCH_LIMIT; j++) {
+                GroupCandidate* candidate = candidates + j;
+                uint32_t bit = 1u << (candidate->Channel % 9);
+                if (!candidate->Grouped && !(channels & bit) && candidate->Previous < (int64_t)first->Order) {
+                    members[candidate->Channel % 9] = candidate;
+                    channels |= bit;
+                    candidate->Grouped = true;
+                }
+            }
+
+            AddGroupCommand(context, first, members, channels);
+        }
+        start = end;
+    }
+
+    Vector_Free(&context->Groups);
+}
+
+// encoder ticks to units of the output's time base, rounded to the nearest
+static inline int64_t TicksToUnits(int64_t ticks, uint32_t timeBase) {
+    return (ticks / TICKS_PER_SECOND) * timeBase + ((ticks % TICKS_PER_SECOND) * timeBase + TICKS_PER_SECOND / 2) / TICKS_PER_SECOND;
+}
+
+// chunk times are rounded before they're subtracted, so rounding error never adds up over a song no matter how
+// short the gaps between chunks are
+static inline uint32_t ElapsedUnits(Context* context, int64_t chunkTime, int64_t lastTime) {
+    return (uint32_t)(TicksToUnits(chunkTime, context->TimeBase) - TicksToUnits(lastTime, context->TimeBase));
+}
 
-    for (int i = start; i < start + count; i++) {
-        Command* cmd = Vector_GetT(Command, &context->CommandStream, i);
+// counts a chunk's low and high register commands and returns the number of bytes they take up
+static size_t CountChunk(Context* context, const uint32_t* refs, int count, int* loCount, int* hiCount) {
+    CommandStream* stream = &context->CommandStream;
+    size_t size = 0;
+    *loCount = 0;
+    *hiCount = 0;
+
+    for (int i = 0; i < count; i++) {
+        uint32_t ref = refs[i];
+        uint16_t addr;
+
+        if (ref & COMMAND_REF_DATA) {
+            OpbData* data = Vector_GetT(OpbData, &context->DataMap, COMMAND_REF_INDEX(ref));
+            addr = data->Addr;
+            size += 1 + data->Count;
+        }
+        else {
+            addr = stream->Addr[ref];
+            size += 2;
+        }
 
-        if ((cmd->Addr & 0x100) == 0) {
-            loCount++;
+        if ((addr & 0x100) == 0) {
+            (*loCount)++;
         }
         else {
-            hiCount++;
+            (*hiCount)++;
         }
     }
 
+    return size;
+}
+
+// where the channel mask of an instrument command is, it follows the uint7 instrument index
+static inline int ChannelMaskPosition(const OpbData* data) {
+    int i = 0;
+    while (i < 3 && data->Args[i] >= 128) {
+        i++;
+    }
+    return i + 1;
+}
+
+// whether an instrument command sets a group of channels
+static inline bool IsGroupCommand(const OpbData* data) {
+    int baseAddr = data->Addr & 0xFF;
+    if (baseAddr != OPB_CMD_SETINSTRUMENT && baseAddr != OPB_CMD_PLAYINSTRUMENT) {
+        return false;
+    }
+    return (data->Args[ChannelMaskPosition(data)] & 0b00011111) == GROUP_CHANNEL;
+}
+
+// 0xD2-0xD6 and 0xF6-0xFE are plain writes in data without the flags that make them commands
+static OPB_CommandKind GetCommandKind(uint8_t baseAddr, uint32_t flags, bool group) {
+    if (group) {
+        return OPB_CommandKind_GroupInstrument;
+    }
+    if (IsDeltaCommand(baseAddr, flags)) {
+        return OPB_CommandKind_DeltaFrequency;
+    }
+    switch (baseAddr) {
+    case OPB_CMD_SETINSTRUMENT:
+        return OPB_CommandKind_SetInstrument;
+    case OPB_CMD_PLAYINSTRUMENT:
+        return OPB_CommandKind_PlayInstrument;
+    case OPB_CMD_BACKREF:
+        return (flags & OPB_FLAG_BACKREF) ? OPB_CommandKind_BackReference : OPB_CommandKind_Plain;
+    case OPB_CMD_SETFOUROP:
+    case OPB_CMD_PLAYFOUROP:
+        return (flags & OPB_FLAG_VOICES) ? OPB_CommandKind_FourOpInstrument : OPB_CommandKind_Plain;
+    case OPB_CMD_SETRHYTHM:
+    case OPB_CMD_PLAYRHYTHM:
+        return (flags & OPB_FLAG_VOICES) ? OPB_CommandKind_RhythmInstrument : OPB_CommandKind_Plain;
+    default:
+        return baseAddr >= OPB_CMD_NOTEON && baseAddr <= OPB_CMD_NOTEON + 8 ? OPB_CommandKind_CombinedNote : OPB_CommandKind_Plain;
+    }
+}
+
+static int WriteChunk(Context* context, uint32_t elapsed, const uint32_t* refs, int count) {
+    CommandStream* stream = &context->CommandStream;
+    int loCount;
+    int hiCount;
+    CountChunk(context, refs, count, &loCount, &hiCount);
+
     // write header
-    WRITE_UINT7(context, elapsedMs);
+    WRITE_UINT7(context, elapsed);
     WRITE_UINT7(context, loCount);
     WRITE_UINT7(context, hiCount);
 
+    if (context->Stats != NULL) {
+        context->Stats->ChunkHeaderBytes += Uint7Size(elapsed) + Uint7Size(loCount) + Uint7Size(hiCount);
+    }
+
     // write low and high register writes
     bool isLow = true;
     while (true) {
-        for (int i = start; i < start + count; i++) {
-            Command* cmd = Vector_GetT(Command, &context->CommandStream, i);
+        for (int i = 0; i < count; i++) {
+            uint32_t ref = refs[i];
 
-            if (((cmd->Addr & 0x100) == 0) == isLow) {
-                uint8_t baseAddr = cmd->Addr & 0xFF;
-                WRITE(&baseAddr, sizeof(uint8_t), 1, context);
+            if (ref & COMMAND_REF_DATA) {
+                // opb command
+                OpbData* data = Vector_GetT(OpbData, &context->DataMap, COMMAND_REF_INDEX(ref));
 
-                if (cmd->DataIndex) {
-                    if (!IsSpecialCommand(baseAddr)) {
+                if (((data->Addr & 0x100) == 0) == isLow) {
+                    uint8_t baseAddr = data->Addr & 0xFF;
+                    if (!IsSpecialCommand(baseAddr) && !IsDeltaCommand(baseAddr, context->FormatFlags)) {
                         Log("Unexpected write error. Command had DataIndex but was not an OPB command\n");
                         return OPBERR_LOGGED;
                     }
 
-                    // opb command
-                    OpbData* data = Vector_GetT(OpbData, &context->DataMap, cmd->DataIndex - 1);
+                    WRITE(&baseAddr, sizeof(uint8_t), 1, context);
                     WRITE(data->Args, sizeof(uint8_t), data->Count, context);
-                }
-                else {
-                    if (IsSpecialCommand(baseAddr)) {
-                        Log("Unexpected write error. Command was an OPB command but had no DataIndex\n");
-                        return OPBERR_LOGGED;
+
+                    if (context->Stats != NULL) {
+                        OPB_CommandStats* kind = context->Stats->Commands + GetCommandKind(baseAddr, context->FormatFlags, IsGroupCommand(data));
+                        kind->Count++;
+                        kind->Bytes += 1 + data->Count;
                     }
+                }
+            }
+            else if (((stream->Addr[ref] & 0x100) == 0) == isLow) {
+                uint8_t baseAddr = stream->Addr[ref] & 0xFF;
+                if (IsSpecialCommand(baseAddr) || IsDeltaCommand(baseAddr, context->FormatFlags)) {
+                    Log("Unexpected write error. Command was an OPB command but had no DataIndex\n");
+                    return OPBERR_LOGGED;
+                }
 
-                    // regular write
-                    WRITE(&(cmd->Data), sizeof(uint8_t), 1, context);
+                // regular write
+                WRITE(&baseAddr, sizeof(uint8_t), 1, context);
+                WRITE(stream->Data + ref, sizeof(uint8_t), 1, context);
+
+                if (context->Stats != NULL) {
+                    context->Stats->Commands[OPB_CommandKind_Plain].Count++;
+                    context->Stats->Commands[OPB_CommandKind_Plain].Bytes += 2;
                 }
             }
         }
@@ -951,523 +1943,4585 @@ static int WriteChunk(Context* context, double elapsed, int start, int count) {
     return 0;
 }
 
-static int SortCommands(const void* a, const void* b) {
-    return ((Command*)a)->OrderIndex - ((Command*)b)->OrderIndex;
+static int SortKeys(const void* a, const void* b) {
+    uint64_t keyA = *(const uint64_t*)a;
+    uint64_t keyB = *(const uint64_t*)b;
+    return keyA < keyB ? -1 : (keyA > keyB ? 1 : 0);
 }
 
-static int ConvertToOpb(Context* context) {
-    if (context->Format < OPB_Format_Default || context->Format > OPB_Format_Raw) {
-        context->Format = OPB_Format_Default;
-    }
+// sorts the processed output back into received order. each sort key holds the order index in its upper
+// 32 bits and the position in the output in its lower 32 bits, which keeps the sort stable
+static int SortOutput(Context* context) {
+    size_t count = context->Output.Count;
+    uint32_t* refs = (uint32_t*)context->Output.Storage;
 
-    WRITE(OPB_Header, sizeof(char), OPB_HEADER_SIZE, context);
+    uint64_t* keys = (uint64_t*)malloc((count > 0 ? count : 1) * sizeof(uint64_t));
+    if (keys == NULL) {
+        return OPBERR_BUFFER_ERROR;
+    }
+    context->Allocations++;
 
-    Log("OPB format %d (%s)\n", context->Format, OPB_GetFormatName(context->Format));
+    for (size_t i = 0; i < count; i++) {
+        uint32_t ref = refs[i];
+        uint64_t order = (ref & COMMAND_REF_DATA) ? Vector_GetT(OpbData, &context->DataMap, COMMAND_REF_INDEX(ref))->Order : ref;
+        keys[i] = (order << 32) | i;
+    }
 
-    uint8_t fmt = (uint8_t)context->Format;
-    WRITE(&fmt, sizeof(uint8_t), 1, context);
+    qsort(keys, count, sizeof(uint64_t), SortKeys);
 
-    if (context->Format == OPB_Format_Raw) {
-        Log("Writing raw OPL data stream\n");
+    // the sorted references are written over the first half of the keys array, which is safe because
+    // the reference for key i is written to bytes that only overlap keys that have already been read
+    uint32_t* sorted = (uint32_t*)keys;
+    for (size_t i = 0; i < count; i++) {
+        sorted[i] = refs[(uint32_t)keys[i]];
+    }
+    memcpy(refs, sorted, count * sizeof(uint32_t));
 
-        double lastTime = 0.0;
-        for (int i = 0; i < context->CommandStream.Count; i++) {
-            Command* cmd = Vector_GetT(Command, &context->CommandStream, i);
+    free(keys);
+    return 0;
+}
 
-            uint16_t elapsed = FlipEndian16((uint16_t)((cmd->Time - lastTime) * 1000.0));
-            uint16_t addr = FlipEndian16(cmd->Addr);
+// the encoder creates instruments as channels first need them and fills in the properties of a match that weren't
+// set yet, so which instruments exist depends on the order property sets arrive in. the instrument optimizer runs
+// the tracks once to gather every set, chooses a small table of instruments that covers them all and puts it in
+// place before the tracks are processed for real
+
+// effort levels, see OPB_EncodeOptions.InstrumentEffort
+#define EFFORT_FIRST_FIT 1  // sets with the most properties first, each in the first instrument it fits
+#define EFFORT_REDUCE 2     // each set in the instrument it adds the fewest properties to, then empty instruments
+                            // whose sets all fit elsewhere
+#define EFFORT_ORDERS 3     // the above for several orders of the sets, keeping the smallest result
+#define NO_CLUSTER UINT32_MAX
+
+// instrument properties one byte each in the order they're stored in, with a mask of 0xFF for every property that's
+// set, so sets are compared a word at a time
+typedef struct PackedProperties {
+    uint64_t Values[2];
+    uint64_t Mask[2];
+} PackedProperties;
+
+typedef struct PropertySet {
+    PackedProperties Properties;
+    uint32_t Uses;                      // number of times the set was requested
+    uint32_t First;                     // order of the set's first request
+    uint32_t Next;                      // next set covered by the same instrument
+} PropertySet;
+
+typedef struct Cluster {
+    PackedProperties Properties;
+    uint32_t Uses;
+    uint32_t Head;                      // first set covered, NO_CLUSTER once the instrument was emptied
+} Cluster;
+
+// an instrument's properties before a set was tried in it, to undo the attempt to empty an instrument
+typedef struct ClusterUndo {
+    PackedProperties Properties;
+    uint32_t Set;
+    uint32_t Cluster;
+} ClusterUndo;
+
+typedef struct ClusterSolver {
+    PropertySet* Sets;
+    Cluster* Clusters;
+    ClusterUndo* Undo;
+    uint64_t* Keys;                     // scratch space for sorting instruments by use
+    PackedProperties* Best;             // the smallest table found so far, most used instrument first
+    uint32_t SetCount;
+    uint32_t ClusterCount;
+    uint32_t BestCount;
+    uint64_t BestCost;
+    uint32_t Shared;                    // dictionary instruments, which come before the table
+} ClusterSolver;
+
+static PackedProperties PackProperties(const Instrument* instr) {
+    int16_t values[INSTRUMENT_SIZE] = {
+        instr->FeedConn,
+        instr->Modulator.Characteristic, instr->Modulator.AttackDecay, instr->Modulator.SustainRelease, instr->Modulator.WaveSelect,
+        instr->Carrier.Characteristic, instr->Carrier.AttackDecay, instr->Carrier.SustainRelease, instr->Carrier.WaveSelect
+    };
 
-            WRITE(&elapsed, sizeof(uint16_t), 1, context);
-            WRITE(&addr, sizeof(uint16_t), 1, context);
-            WRITE(&(cmd->Data), sizeof(uint8_t), 1, context);
-            lastTime = cmd->Time;
+    PackedProperties packed = { { 0 } };
+    for (int i = 0; i < INSTRUMENT_SIZE; i++) {
+        if (values[i] >= 0) {
+            packed.Values[i / 8] |= (uint64_t)values[i] << (i % 8 * 8);
+            packed.Mask[i / 8] |= (uint64_t)0xFF << (i % 8 * 8);
         }
-        return 0;
     }
+    return packed;
+}
 
-    // separate command stream into tracks
-    Log("Separating OPL data stream into channels\n");
-    SeparateTracks(context);
+static Instrument UnpackProperties(const PackedProperties* packed, int index) {
+    int16_t values[INSTRUMENT_SIZE];
+    for (int i = 0; i < INSTRUMENT_SIZE; i++) {
+        int shift = i % 8 * 8;
+        values[i] = (packed->Mask[i / 8] >> shift) & 0xFF ? (int16_t)((packed->Values[i / 8] >> shift) & 0xFF) : -1;
+    }
 
-    // process each track into its own output vector
-    VectorT(Command) chOut[NUM_TRACKS];
+    Instrument instr = {
+        values[0],
+        { values[1], values[2], values[3], values[4] },
+        { values[5], values[6], values[7], values[8] },
+        index
+    };
+    return instr;
+}
 
-    for (int i = 0; i < NUM_TRACKS; i++) {
-        Log("Processing channel %d\n", i);
-        chOut[i] = Vector_New(sizeof(Command));
+static inline bool PropertiesMatch(const PackedProperties* a, const PackedProperties* b) {
+    return (((a->Values[0] ^ b->Values[0]) & a->Mask[0] & b->Mask[0]) |
+        ((a->Values[1] ^ b->Values[1]) & a->Mask[1] & b->Mask[1])) == 0;
+}
 
-        int ret = ProcessTrack(context, i, chOut + i);
-        if (ret) {
-            for (int j = 0; j < NUM_TRACKS; j++) {
-                Vector_Free(chOut + j);
-            }
-            return ret;
-        }
-    }
+// number of properties an instrument would have to take on to cover a set
+static inline int AddedProperties(const PackedProperties* cluster, const PackedProperties* set) {
+    uint64_t low = set->Mask[0] & ~cluster->Mask[0];
+    uint64_t high = set->Mask[1] & ~cluster->Mask[1];
+    return (CountBits((uint32_t)low) + CountBits((uint32_t)(low >> 32)) + CountBits((uint32_t)high)) / 8;
+}
 
-    // combine all output back into command stream
-    Log("Combining processed data into linear stream\n");
-    Vector_Clear(&context->CommandStream, true);
-    for (int i = 0; i < NUM_TRACKS; i++) {
-        Vector_AddRange(&context->CommandStream, chOut[i].Storage, chOut[i].Count);
-    }
+static inline int CountProperties(const PackedProperties* set) {
+    return (CountBits((uint32_t)set->Mask[0]) + CountBits((uint32_t)(set->Mask[0] >> 32)) + CountBits((uint32_t)set->Mask[1])) / 8;
+}
 
-    for (int j = 0; j < NUM_TRACKS; j++) {
-        Vector_Free(chOut + j);
+static inline void MergeProperties(PackedProperties* cluster, const PackedProperties* set) {
+    for (int i = 0; i < 2; i++) {
+        cluster->Values[i] = (cluster->Values[i] & ~set->Mask[i]) | set->Values[i];
+        cluster->Mask[i] |= set->Mask[i];
     }
+}
 
-    // sort by received order
-    Vector_Sort(&context->CommandStream, SortCommands);
+// requests for the same set are sorted next to each other in the order they were made
+static int CompareRequests(const void* a, const void* b) {
+    const PropertySet* x = (const PropertySet*)a;
+    const PropertySet* y = (const PropertySet*)b;
+    int order = memcmp(&x->Properties, &y->Properties, sizeof(PackedProperties));
+    return order != 0 ? order : (x->First < y->First ? -1 : (x->First > y->First ? 1 : 0));
+}
 
-    // write instruments table
-    SEEK(context, 12, SEEK_CUR); // skip header
+static int CompareSetsBySize(const void* a, const void* b) {
+    const PropertySet* x = (const PropertySet*)a;
+    const PropertySet* y = (const PropertySet*)b;
+    int sizeX = CountProperties(&x->Properties);
+    int sizeY = CountProperties(&y->Properties);
+    if (sizeX != sizeY) return sizeX > sizeY ? -1 : 1;
+    if (x->Uses != y->Uses) return x->Uses > y->Uses ? -1 : 1;
+    return x->First < y->First ? -1 : (x->First > y->First ? 1 : 0);
+}
 
-    Log("Writing instrument table\n");
-    for (int i = 0; i < context->Instruments.Count; i++) {
-        int ret = WriteInstrument(context, Vector_GetT(Instrument, &context->Instruments, i));
-        if (ret) return ret;
+static int CompareSetsByUses(const void* a, const void* b) {
+    const PropertySet* x = (const PropertySet*)a;
+    const PropertySet* y = (const PropertySet*)b;
+    if (x->Uses != y->Uses) return x->Uses > y->Uses ? -1 : 1;
+    return x->First < y->First ? -1 : (x->First > y->First ? 1 : 0);
+}
+
+static int CompareSetsByFirst(const void* a, const void* b) {
+    const PropertySet* x = (const PropertySet*)a;
+    const PropertySet* y = (const PropertySet*)b;
+    return x->First < y->First ? -1 : (x->First > y->First ? 1 : 0);
+}
+
+// finds the instrument a set fits in other than skip, the first one or the one that takes on the fewest properties
+// with the most used first on a tie
+static uint32_t FindCluster(const ClusterSolver* solver, const PackedProperties* set, uint32_t skip, bool bestFit) {
+    uint32_t best = NO_CLUSTER;
+    int bestAdded = INSTRUMENT_SIZE + 1;
+    for (uint32_t c = 0; c < solver->ClusterCount; c++) {
+        const Cluster* cluster = solver->Clusters + c;
+        if (c == skip || cluster->Head == NO_CLUSTER || !PropertiesMatch(&cluster->Properties, set)) {
+            continue;
+        }
+        if (!bestFit) {
+            return c;
+        }
+        int added = AddedProperties(&cluster->Properties, set);
+        if (added < bestAdded || (added == bestAdded && cluster->Uses > solver->Clusters[best].Uses)) {
+            best = c;
+            bestAdded = added;
+        }
     }
+    return best;
+}
 
-    // write chunks
-    {
-        int chunks = 0;
-        double lastTime = 0;
-        int i = 0;
-
-        Log("Writing chunks\n");
-        while (i < context->CommandStream.Count) {
-            double chunkTime = Vector_GetT(Command, &context->CommandStream, i)->Time;
-
-            int start = i;
-            while (i < context->CommandStream.Count && Vector_GetT(Command, &context->CommandStream, i)->Time <= chunkTime) {
-                i++;
-            }
-            int end = i;
+static inline void AddToCluster(ClusterSolver* solver, uint32_t set, uint32_t c) {
+    Cluster* cluster = solver->Clusters + c;
+    cluster->Uses += solver->Sets[set].Uses;
+    solver->Sets[set].Next = cluster->Head;
+    cluster->Head = set;
+}
 
-            int ret = WriteChunk(context, chunkTime - lastTime, start, end - start);
-            if (ret) return ret;
-            chunks++;
+// places the sets in the order they're stored, creating an instrument for every set that fits in none so far
+static void PlaceSets(ClusterSolver* solver, bool bestFit) {
+    solver->ClusterCount = 0;
+    for (uint32_t i = 0; i < solver->SetCount; i++) {
+        const PackedProperties* set = &solver->Sets[i].Properties;
+        uint32_t c = FindCluster(solver, set, NO_CLUSTER, bestFit);
+        if (c == NO_CLUSTER) {
+            c = solver->ClusterCount++;
+            solver->Clusters[c] = (Cluster) { *set, 0, NO_CLUSTER };
+        }
+        MergeProperties(&solver->Clusters[c].Properties, set);
+        AddToCluster(solver, i, c);
+    }
+}
 
-            lastTime = chunkTime;
+// sorts the instruments that cover any sets by use into Keys, least used first if ascending, and returns how many
+// there are
+static uint32_t SortClusters(ClusterSolver* solver, bool ascending) {
+    uint32_t count = 0;
+    for (uint32_t c = 0; c < solver->ClusterCount; c++) {
+        uint32_t uses = solver->Clusters[c].Uses;
+        if (solver->Clusters[c].Head != NO_CLUSTER) {
+            solver->Keys[count++] = (uint64_t)(ascending ? uses : UINT32_MAX - uses) << 32 | c;
         }
+    }
+    qsort(solver->Keys, count, sizeof(uint64_t), SortKeys);
+    return count;
+}
+
+// empties instruments whose sets all fit in other instruments, least used first, until no more can be emptied. a
+// set that moves can stop later sets from fitting where they would have, so when any set fits nowhere the
+// properties of every instrument tried so far are put back
+static void ReduceClusters(ClusterSolver* solver) {
+    bool reduced = true;
+    while (reduced) {
+        reduced = false;
+        uint32_t count = SortClusters(solver, true);
+
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t c = (uint32_t)solver->Keys[i];
+            uint32_t undoCount = 0;
+            bool fits = true;
+
+            for (uint32_t set = solver->Clusters[c].Head; set != NO_CLUSTER; set = solver->Sets[set].Next) {
+                const PackedProperties* properties = &solver->Sets[set].Properties;
+                uint32_t target = FindCluster(solver, properties, c, true);
+                if (target == NO_CLUSTER) {
+                    fits = false;
+                    break;
+                }
+                solver->Undo[undoCount++] = (ClusterUndo) { solver->Clusters[target].Properties, set, target };
+                MergeProperties(&solver->Clusters[target].Properties, properties);
+            }
 
-        // write header
-        Log("Writing header\n");
+            if (!fits) {
+                while (undoCount > 0) {
+                    ClusterUndo* undo = solver->Undo + --undoCount;
+                    solver->Clusters[undo->Cluster].Properties = undo->Properties;
+                }
+                continue;
+            }
 
-        long fpos;
-        TELL(context, fpos);
+            // the properties are already merged, the sets only change lists
+            solver->Clusters[c].Head = NO_CLUSTER;
+            solver->Clusters[c].Uses = 0;
+            for (uint32_t j = 0; j < undoCount; j++) {
+                AddToCluster(solver, solver->Undo[j].Set, solver->Undo[j].Cluster);
+            }
+            reduced = true;
+        }
+    }
+}
 
-        uint32_t length = FlipEndian32(fpos);
-        uint32_t instrCount = FlipEndian32((uint32_t)context->Instruments.Count);
-        uint32_t chunkCount = FlipEndian32(chunks);
+// keeps the instruments if their table and the indices that refer to them take fewer bytes than the best so far.
+// the most used instruments come first, so they get the indices that take a single byte
+static void KeepBestClusters(ClusterSolver* solver) {
+    uint32_t count = SortClusters(solver, false);
 
-        SEEK(context, OPB_HEADER_SIZE + 1, SEEK_SET);
-        WRITE(&length, sizeof(uint32_t), 1, context);
-        WRITE(&instrCount, sizeof(uint32_t), 1, context);
-        WRITE(&chunkCount, sizeof(uint32_t), 1, context);
+    uint64_t cost = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        cost += INSTRUMENT_SIZE + (uint64_t)solver->Clusters[(uint32_t)solver->Keys[i]].Uses * Uint7Size(solver->Shared + i);
+    }
+    if (solver->BestCount > 0 && cost >= solver->BestCost) {
+        return;
     }
 
-    return 0;
+    for (uint32_t i = 0; i < count; i++) {
+        solver->Best[i] = solver->Clusters[(uint32_t)solver->Keys[i]].Properties;
+    }
+    solver->BestCount = count;
+    solver->BestCost = cost;
 }
 
-static size_t WriteToFile(const void* buffer, size_t elementSize, size_t elementCount, void* context) {
-    return fwrite(buffer, elementSize, elementCount, (FILE*)context);
-}
+static void SolveClusters(ClusterSolver* solver, int effort) {
+    static int (*const orders[])(const void*, const void*) = { CompareSetsBySize, CompareSetsByUses, CompareSetsByFirst };
+    int orderCount = effort >= EFFORT_ORDERS ? 3 : 1;
 
-static int SeekInFile(void* context, long offset, int origin) {
-    return fseek((FILE*)context, offset, origin);
+    for (int i = 0; i < orderCount; i++) {
+        qsort(solver->Sets, solver->SetCount, sizeof(PropertySet), orders[i]);
+        PlaceSets(solver, effort >= EFFORT_REDUCE);
+        if (effort >= EFFORT_REDUCE) {
+            ReduceClusters(solver);
+        }
+        KeepBestClusters(solver);
+    }
 }
 
-static long TellInFile(void* context) {
-    return ftell((FILE*)context);
-}
+// runs the tracks without creating instruments to gather the property set of every instrument command they need.
+// the commands made on the way are thrown away
+static int CollectPropertySets(Context* context) {
+    uint32_t formatFlags = context->FormatFlags;
+    int ret = 0;
 
-int OPB_OplToFile(OPB_Format format, OPB_Command* commandStream, size_t commandCount, const char* file) {
-    FILE* outFile;
-    if ((outFile = fopen(file, "wb")) == NULL) {
-        Log("Couldn't open file '%s' for writing\n", file);
-        return OPBERR_LOGGED;
-    }
-    int ret = OPB_OplToBinary(format, commandStream, commandCount, WriteToFile, SeekInFile, TellInFile, outFile);
-    if (fclose(outFile)) {
-        Log("Error while closing file '%s'\n", file);
-        return OPBERR_LOGGED;
+    context->CollectInstruments = true;
+    for (int i = 0; i < NUM_TRACKS && !ret; i++) {
+        ret = ProcessTrack(context, i);
     }
+    context->CollectInstruments = false;
+
+    Vector_Clear(&context->Output, true);
+    Vector_Clear(&context->DataMap, true);
+    Vector_Clear(&context->Groups, true);
+    context->FormatFlags = formatFlags;
     return ret;
 }
 
-int OPB_OplToBinary(OPB_Format format, OPB_Command* commandStream, size_t commandCount, OPB_StreamWriter write, OPB_StreamSeeker seek, OPB_StreamTeller tell, void* userData) {
-    Context context = Context_New();
-
-    context.Write = write;
-    context.Seek = seek;
-    context.Tell = tell;
-    context.UserData = userData;
-    context.Format = format;
+// merges the requests for the same set and drops sets a dictionary instrument already covers. returns the number
+// of sets left
+static uint32_t MergeRequests(Context* context, PropertySet* sets) {
+    size_t count = context->InstrumentRequests.Count;
+    for (size_t i = 0; i < count; i++) {
+        const Instrument* request = Vector_GetT(Instrument, &context->InstrumentRequests, (int)i);
+        sets[i].Properties = PackProperties(request);
+        sets[i].First = (uint32_t)request->Index;
+    }
+    qsort(sets, count, sizeof(PropertySet), CompareRequests);
 
-    // convert stream to internal format
-    int orderIndex = 0;
-    for (int i = 0; i < commandCount; i++) {
-        const OPB_Command* source = commandStream + i;
+    uint32_t setCount = 0;
+    for (size_t i = 0, end; i < count; i = end) {
+        const PackedProperties* properties = &sets[i].Properties;
+        for (end = i + 1; end < count && memcmp(properties, &sets[end].Properties, sizeof(PackedProperties)) == 0; end++);
 
-        if (IsSpecialCommand(source->Addr)) {
-            Log("Illegal register 0x%03X with value 0x%02X in command stream, ignored\n", source->Addr, source->Data);
+        bool shared = false;
+        for (uint32_t j = 0; j < context->SharedInstruments && !shared; j++) {
+            PackedProperties instr = PackProperties(Vector_GetT(Instrument, &context->Instruments, j));
+            shared = PropertiesMatch(&instr, properties);
         }
-        else {
-            Command cmd = {
-                source->Addr,   // OPL register
-                source->Data,   // OPL data
-                source->Time,   // Time in seconds
-                orderIndex++,   // Stream index
-                0               // Data index
-            };
-
-            Vector_Add(&context.CommandStream, &cmd);
+        if (!shared) {
+            sets[setCount] = sets[i];
+            sets[setCount++].Uses = (uint32_t)(end - i);
         }
     }
+    return setCount;
+}
 
-    int ret = ConvertToOpb(&context);
-    Context_Free(&context);
+// chooses the instrument table for the effort level and puts it after the dictionary's instruments, where every
+// property set the tracks request finds an instrument it fits in
+static int OptimizeInstruments(Context* context, int effort) {
+    int ret = CollectPropertySets(context);
+    size_t count = context->InstrumentRequests.Count;
+    if (ret || count == 0) {
+        Vector_Free(&context->InstrumentRequests);
+        return ret;
+    }
 
-    if (ret) {
-        Log("%s\n", OPB_GetErrorMessage(ret));
+    ClusterSolver solver = { 0 };
+    solver.Sets = (PropertySet*)malloc(count * sizeof(PropertySet));
+    solver.Clusters = (Cluster*)malloc(count * sizeof(Cluster));
+    solver.Undo = (ClusterUndo*)malloc(count * sizeof(ClusterUndo));
+    solver.Keys = (uint64_t*)malloc(count * sizeof(uint64_t));
+    solver.Best = (PackedProperties*)malloc(count * sizeof(PackedProperties));
+    solver.Shared = context->SharedInstruments;
+    context->Allocations += 5;
+
+    ret = OPBERR_BUFFER_ERROR;
+    if (solver.Sets != NULL && solver.Clusters != NULL && solver.Undo != NULL && solver.Keys != NULL && solver.Best != NULL) {
+        solver.SetCount = MergeRequests(context, solver.Sets);
+        SolveClusters(&solver, effort > EFFORT_ORDERS ? EFFORT_ORDERS : effort);
+
+        ret = Vector_Reserve(&context->Instruments, context->Instruments.Count + solver.BestCount) ? OPBERR_BUFFER_ERROR : 0;
+        for (uint32_t i = 0; i < solver.BestCount && !ret; i++) {
+            Instrument instr = UnpackProperties(solver.Best + i, (int)context->Instruments.Count);
+            Vector_Add(&context->Instruments, &instr);
+        }
     }
 
+    free(solver.Sets);
+    free(solver.Clusters);
+    free(solver.Undo);
+    free(solver.Keys);
+    free(solver.Best);
+    Vector_Free(&context->InstrumentRequests);
     return ret;
 }
 
-static int ReadInstrument(Context* context, Instrument* instr) {
-    uint8_t buffer[9];
-    READ(buffer, sizeof(uint8_t), 9, context);
-    *instr = (Instrument) {
-        buffer[0], // feedconn
-        {
-            buffer[1], // modulator characteristic
-            buffer[2], // modulator attack/decay
-            buffer[3], // modulator sustain/release
-            buffer[4], // modulator wave select
-        },
-        {
-            buffer[5], // carrier characteristic
-            buffer[6], // carrier attack/decay
-            buffer[7], // carrier sustain/release
-            buffer[8], // carrier wave select
-        },
-        (int)context->Instruments.Count // instrument index
-    };
-    return 0;
+static inline int64_t RefTime(Context* context, uint32_t ref) {
+    if (ref & COMMAND_REF_DATA) {
+        ref = Vector_GetT(OpbData, &context->DataMap, COMMAND_REF_INDEX(ref))->Order;
+    }
+    return context->CommandStream.Time[ref];
 }
 
-static int ReadUint7(Context* context) {
-    uint8_t b0 = 0, b1 = 0, b2 = 0, b3 = 0;
+// returns the end of the chunk starting at refs[start]. a chunk holds all commands at the same time
+static size_t NextChunk(Context* context, const uint32_t* refs, size_t count, size_t start, int64_t* chunkTime) {
+    *chunkTime = RefTime(context, refs[start]);
 
-    if (context->Read(&b0, sizeof(uint8_t), 1, context->UserData) != 1) return -1;
-    if (b0 >= 128) {
-        b0 &= 0b01111111;
-        if (context->Read(&b1, sizeof(uint8_t), 1, context->UserData) != 1) return -1;
-        if (b1 >= 128) {
-            b1 &= 0b01111111;
-            if (context->Read(&b2, sizeof(uint8_t), 1, context->UserData) != 1) return -1;
-            if (b2 >= 128) {
-                b2 &= 0b01111111;
-                if (context->Read(&b3, sizeof(uint8_t), 1, context->UserData) != 1) return -1;
-            }
-        }
+    size_t i = start;
+    while (i < count && RefTime(context, refs[i]) <= *chunkTime) {
+        i++;
     }
-
-    return b0 | (b1 << 7) | (b2 << 14) | (b3 << 21);
+    return i;
 }
 
-#define DEFAULT_READBUFFER_SIZE 256
+// back references
+// runs of chunks are matched by their commands only. when the elapsed times of a run differ from the ones it repeats
+// the back reference stores its own, which still leaves out every command and command count. decoders only keep the
+// chunks within the window and never repeat what another back reference played, so their memory is bounded and a
+// back reference can't play more than the data it points at
+#define BACKREF_MAX_CANDIDATES 64   // earlier chunks with the same hash slot that are compared before giving up
+#define BACKREF_NO_CHUNK UINT32_MAX
+#define BACKREF_MAX_LENGTH 0x7FFFFFF // the length is stored shifted left by one to make room for the times flag
+#define BACKREF_MAX_WINDOW 65536    // largest distance readers accept in the header's window
+
+typedef struct ChunkInfo {
+    uint32_t Start;     // index of the chunk's first command in the output
+    uint32_t Count;
+    uint32_t Elapsed;   // time base units since the previous chunk
+    uint32_t Hash;      // hash of the chunk's commands
+    uint32_t Size;      // bytes the chunk takes up when written normally
+    bool Replayed;      // the chunk is played by a back reference, so it can't be repeated itself
+} ChunkInfo;
+
+static inline uint32_t HashRef(Context* context, uint32_t ref, uint32_t hash) {
+    if (ref & COMMAND_REF_DATA) {
+        OpbData* data = Vector_GetT(OpbData, &context->DataMap, COMMAND_REF_INDEX(ref));
+        uint8_t addr[2] = { (uint8_t)(data->Addr >> 8), (uint8_t)data->Addr };
+        return Fnv1a(data->Args, data->Count, Fnv1a(addr, 2, hash));
+    }
+    uint16_t addr = context->CommandStream.Addr[ref];
+    uint8_t command[3] = { (uint8_t)(addr >> 8), (uint8_t)addr, context->CommandStream.Data[ref] };
+    return Fnv1a(command, 3, hash);
+}
+
+static inline bool RefsEqual(Context* context, uint32_t a, uint32_t b) {
+    if ((a & COMMAND_REF_DATA) != (b & COMMAND_REF_DATA)) {
+        return false;
+    }
+    if (a & COMMAND_REF_DATA) {
+        OpbData* dataA = Vector_GetT(OpbData, &context->DataMap, COMMAND_REF_INDEX(a));
+        OpbData* dataB = Vector_GetT(OpbData, &context->DataMap, COMMAND_REF_INDEX(b));
+        return dataA->Addr == dataB->Addr && dataA->Count == dataB->Count && !memcmp(dataA->Args, dataB->Args, dataA->Count);
+    }
+    CommandStream* stream = &context->CommandStream;
+    return stream->Addr[a] == stream->Addr[b] && stream->Data[a] == stream->Data[b];
+}
+
+// commands that are equal in the same order are also written the same way
+static bool ChunksEqual(Context* context, const ChunkInfo* a, const ChunkInfo* b) {
+    if (a->Hash != b->Hash || a->Count != b->Count) {
+        return false;
+    }
+
+    const uint32_t* refs = (const uint32_t*)context->Output.Storage;
+    for (uint32_t i = 0; i < a->Count; i++) {
+        if (!RefsEqual(context, refs[a->Start + i], refs[b->Start + i])) return false;
+    }
+    return true;
+}
+
+static void CollectChunks(Context* context, ChunkInfo* chunks) {
+    size_t i = 0;
+    size_t count = context->Output.Count;
+    uint32_t* refs = (uint32_t*)context->Output.Storage;
+    int64_t lastTime = 0;
+    uint32_t chunkCount = 0;
+
+    while (i < count) {
+        int64_t chunkTime;
+        size_t start = i;
+        i = NextChunk(context, refs, count, start, &chunkTime);
+
+        ChunkInfo* chunk = chunks + chunkCount++;
+        chunk->Start = (uint32_t)start;
+        chunk->Count = (uint32_t)(i - start);
+        chunk->Elapsed = ElapsedUnits(context, chunkTime, lastTime);
+        chunk->Hash = FNV_OFFSET_BASIS;
+        chunk->Replayed = false;
+        for (size_t j = start; j < i; j++) {
+            chunk->Hash = HashRef(context, refs[j], chunk->Hash);
+        }
+
+        int loCount, hiCount;
+        chunk->Size = (uint32_t)(CountChunk(context, refs + start, (int)chunk->Count, &loCount, &hiCount) +
+            Uint7Size(chunk->Elapsed) + Uint7Size(loCount) + Uint7Size(hiCount));
+
+        lastTime = chunkTime;
+    }
+}
+
+typedef struct BackReferenceSearch {
+    ChunkInfo* Chunks;
+    uint32_t Count;
+    uint32_t* Previous;     // earlier position in the same slot
+    uint32_t* Heads;        // latest position in each slot
+    uint32_t TableSize;
+    uint64_t* Sizes;        // running total of chunk sizes, so the size of any run takes one subtraction
+} BackReferenceSearch;
+
+// matches the run at index against the one at candidate and fills in what a back reference to it would look like.
+// runs may not overlap the chunks they repeat, so a run is never longer than its distance, and end before any chunk
+// another back reference plays
+static void MatchChunks(Context* context, const BackReferenceSearch* search, uint32_t index, uint32_t candidate,
+    BackReference* backref) {
+    const ChunkInfo* chunks = search->Chunks;
+    uint32_t distance = index - candidate;
+    uint32_t maxLength = search->Count - index < distance ? search->Count - index : distance;
+    if (maxLength > BACKREF_MAX_LENGTH) maxLength = BACKREF_MAX_LENGTH;
+
+    // the first chunk's elapsed time is stored in the back reference's chunk header either way
+    bool sameTimes = true;
+    size_t timesSize = 0;
+    uint32_t length = 0;
+    while (length < maxLength && !chunks[candidate + length].Replayed &&
+        ChunksEqual(context, chunks + index + length, chunks + candidate + length)) {
+        if (length > 0) {
+            sameTimes = sameTimes && chunks[index + length].Elapsed == chunks[candidate + length].Elapsed;
+            timesSize += Uint7Size(chunks[index + length].Elapsed);
+        }
+        length++;
+    }
+
+    backref->Chunk = index;
+    backref->Distance = distance;
+    backref->Length = length;
+    backref->ExplicitTimes = !sameTimes;
+
+    // chunk header with a single low command, then the command and its arguments
+    backref->Size = (uint32_t)(Uint7Size(chunks[index].Elapsed) + 2 + 1 + Uint7Size(distance) +
+        Uint7Size(length << 1) + (sameTimes ? 0 : timesSize));
+}
+
+// greedy LZ77 style parse over the chunks, taking the run that saves the most bytes at each position
+static int ParseBackReferences(Context* context, BackReferenceSearch* search) {
+    const ChunkInfo* chunks = search->Chunks;
+    uint32_t count = search->Count;
+    uint32_t mask = search->TableSize - 1;
+
+    for (uint32_t i = 0; i < search->TableSize; i++) {
+        search->Heads[i] = BACKREF_NO_CHUNK;
+    }
+
+    search->Sizes[0] = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        search->Sizes[i + 1] = search->Sizes[i] + chunks[i].Size;
+    }
+
+    for (uint32_t i = 0; i < count;) {
+        BackReference best = { 0 };
+        uint64_t bestSaving = 0;
+
+        // candidates only get further away along the chain, so the first one out of the window ends it
+        uint32_t candidate = search->Heads[chunks[i].Hash & mask];
+        for (int tries = 0; candidate != BACKREF_NO_CHUNK && tries < BACKREF_MAX_CANDIDATES; tries++) {
+            if (i - candidate > BACKREF_MAX_WINDOW) break;
+
+            BackReference backref;
+            MatchChunks(context, search, i, candidate, &backref);
+
+            uint64_t saved = search->Sizes[i + backref.Length] - search->Sizes[i];
+            if (saved > backref.Size && saved - backref.Size > bestSaving) {
+                bestSaving = saved - backref.Size;
+                best = backref;
+            }
+            candidate = search->Previous[candidate];
+        }
+
+        if (best.Length > 0) {
+            if (Vector_Add(&context->BackReferences, &best)) return OPBERR_BUFFER_ERROR;
+            if (best.Distance > context->BackReferenceWindow) context->BackReferenceWindow = best.Distance;
+
+            // the chunks a back reference plays can't be repeated, so they never go into the hash table
+            for (uint32_t end = i + best.Length; i < end; i++) {
+                search->Chunks[i].Replayed = true;
+            }
+            continue;
+        }
+
+        search->Previous[i] = search->Heads[chunks[i].Hash & mask];
+        search->Heads[chunks[i].Hash & mask] = i;
+        i++;
+    }
+
+    return 0;
+}
+
+static int FindBackReferences(Context* context) {
+    uint32_t* refs = (uint32_t*)context->Output.Storage;
+    size_t outputCount = context->Output.Count;
+
+    // count chunks first so everything can be allocated at once
+    BackReferenceSearch search = { 0 };
+    for (size_t i = 0; i < outputCount; search.Count++) {
+        int64_t chunkTime;
+        i = NextChunk(context, refs, outputCount, i, &chunkTime);
+    }
+    if (search.Count < 2) {
+        return 0;
+    }
+
+    search.TableSize = 1;
+    while (search.TableSize < search.Count) search.TableSize <<= 1;
+
+    search.Chunks = (ChunkInfo*)malloc(search.Count * sizeof(ChunkInfo));
+    search.Previous = (uint32_t*)malloc(search.Count * sizeof(uint32_t));
+    search.Heads = (uint32_t*)malloc(search.TableSize * sizeof(uint32_t));
+    search.Sizes = (uint64_t*)malloc((search.Count + 1) * sizeof(uint64_t));
+    context->Allocations += 4;
+
+    int ret = OPBERR_BUFFER_ERROR;
+    if (search.Chunks != NULL && search.Previous != NULL && search.Heads != NULL && search.Sizes != NULL) {
+        CollectChunks(context, search.Chunks);
+        ret = ParseBackReferences(context, &search);
+    }
+
+    free(search.Chunks);
+    free(search.Previous);
+    free(search.Heads);
+    free(search.Sizes);
+
+    if (!ret && context->BackReferences.Count > 0) {
+        context->FormatFlags |= OPB_FLAG_BACKREF;
+    }
+    return ret;
+}
+
+// writes a back reference chunk and moves past the chunks it covers after its first, keeping the time of the last
+static int WriteBackReference(Context* context, uint32_t elapsed, const BackReference* backref,
+    const uint32_t* refs, size_t count, size_t* next, int64_t* chunkTime) {
+    uint8_t baseAddr = OPB_CMD_BACKREF;
+
+    WRITE_UINT7(context, elapsed);
+    WRITE_UINT7(context, 1);
+    WRITE_UINT7(context, 0);
+    WRITE(&baseAddr, sizeof(uint8_t), 1, context);
+    WRITE_UINT7(context, backref->Distance);
+    WRITE_UINT7(context, (backref->Length << 1) | backref->ExplicitTimes);
+
+    for (uint32_t i = 1; i < backref->Length; i++) {
+        int64_t lastTime = *chunkTime;
+        *next = NextChunk(context, refs, count, *next, chunkTime);
+        if (backref->ExplicitTimes) {
+            WRITE_UINT7(context, ElapsedUnits(context, *chunkTime, lastTime));
+        }
+    }
+
+    if (context->Stats != NULL) {
+        size_t headerSize = Uint7Size(elapsed) + 2;
+        context->Stats->ChunkHeaderBytes += headerSize;
+        context->Stats->ChunksReferenced += backref->Length;
+        OPB_CommandStats* kind = context->Stats->Commands + OPB_CommandKind_BackReference;
+        kind->Count++;
+        kind->Bytes += backref->Size - headerSize;
+    }
+    return 0;
+}
+
+// returns the back reference that starts at chunk, if any, and moves next past it
+static inline const BackReference* BackReferenceAt(Context* context, uint32_t chunk, size_t* next) {
+    if (*next >= context->BackReferences.Count) {
+        return NULL;
+    }
+    const BackReference* backref = (const BackReference*)context->BackReferences.Storage + *next;
+    if (backref->Chunk != chunk) {
+        return NULL;
+    }
+    (*next)++;
+    return backref;
+}
+
+// delta frequency commands
+// pitch slides and vibrato write a channel's frequency over and over with values only a few units apart. by the time
+// the output is sorted it's in the order the decoder reads it, so the frequency and note registers of every channel
+// can be followed along it and each write compared to the value before it. deltas are only chosen once back
+// references are found, because the same deltas from a different frequency write different values. chunks that back
+// references stand in for still write what their replay does, so they're followed like any other
+#define DELTA_MIN -64
+#define DELTA_MAX 63
+
+// the block and frequency of a channel as one 13-bit value, which is what deltas are added to
+static inline int FrequencyValue(uint8_t frequency, uint8_t note) {
+    return ((note & 0b00011111) << 8) | frequency;
+}
+
+// follows the frequency and note writes of a play instrument command, for the channel in its mask or every channel of
+// its group
+static void FollowPlayedNotes(const OpbData* data, uint8_t* registers) {
+    int pos = ChannelMaskPosition(data);
+    int channelMask = data->Args[pos];
+    int levels = ((channelMask >> 5) & 1) + ((channelMask >> 6) & 1);
+    pos += 2;
+
+    int first = channelMask & 0b00011111;
+    uint32_t channels = 1;
+    if (first == GROUP_CHANNEL) {
+        first = (data->Addr & 0x100) ? NUM_CHANNELS / 2 : 0;
+        channels = data->Args[pos++];
+        if (channels >= 128) {
+            channels = (channels & 0x7F) | ((uint32_t)data->Args[pos++] << 7);
+        }
+    }
+
+    for (; channels != 0; channels &= channels - 1) {
+        const uint16_t* regs = ChannelSlotRegisters[first + CountTrailingZeros(channels)];
+        registers[regs[SLOT_FREQUENCY]] = data->Args[pos];
+        registers[regs[SLOT_NOTE]] = data->Args[pos + 1];
+        pos += 2 + levels;
+    }
+}
+
+static void SetDeltaFrequency(OpbData* data, int freqReg, int delta, bool writeNote) {
+    data->Addr = (uint16_t)(freqReg - REG_FREQUENCY + OPB_CMD_DELTAFREQ);
+    data->Count = 0;
+    OpbData_WriteU8(data, (writeNote ? 0x80 : 0) | (delta & 0x7F));
+}
+
+// replaces frequency writes and note commands that only move a channel's frequency by a little with delta frequency
+// commands. a frequency write is written as large either way, but its small deltas repeat in slides where the
+// values themselves don't, which the compressed format codes in fewer bits
+static int EncodeDeltaFrequencies(Context* context) {
+    CommandStream* stream = &context->CommandStream;
+
+    // the commands take the place of registers the OPL3 doesn't have, which some captures still write to
+    for (size_t i = 0; i < stream->Count; i++) {
+        if (IsDeltaCommand(stream->Addr[i] & 0xFF, OPB_FLAG_DELTAFREQ)) {
+            Log("Register 0x%03X is written to, so delta frequency commands aren't used\n", stream->Addr[i]);
+            return 0;
+        }
+    }
+
+    uint8_t registers[0x200] = { 0 };
+    uint32_t* refs = (uint32_t*)context->Output.Storage;
+
+    for (size_t i = 0; i < context->Output.Count; i++) {
+        uint32_t ref = refs[i];
+
+        if (!(ref & COMMAND_REF_DATA)) {
+            int addr = stream->Addr[ref] & 0x1FF;
+            uint8_t value = stream->Data[ref];
+            int baseAddr = addr & 0xFF;
+
+            if (baseAddr >= REG_FREQUENCY && baseAddr <= REG_FREQUENCY + 8) {
+                int delta = (int8_t)(value - registers[addr]);
+                if (delta >= DELTA_MIN && delta <= DELTA_MAX) {
+                    OpbData data = { 0 };
+                    SetDeltaFrequency(&data, addr, delta, false);
+                    data.Order = ref;
+
+                    refs[i] = (uint32_t)context->DataMap.Count | COMMAND_REF_DATA;
+                    if (Vector_Add(&context->DataMap, &data)) return OPBERR_BUFFER_ERROR;
+                    context->FormatFlags |= OPB_FLAG_DELTAFREQ;
+                }
+            }
+            registers[addr] = value;
+            continue;
+        }
+
+        OpbData* data = Vector_GetT(OpbData, &context->DataMap, COMMAND_REF_INDEX(ref));
+        int baseAddr = data->Addr & 0xFF;
+
+        if (baseAddr >= OPB_CMD_NOTEON && baseAddr <= OPB_CMD_NOTEON + 8) {
+            // the delta command keeps the upper bits of the note register, so only notes without levels that keep
+            // the key bit as it is can be replaced
+            int freqReg = data->Addr - (OPB_CMD_NOTEON - REG_FREQUENCY);
+            int noteReg = freqReg + (REG_NOTE - REG_FREQUENCY);
+            uint8_t frequency = data->Args[0];
+            uint8_t note = data->Args[1];
+            int delta = FrequencyValue(frequency, note) - FrequencyValue(registers[freqReg], registers[noteReg]);
+
+            if ((note & 0b11000000) == 0 && delta >= DELTA_MIN && delta <= DELTA_MAX &&
+                ((registers[noteReg] & 0b11100000) | (note & 0b00011111)) == note) {
+                SetDeltaFrequency(data, freqReg, delta, true);
+                context->FormatFlags |= OPB_FLAG_DELTAFREQ;
+            }
+            registers[freqReg] = frequency;
+            registers[noteReg] = note & 0b00111111;
+        }
+        else if (IsPlayCommand(baseAddr)) {
+            FollowPlayedNotes(data, registers);
+        }
+    }
+
+    return 0;
+}
+
+typedef struct MemoryWriter {
+    uint8_t* Buffer;
+    size_t Size;
+    size_t Position;
+} MemoryWriter;
+
+static size_t WriteToMemory(const void* buffer, size_t elementSize, size_t elementCount, void* context) {
+    MemoryWriter* writer = (MemoryWriter*)context;
+    size_t size = elementSize * elementCount;
+
+    if (size > writer->Size - writer->Position) {
+        return 0;
+    }
+
+    memcpy(writer->Buffer + writer->Position, buffer, size);
+    writer->Position += size;
+    return elementCount;
+}
+
+// computes the exact size in bytes of the analyzed chunks and how many of them there are
+static size_t MeasureChunks(Context* context, uint32_t* chunkCount) {
+    size_t size = 0;
+    *chunkCount = 0;
+
+    int64_t lastTime = 0;
+    size_t i = 0;
+    size_t count = context->Output.Count;
+    uint32_t* refs = (uint32_t*)context->Output.Storage;
+    uint32_t chunk = 0;
+    size_t nextBackref = 0;
+
+    while (i < count) {
+        int64_t chunkTime;
+        size_t start = i;
+        i = NextChunk(context, refs, count, start, &chunkTime);
+
+        const BackReference* backref = BackReferenceAt(context, chunk, &nextBackref);
+        if (backref != NULL) {
+            size += backref->Size;
+            for (uint32_t j = 1; j < backref->Length; j++) {
+                i = NextChunk(context, refs, count, i, &chunkTime);
+            }
+            chunk += backref->Length;
+        }
+        else {
+            int loCount, hiCount;
+            size += CountChunk(context, refs + start, (int)(i - start), &loCount, &hiCount);
+            size += Uint7Size(ElapsedUnits(context, chunkTime, lastTime)) + Uint7Size(loCount) + Uint7Size(hiCount);
+            chunk++;
+        }
+        (*chunkCount)++;
+
+        lastTime = chunkTime;
+    }
+
+    return size;
+}
+
+static int WriteChunks(Context* context) {
+    int64_t lastTime = 0;
+    size_t i = 0;
+    size_t count = context->Output.Count;
+    uint32_t* refs = (uint32_t*)context->Output.Storage;
+    uint32_t chunk = 0;
+    size_t nextBackref = 0;
+
+    while (i < count) {
+        int64_t chunkTime;
+        size_t start = i;
+        i = NextChunk(context, refs, count, start, &chunkTime);
+
+        int ret;
+        const BackReference* backref = BackReferenceAt(context, chunk, &nextBackref);
+        if (backref != NULL) {
+            ret = WriteBackReference(context, ElapsedUnits(context, chunkTime, lastTime), backref, refs, count, &i, &chunkTime);
+            chunk += backref->Length;
+        }
+        else {
+            ret = WriteChunk(context, ElapsedUnits(context, chunkTime, lastTime), refs + start, (int)(i - start));
+            chunk++;
+        }
+        if (ret) return ret;
+
+        lastTime = chunkTime;
+    }
+
+    return 0;
+}
+
+// entropy encoder
+// huffman code lengths limited to ENTROPY_MAX_CODE_LENGTH. the tree is built by repeatedly merging the two lightest
+// nodes, which is quick enough for 256 symbols, and lengths past the limit are then evened out the way zlib does
+static void BuildCodeLengths(const uint32_t* counts, uint8_t* lengths) {
+    uint64_t weights[512];
+    int16_t parents[512];
+    uint8_t symbols[256];
+    int leafCount = 0;
+
+    memset(lengths, 0, 256);
+    for (int i = 0; i < 256; i++) {
+        if (counts[i] > 0) {
+            symbols[leafCount] = (uint8_t)i;
+            weights[leafCount++] = counts[i];
+        }
+    }
+    if (leafCount <= 1) {
+        // a lone symbol still needs a code so the decoder can tell it apart from the end of the data
+        if (leafCount == 1) lengths[symbols[0]] = 1;
+        return;
+    }
+
+    // leaves sorted by ascending count, so the lightest get the longest codes when lengths are handed out
+    for (int i = 1; i < leafCount; i++) {
+        for (int j = i; j > 0 && weights[j] < weights[j - 1]; j--) {
+            uint64_t weight = weights[j]; weights[j] = weights[j - 1]; weights[j - 1] = weight;
+            uint8_t symbol = symbols[j]; symbols[j] = symbols[j - 1]; symbols[j - 1] = symbol;
+        }
+    }
+
+    int nodeCount = leafCount;
+    bool merged[512] = { false };
+    for (int i = 0; i < leafCount - 1; i++) {
+        int lightest[2] = { -1, -1 };
+        for (int j = 0; j < nodeCount; j++) {
+            if (merged[j]) continue;
+            if (lightest[0] < 0 || weights[j] < weights[lightest[0]]) {
+                lightest[1] = lightest[0];
+                lightest[0] = j;
+            }
+            else if (lightest[1] < 0 || weights[j] < weights[lightest[1]]) {
+                lightest[1] = j;
+            }
+        }
+        merged[lightest[0]] = merged[lightest[1]] = true;
+        parents[lightest[0]] = parents[lightest[1]] = (int16_t)nodeCount;
+        weights[nodeCount++] = weights[lightest[0]] + weights[lightest[1]];
+    }
+
+    uint32_t lengthCounts[ENTROPY_MAX_CODE_LENGTH + 1] = { 0 };
+    for (int i = 0; i < leafCount; i++) {
+        int depth = 0;
+        for (int node = i; node != nodeCount - 1; node = parents[node]) depth++;
+        lengthCounts[depth < ENTROPY_MAX_CODE_LENGTH ? depth : ENTROPY_MAX_CODE_LENGTH]++;
+    }
+
+    // clamping overfills the code space, so codes are moved down a level until everything fits again
+    uint32_t used = 0;
+    for (int i = 1; i <= ENTROPY_MAX_CODE_LENGTH; i++) {
+        used += lengthCounts[i] << (ENTROPY_MAX_CODE_LENGTH - i);
+    }
+    while (used > ENTROPY_LOOKUP_SIZE) {
+        lengthCounts[ENTROPY_MAX_CODE_LENGTH]--;
+        for (int i = ENTROPY_MAX_CODE_LENGTH - 1; i > 0; i--) {
+            if (lengthCounts[i] > 0) {
+                lengthCounts[i]--;
+                lengthCounts[i + 1] += 2;
+                break;
+            }
+        }
+        used--;
+    }
+
+    int leaf = 0;
+    for (int length = ENTROPY_MAX_CODE_LENGTH; length > 0; length--) {
+        for (uint32_t i = 0; i < lengthCounts[length]; i++) {
+            lengths[symbols[leaf++]] = (uint8_t)length;
+        }
+    }
+}
+
+#define ENTROPY_WRITEBUFFER_SIZE 4096
+
+// reads the default format chunks for WalkEntropyChunks, and when emitting writes each byte's code
+typedef struct EntropyCursor {
+    EntropyEncoder* Encoder;
+    const uint8_t* Next;
+    const uint8_t* End;
+    Context* Context;
+    uint64_t Bits;
+    int BitCount;
+    size_t Position;
+    uint8_t Buffer[ENTROPY_WRITEBUFFER_SIZE];
+} EntropyCursor;
+
+static int CountEntropyByte(void* state, int model) {
+    EntropyCursor* cursor = (EntropyCursor*)state;
+    if (cursor->Next == cursor->End) return -1;
+
+    uint8_t value = *cursor->Next++;
+    cursor->Encoder->Counts[model][value]++;
+    return value;
+}
+
+static bool FlushEntropyBuffer(EntropyCursor* cursor) {
+    Context* context = cursor->Context;
+    bool written = context->Write(cursor->Buffer, sizeof(uint8_t), cursor->Position, context->UserData) == cursor->Position;
+    cursor->Position = 0;
+    return written;
+}
+
+static int EmitEntropyByte(void* state, int model) {
+    EntropyCursor* cursor = (EntropyCursor*)state;
+    if (cursor->Next == cursor->End) return -1;
+
+    uint8_t value = *cursor->Next++;
+    cursor->Bits |= (uint64_t)cursor->Encoder->Codes[model][value] << cursor->BitCount;
+    cursor->BitCount += cursor->Encoder->Lengths[model][value];
+
+    while (cursor->BitCount >= 8) {
+        cursor->Buffer[cursor->Position++] = (uint8_t)cursor->Bits;
+        cursor->Bits >>= 8;
+        cursor->BitCount -= 8;
+        if (cursor->Position == ENTROPY_WRITEBUFFER_SIZE && !FlushEntropyBuffer(cursor)) return -1;
+    }
+    return value;
+}
+
+// writes the chunks to memory as the default format would, then counts their bytes per model and builds codes
+static int CompressChunks(Context* context) {
+    EntropyEncoder* encoder = (EntropyEncoder*)calloc(1, sizeof(EntropyEncoder));
+    if (encoder == NULL) {
+        return OPBERR_BUFFER_ERROR;
+    }
+    context->EntropyEncoder = encoder;
+    context->Allocations++;
+
+    OPB_EncodeStats* stats = context->Stats;
+    double time = stats != NULL ? GetClock() : 0;
+
+    encoder->ChunksSize = MeasureChunks(context, &encoder->ChunkCount);
+    encoder->Chunks = (uint8_t*)malloc(encoder->ChunksSize > 0 ? encoder->ChunksSize : 1);
+    if (encoder->Chunks == NULL) {
+        return OPBERR_BUFFER_ERROR;
+    }
+    context->Allocations++;
+
+    // the regular chunk writer also fills in the chunk and command statistics
+    Log("Writing chunks\n");
+    OPB_StreamWriter write = context->Write;
+    void* userData = context->UserData;
+    MemoryWriter writer = { encoder->Chunks, encoder->ChunksSize, 0 };
+    context->Write = WriteToMemory;
+    context->UserData = &writer;
+
+    int ret = WriteChunks(context);
+
+    context->Write = write;
+    context->UserData = userData;
+    if (ret) return ret;
+
+    if (stats != NULL) {
+        stats->ChunkTime = GetClock() - time;
+        time = GetClock();
+    }
+
+    Log("Building entropy codes\n");
+    EntropyCursor* cursor = (EntropyCursor*)malloc(sizeof(EntropyCursor));
+    if (cursor == NULL) {
+        return OPBERR_BUFFER_ERROR;
+    }
+    context->Allocations++;
+
+    cursor->Encoder = encoder;
+    cursor->Next = encoder->Chunks;
+    cursor->End = encoder->Chunks + encoder->ChunksSize;
+    bool walked = WalkEntropyChunks(encoder->ChunkCount, context->FormatFlags, CountEntropyByte, cursor) &&
+        cursor->Next == cursor->End;
+    free(cursor);
+
+    if (!walked) {
+        Log("Unexpected error while counting the bytes of %zu bytes of chunks\n", encoder->ChunksSize);
+        return OPBERR_LOGGED;
+    }
+
+    encoder->Bits = 0;
+    for (int model = 0; model < ENTROPY_MODELS; model++) {
+        BuildCodeLengths(encoder->Counts[model], encoder->Lengths[model]);
+        CanonicalCodes(encoder->Lengths[model], encoder->Codes[model]);
+        for (int i = 0; i < 256; i++) {
+            encoder->Bits += (uint64_t)encoder->Counts[model][i] * encoder->Lengths[model][i];
+        }
+    }
+
+    if (stats != NULL) {
+        stats->EntropyTime = GetClock() - time;
+        stats->EntropyBytes = ENTROPY_TABLE_SIZE + (size_t)((encoder->Bits + 7) / 8);
+    }
+    return 0;
+}
+
+// writes the code lengths and then the code of every chunk byte
+static int WriteEntropyChunks(Context* context) {
+    EntropyEncoder* encoder = context->EntropyEncoder;
+
+    uint8_t table[ENTROPY_TABLE_SIZE];
+    for (int model = 0; model < ENTROPY_MODELS; model++) {
+        for (int i = 0; i < ENTROPY_LENGTHS_SIZE; i++) {
+            table[model * ENTROPY_LENGTHS_SIZE + i] = encoder->Lengths[model][i * 2] | (encoder->Lengths[model][i * 2 + 1] << 4);
+        }
+    }
+    WRITE(table, sizeof(uint8_t), ENTROPY_TABLE_SIZE, context);
+
+    EntropyCursor* cursor = (EntropyCursor*)calloc(1, sizeof(EntropyCursor));
+    if (cursor == NULL) {
+        return OPBERR_BUFFER_ERROR;
+    }
+    context->Allocations++;
+
+    cursor->Encoder = encoder;
+    cursor->Next = encoder->Chunks;
+    cursor->End = encoder->Chunks + encoder->ChunksSize;
+    cursor->Context = context;
+
+    bool written = WalkEntropyChunks(encoder->ChunkCount, context->FormatFlags, EmitEntropyByte, cursor);
+    if (written && cursor->BitCount > 0) {
+        cursor->Buffer[cursor->Position++] = (uint8_t)cursor->Bits;
+    }
+    written = written && FlushEntropyBuffer(cursor);
+    free(cursor);
+
+    if (!written) {
+        Log("OPB write error occurred in '%s' at line %d\n", GetSourceFilename(), __LINE__);
+        return OPBERR_WRITE_ERROR;
+    }
+    return 0;
+}
+
+// puts the dictionary's instruments at the start of the instrument table, so the encoder matches against them
+// before it creates instruments of its own
+static int UseDictionary(Context* context) {
+    uint32_t count = DictionaryCount(context->Dictionary);
+    if (count == 0) {
+        return 0;
+    }
+
+    if (Vector_Reserve(&context->Instruments, count) ||
+        Vector_AddRange(&context->Instruments, context->Dictionary->Instruments.Storage, count)) {
+        return OPBERR_BUFFER_ERROR;
+    }
+    context->FormatFlags |= OPB_FLAG_DICTIONARY;
+    context->SharedInstruments = count;
+    return 0;
+}
+
+// moves writes that follow the first write of an event by at most the coalescing window to its time. every event
+// is measured from its own first write, so a steady stream of writes never chains into one long chunk. the
+// received order doesn't change, only times do
+static void CoalesceTimes(Context* context) {
+    CommandStream* stream = &context->CommandStream;
+    int64_t window = context->CoalesceWindow;
+    size_t moved = 0;
+
+    int64_t eventTime = stream->Count > 0 ? stream->Time[0] : 0;
+    for (size_t i = 1; i < stream->Count; i++) {
+        int64_t time = stream->Time[i];
+        if (time > eventTime && time - eventTime <= window) {
+            stream->Time[i] = eventTime;
+            moved++;
+        }
+        else if (time != eventTime) {
+            eventTime = time;
+        }
+    }
+
+    if (context->Stats != NULL) {
+        context->Stats->CommandsCoalesced = moved;
+    }
+}
+
+// turns the command stream into instruments and OPB commands, sorted back into received order
+static int AnalyzeOpb(Context* context) {
+    if (context->Format < OPB_Format_Default || context->Format > OPB_Format_Compressed) {
+        context->Format = OPB_Format_Default;
+    }
+
+    if (context->Format == OPB_Format_Raw) {
+        return 0;
+    }
+
+    if (context->TimeBase > TICKS_PER_SECOND) {
+        Log("Time base of %u units per second is finer than the encoder's %d\n", context->TimeBase, TICKS_PER_SECOND);
+        return OPBERR_LOGGED;
+    }
+    if (context->TimeBase != OPB_TIMEBASE_MS) {
+        context->FormatFlags |= OPB_FLAG_TIMEBASE;
+    }
+    if (context->CoalesceWindow > 0) {
+        CoalesceTimes(context);
+    }
+
+    int ret = UseDictionary(context);
+    if (ret) return ret;
+
+    OPB_EncodeStats* stats = context->Stats;
+    double time = stats != NULL ? GetClock() : 0;
+
+    // separate command stream into tracks
+    Log("Separating OPL data stream into channels\n");
+    ret = SeparateTracks(context);
+    if (ret) return ret;
+
+    if (stats != NULL) {
+        stats->SeparateTime = GetClock() - time;
+    }
+
+    // processing never produces more commands than it receives
+    if (Vector_Reserve(&context->Output, context->CommandStream.Count)) {
+        return OPBERR_BUFFER_ERROR;
+    }
+
+    if (context->InstrumentEffort >= EFFORT_FIRST_FIT) {
+        Log("Choosing instruments\n");
+        if (stats != NULL) time = GetClock();
+
+        ret = OptimizeInstruments(context, context->InstrumentEffort);
+
+        if (stats != NULL) stats->OptimizeTime = GetClock() - time;
+        if (ret) return ret;
+    }
+
+    // process each track into the output stream
+    for (int i = 0; i < NUM_TRACKS; i++) {
+        Log("Processing channel %d\n", i);
+
+        if (stats != NULL) time = GetClock();
+
+        ret = ProcessTrack(context, i);
+        if (ret) return ret;
+
+        Vector_Free(&context->Tracks[i]);
+
+        if (stats != NULL) stats->ProcessTime[i] = GetClock() - time;
+    }
+    Vector_Free(&context->Range);
+
+    if (context->UseGroupCommands) {
+        Log("Grouping instrument commands across channels\n");
+        if (stats != NULL) time = GetClock();
+
+        GroupInstruments(context);
+
+        if (stats != NULL) stats->GroupTime = GetClock() - time;
+    }
+
+    // sort by received order
+    Log("Combining processed data into linear stream\n");
+    if (stats != NULL) time = GetClock();
+
+    ret = SortOutput(context);
+
+    if (stats != NULL) stats->SortTime = GetClock() - time;
+    if (ret) return ret;
+
+    if (context->UseBackReferences) {
+        Log("Finding repeated chunks\n");
+        if (stats != NULL) time = GetClock();
+
+        ret = FindBackReferences(context);
+
+        if (stats != NULL) stats->BackReferenceTime = GetClock() - time;
+        if (ret) return ret;
+    }
+
+    if (context->UseDeltaFrequencies) {
+        Log("Replacing frequency changes with deltas\n");
+        if (stats != NULL) time = GetClock();
+
+        ret = EncodeDeltaFrequencies(context);
+
+        if (stats != NULL) stats->DeltaTime = GetClock() - time;
+        if (ret) return ret;
+    }
+
+    return context->Format == OPB_Format_Compressed ? CompressChunks(context) : 0;
+}
+
+// raw format records store elapsed time as a uint16, longer gaps are either split up with delay records or wrap
+#define RAW_MAX_ELAPSED 0xFFFF
+#define RAW_WRITEBUFFER_SIZE (4096 * RAW_ENTRY_SIZE)
+
+static inline int64_t RawElapsedMs(const CommandStream* stream, size_t index, int64_t lastTime) {
+    return (stream->Time[index] - lastTime) / TICKS_PER_MS;
+}
+
+// number of delay records needed in front of a record that comes elapsed milliseconds after the one before it
+static inline int64_t RawDelayCount(int64_t elapsed) {
+    return elapsed > RAW_MAX_ELAPSED ? (elapsed - 1) / RAW_MAX_ELAPSED : 0;
+}
+
+static size_t CountRawDelays(Context* context) {
+    if (!context->RawDelayRecords) {
+        return 0;
+    }
+
+    CommandStream* stream = &context->CommandStream;
+    size_t count = 0;
+    int64_t lastTime = 0;
+    for (size_t i = 0; i < stream->Count; i++) {
+        count += (size_t)RawDelayCount(RawElapsedMs(stream, i, lastTime));
+        lastTime = stream->Time[i];
+    }
+    return count;
+}
+
+static inline void PutRawRecord(uint8_t* p, uint16_t elapsed, uint16_t addr, uint8_t data) {
+    p[0] = (uint8_t)(elapsed >> 8);
+    p[1] = (uint8_t)elapsed;
+    p[2] = (uint8_t)(addr >> 8);
+    p[3] = (uint8_t)addr;
+    p[4] = data;
+}
+
+static int FlushRawBuffer(Context* context, const uint8_t* buffer, size_t* position) {
+    if (*position > 0 && context->Write(buffer, sizeof(uint8_t), *position, context->UserData) != *position) {
+        Log("OPB write error occurred in '%s' at line %d\n", GetSourceFilename(), __LINE__);
+        return OPBERR_WRITE_ERROR;
+    }
+    *position = 0;
+    return 0;
+}
+
+// records are serialized into a staging buffer which is handed to the writer in large blocks
+static int WriteOpbRaw(Context* context) {
+    CommandStream* stream = &context->CommandStream;
+    uint8_t* buffer = (uint8_t*)malloc(RAW_WRITEBUFFER_SIZE);
+    if (buffer == NULL) {
+        return OPBERR_BUFFER_ERROR;
+    }
+    context->Allocations++;
+
+    size_t position = 0;
+    size_t wrapped = 0;
+    int64_t lastTime = 0;
+    int ret = 0;
+
+    for (size_t i = 0; i < stream->Count; i++) {
+        int64_t elapsed = RawElapsedMs(stream, i, lastTime);
+        lastTime = stream->Time[i];
+
+        if (elapsed > RAW_MAX_ELAPSED) {
+            if (!context->RawDelayRecords) {
+                wrapped++;
+            }
+            else {
+                for (int64_t n = RawDelayCount(elapsed); n > 0; n--, elapsed -= RAW_MAX_ELAPSED) {
+                    if (position + RAW_ENTRY_SIZE > RAW_WRITEBUFFER_SIZE && (ret = FlushRawBuffer(context, buffer, &position))) break;
+                    PutRawRecord(buffer + position, RAW_MAX_ELAPSED, OPB_RAW_DELAY_ADDR, 0);
+                    position += RAW_ENTRY_SIZE;
+                }
+                if (ret) break;
+            }
+        }
+
+        if (position + RAW_ENTRY_SIZE > RAW_WRITEBUFFER_SIZE && (ret = FlushRawBuffer(context, buffer, &position))) break;
+        PutRawRecord(buffer + position, (uint16_t)elapsed, stream->Addr[i], stream->Data[i]);
+        position += RAW_ENTRY_SIZE;
+    }
+
+    if (!ret) {
+        ret = FlushRawBuffer(context, buffer, &position);
+    }
+    free(buffer);
+
+    if (wrapped > 0) {
+        Log("%zu gaps of over %d ms wrapped around in raw output, set RawDelayRecords in OPB_EncodeOptions to keep them\n",
+            wrapped, RAW_MAX_ELAPSED);
+    }
+
+    if (context->Stats != NULL) {
+        context->Stats->Commands[OPB_CommandKind_Plain].Count = stream->Count;
+        context->Stats->Commands[OPB_CommandKind_Plain].Bytes = stream->Count * RAW_ENTRY_SIZE;
+    }
+    return ret;
+}
+
+// computes the exact size in bytes of the analyzed OPB data and how many chunks it holds
+static size_t MeasureOpb(Context* context, uint32_t* chunkCount) {
+    size_t size = OPB_HEADER_SIZE + 1;
+    *chunkCount = 0;
+
+    if (context->Format == OPB_Format_Raw) {
+        return size + (context->CommandStream.Count + CountRawDelays(context)) * RAW_ENTRY_SIZE;
+    }
+
+    double time = context->Stats != NULL ? GetClock() : 0;
+
+    size += OpbHeaderSize(OpbVersion(context->FormatFlags), context->FormatFlags) +
+        (context->Instruments.Count - context->SharedInstruments) * INSTRUMENT_SIZE;
+
+    // compressed chunks were already written and coded during analysis
+    if (context->Format == OPB_Format_Compressed) {
+        *chunkCount = context->EntropyEncoder->ChunkCount;
+        size += ENTROPY_TABLE_SIZE + (size_t)((context->EntropyEncoder->Bits + 7) / 8);
+    }
+    else {
+        size += MeasureChunks(context, chunkCount);
+    }
+
+    if (context->Stats != NULL) {
+        context->Stats->MeasureTime = GetClock() - time;
+    }
+
+    return size;
+}
+
+// writes the analyzed OPB data front to back. because the header is known up front no seeking is needed
+static int WriteOpb(Context* context, size_t size, uint32_t chunkCount) {
+    char id[OPB_HEADER_SIZE];
+    memcpy(id, OPB_Header, OPB_HEADER_SIZE);
+    id[OPB_VERSION_INDEX] = OpbVersion(context->FormatFlags);
+    WRITE(id, sizeof(char), OPB_HEADER_SIZE, context);
+
+    Log("OPB format %d (%s)\n", context->Format, OPB_GetFormatName(context->Format));
+
+    uint8_t fmt = (uint8_t)context->Format;
+    WRITE(&fmt, sizeof(uint8_t), 1, context);
+
+    if (context->Format == OPB_Format_Raw) {
+        Log("Writing raw OPL data stream\n");
+        return WriteOpbRaw(context);
+    }
+
+    // write header
+    Log("Writing header\n");
+
+    uint32_t header[8];
+    size_t headerCount = 0;
+    header[headerCount++] = (uint32_t)size;
+    if (context->FormatFlags != 0) {
+        header[headerCount++] = context->FormatFlags;
+    }
+    header[headerCount++] = (uint32_t)(context->Instruments.Count - context->SharedInstruments);
+    header[headerCount++] = chunkCount;
+    if (context->FormatFlags & OPB_FLAG_DICTIONARY) {
+        header[headerCount++] = context->SharedInstruments;
+        header[headerCount++] = context->Dictionary->Id;
+    }
+    if (context->FormatFlags & OPB_FLAG_BACKREF) {
+        header[headerCount++] = context->BackReferenceWindow;
+    }
+    if (context->FormatFlags & OPB_FLAG_TIMEBASE) {
+        header[headerCount++] = context->TimeBase;
+    }
+
+    for (size_t i = 0; i < headerCount; i++) header[i] = FlipEndian32(header[i]);
+    WRITE(header, sizeof(uint32_t), headerCount, context);
+
+    // write instruments table, which leaves out the instruments that come from the dictionary
+    Log("Writing instrument table\n");
+    OPB_EncodeStats* stats = context->Stats;
+    double time = stats != NULL ? GetClock() : 0;
+
+    int ret;
+    for (int i = (int)context->SharedInstruments; i < context->Instruments.Count; i++) {
+        ret = WriteInstrument(context, Vector_GetT(Instrument, &context->Instruments, i));
+        if (ret) return ret;
+    }
+
+    if (stats != NULL) {
+        stats->InstrumentTime = GetClock() - time;
+        time = GetClock();
+    }
+
+    if (context->Format == OPB_Format_Compressed) {
+        Log("Writing entropy coded chunks\n");
+        ret = WriteEntropyChunks(context);
+        if (stats != NULL) stats->EntropyTime += GetClock() - time;
+        return ret;
+    }
+
+    // write chunks
+    Log("Writing chunks\n");
+    ret = WriteChunks(context);
+
+    if (stats != NULL) {
+        stats->ChunkTime = GetClock() - time;
+    }
+
+    return ret;
+}
+
+static size_t CountAllocations(Context* context) {
+    size_t count = context->Allocations + context->CommandStream.Allocations +
+        context->DataMap.Allocations + context->Instruments.Allocations + context->Output.Allocations + context->Range.Allocations +
+        context->Groups.Allocations + context->InstrumentRequests.Allocations;
+    for (int i = 0; i < NUM_TRACKS; i++) {
+        count += context->Tracks[i].Allocations;
+    }
+    return count;
+}
+
+// fills in the totals of the encoder statistics once the output has been written
+static void FinishStats(Context* context, size_t size, uint32_t chunkCount) {
+    OPB_EncodeStats* stats = context->Stats;
+    if (stats == NULL) {
+        return;
+    }
+
+    stats->InstrumentCount = context->Instruments.Count - context->SharedInstruments;
+    stats->InstrumentBytes = stats->InstrumentCount * INSTRUMENT_SIZE;
+    stats->ChunkCount = chunkCount;
+    stats->TotalBytes = size;
+    stats->Allocations = CountAllocations(context);
+    stats->TotalTime = GetClock() - context->StartTime;
+}
+
+static void SetEncodeOptions(Context* context, const OPB_EncodeOptions* options) {
+    context->Stats = options != NULL ? options->Stats : NULL;
+    context->RawDelayRecords = options != NULL && options->RawDelayRecords;
+    context->UseBackReferences = options != NULL && options->BackReferences;
+    context->UseVoiceCommands = options != NULL && options->VoiceCommands;
+    context->UseGroupCommands = options != NULL && options->GroupInstruments;
+    context->UseDeltaFrequencies = options != NULL && options->DeltaFrequencies;
+    context->InstrumentEffort = options != NULL ? options->InstrumentEffort : 0;
+    context->Dictionary = options != NULL ? options->Dictionary : NULL;
+    if (options != NULL && options->TimeBase != 0) {
+        context->TimeBase = options->TimeBase;
+    }
+    context->CoalesceWindow = options != NULL && options->CoalesceWindow > 0 ? SecondsToTicks(options->CoalesceWindow) : 0;
+    if (context->Stats != NULL) {
+        memset(context->Stats, 0, sizeof(OPB_EncodeStats));
+        context->StartTime = GetClock();
+    }
+}
+
+static int ConvertToOpb(Context* context) {
+    int ret = AnalyzeOpb(context);
+    if (ret) return ret;
+
+    uint32_t chunkCount;
+    size_t size = MeasureOpb(context, &chunkCount);
+
+    ret = WriteOpb(context, size, chunkCount);
+    if (ret) return ret;
+
+    FinishStats(context, size, chunkCount);
+    return 0;
+}
+
+static size_t WriteToFile(const void* buffer, size_t elementSize, size_t elementCount, void* context) {
+    return fwrite(buffer, elementSize, elementCount, (FILE*)context);
+}
+
+int OPB_OplToFile(OPB_Format format, OPB_Command* commandStream, size_t commandCount, const char* file) {
+    FILE* outFile;
+    if ((outFile = fopen(file, "wb")) == NULL) {
+        Log("Couldn't open file '%s' for writing\n", file);
+        return OPBERR_LOGGED;
+    }
+    int ret = OPB_OplToStream(format, commandStream, commandCount, WriteToFile, outFile);
+    if (fclose(outFile)) {
+        Log("Error while closing file '%s'\n", file);
+        return OPBERR_LOGGED;
+    }
+    return ret;
+}
+
+// adds a command from the source stream to the encoder's internal command stream
+static int AddSourceCommand(Context* context, uint16_t addr, uint8_t data, double time) {
+    if (IsSpecialCommand(addr) || addr == OPB_RAW_DELAY_ADDR) {
+        Log("Illegal register 0x%03X with value 0x%02X in command stream, ignored\n", addr, data);
+        return 0;
+    }
+
+    if (CommandStream_Add(&context->CommandStream, addr, data, SecondsToTicks(time))) return OPBERR_BUFFER_ERROR;
+    return 0;
+}
+
+// converts an OPL command stream to the encoder's internal format
+static int AddSourceCommands(Context* context, const OPB_Command* commandStream, size_t commandCount) {
+    if (CommandStream_Reserve(&context->CommandStream, commandCount)) return OPBERR_BUFFER_ERROR;
+    for (size_t i = 0; i < commandCount; i++) {
+        const OPB_Command* source = commandStream + i;
+        int ret = AddSourceCommand(context, source->Addr, source->Data, source->Time);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+int OPB_OplToBinary(OPB_Format format, OPB_Command* commandStream, size_t commandCount, OPB_StreamWriter write, OPB_StreamSeeker seek, OPB_StreamTeller tell, void* userData) {
+    return OPB_OplToStream(format, commandStream, commandCount, write, userData);
+}
+
+int OPB_OplToStream(OPB_Format format, OPB_Command* commandStream, size_t commandCount, OPB_StreamWriter write, void* userData) {
+    return OPB_OplToStreamEx(format, commandStream, commandCount, write, userData, NULL);
+}
+
+int OPB_OplToStreamEx(OPB_Format format, OPB_Command* commandStream, size_t commandCount, OPB_StreamWriter write, void* userData,
+    const OPB_EncodeOptions* options) {
+    Context context = Context_New();
+
+    context.Write = write;
+    context.UserData = userData;
+    context.Format = format;
+    SetEncodeOptions(&context, options);
+
+    int ret = AddSourceCommands(&context, commandStream, commandCount);
+    if (!ret) {
+        ret = ConvertToOpb(&context);
+    }
+    Context_Free(&context);
+
+    if (ret) {
+        Log("%s\n", OPB_GetErrorMessage(ret));
+    }
+
+    return ret;
+}
+
+int OPB_EstimateSize(OPB_Format format, OPB_Command* commandStream, size_t commandCount, size_t* size) {
+    Context context = Context_New();
+    context.Format = format;
+
+    uint32_t chunkCount;
+    int ret = AddSourceCommands(&context, commandStream, commandCount);
+    if (!ret) {
+        ret = AnalyzeOpb(&context);
+    }
+    if (!ret) {
+        *size = MeasureOpb(&context, &chunkCount);
+    }
+    Context_Free(&context);
+
+    if (ret) {
+        Log("%s\n", OPB_GetErrorMessage(ret));
+    }
+
+    return ret;
+}
+
+// analyzes the context's command stream and writes it to buffer, or to a newly allocated buffer if buffer is NULL
+static int ConvertToMemory(Context* context, uint8_t** buffer, size_t bufferSize, size_t* size) {
+    int ret = AnalyzeOpb(context);
+    if (ret) return ret;
+
+    uint32_t chunkCount;
+    size_t opbSize = MeasureOpb(context, &chunkCount);
+
+    MemoryWriter writer = { *buffer, bufferSize, 0 };
+    if (writer.Buffer == NULL) {
+        writer.Buffer = (uint8_t*)malloc(opbSize);
+        writer.Size = opbSize;
+        if (writer.Buffer == NULL) {
+            return OPBERR_BUFFER_ERROR;
+        }
+        context->Allocations++;
+    }
+    else if (bufferSize < opbSize) {
+        Log("Buffer of %zu bytes is too small for %zu bytes of OPB data\n", bufferSize, opbSize);
+        return OPBERR_LOGGED;
+    }
+
+    context->Write = WriteToMemory;
+    context->UserData = &writer;
+
+    ret = WriteOpb(context, opbSize, chunkCount);
+    if (!ret && writer.Position != opbSize) {
+        Log("Unexpected write error. Wrote %zu bytes of OPB data but expected %zu\n", writer.Position, opbSize);
+        ret = OPBERR_LOGGED;
+    }
+
+    if (ret) {
+        if (*buffer == NULL) {
+            free(writer.Buffer);
+        }
+        return ret;
+    }
+
+    *buffer = writer.Buffer;
+    *size = opbSize;
+    FinishStats(context, opbSize, chunkCount);
+    return 0;
+}
+
+int OPB_OplToMemory(OPB_Format format, OPB_Command* commandStream, size_t commandCount, void** buffer, size_t* size) {
+    return OPB_OplToMemoryEx(format, commandStream, commandCount, buffer, size, NULL);
+}
+
+int OPB_OplToMemoryEx(OPB_Format format, OPB_Command* commandStream, size_t commandCount, void** buffer, size_t* size,
+    const OPB_EncodeOptions* options) {
+    Context context = Context_New();
+    context.Format = format;
+    SetEncodeOptions(&context, options);
+
+    uint8_t* result = NULL;
+    int ret = AddSourceCommands(&context, commandStream, commandCount);
+    if (!ret) {
+        ret = ConvertToMemory(&context, &result, 0, size);
+    }
+    Context_Free(&context);
+
+    if (ret) {
+        Log("%s\n", OPB_GetErrorMessage(ret));
+    }
+    else {
+        *buffer = result;
+    }
+
+    return ret;
+}
+
+int OPB_OplToBuffer(OPB_Format format, OPB_Command* commandStream, size_t commandCount, void* buffer, size_t bufferSize, size_t* size) {
+    Context context = Context_New();
+    context.Format = format;
+
+    uint8_t* result = (uint8_t*)buffer;
+    int ret = AddSourceCommands(&context, commandStream, commandCount);
+    if (!ret) {
+        ret = result != NULL ? ConvertToMemory(&context, &result, bufferSize, size) : OPBERR_BUFFER_ERROR;
+    }
+    Context_Free(&context);
+
+    if (ret) {
+        Log("%s\n", OPB_GetErrorMessage(ret));
+    }
+
+    return ret;
+}
+
+// reads an entire file into a newly allocated buffer which must be freed by the caller
+static int ReadWholeFile(const char* file, uint8_t** buffer, size_t* size) {
+    FILE* inFile;
+    if ((inFile = fopen(file, "rb")) == NULL) {
+        Log("Couldn't open file '%s' for reading\n", file);
+        return OPBERR_LOGGED;
+    }
+
+    long length;
+    if (fseek(inFile, 0, SEEK_END) || (length = ftell(inFile)) < 0 || fseek(inFile, 0, SEEK_SET)) {
+        fclose(inFile);
+        Log("Couldn't determine size of file '%s'\n", file);
+        return OPBERR_LOGGED;
+    }
+
+    *size = (size_t)length;
+    *buffer = (uint8_t*)malloc(*size > 0 ? *size : 1);
+    if (*buffer == NULL) {
+        fclose(inFile);
+        Log("Out of memory reading file '%s'\n", file);
+        return OPBERR_LOGGED;
+    }
+
+    if (fread(*buffer, sizeof(uint8_t), *size, inFile) != *size) {
+        fclose(inFile);
+        free(*buffer);
+        *buffer = NULL;
+        Log("Couldn't read file '%s'\n", file);
+        return OPBERR_READ_ERROR;
+    }
+
+    fclose(inFile);
+    return 0;
+}
+
+static inline uint16_t ReadLE16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t ReadLE32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// minimal inflate (RFC 1951) implementation so VGZ files can be read without depending on zlib
+typedef struct InflateState {
+    const uint8_t* Src;
+    size_t SrcSize;
+    size_t SrcPos;
+    uint8_t* Dst;
+    size_t DstSize;
+    size_t DstPos;
+    size_t DstLimit;    // the output grows as it's written, up to this many bytes
+    uint32_t BitBuffer;
+    int BitCount;
+} InflateState;
+
+// makes room for len more bytes of output
+static int Inflate_Grow(InflateState* s, size_t len) {
+    if (len > s->DstLimit - s->DstPos) return -1;
+
+    size_t size = s->DstSize > s->DstLimit / 2 ? s->DstLimit : s->DstSize * 2;
+    if (size < s->DstPos + len) size = s->DstPos + len;
+
+    uint8_t* dst = (uint8_t*)realloc(s->Dst, size);
+    if (dst == NULL) return -1;
+    s->Dst = dst;
+    s->DstSize = size;
+    return 0;
+}
+
+#define INFLATE_MAX_BITS 15
+#define INFLATE_MAX_LCODES 286
+#define INFLATE_MAX_DCODES 30
+#define INFLATE_FIX_LCODES 288
+
+typedef struct HuffmanTable {
+    int16_t Counts[INFLATE_MAX_BITS + 1];
+    int16_t Symbols[INFLATE_FIX_LCODES];
+} HuffmanTable;
+
+static const uint16_t InflateLengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t InflateLengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t InflateDistBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t InflateDistExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// returns -1 if out of input, otherwise the next `need` bits
+static int Inflate_Bits(InflateState* s, int need) {
+    uint32_t value = s->BitBuffer;
+    while (s->BitCount < need) {
+        if (s->SrcPos >= s->SrcSize) return -1;
+        value |= (uint32_t)s->Src[s->SrcPos++] << s->BitCount;
+        s->BitCount += 8;
+    }
+    s->BitBuffer = value >> need;
+    s->BitCount -= need;
+    return (int)(value & ((1u << need) - 1));
+}
+
+static int Inflate_Build(HuffmanTable* table, const uint8_t* lengths, int count) {
+    int16_t offsets[INFLATE_MAX_BITS + 1];
+
+    memset(table->Counts, 0, sizeof(table->Counts));
+    for (int i = 0; i < count; i++) {
+        table->Counts[lengths[i]]++;
+    }
+
+    // check for an over-subscribed set of lengths
+    int left = 1;
+    for (int len = 1; len <= INFLATE_MAX_BITS; len++) {
+        left <<= 1;
+        left -= table->Counts[len];
+        if (left < 0) return -1;
+    }
+
+    offsets[1] = 0;
+    for (int len = 1; len < INFLATE_MAX_BITS; len++) {
+        offsets[len + 1] = offsets[len] + table->Counts[len];
+    }
+    for (int i = 0; i < count; i++) {
+        if (lengths[i] != 0) {
+            table->Symbols[offsets[lengths[i]]++] = (int16_t)i;
+        }
+    }
+
+    return 0;
+}
+
+// decodes a single symbol using a canonical huffman table, returns -1 on error
+static int Inflate_Decode(InflateState* s, const HuffmanTable* table) {
+    int code = 0, first = 0, index = 0;
+    for (int len = 1; len <= INFLATE_MAX_BITS; len++) {
+        int bit = Inflate_Bits(s, 1);
+        if (bit < 0) return -1;
+        code |= bit;
+        int count = table->Counts[len];
+        if (code - count < first) {
+            return table->Symbols[index + (code - first)];
+        }
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+static int Inflate_Codes(InflateState* s, const HuffmanTable* lencode, const HuffmanTable* distcode) {
+    int symbol;
+    do {
+        if ((symbol = Inflate_Decode(s, lencode)) < 0) return -1;
+
+        if (symbol < 256) {
+            if (s->DstPos == s->DstSize && Inflate_Grow(s, 1)) return -1;
+            s->Dst[s->DstPos++] = (uint8_t)symbol;
+        }
+        else if (symbol > 256) {
+            symbol -= 257;
+            if (symbol >= 29) return -1;
+
+            int extra = Inflate_Bits(s, InflateLengthExtra[symbol]);
+            if (extra < 0) return -1;
+            size_t len = InflateLengthBase[symbol] + extra;
+
+            if ((symbol = Inflate_Decode(s, distcode)) < 0 || symbol >= 30) return -1;
+            if ((extra = Inflate_Bits(s, InflateDistExtra[symbol])) < 0) return -1;
+            size_t dist = InflateDistBase[symbol] + extra;
+
+            if (dist > s->DstPos) return -1;
+            if (len > s->DstSize - s->DstPos && Inflate_Grow(s, len)) return -1;
+
+            uint8_t* dst = s->Dst + s->DstPos;
+            const uint8_t* src = dst - dist;
+            for (size_t i = 0; i < len; i++) {
+                dst[i] = src[i];
+            }
+            s->DstPos += len;
+        }
+    } while (symbol != 256);
+
+    return 0;
+}
+
+static int Inflate_Stored(InflateState* s) {
+    // discard leftover bits from current byte
+    s->BitBuffer = 0;
+    s->BitCount = 0;
+
+    if (s->SrcSize - s->SrcPos < 4) return -1;
+    size_t len = ReadLE16(s->Src + s->SrcPos);
+    size_t nlen = ReadLE16(s->Src + s->SrcPos + 2);
+    s->SrcPos += 4;
+
+    if (len != (~nlen & 0xFFFF)) return -1;
+    if (len > s->SrcSize - s->SrcPos) return -1;
+    if (len > s->DstSize - s->DstPos && Inflate_Grow(s, len)) return -1;
+
+    memcpy(s->Dst + s->DstPos, s->Src + s->SrcPos, len);
+    s->SrcPos += len;
+    s->DstPos += len;
+    return 0;
+}
+
+static int Inflate_Fixed(InflateState* s) {
+    HuffmanTable lencode, distcode;
+    uint8_t lengths[INFLATE_FIX_LCODES];
+
+    int i = 0;
+    for (; i < 144; i++) lengths[i] = 8;
+    for (; i < 256; i++) lengths[i] = 9;
+    for (; i < 280; i++) lengths[i] = 7;
+    for (; i < INFLATE_FIX_LCODES; i++) lengths[i] = 8;
+    Inflate_Build(&lencode, lengths, INFLATE_FIX_LCODES);
+
+    for (i = 0; i < INFLATE_MAX_DCODES; i++) lengths[i] = 5;
+    Inflate_Build(&distcode, lengths, INFLATE_MAX_DCODES);
+
+    return Inflate_Codes(s, &lencode, &distcode);
+}
+
+static int Inflate_Dynamic(InflateState* s) {
+    static const uint8_t order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    HuffmanTable lencode, distcode;
+    uint8_t lengths[INFLATE_MAX_LCODES + INFLATE_MAX_DCODES];
+
+    int nlen = Inflate_Bits(s, 5);
+    int ndist = Inflate_Bits(s, 5);
+    int ncode = Inflate_Bits(s, 4);
+    if (nlen < 0 || ndist < 0 || ncode < 0) return -1;
+    nlen += 257;
+    ndist += 1;
+    ncode += 4;
+    if (nlen > INFLATE_MAX_LCODES || ndist > INFLATE_MAX_DCODES) return -1;
+
+    // code length code lengths
+    int index = 0;
+    for (; index < ncode; index++) {
+        int len = Inflate_Bits(s, 3);
+        if (len < 0) return -1;
+        lengths[order[index]] = (uint8_t)len;
+    }
+    for (; index < 19; index++) {
+        lengths[order[index]] = 0;
+    }
+    if (Inflate_Build(&lencode, lengths, 19)) return -1;
+
+    // literal/length and distance code lengths
+    index = 0;
+    while (index < nlen + ndist) {
+        int symbol = Inflate_Decode(s, &lencode);
+        if (symbol < 0) return -1;
+
+        if (symbol < 16) {
+            lengths[index++] = (uint8_t)symbol;
+            continue;
+        }
+
+        int len = 0, repeat;
+        if (symbol == 16) {
+            if (index == 0) return -1;
+            len = lengths[index - 1];
+            repeat = Inflate_Bits(s, 2);
+            if (repeat < 0) return -1;
+            repeat += 3;
+        }
+        else if (symbol == 17) {
+            repeat = Inflate_Bits(s, 3);
+            if (repeat < 0) return -1;
+            repeat += 3;
+        }
+        else {
+            repeat = Inflate_Bits(s, 7);
+            if (repeat < 0) return -1;
+            repeat += 11;
+        }
+
+        if (index + repeat > nlen + ndist) return -1;
+        while (repeat--) {
+            lengths[index++] = (uint8_t)len;
+        }
+    }
+
+    // end of block code must be present
+    if (lengths[256] == 0) return -1;
+
+    if (Inflate_Build(&lencode, lengths, nlen)) return -1;
+    if (Inflate_Build(&distcode, lengths + nlen, ndist)) return -1;
+
+    return Inflate_Codes(s, &lencode, &distcode);
+}
+
+static int Inflate(InflateState* s) {
+    int last;
+    do {
+        last = Inflate_Bits(s, 1);
+        int type = Inflate_Bits(s, 2);
+        if (last < 0 || type < 0) return -1;
+
+        int ret;
+        switch (type) {
+        case 0: ret = Inflate_Stored(s); break;
+        case 1: ret = Inflate_Fixed(s); break;
+        case 2: ret = Inflate_Dynamic(s); break;
+        default: ret = -1; break;
+        }
+        if (ret) return ret;
+    } while (!last);
+
+    return 0;
+}
+
+#define GZIP_FHCRC 0x02
+#define GZIP_FEXTRA 0x04
+#define GZIP_FNAME 0x08
+#define GZIP_FCOMMENT 0x10
+
+static inline bool IsGzip(const uint8_t* data, size_t size) {
+    return size >= 18 && data[0] == 0x1F && data[1] == 0x8B;
+}
+
+// deflate can't expand data by more than about 1032 times, and no VGM file comes near the absolute limit. the
+// output starts out at a typical VGM compression ratio and grows from there
+#define INFLATE_START_RATIO 8
+#define INFLATE_MAX_RATIO 1032
+#define INFLATE_MAX_SIZE ((size_t)1 << 30)
+
+// decompresses gzip data into a single allocation. the size in the gzip trailer comes from the data, so it's only
+// used to check the result and to avoid growing the output past it
+static int Gunzip(const uint8_t* data, size_t size, uint8_t** out, size_t* outSize) {
+    if (!IsGzip(data, size) || data[2] != 8) {
+        Log("Error reading VGZ data: not a deflate compressed gzip stream\n");
+        return OPBERR_LOGGED;
+    }
+
+    uint8_t flags = data[3];
+    size_t pos = 10;
+
+    if (flags & GZIP_FEXTRA) {
+        pos += 2 + ReadLE16(data + pos);
+    }
+    if (flags & GZIP_FNAME) {
+        while (pos < size && data[pos] != 0) pos++;
+        pos++;
+    }
+    if (flags & GZIP_FCOMMENT) {
+        while (pos < size && data[pos] != 0) pos++;
+        pos++;
+    }
+    if (flags & GZIP_FHCRC) {
+        pos += 2;
+    }
+    if (pos > size - 8) {
+        Log("Error reading VGZ data: gzip header truncated\n");
+        return OPBERR_LOGGED;
+    }
+
+    // uncompressed size modulo 2^32 is stored in the last 4 bytes
+    uint32_t inflatedSize = ReadLE32(data + size - 4);
+
+    InflateState s = { 0 };
+    s.Src = data + pos;
+    s.SrcSize = size - 8 - pos;
+    s.DstLimit = s.SrcSize < INFLATE_MAX_SIZE / INFLATE_MAX_RATIO ? s.SrcSize * INFLATE_MAX_RATIO : INFLATE_MAX_SIZE;
+    s.DstSize = s.SrcSize < s.DstLimit / INFLATE_START_RATIO ? s.SrcSize * INFLATE_START_RATIO : s.DstLimit;
+    if (inflatedSize < s.DstSize) s.DstSize = inflatedSize;
+    if (s.DstSize == 0) s.DstSize = 1;
+    s.Dst = (uint8_t*)malloc(s.DstSize);
+    if (s.Dst == NULL) {
+        Log("Out of memory decompressing VGZ data\n");
+        return OPBERR_LOGGED;
+    }
+
+    if (Inflate(&s) || (uint32_t)s.DstPos != inflatedSize) {
+        free(s.Dst);
+        Log("Error reading VGZ data: corrupt deflate stream\n");
+        return OPBERR_LOGGED;
+    }
+
+    *out = s.Dst;
+    *outSize = s.DstPos;
+    return 0;
+}
+
+#define VGM_SAMPLE_RATE 44100.0
+#define VGM_MIN_VERSION 0x151 // YMF262 support was added in 1.51
+
+#define VGM_CMD_YM3812 0x5A
+#define VGM_CMD_YM3526 0x5B
+#define VGM_CMD_Y8950 0x5C
+#define VGM_CMD_YMF262_PORT0 0x5E
+#define VGM_CMD_YMF262_PORT1 0x5F
+#define VGM_CMD_WAIT 0x61
+#define VGM_CMD_WAIT60 0x62
+#define VGM_CMD_WAIT50 0x63
+#define VGM_CMD_END 0x66
+#define VGM_CMD_DATABLOCK 0x67
+#define VGM_CMD_PCMRAMWRITE 0x68
+
+// parses a VGM command stream straight into the encoder's command stream
+static int ParseVgm(Context* context, const uint8_t* data, size_t size) {
+    if (size < 0x40 || data[0] != 'V' || data[1] != 'g' || data[2] != 'm' || data[3] != ' ') {
+        Log("Error reading VGM data: not a VGM file\n");
+        return OPBERR_LOGGED;
+    }
+
+    size_t length = (size_t)ReadLE32(data + 0x04) + 0x04;
+    if (length > size) {
+        length = size;
+    }
+
+    uint32_t version = ReadLE32(data + 0x08);
+    if (version < VGM_MIN_VERSION) {
+        Log("Error reading VGM data: unsupported VGM version %X.%02X\n", version >> 8, version & 0xFF);
+        return OPBERR_LOGGED;
+    }
+
+    size_t dataOffset = ReadLE32(data + 0x34);
+    dataOffset = dataOffset == 0 ? 0x40 : dataOffset + 0x34;
+
+    // OPL chip clocks are only present if the header is long enough to include them
+    uint32_t clock = 0;
+    for (size_t offset = 0x50; offset <= 0x5C; offset += 4) {
+        if (offset + 4 <= dataOffset && offset + 4 <= length) {
+            clock |= ReadLE32(data + offset);
+        }
+    }
+    if (clock == 0) {
+        Log("Error reading VGM data: not an OPL compatible VGM file\n");
+        return OPBERR_LOGGED;
+    }
+
+    uint64_t samples = 0;
+    size_t pos = dataOffset;
+    bool end = false;
+
+    while (!end && pos < length) {
+        uint8_t cmd = data[pos++];
+        size_t skip = 0;
+
+        if (cmd >= 0x70 && cmd <= 0x7F) {
+            samples += (cmd & 0x0F) + 1;
+            continue;
+        }
+        if (cmd >= 0x80 && cmd <= 0x8F) {
+            // YM2612 DAC write with wait, only the wait is relevant
+            samples += cmd & 0x0F;
+            continue;
+        }
+
+        switch (cmd) {
+        case VGM_CMD_YM3812:
+        case VGM_CMD_YM3526:
+        case VGM_CMD_Y8950:
+        case VGM_CMD_YMF262_PORT0:
+        case VGM_CMD_YMF262_PORT1:
+            if (length - pos < 2) {
+                skip = 2;
+                break;
+            }
+            if (AddSourceCommand(context, (uint16_t)(data[pos] | (cmd == VGM_CMD_YMF262_PORT1 ? 0x100 : 0)), data[pos + 1], samples / VGM_SAMPLE_RATE)) {
+                return OPBERR_BUFFER_ERROR;
+            }
+            pos += 2;
+            break;
+
+        case VGM_CMD_WAIT:
+            if (length - pos < 2) {
+                skip = 2;
+                break;
+            }
+            samples += ReadLE16(data + pos);
+            pos += 2;
+            break;
+        case VGM_CMD_WAIT60:
+            samples += 735; // 1/60th of a second
+            break;
+        case VGM_CMD_WAIT50:
+            samples += 882; // 1/50th of a second
+            break;
+
+        case VGM_CMD_END:
+            end = true;
+            break;
+
+        // data blocks are used by the Y8950 chip but aren't OPL compatible so just skip em
+        case VGM_CMD_DATABLOCK:
+            skip = 6;
+            if (length - pos >= 6) {
+                skip += ReadLE32(data + pos + 2);
+            }
+            break;
+
+        case VGM_CMD_PCMRAMWRITE: skip = 11; break;
+        case 0x90: skip = 4; break; // DAC stream setup
+        case 0x91: skip = 4; break; // DAC stream set data
+        case 0x92: skip = 5; break; // DAC stream frequency
+        case 0x93: skip = 10; break; // DAC stream start
+        case 0x94: skip = 1; break; // DAC stream stop
+        case 0x95: skip = 4; break; // DAC stream start fast
+
+        default:
+            // commands for other chips (including a second OPL chip) are skipped based on their reserved sizes
+            if (cmd == 0x4F || cmd == 0x50 || (cmd >= 0x30 && cmd <= 0x3F)) {
+                skip = 1;
+            }
+            else if ((cmd >= 0x40 && cmd <= 0x5F) || (cmd >= 0xA0 && cmd <= 0xBF)) {
+                skip = 2;
+            }
+            else if (cmd >= 0xC0 && cmd <= 0xDF) {
+                skip = 3;
+            }
+            else if (cmd >= 0xE0) {
+                skip = 4;
+            }
+            else {
+                Log("Error reading VGM data: unsupported VGM command 0x%02X at offset 0x%X\n", cmd, (unsigned)(pos - 1));
+                return OPBERR_LOGGED;
+            }
+            break;
+        }
+
+        if (skip > 0) {
+            if (skip > length - pos) {
+                Log("Error reading VGM data: command 0x%02X at offset 0x%X is truncated\n", cmd, (unsigned)(pos - 1));
+                return OPBERR_LOGGED;
+            }
+            pos += skip;
+        }
+    }
+
+    return 0;
+}
+
+int OPB_VgmToBinary(OPB_Format format, const void* vgmData, size_t vgmSize,
+    OPB_StreamWriter write, OPB_StreamSeeker seek, OPB_StreamTeller tell, void* userData) {
+    return OPB_VgmToStreamEx(format, vgmData, vgmSize, write, userData, NULL);
+}
+
+int OPB_VgmToStreamEx(OPB_Format format, const void* vgmData, size_t vgmSize,
+    OPB_StreamWriter write, void* userData, const OPB_EncodeOptions* options) {
+    const uint8_t* data = (const uint8_t*)vgmData;
+    uint8_t* inflated = NULL;
+    int ret;
+
+    if (IsGzip(data, vgmSize)) {
+        size_t inflatedSize;
+        if ((ret = Gunzip(data, vgmSize, &inflated, &inflatedSize))) {
+            Log("%s\n", OPB_GetErrorMessage(ret));
+            return ret;
+        }
+        data = inflated;
+        vgmSize = inflatedSize;
+    }
+
+    Context context = Context_New();
+
+    context.Write = write;
+    context.UserData = userData;
+    context.Format = format;
+    SetEncodeOptions(&context, options);
+
+    // every OPL write takes at least 3 bytes, which gives an upper bound for the command count
+    ret = CommandStream_Reserve(&context.CommandStream, vgmSize / 3) ? OPBERR_BUFFER_ERROR : ParseVgm(&context, data, vgmSize);
+    if (inflated != NULL) {
+        free(inflated);
+    }
+
+    if (!ret) {
+        ret = ConvertToOpb(&context);
+    }
+    Context_Free(&context);
+
+    if (ret) {
+        Log("%s\n", OPB_GetErrorMessage(ret));
+    }
+
+    return ret;
+}
+
+int OPB_VgmFileToFile(OPB_Format format, const char* vgmFile, const char* opbFile) {
+    uint8_t* vgmData;
+    size_t vgmSize;
+    int ret = ReadWholeFile(vgmFile, &vgmData, &vgmSize);
+    if (ret) return ret;
+
+    FILE* outFile;
+    if ((outFile = fopen(opbFile, "wb")) == NULL) {
+        free(vgmData);
+        Log("Couldn't open file '%s' for writing\n", opbFile);
+        return OPBERR_LOGGED;
+    }
+
+    ret = OPB_VgmToBinary(format, vgmData, vgmSize, WriteToFile, NULL, NULL, outFile);
+    free(vgmData);
+
+    if (fclose(outFile)) {
+        Log("Error while closing file '%s'\n", opbFile);
+        return OPBERR_LOGGED;
+    }
+    return ret;
+}
+
+int OPB_ReadFile(const char* file, void** data, size_t* size) {
+    uint8_t* buffer;
+    int ret = ReadWholeFile(file, &buffer, size);
+    if (!ret) *data = buffer;
+    return ret;
+}
+
+// instruments read from a reader go in this many at a time at first, so a header that claims far more instruments
+// than the data holds can't make the decoder allocate for all of them up front
+#define INSTRUMENT_READ_BLOCK 65536
+
+// the instrument table is kept as it is stored and only unpacked when an instrument is used. memory input is used in
+// place, reader input is read with as few calls as possible
+static int ReadInstrumentTable(Context* context, uint32_t count) {
+    context->InstrumentCount = count;
+    if (context->Memory != NULL) {
+        if ((context->MemorySize - context->MemoryPosition) / INSTRUMENT_SIZE < count) {
+            Log("OPB read error occurred in '%s' at line %d\n", GetSourceFilename(), __LINE__);
+            return OPBERR_READ_ERROR;
+        }
+        context->InstrumentTable = context->Memory + context->MemoryPosition;
+        context->MemoryPosition += (size_t)count * INSTRUMENT_SIZE;
+        return 0;
+    }
+
+    Vector* data = &context->InstrumentData;
+    while (data->Count < count) {
+        size_t block = data->Count > INSTRUMENT_READ_BLOCK ? data->Count : INSTRUMENT_READ_BLOCK;
+        if (block > count - data->Count) {
+            block = count - data->Count;
+        }
+        if (Vector_Reserve(data, data->Count + block)) {
+            return OPBERR_BUFFER_ERROR;
+        }
+        READ(VECTOR_PTR(data, data->Count), INSTRUMENT_SIZE, block, context);
+        data->Count += block;
+    }
+    context->InstrumentTable = (const uint8_t*)data->Storage;
+    return 0;
+}
+
+// the dictionary's instruments come first, then the ones stored in the data
+static inline void GetInstrumentSlots(Context* context, uint32_t index, InstrumentSlots* slots) {
+    if (index < context->SharedInstruments) {
+        *slots = ((const InstrumentSlots*)context->Dictionary->Slots.Storage)[index];
+    }
+    else {
+        UnpackSlots(context->InstrumentTable + (size_t)(index - context->SharedInstruments) * INSTRUMENT_SIZE, slots);
+    }
+}
+
+// reference uint7+ decoder, which works with any input
+static int ReadUint7Reference(Context* context) {
+    uint8_t b0 = 0, b1 = 0, b2 = 0, b3 = 0;
+
+    if (ReadBytes(context, &b0, sizeof(uint8_t), 1) != 1) return -1;
+    if (b0 >= 128) {
+        b0 &= 0b01111111;
+        if (ReadBytes(context, &b1, sizeof(uint8_t), 1) != 1) return -1;
+        if (b1 >= 128) {
+            b1 &= 0b01111111;
+            if (ReadBytes(context, &b2, sizeof(uint8_t), 1) != 1) return -1;
+            if (b2 >= 128) {
+                b2 &= 0b01111111;
+                if (ReadBytes(context, &b3, sizeof(uint8_t), 1) != 1) return -1;
+            }
+        }
+    }
+
+    return b0 | (b1 << 7) | (b2 << 14) | (b3 << 21);
+}
+
+// branch-reduced uint7+ decoders for memory input. these read 4 bytes (16 for the SSE2 chunk header decoder)
+// regardless of the encoded length, so callers must make sure that many bytes are available
+static inline uint32_t Load32LE(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static const uint32_t Uint7LengthMasks[5] = { 0, 0xFF, 0xFFFF, 0xFFFFFF, 0xFFFFFFFF };
+
+// drops the bytes past the value's length and packs the 7, 7, 7 and 8 bit groups together
+static inline uint32_t ExtractUint7(uint32_t bytes, int length) {
+    bytes &= Uint7LengthMasks[length];
+    return (bytes & 0x7F) | ((bytes >> 1) & 0x3F80) | ((bytes >> 2) & 0x1FC000) | ((bytes >> 3) & 0x1FE00000);
+}
+
+// the length is the position of the first byte without a continuation bit. the fourth byte never has one
+static inline int Uint7Length(uint32_t bytes) {
+    return (CountTrailingZeros((~bytes & 0x00808080u) | 0x80000000u) >> 3) + 1;
+}
+
+static inline uint32_t DecodeUint7Scalar(const uint8_t* p, int* length) {
+    uint32_t bytes = Load32LE(p);
+    *length = Uint7Length(bytes);
+    return ExtractUint7(bytes, *length);
+}
+
+#ifdef OPB_BMI2
+static inline uint32_t DecodeUint7Bmi2(const uint8_t* p, int* length) {
+    uint32_t bytes = Load32LE(p);
+    *length = Uint7Length(bytes);
+    return _pext_u32(bytes & Uint7LengthMasks[*length], 0xFF7F7F7Fu);
+}
+#define DecodeUint7 DecodeUint7Bmi2
+#else
+#define DecodeUint7 DecodeUint7Scalar
+#endif
+
+// decodes the elapsed time, low count and high count at the start of a chunk, returns the number of bytes used
+static inline size_t DecodeChunkHeaderScalar(const uint8_t* p, uint32_t* values) {
+    size_t pos = 0;
+    for (int i = 0; i < 3; i++) {
+        int length;
+        values[i] = DecodeUint7(p + pos, &length);
+        pos += length;
+    }
+    return pos;
+}
+
+#ifdef OPB_SSE2
+// gathers all continuation bits of the three values with a single movemask
+static inline size_t DecodeChunkHeaderSse2(const uint8_t* p, uint32_t* values) {
+    uint32_t continuation = (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)p));
+    size_t pos = 0;
+    for (int i = 0; i < 3; i++) {
+        int length = CountTrailingZeros((~continuation >> pos) | 0x8u) + 1;
+        values[i] = ExtractUint7(Load32LE(p + pos), length);
+        pos += length;
+    }
+    return pos;
+}
+#define DecodeChunkHeader DecodeChunkHeaderSse2
+#define CHUNK_HEADER_READ_SIZE 16
+#else
+#define DecodeChunkHeader DecodeChunkHeaderScalar
+#define CHUNK_HEADER_READ_SIZE 12
+#endif
+
+static int ReadUint7(Context* context) {
+    if (context->Memory != NULL && context->MemorySize - context->MemoryPosition >= 4) {
+        int length;
+        uint32_t value = DecodeUint7(context->Memory + context->MemoryPosition, &length);
+        context->MemoryPosition += length;
+        return (int)value;
+    }
+
+    uint8_t model = context->ReadModel;
+    context->ReadModel = ENTROPY_MODEL_UINT7;
+    int value = ReadUint7Reference(context);
+    context->ReadModel = model;
+    return value;
+}
+
+#define DEFAULT_READBUFFER_SIZE 256
+
+// the time is counted in whole time base units and only converted for the command times, which keeps a chain of
+// floating point additions from building up rounding error over long songs
+static inline void AdvanceTime(Context* context, uint32_t elapsed) {
+    context->TimeUnits += elapsed;
+    context->Time = (double)context->TimeUnits / context->TimeBase;
+}
+
+// sends the decoded commands to the receiver, or their integer time counterparts when decoding to ticks
+static int SubmitBuffer(Context* context, OPB_Command* buffer, int count) {
+    if (context->TickBuffer.Storage == NULL) {
+        SUBMIT(buffer, count, context);
+        return 0;
+    }
+
+    if (context->DecodeOptions != NULL) {
+        context->DecodeOptions->Stats->Submissions++;
+    }
+    if (context->SubmitTicks((OPB_TickCommand*)context->TickBuffer.Storage, count, context->ReceiverData)) {
+        return OPBERR_BUFFER_ERROR;
+    }
+    return 0;
+}
+
+static inline int AddToBuffer(Context* context, OPB_Command* buffer, int* index, OPB_Command cmd) {
+    if (context->TickBuffer.Storage != NULL) {
+        OPB_TickCommand tick = { cmd.Addr, cmd.Data, context->TimeUnits };
+        ((OPB_TickCommand*)context->TickBuffer.Storage)[*index] = tick;
+    }
+    else {
+        buffer[*index] = cmd;
+    }
+    (*index)++;
+    context->Registers[cmd.Addr & 0x1FF] = cmd.Data;
+
+    // back references can repeat the chunks read from the data, so their commands are kept while they're in reach
+    if ((context->FormatFlags & OPB_FLAG_BACKREF) && !context->Replaying) {
+        uint32_t packed = ((uint32_t)cmd.Addr << 8) | cmd.Data;
+        if (Vector_Add(&context->History, &packed)) return OPBERR_BUFFER_ERROR;
+    }
+
+    if (*index >= DEFAULT_READBUFFER_SIZE) {
+        int ret = SubmitBuffer(context, buffer, DEFAULT_READBUFFER_SIZE);
+        if (ret) return ret;
+        *index = 0;
+    }
+
+    return 0;
+}
+
+#define ADD_TO_BUFFER_IMPL(retvar, context, buffer, index, ...) \
+    { int retvar; \
+    if ((retvar = AddToBuffer(context, buffer, bufferIndex, (OPB_Command) __VA_ARGS__))) return retvar; }
+#define ADD_TO_BUFFER(context, buffer, index, ...) ADD_TO_BUFFER_IMPL(MACRO_CONCAT(__ret, __LINE__), context, buffer, index, __VA_ARGS__)
+
+// adds a chunk that starts at time and returns how many chunks out of reach of later back references were dropped.
+// they're dropped in batches once there are as many chunks as the window holds, which is at least that many out of
+// reach, so the history never holds more than twice the window
+static int AddHistoryChunk(ChunkHistory* history, uint64_t time, size_t start, size_t* dropped) {
+    Vector* chunks = &history->Chunks;
+    HistoryChunk* entries = (HistoryChunk*)chunks->Storage;
+
+    *dropped = 0;
+    if (chunks->Count >= 2 * (size_t)history->Window) {
+        while (*dropped < chunks->Count && entries[*dropped].Index + history->Window < history->Played) (*dropped)++;
+        chunks->Count -= *dropped;
+        memmove(entries, entries + *dropped, chunks->Count * sizeof(HistoryChunk));
+    }
+
+    HistoryChunk chunk = { history->Played, time, start, history->BackReferences, 0 };
+    if (Vector_Add(chunks, &chunk)) return OPBERR_BUFFER_ERROR;
+    history->Played++;
+    return 0;
+}
+
+// turns the newest chunk into a back reference and returns the index of the first chunk it repeats, or -1 when they're
+// out of range. they all have to be chunks read from the data, which the back reference counts of the first and last
+// show with one comparison
+static int64_t AddBackReference(ChunkHistory* history, uint32_t distance, uint32_t length) {
+    HistoryChunk* entries = (HistoryChunk*)history->Chunks.Storage;
+    size_t current = history->Chunks.Count - 1;
+    uint64_t index = entries[current].Index;
+    if (distance < 1 || length < 1 || length > distance || distance > history->Window || distance > index) {
+        return -1;
+    }
+
+    // chunks are in the order they were played, so the first repeated one is found with a binary search
+    uint64_t first = index - distance;
+    size_t low = 0;
+    size_t high = current;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (entries[middle].Index < first) low = middle + 1;
+        else high = middle;
+    }
+
+    size_t last = low + length - 1;
+    if (low == current || entries[low].Index != first || last >= current ||
+        entries[last].BackReferences != entries[low].BackReferences || entries[last].Played != 0) {
+        return -1;
+    }
+
+    entries[current].Played = length;
+    history->BackReferences++;
+    history->Played += length - 1;
+    return (int64_t)low;
+}
+
+// the decoder's history also keeps the commands of its chunks, which move to the front with them
+static int AddDecoderChunk(Context* context) {
+    size_t dropped;
+    if (AddHistoryChunk(&context->HistoryChunks, (uint64_t)context->TimeUnits, context->History.Count, &dropped)) {
+        return OPBERR_BUFFER_ERROR;
+    }
+    if (dropped == 0) {
+        return 0;
+    }
+
+    HistoryChunk* entries = (HistoryChunk*)context->HistoryChunks.Chunks.Storage;
+    size_t base = entries[0].Start;
+    context->History.Count -= base;
+    memmove(context->History.Storage, (uint32_t*)context->History.Storage + base, context->History.Count * sizeof(uint32_t));
+    for (size_t i = 0; i < context->HistoryChunks.Chunks.Count; i++) {
+        entries[i].Start -= base;
+    }
+    return 0;
+}
+
+// replays earlier chunks from the history. the first replayed chunk takes the place of the back reference's own
+// chunk, the others follow with their original elapsed times unless the back reference stores its own
+static int ReadBackReference(Context* context, OPB_Command* buffer, int* bufferIndex, int mask) {
+    int distance, lengthField;
+    READ_UINT7(distance, context);
+    READ_UINT7(lengthField, context);
+    int length = lengthField >> 1;
+    bool explicitTimes = lengthField & 1;
+
+    if (mask != 0 || context->ChunkCommands != 1) {
+        Log("Error reading OPB command: back reference must be the only command in its chunk\n");
+        return OPBERR_LOGGED;
+    }
+
+    int64_t first = AddBackReference(&context->HistoryChunks, (uint32_t)distance, (uint32_t)length);
+    if (first < 0) {
+        Log("Error reading OPB command: back reference to %d chunks at distance %d out of range\n", length, distance);
+        return OPBERR_LOGGED;
+    }
+
+    // nothing is added to the history while replaying, so the chunks stay where they are. the chunk after the last
+    // repeated one always exists, because runs never overlap the chunks they repeat
+    const HistoryChunk* chunks = (const HistoryChunk*)context->HistoryChunks.Chunks.Storage + first;
+    const uint32_t* history = (const uint32_t*)context->History.Storage;
+    context->Replaying = true;
+    for (int i = 0; i < length; i++) {
+        if (i > 0) {
+            uint32_t elapsed = (uint32_t)(chunks[i].Time - chunks[i - 1].Time);
+            if (explicitTimes) {
+                int value;
+                READ_UINT7(value, context);
+                elapsed = (uint32_t)value;
+            }
+            AdvanceTime(context, elapsed);
+        }
+
+        for (size_t j = chunks[i].Start; j < chunks[i + 1].Start; j++) {
+            ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)(history[j] >> 8), (uint8_t)history[j], context->Time });
+        }
+    }
+    context->Replaying = false;
+
+    return 0;
+}
+
+// reads the arguments 0xD0 and 0xD1 take for a channel, which every instrument command is built from. the values
+// of the writes they stand for are returned by slot, along with a mask of the slots to write. for a group the channel
+// is GROUP_CHANNEL and the arguments after the masks are left for ReadInstrumentGroup
+static int ReadInstrumentArgs(Context* context, bool isPlay, int* channel, InstrumentSlots* slots, uint32_t* slotMask) {
+    int instrIndex;
+    READ_UINT7(instrIndex, context);
+
+    uint8_t channelMask[2];
+    READ(channelMask, sizeof(uint8_t), 2, context);
+
+    *channel = channelMask[0] & 0b00011111;
+    bool group = *channel == GROUP_CHANNEL && (context->FormatFlags & OPB_FLAG_GROUPS);
+    if (*channel >= NUM_CHANNELS && !group) {
+        Log("Error reading OPB command: channel %d out of range\n", *channel);
+        return OPBERR_LOGGED;
+    }
+
+    // the arguments that follow are frequency and note when playing, then the modulator and carrier levels if set
+    bool modLvl = (channelMask[0] & 0b00100000) != 0;
+    bool carLvl = (channelMask[0] & 0b01000000) != 0;
+
+    uint8_t args[4];
+    int argCount = group ? 0 : (isPlay ? 2 : 0) + modLvl + carLvl;
+    if (argCount > 0) {
+        READ(args, sizeof(uint8_t), argCount, context);
+    }
+
+    if (instrIndex < 0 || instrIndex >= (int64_t)context->SharedInstruments + context->InstrumentCount) {
+        Log("Error reading OPB command: instrument %d out of range\n", instrIndex);
+        return OPBERR_LOGGED;
+    }
+
+    GetInstrumentSlots(context, (uint32_t)instrIndex, slots);
+    uint8_t* values = slots->Values;
+    uint8_t* arg = args;
+
+    if (!group) {
+        if (isPlay) {
+            values[SLOT_FREQUENCY] = *arg++;
+            values[SLOT_NOTE] = *arg++;
+        }
+        if (modLvl) values[SLOT_MODLEVEL] = *arg++;
+        if (carLvl) values[SLOT_CARLEVEL] = *arg++;
+    }
+
+    *slotMask = ExpandChannelFlags(channelMask[0]) | ExpandPropertyMask(channelMask[1]) |
+        (isPlay ? (1u << SLOT_FREQUENCY) | (1u << SLOT_NOTE) : 0);
+    return 0;
+}
+
+// slots are emitted in ascending order, which is the order the encoder expects them to be replayed in
+static int AddInstrumentSlots(Context* context, OPB_Command* buffer, int* bufferIndex, int channel, const uint8_t* values, uint32_t slotMask) {
+    const uint16_t* regs = ChannelSlotRegisters[channel];
+
+    while (slotMask != 0) {
+        int slot = CountTrailingZeros(slotMask);
+        slotMask &= slotMask - 1;
+        ADD_TO_BUFFER(context, buffer, bufferIndex, { regs[slot], values[slot], context->Time });
+    }
+    return 0;
+}
+
+// reads the channels of a group and the arguments each of them takes, then sets the instrument on each channel in
+// ascending order. the channels are those of the half of the chip the command is stored for
+static int ReadInstrumentGroup(Context* context, OPB_Command* buffer, int* bufferIndex, int mask, InstrumentSlots* slots, uint32_t slotMask) {
+    int channels;
+    READ_UINT7(channels, context);
+
+    if (channels <= 0 || channels >= (1 << (NUM_CHANNELS / 2))) {
+        Log("Error reading OPB command: channel group 0x%X out of range\n", channels);
+        return OPBERR_LOGGED;
+    }
+
+    bool isPlay = (slotMask & (1u << SLOT_NOTE)) != 0;
+    bool modLvl = (slotMask & (1u << SLOT_MODLEVEL)) != 0;
+    bool carLvl = (slotMask & (1u << SLOT_CARLEVEL)) != 0;
+    int argCount = (isPlay ? 2 : 0) + modLvl + carLvl;
+    uint8_t* values = slots->Values;
+
+    for (; channels != 0; channels &= channels - 1) {
+        uint8_t args[4];
+        if (argCount > 0) {
+            READ(args, sizeof(uint8_t), argCount, context);
+        }
+
+        uint8_t* arg = args;
+        if (isPlay) {
+            values[SLOT_FREQUENCY] = *arg++;
+            values[SLOT_NOTE] = *arg++;
+        }
+        if (modLvl) values[SLOT_MODLEVEL] = *arg++;
+        if (carLvl) values[SLOT_CARLEVEL] = *arg++;
+
+        int channel = CountTrailingZeros((uint32_t)channels) + (mask != 0 ? NUM_CHANNELS / 2 : 0);
+        int ret = AddInstrumentSlots(context, buffer, bufferIndex, channel, values, slotMask);
+        if (ret) return ret;
+    }
+    return 0;
+}
+
+// moves a channel's frequency by the signed 7-bit delta in the low bits of the argument. the note is written as well
+// when bit 7 is set, with the upper bits it already had. the value wraps around instead of failing, since only the
+// decoder knows what it was
+static int ReadDeltaFrequency(Context* context, OPB_Command* buffer, int* bufferIndex, int addr, uint8_t delta) {
+    int freqReg = addr - (OPB_CMD_DELTAFREQ - REG_FREQUENCY);
+    int noteReg = freqReg + (REG_NOTE - REG_FREQUENCY);
+    uint8_t note = context->Registers[noteReg];
+
+    int value = (FrequencyValue(context->Registers[freqReg], note) + ((delta & 0x7F) ^ 0x40) - 0x40) & 0x1FFF;
+    ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)freqReg, (uint8_t)value, context->Time });
+
+    if (delta & 0x80) {
+        ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)noteReg, (uint8_t)((note & 0b11100000) | (value >> 8)), context->Time });
+    }
+    return 0;
+}
+
+static int ReadCommand(Context* context, OPB_Command* buffer, int* bufferIndex, int mask) {
+    uint8_t baseAddr;
+    context->ReadModel = ENTROPY_MODEL_REGISTER;
+    READ(&baseAddr, sizeof(uint8_t), 1, context);
+    context->LastCommand = baseAddr;
+    context->LastGroup = false;
+    context->ReadModel = ENTROPY_MODEL_DATA;
+
+    if (baseAddr == OPB_CMD_BACKREF && (context->FormatFlags & OPB_FLAG_BACKREF)) {
+        return ReadBackReference(context, buffer, bufferIndex, mask);
+    }
+
+    int addr = baseAddr | mask;
+
+    // without the voices flag 0xD3-0xD6 are written like any other register
+    int command = baseAddr;
+    if (baseAddr >= OPB_CMD_SETFOUROP && baseAddr <= OPB_CMD_PLAYRHYTHM && !(context->FormatFlags & OPB_FLAG_VOICES)) {
+        command = -1;
+    }
+
+    switch (command) {
+        default: {
+            uint8_t data;
+            READ(&data, sizeof(uint8_t), 1, context);
+            if (IsDeltaCommand(baseAddr, context->FormatFlags)) {
+                return ReadDeltaFrequency(context, buffer, bufferIndex, addr, data);
+            }
+            ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)addr, data, context->Time });
+            break;
+        }
+        
+        case OPB_CMD_PLAYINSTRUMENT:
+        case OPB_CMD_SETINSTRUMENT:
+        case OPB_CMD_SETFOUROP:
+        case OPB_CMD_PLAYFOUROP:
+        case OPB_CMD_SETRHYTHM:
+        case OPB_CMD_PLAYRHYTHM: {
+            int channel;
+            InstrumentSlots slots;
+            uint32_t slotMask;
+            int ret = ReadInstrumentArgs(context, IsPlayCommand(baseAddr), &channel, &slots, &slotMask);
+            if (ret) return ret;
+
+            if (channel == GROUP_CHANNEL) {
+                if (baseAddr > OPB_CMD_PLAYINSTRUMENT) {
+                    Log("Error reading OPB command: command 0x%X can't set a group of channels\n", baseAddr);
+                    return OPBERR_LOGGED;
+                }
+                context->LastGroup = true;
+                return ReadInstrumentGroup(context, buffer, bufferIndex, mask, &slots, slotMask);
+            }
+
+            // the second channel of a 4-op pair is set up before the first one's note is played
+            if (IsFourOpCommand(baseAddr)) {
+                int pairChannel;
+                InstrumentSlots pairSlots;
+                uint32_t pairMask;
+                ret = ReadInstrumentArgs(context, false, &pairChannel, &pairSlots, &pairMask);
+                if (ret) return ret;
+
+                if (!IsFourOpFirst(channel) || pairChannel != channel + 3) {
+                    Log("Error reading OPB command: channels %d and %d aren't a 4-op pair\n", channel, pairChannel);
+                    return OPBERR_LOGGED;
+                }
+
+                uint32_t noteMask = slotMask & ((1u << SLOT_FREQUENCY) | (1u << SLOT_NOTE));
+                ret = AddInstrumentSlots(context, buffer, bufferIndex, channel, slots.Values, slotMask & ~noteMask);
+                if (ret) return ret;
+                ret = AddInstrumentSlots(context, buffer, bufferIndex, pairChannel, pairSlots.Values, pairMask);
+                if (ret) return ret;
+                slotMask = noteMask;
+            }
+
+            ret = AddInstrumentSlots(context, buffer, bufferIndex, channel, slots.Values, slotMask);
+            if (ret) return ret;
+
+            // the drums are keyed once their instrument is set
+            if (IsRhythmCommand(baseAddr)) {
+                if (!IsRhythmChannel(channel)) {
+                    Log("Error reading OPB command: channel %d isn't a drum channel\n", channel);
+                    return OPBERR_LOGGED;
+                }
+
+                uint8_t rhythm;
+                READ(&rhythm, sizeof(uint8_t), 1, context);
+                ADD_TO_BUFFER(context, buffer, bufferIndex, { REG_RHYTHM, rhythm, context->Time });
+            }
+            break;
+        }
+
+        case OPB_CMD_NOTEON:
+        case OPB_CMD_NOTEON + 1:
+        case OPB_CMD_NOTEON + 2:
+        case OPB_CMD_NOTEON + 3:
+        case OPB_CMD_NOTEON + 4:
+        case OPB_CMD_NOTEON + 5:
+        case OPB_CMD_NOTEON + 6:
+        case OPB_CMD_NOTEON + 7:
+        case OPB_CMD_NOTEON + 8: {
+            int channel = (baseAddr - 0xD7) + (mask != 0 ? 9 : 0);
+
+            if (channel < 0 || channel >= NUM_CHANNELS) {
+                Log("Error reading OPB command: channel %d out of range\n", channel);
+                return OPBERR_LOGGED;
+            }
+
+            uint8_t freqNote[2];
+            READ(freqNote, sizeof(uint8_t), 2, context);
+
+            uint8_t freq = freqNote[0];
+            uint8_t note = freqNote[1];
+
+            ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)(addr - (OPB_CMD_NOTEON - REG_FREQUENCY)), freq, context->Time });
+            ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)(addr - (OPB_CMD_NOTEON - REG_NOTE)), (uint8_t)(note & 0b00111111), context->Time });
+
+            if ((note & 0b01000000) != 0) {
+                // set modulator volume
+                uint8_t vol;
+                READ(&vol, sizeof(uint8_t), 1, context);
+                int reg = ChannelSlotRegisters[channel][SLOT_MODLEVEL];
+                ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)reg, vol, context->Time });
+            }
+            if ((note & 0b10000000) != 0) {
+                // set carrier volume
+                uint8_t vol;
+                READ(&vol, sizeof(uint8_t), 1, context);
+                int reg = ChannelSlotRegisters[channel][SLOT_CARLEVEL];
+                ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)reg, vol, context->Time });
+            }
+            break;
+        }
+    }
+
+    return 0;
+}
+
+// decoder statistics
+// when statistics are requested the reader and receiver are wrapped so their calls can be counted
+static size_t ReadWithStats(void* buffer, size_t elementSize, size_t elementCount, void* userData) {
+    Context* context = (Context*)userData;
+    OPB_DecodeStats* stats = context->DecodeOptions->Stats;
+
+    size_t read = context->SourceRead(buffer, elementSize, elementCount, context->SourceData);
+    stats->ReadCalls++;
+    stats->BytesRead += read * elementSize;
+    return read;
+}
+
+static int SubmitWithStats(OPB_Command* commandStream, size_t commandCount, void* userData) {
+    Context* context = (Context*)userData;
+    OPB_DecodeStats* stats = context->DecodeOptions->Stats;
+
+    stats->Submissions++;
+    return context->SourceSubmit(commandStream, commandCount, context->SourceReceiverData);
+}
+
+static int ReadCommandWithStats(Context* context, OPB_Command* buffer, int* bufferIndex, int mask) {
+    OPB_DecodeStats* stats = context->DecodeOptions->Stats;
+    size_t bytesRead = stats->BytesRead;
+    size_t submissions = stats->Submissions;
+    int index = *bufferIndex;
+
+    int ret = ReadCommand(context, buffer, bufferIndex, mask);
+    if (ret) return ret;
+
+    // every submission while reading the command sent a full buffer
+    size_t emitted = (stats->Submissions - submissions) * DEFAULT_READBUFFER_SIZE + *bufferIndex - index;
+    OPB_CommandKind kind = GetCommandKind(context->LastCommand, context->FormatFlags, context->LastGroup);
+
+    stats->Commands[kind].Count++;
+    stats->Commands[kind].Bytes += stats->BytesRead - bytesRead;
+    stats->Emitted[kind] += emitted;
+    stats->CommandsEmitted += emitted;
+    return 0;
+}
+
+static void FinishChunkStats(Context* context, size_t emitted, double startTime) {
+    const OPB_DecodeOptions* options = context->DecodeOptions;
+    OPB_DecodeStats* stats = options->Stats;
+
+    double time = GetClock();
+    double elapsed = time - startTime;
+
+    stats->ChunksRead++;
+    if (emitted > stats->MaxChunkCommands) stats->MaxChunkCommands = emitted;
+    if (elapsed > stats->MaxChunkTime) stats->MaxChunkTime = elapsed;
+    if (emitted > stats->IntervalMaxChunkCommands) stats->IntervalMaxChunkCommands = emitted;
+    if (elapsed > stats->IntervalMaxChunkTime) stats->IntervalMaxChunkTime = elapsed;
+    stats->TotalTime = time - context->StartTime;
+
+    if (options->Sampler != NULL && ++context->ChunksSinceSample >= options->SampleInterval) {
+        options->Sampler(stats, options->SamplerData);
+        stats->IntervalMaxChunkCommands = 0;
+        stats->IntervalMaxChunkTime = 0;
+        context->ChunksSinceSample = 0;
+    }
+}
+
+static int ReadChunk(Context* context, OPB_Command* buffer, int* bufferIndex) {
+    int elapsed, loCount, hiCount;
+
+    if (context->Memory != NULL && context->MemorySize - context->MemoryPosition >= CHUNK_HEADER_READ_SIZE) {
+        uint32_t header[3];
+        context->MemoryPosition += DecodeChunkHeader(context->Memory + context->MemoryPosition, header);
+        elapsed = (int)header[0];
+        loCount = (int)header[1];
+        hiCount = (int)header[2];
+    }
+    else {
+        READ_UINT7(elapsed, context);
+        READ_UINT7(loCount, context);
+        READ_UINT7(hiCount, context);
+    }
+
+    AdvanceTime(context, (uint32_t)elapsed);
+    context->ChunkCommands = loCount + hiCount;
+
+    if (context->FormatFlags & OPB_FLAG_BACKREF) {
+        int ret = AddDecoderChunk(context);
+        if (ret) return ret;
+    }
+
+    if (context->DecodeOptions != NULL) {
+        double startTime = GetClock();
+        size_t emitted = context->DecodeOptions->Stats->CommandsEmitted;
+
+        for (int i = 0; i < loCount + hiCount; i++) {
+            int ret = ReadCommandWithStats(context, buffer, bufferIndex, i < loCount ? 0x0 : 0x100);
+            if (ret) return ret;
+        }
+
+        FinishChunkStats(context, context->DecodeOptions->Stats->CommandsEmitted - emitted, startTime);
+        return 0;
+    }
+
+    for (int i = 0; i < loCount; i++) {
+        int ret = ReadCommand(context, buffer, bufferIndex, 0x0);
+        if (ret) return ret;
+    }
+    for (int i = 0; i < hiCount; i++) {
+        int ret = ReadCommand(context, buffer, bufferIndex, 0x100);
+        if (ret) return ret;
+    }
+
+    return 0;
+}
+
+static int ReadOpbHeader(Context* context, char version, OpbHeader* header) {
+    uint32_t values[6] = { 0 };
+    size_t count = OpbHeaderSize(version, 0) / sizeof(uint32_t);
+    READ(values, sizeof(uint32_t), count, context);
+
+    memset(header, 0, sizeof(OpbHeader));
+    header->Size = FlipEndian32(values[0]);
+    header->TimeBase = OPB_TIMEBASE_MS;
+    if (version == '1') {
+        header->InstrumentCount = FlipEndian32(values[1]);
+        header->ChunkCount = FlipEndian32(values[2]);
+        return 0;
+    }
+
+    header->Flags = FlipEndian32(values[1]);
+    header->InstrumentCount = FlipEndian32(values[2]);
+    header->ChunkCount = FlipEndian32(values[3]);
+
+    if (header->Flags & ~OPB_KNOWN_FLAGS) {
+        Log("Error reading OPB file: unsupported format flags 0x%X\n", header->Flags & ~OPB_KNOWN_FLAGS);
+        return OPBERR_VERSION_UNSUPPORTED;
+    }
+    if (header->Flags & OPB_FLAG_DICTIONARY) {
+        READ(values, sizeof(uint32_t), 2, context);
+        header->DictionaryCount = FlipEndian32(values[0]);
+        header->DictionaryId = FlipEndian32(values[1]);
+    }
+    if (header->Flags & OPB_FLAG_BACKREF) {
+        READ(values, sizeof(uint32_t), 1, context);
+        header->BackReferenceWindow = FlipEndian32(values[0]);
+        if (header->BackReferenceWindow == 0 || header->BackReferenceWindow > BACKREF_MAX_WINDOW) {
+            Log("Error reading OPB file: back reference window of %u chunks out of range\n", header->BackReferenceWindow);
+            return OPBERR_LOGGED;
+        }
+    }
+    if (header->Flags & OPB_FLAG_TIMEBASE) {
+        READ(values, sizeof(uint32_t), 1, context);
+        header->TimeBase = FlipEndian32(values[0]);
+        if (header->TimeBase == 0) {
+            Log("Error reading OPB file: time base of zero\n");
+            return OPBERR_LOGGED;
+        }
+    }
+    return 0;
+}
+
+// the dictionary's instruments go in front of the ones stored in the data, which is the order the encoder used. they
+// are looked up in the dictionary itself, see GetInstrumentSlots
+static int AddDictionaryInstruments(Context* context, const OpbHeader* header) {
+    const OPB_Dictionary* dictionary = context->Dictionary;
+    if (!(header->Flags & OPB_FLAG_DICTIONARY)) {
+        return 0;
+    }
+    if (dictionary == NULL || DictionaryCount(dictionary) != header->DictionaryCount || dictionary->Id != header->DictionaryId) {
+        Log("Error reading OPB file: data needs a dictionary of %u instruments with id 0x%08X\n",
+            header->DictionaryCount, header->DictionaryId);
+        return OPBERR_DICTIONARY_MISMATCH;
+    }
+
+    context->SharedInstruments = header->DictionaryCount;
+    return 0;
+}
+
+// sets up the entropy decoder once the code lengths that follow the instruments have been read. from here on every
+// read goes through it, so the memory fast paths are turned off
+static int StartEntropyDecoder(Context* context, EntropyDecoder* decoder, char version, const OpbHeader* header) {
+    uint8_t table[ENTROPY_TABLE_SIZE];
+    READ(table, sizeof(uint8_t), ENTROPY_TABLE_SIZE, context);
+
+    if (!InitEntropyDecoder(decoder, table)) {
+        Log("Error reading OPB file: invalid entropy code lengths\n");
+        return OPBERR_LOGGED;
+    }
+
+    size_t start = OPB_HEADER_SIZE + 1 + OpbHeaderSize(version, header->Flags) +
+        (size_t)header->InstrumentCount * INSTRUMENT_SIZE + ENTROPY_TABLE_SIZE;
+    if (header->Size < start) {
+        Log("Error reading OPB file: header size %u is smaller than the data before the chunks\n", header->Size);
+        return OPBERR_LOGGED;
+    }
+
+    if (context->Memory != NULL) {
+        decoder->Next = context->Memory + context->MemoryPosition;
+        decoder->End = context->Memory + context->MemorySize;
+        context->Memory = NULL;
+    }
+    else {
+        decoder->Read = context->Read;
+        decoder->ReadData = context->UserData;
+        decoder->Remaining = header->Size - start;
+    }
+
+    context->EntropyDecoder = decoder;
+    return 0;
+}
+
+static int ReadOpbDefault(Context* context, char version, uint8_t format) {
+    OpbHeader header;
+    int ret = ReadOpbHeader(context, version, &header);
+    if (ret) return ret;
+
+    context->FormatFlags = header.Flags;
+    context->TimeBase = header.TimeBase;
+    context->HistoryChunks.Window = header.BackReferenceWindow;
+    if ((ret = AddDictionaryInstruments(context, &header))) return ret;
+    if ((ret = ReadInstrumentTable(context, header.InstrumentCount))) return ret;
+
+    uint32_t chunkCount = header.ChunkCount;
+
+    EntropyDecoder decoder;
+    if (format == OPB_Format_Compressed && (ret = StartEntropyDecoder(context, &decoder, version, &header))) {
+        return ret;
+    }
+
+    OPB_Command buffer[DEFAULT_READBUFFER_SIZE];
+    int bufferIndex = 0;
+    if (context->SubmitTicks != NULL && Vector_Reserve(&context->TickBuffer, DEFAULT_READBUFFER_SIZE)) {
+        return OPBERR_BUFFER_ERROR;
+    }
+
+    for (uint32_t i = 0; i < chunkCount; i++) {
+        if ((ret = ReadChunk(context, buffer, &bufferIndex))) return ret;
+    }
+
+    if (bufferIndex > 0) {
+        return SubmitBuffer(context, buffer, bufferIndex);
+    }
+
+    return 0;
+}
+
+#define RAW_READBUFFER_SIZE 256
+
+// returns up to batchSize raw records of memory input, used in place
+static size_t NextRawMemoryBatch(Context* context, size_t batchSize, const uint8_t** records) {
+    size_t count = (context->MemorySize - context->MemoryPosition) / RAW_ENTRY_SIZE;
+    if (count > batchSize) count = batchSize;
+
+    *records = context->Memory + context->MemoryPosition;
+    context->MemoryPosition += count * RAW_ENTRY_SIZE;
+    return count;
+}
+
+// returns up to batchSize raw records. memory input is used in place, anything else is read into buffer
+static size_t NextRawBatch(Context* context, uint8_t* buffer, size_t batchSize, const uint8_t** records) {
+    if (context->Memory != NULL) {
+        return NextRawMemoryBatch(context, batchSize, records);
+    }
+
+    *records = buffer;
+    return ReadBytes(context, buffer, RAW_ENTRY_SIZE, batchSize);
+}
+
+static void FinishRawBatchStats(Context* context, size_t count, size_t emitted, double startTime) {
+    OPB_DecodeStats* stats = context->DecodeOptions->Stats;
+    stats->Commands[OPB_CommandKind_Plain].Count += count;
+    stats->Commands[OPB_CommandKind_Plain].Bytes += count * RAW_ENTRY_SIZE;
+    stats->Emitted[OPB_CommandKind_Plain] += emitted;
+    stats->CommandsEmitted += emitted;
+    FinishChunkStats(context, emitted, startTime);
+}
+
+// time is kept in whole milliseconds, which avoids a chain of floating point additions and the rounding error
+// they accumulate over long songs
+static int ReadOpbRaw(Context* context) {
+    size_t batchSize = context->BatchSize;
+    uint8_t* buffer = context->Memory == NULL ? (uint8_t*)malloc(batchSize * RAW_ENTRY_SIZE) : NULL;
+    OPB_Command* commandStream = (OPB_Command*)malloc(batchSize * sizeof(OPB_Command));
+
+    int ret = 0;
+    if ((context->Memory == NULL && buffer == NULL) || commandStream == NULL) {
+        ret = OPBERR_BUFFER_ERROR;
+    }
+
+    int64_t time = 0;
+    const uint8_t* value;
+    size_t itemsRead;
+    while (!ret && (itemsRead = NextRawBatch(context, buffer, batchSize, &value)) > 0) {
+        double startTime = context->DecodeOptions != NULL ? GetClock() : 0;
+
+        // delay records are written like any other and then overwritten by the next record
+        size_t count = 0;
+        for (size_t i = 0; i < itemsRead; i++, value += RAW_ENTRY_SIZE) {
+            time += (value[0] << 8) | value[1];
+
+            OPB_Command cmd = {
+                (uint16_t)((value[2] << 8) | value[3]),
+                value[4],
+                time / 1000.0
+            };
+            commandStream[count] = cmd;
+            count += cmd.Addr != OPB_RAW_DELAY_ADDR;
+        }
+
+        if (count > 0 && context->Submit(commandStream, count, context->ReceiverData)) {
+            ret = OPBERR_BUFFER_ERROR;
+        }
+        else if (context->DecodeOptions != NULL) {
+            FinishRawBatchStats(context, itemsRead, count, startTime);
+        }
+    }
+
+    free(buffer);
+    free(commandStream);
+    return ret;
+}
+
+// decodes raw records to integer millisecond times. this only does byte loads and shifts: a three records at a
+// time SSSE3 shuffle and 64-bit loads with a byte swap both measured slower, as the running time and the 16 byte
+// output records are what limit the loop
+static inline size_t DecodeRawTicks(const uint8_t* value, size_t count, int64_t* time, OPB_TickCommand* out) {
+    int64_t t = *time;
+    size_t emitted = 0;
+    for (size_t i = 0; i < count; i++, value += RAW_ENTRY_SIZE) {
+        t += (value[0] << 8) | value[1];
+        out[emitted].Addr = (uint16_t)((value[2] << 8) | value[3]);
+        out[emitted].Data = value[4];
+        out[emitted].Time = t;
+        emitted += out[emitted].Addr != OPB_RAW_DELAY_ADDR;
+    }
+    *time = t;
+    return emitted;
+}
+
+// raw data is only decoded to integer times from memory, see MemoryToTicks
+static int ReadOpbRawTicks(Context* context) {
+    size_t batchSize = context->BatchSize;
+    OPB_TickCommand* commandStream = (OPB_TickCommand*)malloc(batchSize * sizeof(OPB_TickCommand));
+    if (commandStream == NULL) return OPBERR_BUFFER_ERROR;
+
+    int ret = 0;
+    int64_t time = 0;
+    const uint8_t* records;
+    size_t count;
+    while (!ret && (count = NextRawMemoryBatch(context, batchSize, &records)) > 0) {
+        double startTime = context->DecodeOptions != NULL ? GetClock() : 0;
+
+        size_t emitted = DecodeRawTicks(records, count, &time, commandStream);
+
+        if (emitted > 0 && context->SubmitTicks(commandStream, emitted, context->ReceiverData)) {
+            ret = OPBERR_BUFFER_ERROR;
+        }
+        else if (context->DecodeOptions != NULL) {
+            OPB_DecodeStats* stats = context->DecodeOptions->Stats;
+            stats->BytesRead += count * RAW_ENTRY_SIZE;
+            stats->Submissions += emitted > 0;
+            FinishRawBatchStats(context, count, emitted, startTime);
+        }
+    }
+
+    free(commandStream);
+    return ret;
+}
+
+static int ConvertFromOpb(Context* context) {
+    char id[OPB_HEADER_SIZE + 1] = { 0 };
+    READ(id, sizeof(char), OPB_HEADER_SIZE, context);
+
+    if (strncmp(id, "OPBin", 5)) {
+        return OPBERR_NOT_AN_OPB_FILE;
+    }
+
+    switch (id[OPB_VERSION_INDEX]) {
+    case '1':
+    case '2':
+        break;
+    default:
+        return OPBERR_VERSION_UNSUPPORTED;
+    }
+
+    if (id[6] != '\0') {
+        return OPBERR_NOT_AN_OPB_FILE;
+    }
+
+    uint8_t fmt;
+    READ(&fmt, sizeof(uint8_t), 1, context);
+
+    switch (fmt) {
+    default:
+        Log("Error reading OPB file: unknown format %d\n", fmt);
+        return OPBERR_LOGGED;
+    case OPB_Format_Default:
+    case OPB_Format_Compressed:
+        if (context->RawTicksOnly) {
+            Log("Error reading OPB file: only raw format data can be decoded to integer times\n");
+            return OPBERR_LOGGED;
+        }
+        return ReadOpbDefault(context, id[OPB_VERSION_INDEX], fmt);
+    case OPB_Format_Raw:
+        return context->SubmitTicks != NULL ? ReadOpbRawTicks(context) : ReadOpbRaw(context);
+    }
+}
+
+static size_t ReadFromFile(void* buffer, size_t elementSize, size_t elementCount, void* context) {
+    return fread(buffer, elementSize, elementCount, (FILE*)context);
+}
+
+int OPB_FileToOpl(const char* file, OPB_BufferReceiver receiver, void* receiverData) {
+    FILE* inFile;
+    if ((inFile = fopen(file, "rb")) == NULL) {
+        Log("Couldn't open file '%s' for reading\n", file);
+        return OPBERR_LOGGED;
+    }
+    int ret = OPB_BinaryToOpl(ReadFromFile, inFile, receiver, receiverData);
+    fclose(inFile);
+    return ret;
+}
+
+int OPB_BinaryToOpl(OPB_StreamReader reader, void* readerData, OPB_BufferReceiver receiver, void* receiverData) {
+    return OPB_BinaryToOplEx(reader, readerData, receiver, receiverData, NULL);
+}
+
+static size_t GetBatchSize(const OPB_DecodeOptions* options) {
+    return options != NULL && options->BatchSize > 0 ? options->BatchSize : RAW_READBUFFER_SIZE;
+}
+
+int OPB_BinaryToOplEx(OPB_StreamReader reader, void* readerData, OPB_BufferReceiver receiver, void* receiverData,
+    const OPB_DecodeOptions* options) {
+    Context context = { 0 };
+
+    context.Read = reader;
+    context.Submit = receiver;
+    context.UserData = readerData;
+    context.ReceiverData = receiverData;
+    context.InstrumentData = Vector_New(INSTRUMENT_SIZE);
+    context.History = Vector_New(sizeof(uint32_t));
+    context.HistoryChunks.Chunks = Vector_New(sizeof(HistoryChunk));
+    context.BatchSize = GetBatchSize(options);
+    context.Dictionary = options != NULL ? options->Dictionary : NULL;
+
+    if (options != NULL && options->Stats != NULL) {
+        memset(options->Stats, 0, sizeof(OPB_DecodeStats));
+        context.DecodeOptions = options;
+        context.StartTime = GetClock();
+
+        context.SourceRead = reader;
+        context.SourceData = readerData;
+        context.SourceSubmit = receiver;
+        context.SourceReceiverData = receiverData;
+        context.Read = ReadWithStats;
+        context.UserData = &context;
+        context.Submit = SubmitWithStats;
+        context.ReceiverData = &context;
+    }
+
+    int ret = ConvertFromOpb(&context);
+    if (context.DecodeOptions != NULL) {
+        options->Stats->TotalTime = GetClock() - context.StartTime;
+    }
+    Context_Free(&context);
+
+    if (ret) {
+        Log("%s\n", OPB_GetErrorMessage(ret));
+    }
+
+    return ret;
+}
+
+static size_t ReadFromMemory(void* buffer, size_t elementSize, size_t elementCount, void* context) {
+    Context* memory = (Context*)context;
+    return ReadBytes(memory, buffer, elementSize, elementCount);
+}
+
+int OPB_MemoryToOpl(const void* data, size_t size, OPB_BufferReceiver receiver, void* receiverData) {
+    return OPB_MemoryToOplEx(data, size, receiver, receiverData, NULL);
+}
+
+int OPB_MemoryToOplEx(const void* data, size_t size, OPB_BufferReceiver receiver, void* receiverData,
+    const OPB_DecodeOptions* options) {
+    if (options != NULL && options->Stats != NULL) {
+        // statistics count reader calls, so go through a regular reader over the memory
+        Context source = { 0 };
+        source.Memory = (const uint8_t*)data;
+        source.MemorySize = size;
+        return OPB_BinaryToOplEx(ReadFromMemory, &source, receiver, receiverData, options);
+    }
+
+    Context context = { 0 };
 
-static inline int AddToBuffer(Context* context, OPB_Command* buffer, int* index, OPB_Command cmd) {
-    buffer[*index] = cmd;
-    (*index)++;
+    context.Memory = (const uint8_t*)data;
+    context.MemorySize = size;
+    context.Submit = receiver;
+    context.ReceiverData = receiverData;
+    context.InstrumentData = Vector_New(INSTRUMENT_SIZE);
+    context.History = Vector_New(sizeof(uint32_t));
+    context.HistoryChunks.Chunks = Vector_New(sizeof(HistoryChunk));
+    context.BatchSize = GetBatchSize(options);
+    context.Dictionary = options != NULL ? options->Dictionary : NULL;
+
+    int ret = ConvertFromOpb(&context);
+    Context_Free(&context);
+
+    if (ret) {
+        Log("%s\n", OPB_GetErrorMessage(ret));
+    }
+
+    return ret;
+}
+
+// validation
+// walks the structure of OPB data in memory without expanding any commands. every length is checked against the
+// bytes that remain before it is used, so truncated or hostile data is never read past its end
+typedef struct Validator {
+    const uint8_t* Data;
+    size_t Size;
+    size_t Position;
+    const char* Error;
+    uint64_t Time;      // elapsed time base units of the chunks checked so far
+    uint32_t Flags;
+    uint32_t TimeBase;
+    ChunkHistory History;   // only kept for back references
+} Validator;
+
+static inline bool ValidateFail(Validator* v, const char* error) {
+    v->Error = error;
+    return false;
+}
+
+static inline bool ValidateUint7(Validator* v, uint32_t* value) {
+    size_t remaining = v->Size - v->Position;
+    int length;
+
+    if (remaining >= 4) {
+        *value = DecodeUint7(v->Data + v->Position, &length);
+    }
+    else {
+        // zero padding ends the value, so a value cut off by the end of the data decodes as longer than what's left
+        uint8_t bytes[4] = { 0 };
+        memcpy(bytes, v->Data + v->Position, remaining);
+        *value = DecodeUint7Scalar(bytes, &length);
+        if ((size_t)length > remaining) return ValidateFail(v, "truncated uint7+ value");
+    }
+
+    v->Position += length;
+    return true;
+}
+
+// back references repeat chunks the validator has already checked, so only their range and times are needed. the
+// times of the repeated chunks are the difference of their start times, which takes the same time however long the run
+static bool AddValidatedBackReference(Validator* v, uint32_t distance, uint32_t lengthField) {
+    uint32_t length = lengthField >> 1;
+
+    int64_t first = AddBackReference(&v->History, distance, length);
+    if (first < 0) {
+        return ValidateFail(v, "back reference out of range or repeats chunks another back reference played");
+    }
+
+    if (!(lengthField & 1)) {
+        const HistoryChunk* chunks = (const HistoryChunk*)v->History.Chunks.Storage + first;
+        v->Time += chunks[length - 1].Time - chunks[0].Time;
+    }
+    return true;
+}
+
+static bool ValidateBackReference(Validator* v) {
+    size_t start = v->Position++;
+    uint32_t distance, lengthField;
+    if (!ValidateUint7(v, &distance) || !ValidateUint7(v, &lengthField)) return false;
+
+    if (!AddValidatedBackReference(v, distance, lengthField)) {
+        v->Position = start;
+        return false;
+    }
+
+    uint32_t length = lengthField >> 1;
+    for (uint32_t i = 1; (lengthField & 1) && i < length; i++) {
+        uint32_t elapsed;
+        if (!ValidateUint7(v, &elapsed)) return false;
+        v->Time += elapsed;
+    }
+    return true;
+}
+
+// checks the arguments 0xD0 and 0xD1 take for a channel or a group of channels and moves pos past them. returns 0
+// when they're cut off by the end of the data and -1 when they're invalid
+static int ValidateInstrumentArgs(Validator* v, size_t start, size_t* pos, uint64_t instrumentCount, bool isPlay, int* channel) {
+    v->Position = *pos;
+
+    uint32_t instrIndex;
+    if (!ValidateUint7(v, &instrIndex)) return -1;
+    if (instrIndex >= instrumentCount) {
+        v->Position = start;
+        ValidateFail(v, "instrument index out of range");
+        return -1;
+    }
+
+    *pos = v->Position;
+    if (v->Size - *pos < 2) return 0;
+    uint8_t channelMask = v->Data[*pos];
+    *channel = channelMask & 0b00011111;
+    bool group = *channel == GROUP_CHANNEL && (v->Flags & OPB_FLAG_GROUPS);
+    if (*channel >= NUM_CHANNELS && !group) {
+        ValidateFail(v, "instrument command channel out of range");
+        return -1;
+    }
+
+    // a group's channels follow the masks, then the arguments after them are repeated for every channel
+    size_t channelCount = 1;
+    size_t length = 2;
+    if (group) {
+        uint32_t channels;
+        v->Position = *pos + 2;
+        if (!ValidateUint7(v, &channels)) return -1;
+        if (channels == 0 || channels >= (1u << (NUM_CHANNELS / 2))) {
+            v->Position = start;
+            ValidateFail(v, "instrument command channel group out of range");
+            return -1;
+        }
+        channelCount = (size_t)CountBits(channels);
+        length = v->Position - *pos;
+    }
+
+    length += channelCount * ((isPlay ? 2 : 0) + ((channelMask >> 5) & 1) + ((channelMask >> 6) & 1));
+    if (v->Size - *pos < length) return 0;
+    *pos += length;
+    return 1;
+}
+
+// checks an instrument command and moves pos past it. the second channel of a 4-op pair follows all arguments of the
+// first, and the drum commands end with the value written to 0xBD. returns 0 when the command is cut off by the end
+// of the data and -1 when it's invalid
+static int ValidateInstrumentCommand(Validator* v, size_t* pos, uint64_t instrumentCount) {
+    uint8_t baseAddr = v->Data[*pos];
+    size_t start = (*pos)++;
+    int channel, pairChannel;
+    int result = ValidateInstrumentArgs(v, start, pos, instrumentCount, IsPlayCommand(baseAddr), &channel);
+
+    if (result > 0 && channel == GROUP_CHANNEL && baseAddr > OPB_CMD_PLAYINSTRUMENT) {
+        v->Position = start;
+        ValidateFail(v, "only 0xD0 and 0xD1 can set a group of channels");
+        return -1;
+    }
+    if (result > 0 && IsFourOpCommand(baseAddr)) {
+        result = ValidateInstrumentArgs(v, start, pos, instrumentCount, false, &pairChannel);
+        if (result > 0 && (!IsFourOpFirst(channel) || pairChannel != channel + 3)) {
+            v->Position = start;
+            ValidateFail(v, "4-op command channels aren't a pair");
+            return -1;
+        }
+    }
+    if (result > 0 && IsRhythmCommand(baseAddr)) {
+        if (!IsRhythmChannel(channel)) {
+            v->Position = start;
+            ValidateFail(v, "rhythm command channel isn't a drum channel");
+            return -1;
+        }
+        if (*pos == v->Size) return 0;
+        (*pos)++;
+    }
+    return result;
+}
+
+static bool ValidateChunk(Validator* v, uint64_t instrumentCount) {
+    uint32_t header[3];
+    if (v->Size - v->Position >= CHUNK_HEADER_READ_SIZE) {
+        v->Position += DecodeChunkHeader(v->Data + v->Position, header);
+    }
+    else {
+        for (int i = 0; i < 3; i++) {
+            if (!ValidateUint7(v, header + i)) return false;
+        }
+    }
+
+    v->Time += header[0];
+
+    // every command takes at least 2 bytes, which rejects absurd counts before looping over them
+    uint64_t commandCount = (uint64_t)header[1] + header[2];
+    if (commandCount * 2 > v->Size - v->Position) return ValidateFail(v, "chunk command count exceeds the remaining data");
+
+    if (v->Flags & OPB_FLAG_BACKREF) {
+        size_t dropped;
+        if (AddHistoryChunk(&v->History, v->Time, 0, &dropped)) return ValidateFail(v, "out of memory");
+        if (header[1] == 1 && header[2] == 0 && v->Data[v->Position] == OPB_CMD_BACKREF) {
+            return ValidateBackReference(v);
+        }
+    }
+
+    // the position is kept in a local so the loop doesn't store through the validator after every command
+    const uint8_t* data = v->Data;
+    size_t size = v->Size;
+    size_t pos = v->Position;
+
+    // commands cut off by the end of the data leave the loop early
+    uint64_t i;
+    for (i = 0; i < commandCount; i++) {
+        size_t remaining = size - pos;
+        if (remaining < 2) break;
+
+        uint8_t baseAddr = data[pos];
+
+        // plain register writes make up most of the data, so they're checked first
+        if (baseAddr < OPB_CMD_SETINSTRUMENT || baseAddr > OPB_CMD_NOTEON + 8) {
+            pos += 2;
+        }
+        else if (baseAddr >= OPB_CMD_NOTEON) {
+            // the channel is implied by the register and always in range, only the volume flags add length
+            if (remaining < 3) break;
+            uint8_t note = data[pos + 2];
+            size_t length = 3 + ((note >> 6) & 1) + (note >> 7);
+            if (remaining < length) break;
+            pos += length;
+        }
+        else if (baseAddr > OPB_CMD_PLAYINSTRUMENT && !IsInstrumentCommand(baseAddr, v->Flags)) {
+            // 0xD2-0xD6 aren't special commands and decode as plain writes, except for back references and the
+            // commands of the voices flag
+            if (baseAddr == OPB_CMD_BACKREF && (v->Flags & OPB_FLAG_BACKREF)) {
+                v->Position = pos;
+                return ValidateFail(v, "back reference must be the only command in its chunk");
+            }
+            pos += 2;
+        }
+        else {
+            int result = ValidateInstrumentCommand(v, &pos, instrumentCount);
+            if (result < 0) return false;
+            if (result == 0) break;
+        }
+    }
+
+    v->Position = pos;
+    return i == commandCount || ValidateFail(v, "truncated command");
+}
+
+static int ValidateChunks(Validator* v, uint32_t chunkCount, uint64_t indexCount) {
+    v->History.Chunks = Vector_New(sizeof(HistoryChunk));
+
+    bool valid = true;
+    for (uint32_t i = 0; i < chunkCount && valid; i++) {
+        valid = ValidateChunk(v, indexCount);
+    }
+    Vector_Free(&v->History.Chunks);
+
+    if (!valid) {
+        return OPBERR_INVALID_DATA;
+    }
+
+    if (v->Position != v->Size) {
+        ValidateFail(v, "trailing data after the last chunk");
+        return OPBERR_INVALID_DATA;
+    }
+
+    return 0;
+}
+
+// the longest command the entropy walk can produce, a 4-op command whose channels both claim a group of 32 channels,
+// takes under 300 bytes. valid commands are far shorter
+#define ENTROPY_COMMAND_SIZE 512
+
+// the bytes of the command being checked, decoded straight from the coded chunks
+typedef struct EntropyCommand {
+    EntropyDecoder* Decoder;
+    size_t Size;
+    uint8_t Data[ENTROPY_COMMAND_SIZE];
+} EntropyCommand;
+
+static int NextEntropyByte(void* state, int model) {
+    return DecodeEntropyByte((EntropyDecoder*)state, model);
+}
+
+static int CollectEntropyByte(void* state, int model) {
+    EntropyCommand* command = (EntropyCommand*)state;
+    if (command->Size == ENTROPY_COMMAND_SIZE) return -1;
+
+    int value = DecodeEntropyByte(command->Decoder, model);
+    if (value >= 0) command->Data[command->Size++] = (uint8_t)value;
+    return value;
+}
+
+// decodes a chunk one command at a time, checking each like ValidateChunk does. chunk errors are left without a
+// message when the coded data runs out or holds an unused code
+static bool ValidateEntropyChunk(Validator* v, EntropyCommand* command, uint64_t instrumentCount) {
+    uint32_t header[3];
+    for (int i = 0; i < 3; i++) {
+        if (!WalkUint7(NextEntropyByte, command->Decoder, header + i)) return false;
+    }
+
+    v->Time += header[0];
+
+    if (v->Flags & OPB_FLAG_BACKREF) {
+        size_t dropped;
+        if (AddHistoryChunk(&v->History, v->Time, 0, &dropped)) return ValidateFail(v, "out of memory");
+    }
+
+    uint64_t commandCount = (uint64_t)header[1] + header[2];
+    for (uint64_t i = 0; i < commandCount; i++) {
+        int baseAddr = DecodeEntropyByte(command->Decoder, ENTROPY_MODEL_REGISTER);
+        if (baseAddr < 0) return false;
+
+        if (baseAddr == OPB_CMD_BACKREF && (v->Flags & OPB_FLAG_BACKREF)) {
+            if (header[1] != 1 || header[2] != 0) {
+                return ValidateFail(v, "back reference must be the only command in its chunk");
+            }
+
+            uint32_t distance, lengthField, elapsed;
+            if (!WalkUint7(NextEntropyByte, command->Decoder, &distance) ||
+                !WalkUint7(NextEntropyByte, command->Decoder, &lengthField)) return false;
+            if (!AddValidatedBackReference(v, distance, lengthField)) return false;
+
+            for (uint32_t j = 1; (lengthField & 1) && j < (lengthField >> 1); j++) {
+                if (!WalkUint7(NextEntropyByte, command->Decoder, &elapsed)) return false;
+                v->Time += elapsed;
+            }
+            return true;
+        }
+
+        // only instrument commands have anything to check, so only they are collected
+        if (!IsInstrumentCommand(baseAddr, v->Flags)) {
+            if (!WalkEntropyCommand(baseAddr, v->Flags, NextEntropyByte, command->Decoder)) return false;
+            continue;
+        }
+
+        command->Data[0] = (uint8_t)baseAddr;
+        command->Size = 1;
+        if (!WalkEntropyCommand(baseAddr, v->Flags, CollectEntropyByte, command)) return false;
+
+        Validator check = { command->Data, command->Size, 0, NULL, 0 };
+        check.Flags = v->Flags;
+        size_t pos = 0;
+        if (ValidateInstrumentCommand(&check, &pos, instrumentCount) <= 0) {
+            v->Error = check.Error;
+            return false;
+        }
+    }
+    return true;
+}
+
+// compressed chunks are checked as the entropy decoder produces them, so validation needs no more memory than the
+// default format's does. errors inside the chunks are reported at the start of the coded chunks, because positions in
+// the decoded chunks don't map back to whole bytes
+static int ValidateEntropyChunks(Validator* v, uint32_t chunkCount, uint64_t indexCount) {
+    EntropyCommand command;
+    EntropyDecoder decoder;
+    if (v->Size - v->Position < ENTROPY_TABLE_SIZE) {
+        ValidateFail(v, "truncated entropy code lengths");
+        return OPBERR_INVALID_DATA;
+    }
+    if (!InitEntropyDecoder(&decoder, v->Data + v->Position)) {
+        ValidateFail(v, "invalid entropy code lengths");
+        return OPBERR_INVALID_DATA;
+    }
+    v->Position += ENTROPY_TABLE_SIZE;
+
+    const uint8_t* start = v->Data + v->Position;
+    decoder.Next = start;
+    decoder.End = v->Data + v->Size;
+    command.Decoder = &decoder;
+
+    v->History.Chunks = Vector_New(sizeof(HistoryChunk));
+    bool valid = true;
+    for (uint32_t i = 0; i < chunkCount && valid; i++) {
+        valid = ValidateEntropyChunk(v, &command, indexCount);
+    }
+    Vector_Free(&v->History.Chunks);
+
+    if (!valid) {
+        if (v->Error == NULL) ValidateFail(v, "truncated or invalid entropy coded chunks");
+        return OPBERR_INVALID_DATA;
+    }
+
+    size_t codedSize = (size_t)(((decoder.Next - start) * 8 - decoder.BitCount + 7) / 8);
+    if (codedSize != v->Size - v->Position) {
+        v->Position += codedSize;
+        ValidateFail(v, "trailing data after the last chunk");
+        return OPBERR_INVALID_DATA;
+    }
+
+    v->Position = v->Size;
+    return 0;
+}
+
+static int ValidateOpb(Validator* v) {
+    const uint8_t* data = v->Data;
+
+    if (v->Size < OPB_HEADER_SIZE || memcmp(data, OPB_Header, 5)) {
+        return OPBERR_NOT_AN_OPB_FILE;
+    }
+    char version = (char)data[OPB_VERSION_INDEX];
+    if (version != '1' && version != '2') {
+        v->Position = OPB_VERSION_INDEX;
+        return OPBERR_VERSION_UNSUPPORTED;
+    }
+    if (data[6] != '\0') {
+        v->Position = 6;
+        return OPBERR_NOT_AN_OPB_FILE;
+    }
+
+    v->Position = OPB_HEADER_SIZE;
+    v->TimeBase = OPB_TIMEBASE_MS;
+    if (v->Size < OPB_HEADER_SIZE + 1) {
+        ValidateFail(v, "missing format");
+        return OPBERR_INVALID_DATA;
+    }
+
+    uint8_t fmt = data[v->Position++];
+
+    if (fmt == OPB_Format_Raw) {
+        size_t partial = (v->Size - v->Position) % RAW_ENTRY_SIZE;
+        if (partial != 0) {
+            v->Position = v->Size - partial;
+            ValidateFail(v, "truncated raw entry");
+            return OPBERR_INVALID_DATA;
+        }
+        v->Position = v->Size;
+        return 0;
+    }
+    if (fmt != OPB_Format_Default && fmt != OPB_Format_Compressed) {
+        v->Position--;
+        ValidateFail(v, "unknown format");
+        return OPBERR_INVALID_DATA;
+    }
+
+    size_t headerStart = v->Position;
+    if (v->Size - v->Position < OpbHeaderSize(version, 0)) {
+        ValidateFail(v, "truncated header");
+        return OPBERR_INVALID_DATA;
+    }
+
+    uint32_t header[8] = { 0 };
+    memcpy(header, data + v->Position, OpbHeaderSize(version, 0));
+    uint32_t flags = version == '1' ? 0 : FlipEndian32(header[1]);
+
+    if (flags & ~OPB_KNOWN_FLAGS) {
+        v->Position += 4;
+        return OPBERR_VERSION_UNSUPPORTED;
+    }
+    if (v->Size - v->Position < OpbHeaderSize(version, flags)) {
+        ValidateFail(v, "truncated header");
+        return OPBERR_INVALID_DATA;
+    }
+    memcpy(header, data + v->Position, OpbHeaderSize(version, flags));
+    for (int i = 0; i < 8; i++) header[i] = FlipEndian32(header[i]);
+
+    // version 2 puts the flags after the size, then the dictionary fields, the back reference window and the time
+    // base last
+    size_t countsIndex = version == '1' ? 1 : 2;
+    uint32_t instrumentCount = header[countsIndex];
+    uint32_t chunkCount = header[countsIndex + 1];
+
+    // the dictionary itself isn't needed to check indices, only how many instruments it holds
+    uint64_t indexCount = instrumentCount;
+    if (flags & OPB_FLAG_DICTIONARY) {
+        indexCount += header[4];
+    }
+
+    if (header[0] != v->Size) {
+        ValidateFail(v, "header size doesn't match the size of the data");
+        return OPBERR_INVALID_DATA;
+    }
+    if (flags & OPB_FLAG_BACKREF) {
+        size_t windowIndex = (flags & OPB_FLAG_DICTIONARY) ? 6 : 4;
+        v->History.Window = header[windowIndex];
+        if (v->History.Window == 0 || v->History.Window > BACKREF_MAX_WINDOW) {
+            v->Position += windowIndex * 4;
+            ValidateFail(v, "back reference window out of range");
+            return OPBERR_INVALID_DATA;
+        }
+    }
+    if (flags & OPB_FLAG_TIMEBASE) {
+        size_t timeBaseIndex = OpbHeaderSize(version, flags) / 4 - 1;
+        v->TimeBase = header[timeBaseIndex];
+        if (v->TimeBase == 0) {
+            v->Position += timeBaseIndex * 4;
+            ValidateFail(v, "time base of zero");
+            return OPBERR_INVALID_DATA;
+        }
+    }
+    v->Position += OpbHeaderSize(version, flags);
+
+    // instruments are 9 bytes each and chunks at least 3, so oversized counts are caught before any looping
+    if ((uint64_t)instrumentCount * INSTRUMENT_SIZE > v->Size - v->Position) {
+        v->Position = headerStart + countsIndex * 4;
+        ValidateFail(v, "instrument count exceeds the remaining data");
+        return OPBERR_INVALID_DATA;
+    }
+    v->Position += (size_t)instrumentCount * INSTRUMENT_SIZE;
+    v->Flags = flags;
+
+    if (fmt == OPB_Format_Compressed) {
+        return ValidateEntropyChunks(v, chunkCount, indexCount);
+    }
+
+    if ((uint64_t)chunkCount * 3 > v->Size - v->Position) {
+        v->Position = headerStart + (countsIndex + 1) * 4;
+        ValidateFail(v, "chunk count exceeds the remaining data");
+        return OPBERR_INVALID_DATA;
+    }
+
+    return ValidateChunks(v, chunkCount, indexCount);
+}
+
+int OPB_Validate(const void* data, size_t size, size_t* errorOffset) {
+    Validator v = { (const uint8_t*)data, data != NULL ? size : 0, 0, NULL, 0 };
+
+    int ret = ValidateOpb(&v);
+    if (ret == OPBERR_INVALID_DATA) {
+        Log("Invalid OPB data at offset %zu: %s\n", v.Position, v.Error);
+    }
+    if (ret && errorOffset != NULL) {
+        *errorOffset = v.Position;
+    }
+
+    return ret;
+}
+
+// instrument dictionaries
+static inline uint32_t ReadBE32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void WriteBE32(uint8_t* p, uint32_t value) {
+    p[0] = (uint8_t)(value >> 24);
+    p[1] = (uint8_t)(value >> 16);
+    p[2] = (uint8_t)(value >> 8);
+    p[3] = (uint8_t)value;
+}
+
+// finds the instruments stored in OPB data in memory once the data has been validated. raw data stores none, and
+// compressed data stores them before its coded chunks just like the default format
+static int FindInstrumentTable(const uint8_t* data, size_t size, const uint8_t** table, uint32_t* count, uint32_t* flags) {
+    int ret = OPB_Validate(data, size, NULL);
+    if (ret) return ret;
+
+    *table = NULL;
+    *count = 0;
+    *flags = 0;
+    if (data[OPB_HEADER_SIZE] == OPB_Format_Raw) {
+        return 0;
+    }
+
+    char version = (char)data[OPB_VERSION_INDEX];
+    const uint8_t* header = data + OPB_HEADER_SIZE + 1;
+    if (version != '1') {
+        *flags = ReadBE32(header + 4);
+    }
+    *count = ReadBE32(header + (version == '1' ? 4 : 8));
+    *table = header + OpbHeaderSize(version, *flags);
+    return 0;
+}
+
+// fills in both views of the dictionary from stored instruments, which are stride bytes apart
+static int SetDictionaryInstruments(OPB_Dictionary* dictionary, const uint8_t* values, size_t count, size_t stride) {
+    Vector_Clear(&dictionary->Instruments, true);
+    Vector_Clear(&dictionary->Slots, true);
+    if (Vector_Reserve(&dictionary->Instruments, count) || Vector_Reserve(&dictionary->Slots, count)) {
+        return OPBERR_BUFFER_ERROR;
+    }
+
+    uint32_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < count; i++, values += stride) {
+        Instrument instr;
+        InstrumentSlots slots;
+        UnpackInstrument(values, (int)i, &instr, &slots);
+        Vector_Add(&dictionary->Instruments, &instr);
+        Vector_Add(&dictionary->Slots, &slots);
+        hash = Fnv1a(values, INSTRUMENT_SIZE, hash);
+    }
+
+    dictionary->Id = hash;
+    return 0;
+}
+
+static int CompareCandidateValues(const void* a, const void* b) {
+    return memcmp(((const DictionaryCandidate*)a)->Values, ((const DictionaryCandidate*)b)->Values, INSTRUMENT_SIZE);
+}
+
+static int CompareCandidateFiles(const void* a, const void* b) {
+    uint32_t filesA = ((const DictionaryCandidate*)a)->Files;
+    uint32_t filesB = ((const DictionaryCandidate*)b)->Files;
+    if (filesA != filesB) {
+        return filesA > filesB ? -1 : 1;
+    }
+    return CompareCandidateValues(a, b);
+}
+
+int OPB_NewDictionary(OPB_Dictionary** dictionary) {
+    *dictionary = (OPB_Dictionary*)calloc(1, sizeof(OPB_Dictionary));
+    if (*dictionary == NULL) {
+        return OPBERR_BUFFER_ERROR;
+    }
+
+    (*dictionary)->Instruments = Vector_New(sizeof(Instrument));
+    (*dictionary)->Slots = Vector_New(sizeof(InstrumentSlots));
+    (*dictionary)->Candidates = Vector_New(sizeof(DictionaryCandidate));
+    return 0;
+}
+
+int OPB_DictionaryAddBinary(OPB_Dictionary* dictionary, const void* data, size_t size) {
+    const uint8_t* table;
+    uint32_t count, flags;
+    int ret = FindInstrumentTable((const uint8_t*)data, size, &table, &count, &flags);
+    if (ret) {
+        Log("%s\n", OPB_GetErrorMessage(ret));
+        return ret;
+    }
+
+    // a file counts once per instrument, so its own duplicates are removed before counting
+    Vector added = Vector_New(sizeof(DictionaryCandidate));
+    if (Vector_Reserve(&added, count)) {
+        return OPBERR_BUFFER_ERROR;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        DictionaryCandidate candidate = { { 0 }, 1 };
+        memcpy(candidate.Values, table + (size_t)i * INSTRUMENT_SIZE, INSTRUMENT_SIZE);
+        Vector_Add(&added, &candidate);
+    }
+    Vector_Sort(&added, CompareCandidateValues);
+
+    Vector* candidates = &dictionary->Candidates;
+    size_t known = candidates->Count;
+    DictionaryCandidate* items = (DictionaryCandidate*)added.Storage;
+
+    for (size_t i = 0; i < added.Count && !ret; i++) {
+        if (i > 0 && !CompareCandidateValues(items + i - 1, items + i)) {
+            continue;
+        }
+
+        DictionaryCandidate* found = known > 0 ?
+            (DictionaryCandidate*)bsearch(items + i, candidates->Storage, known, sizeof(DictionaryCandidate), CompareCandidateValues) : NULL;
+        if (found != NULL) {
+            found->Files++;
+        }
+        else if (Vector_Add(candidates, items + i)) {
+            ret = OPBERR_BUFFER_ERROR;
+        }
+    }
+    Vector_Free(&added);
+
+    // new instruments were appended, so the candidates need sorting again for the next file's lookups
+    if (candidates->Count > known) {
+        Vector_Sort(candidates, CompareCandidateValues);
+    }
+    return ret;
+}
+
+int OPB_FinishDictionary(OPB_Dictionary* dictionary, size_t minFiles) {
+    Vector* candidates = &dictionary->Candidates;
+    DictionaryCandidate* items = (DictionaryCandidate*)candidates->Storage;
+
+    size_t kept = 0;
+    for (size_t i = 0; i < candidates->Count; i++) {
+        if (items[i].Files >= minFiles) {
+            items[kept++] = items[i];
+        }
+    }
+    candidates->Count = kept;
+
+    // the most widely shared instruments get the lowest indices, which take the fewest bytes to store
+    Vector_Sort(candidates, CompareCandidateFiles);
+
+    int ret = SetDictionaryInstruments(dictionary, (const uint8_t*)candidates->Storage, kept, sizeof(DictionaryCandidate));
+    Vector_Free(candidates);
+    return ret;
+}
+
+int OPB_DictionaryFromMemory(const void* data, size_t size, OPB_Dictionary** dictionary) {
+    const uint8_t* table;
+    uint32_t count, flags;
+    *dictionary = NULL;
+
+    int ret = FindInstrumentTable((const uint8_t*)data, size, &table, &count, &flags);
+    if (!ret && (flags & OPB_FLAG_DICTIONARY)) {
+        Log("Data encoded with a dictionary can't be used as a dictionary\n");
+        ret = OPBERR_LOGGED;
+    }
+    if (!ret) {
+        ret = OPB_NewDictionary(dictionary);
+    }
+    if (!ret) {
+        ret = SetDictionaryInstruments(*dictionary, table, count, INSTRUMENT_SIZE);
+    }
+
+    if (ret) {
+        OPB_FreeDictionary(*dictionary);
+        *dictionary = NULL;
+        Log("%s\n", OPB_GetErrorMessage(ret));
+    }
+    return ret;
+}
+
+int OPB_DictionaryToMemory(const OPB_Dictionary* dictionary, void** buffer, size_t* size) {
+    size_t count = DictionaryCount(dictionary);
+    size_t length = OPB_HEADER_SIZE + 1 + OpbHeaderSize('1', 0) + count * INSTRUMENT_SIZE;
+
+    uint8_t* data = (uint8_t*)malloc(length);
+    if (data == NULL) {
+        return OPBERR_BUFFER_ERROR;
+    }
+
+    // a version 1 file without chunks, so any OPB reader can inspect the instruments
+    memcpy(data, OPB_Header, OPB_HEADER_SIZE);
+    data[OPB_HEADER_SIZE] = OPB_Format_Default;
+    WriteBE32(data + OPB_HEADER_SIZE + 1, (uint32_t)length);
+    WriteBE32(data + OPB_HEADER_SIZE + 5, (uint32_t)count);
+    WriteBE32(data + OPB_HEADER_SIZE + 9, 0);
+
+    uint8_t* table = data + OPB_HEADER_SIZE + 1 + OpbHeaderSize('1', 0);
+    for (size_t i = 0; i < count; i++) {
+        PackInstrument((const Instrument*)dictionary->Instruments.Storage + i, table + i * INSTRUMENT_SIZE);
+    }
+
+    *buffer = data;
+    *size = length;
+    return 0;
+}
+
+size_t OPB_DictionaryCount(const OPB_Dictionary* dictionary) {
+    return DictionaryCount(dictionary);
+}
 
-    if (*index >= DEFAULT_READBUFFER_SIZE) {
-        SUBMIT(buffer, DEFAULT_READBUFFER_SIZE, context);
-        *index = 0;
+void OPB_FreeDictionary(OPB_Dictionary* dictionary) {
+    if (dictionary == NULL) {
+        return;
     }
-
-    return 0;
+    Vector_Free(&dictionary->Instruments);
+    Vector_Free(&dictionary->Slots);
+    Vector_Free(&dictionary->Candidates);
+    free(dictionary);
 }
 
-#define ADD_TO_BUFFER_IMPL(retvar, context, buffer, index, ...) \
-    { int retvar; \
-    if ((retvar = AddToBuffer(context, buffer, bufferIndex, (OPB_Command) __VA_ARGS__))) return retvar; }
-#define ADD_TO_BUFFER(context, buffer, index, ...) ADD_TO_BUFFER_IMPL(MACRO_CONCAT(__ret, __LINE__), context, buffer, index, __VA_ARGS__)
+// archives
+// a 32 byte header, a directory of fixed size entries sorted by name hash, the names, the dictionary and then the
+// tracks. the dictionary and every track start on an 8 byte boundary, so tracks can be used straight from a mapping
+#define ARCHIVE_HEADER_SIZE 32
+#define ARCHIVE_ENTRY_SIZE 32
+#define ARCHIVE_ALIGNMENT 8
+// OPBar1\0
+const char OPB_ArchiveHeader[OPB_HEADER_SIZE] = { 'O', 'P', 'B', 'a', 'r', '1', '\0' };
+
+struct OPB_Archive {
+    const uint8_t* Data;
+    size_t Size;
+    uint32_t TrackCount;
+    OPB_Dictionary* Dictionary;
+    void* Mapping;          // set when the archive was mapped by OPB_MapArchive
+    size_t MappingSize;
+};
 
-static int ReadCommand(Context* context, OPB_Command* buffer, int* bufferIndex, int mask) {
-    uint8_t baseAddr;
-    READ(&baseAddr, sizeof(uint8_t), 1, context);
+typedef struct ArchiveTrack {
+    const OPB_ArchiveEntry* Entry;
+    uint32_t NameHash;
+    uint32_t NameLength;
+    uint32_t Duration;
+    uint32_t Offset;
+} ArchiveTrack;
+
+static int CompareArchiveTracks(const void* a, const void* b) {
+    const ArchiveTrack* trackA = (const ArchiveTrack*)a;
+    const ArchiveTrack* trackB = (const ArchiveTrack*)b;
+    if (trackA->NameHash != trackB->NameHash) {
+        return trackA->NameHash < trackB->NameHash ? -1 : 1;
+    }
+    return strcmp(trackA->Entry->Name, trackB->Entry->Name);
+}
 
-    int addr = baseAddr | mask;
+static inline size_t AlignArchiveOffset(size_t offset) {
+    return (offset + ARCHIVE_ALIGNMENT - 1) & ~(size_t)(ARCHIVE_ALIGNMENT - 1);
+}
 
-    switch (baseAddr) {
-        default: {
-            uint8_t data;
-            READ(&data, sizeof(uint8_t), 1, context);
-            ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)addr, data, context->Time });
-            break;
-        }
-        
-        case OPB_CMD_PLAYINSTRUMENT:
-        case OPB_CMD_SETINSTRUMENT: {
-            int instrIndex;
-            READ_UINT7(instrIndex, context);
+// checks a track's data and finds its duration. raw data has no chunks, so its records are added up instead
+static int MeasureArchiveTrack(const OPB_ArchiveEntry* entry, const OPB_Dictionary* dictionary, uint32_t* duration) {
+    const uint8_t* data = (const uint8_t*)entry->Data;
+    Validator v = { data, data != NULL ? entry->Size : 0, 0, NULL, 0 };
 
-            uint8_t channelMask[2];
-            READ(channelMask, sizeof(uint8_t), 2, context);
+    int ret = ValidateOpb(&v);
+    if (ret) {
+        Log("Track '%s' is not valid OPB data\n", entry->Name);
+        return ret;
+    }
 
-            int channel = channelMask[0];
-            bool modLvl = (channel & 0b00100000) != 0;
-            bool carLvl = (channel & 0b01000000) != 0;
-            bool feedconn = (channel & 0b10000000) != 0;
-            channel &= 0b00011111;
+    if (data[OPB_HEADER_SIZE] == OPB_Format_Raw) {
+        for (size_t pos = OPB_HEADER_SIZE + 1; pos < entry->Size; pos += RAW_ENTRY_SIZE) {
+            v.Time += (data[pos] << 8) | data[pos + 1];
+        }
+    }
+    else if (data[OPB_VERSION_INDEX] != '1' && (ReadBE32(data + OPB_HEADER_SIZE + 5) & OPB_FLAG_DICTIONARY)) {
+        const uint8_t* header = data + OPB_HEADER_SIZE + 1;
+        if (DictionaryCount(dictionary) != ReadBE32(header + 16) || dictionary->Id != ReadBE32(header + 20)) {
+            Log("Track '%s' was encoded with a different dictionary than the archive's\n", entry->Name);
+            return OPBERR_DICTIONARY_MISMATCH;
+        }
+    }
 
-            if (channel < 0 || channel >= NUM_CHANNELS) {
-                Log("Error reading OPB command: channel %d out of range\n", channel);
-                return OPBERR_LOGGED;
-            }
+    // durations are stored in milliseconds whatever the track's time base
+    uint64_t ms = v.Time / v.TimeBase * OPB_TIMEBASE_MS + ((v.Time % v.TimeBase) * OPB_TIMEBASE_MS + v.TimeBase / 2) / v.TimeBase;
+    *duration = ms < OPB_NO_LOOP ? (uint32_t)ms : OPB_NO_LOOP - 1;
+    return 0;
+}
 
-            int chmask = channelMask[1];
-            bool modChr = (chmask & 0b00000001) != 0;
-            bool modAtk = (chmask & 0b00000010) != 0;
-            bool modSus = (chmask & 0b00000100) != 0;
-            bool modWav = (chmask & 0b00001000) != 0;
-            bool carChr = (chmask & 0b00010000) != 0;
-            bool carAtk = (chmask & 0b00100000) != 0;
-            bool carSus = (chmask & 0b01000000) != 0;
-            bool carWav = (chmask & 0b10000000) != 0;
-
-            uint8_t freq = 0, note = 0;
-            bool isPlay = baseAddr == OPB_CMD_PLAYINSTRUMENT;
-            if (isPlay) {
-                READ(&freq, sizeof(uint8_t), 1, context);
-                READ(&note, sizeof(uint8_t), 1, context);
-            }
+static int WriteArchivePadding(OPB_StreamWriter write, void* userData, size_t* position) {
+    static const uint8_t zeros[ARCHIVE_ALIGNMENT] = { 0 };
+    size_t padding = AlignArchiveOffset(*position) - *position;
+    if (padding > 0 && write(zeros, sizeof(uint8_t), padding, userData) != padding) {
+        return OPBERR_WRITE_ERROR;
+    }
+    *position += padding;
+    return 0;
+}
 
-            uint8_t modLvlData = 0, carLvlData = 0;
-            if (modLvl) READ(&modLvlData, sizeof(uint8_t), 1, context);
-            if (carLvl) READ(&carLvlData, sizeof(uint8_t), 1, context);
+static int WriteArchiveData(OPB_StreamWriter write, void* userData, const void* data, size_t size, size_t* position) {
+    if (size > 0 && write(data, sizeof(uint8_t), size, userData) != size) {
+        return OPBERR_WRITE_ERROR;
+    }
+    *position += size;
+    return 0;
+}
 
-            if (instrIndex < 0 || instrIndex >= context->Instruments.Count) {
-                Log("Error reading OPB command: instrument %d out of range\n", instrIndex);
-                return OPBERR_LOGGED;
-            }
+static int WriteArchiveTracks(ArchiveTrack* tracks, size_t count, const OPB_Dictionary* dictionary,
+    OPB_StreamWriter write, void* userData) {
+    for (size_t i = 0; i < count; i++) {
+        const OPB_ArchiveEntry* entry = tracks[i].Entry;
+        int ret = MeasureArchiveTrack(entry, dictionary, &tracks[i].Duration);
+        if (ret) return ret;
 
-            Instrument* instr = Vector_GetT(Instrument, &context->Instruments, instrIndex);
-            int conn = ChannelToOffset[channel];
-            int mod = OperatorOffsets[ChannelToOp[channel]];
-            int car = mod + 3;
-            int playOffset = ChannelToOffset[channel];
-
-            if (feedconn) ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)(REG_FEEDCONN + conn), (uint8_t)instr->FeedConn, context->Time });
-            if (modChr)   ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)(REG_CHARACTER + mod), (uint8_t)instr->Modulator.Characteristic, context->Time });
-            if (modLvl)   ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)(REG_LEVELS + mod), modLvlData, context->Time });
-            if (modAtk)   ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)(REG_ATTACK + mod), (uint8_t)instr->Modulator.AttackDecay, context->Time });
-            if (modSus)   ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)(REG_SUSTAIN + mod), (uint8_t)instr->Modulator.SustainRelease, context->Time });
-            if (modWav)   ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)(REG_WAVE + mod), (uint8_t)instr->Modulator.WaveSelect, context->Time });
-            if (carChr)   ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)(REG_CHARACTER + car), (uint8_t)instr->Carrier.Characteristic, context->Time });
-            if (carLvl)   ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)(REG_LEVELS + car), carLvlData, context->Time });
-            if (carAtk)   ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)(REG_ATTACK + car), (uint8_t)instr->Carrier.AttackDecay, context->Time });
-            if (carSus)   ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)(REG_SUSTAIN + car), (uint8_t)instr->Carrier.SustainRelease, context->Time });
-            if (carWav)   ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)(REG_WAVE + car), (uint8_t)instr->Carrier.WaveSelect, context->Time });
-            if (isPlay) {
-                ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)(REG_FREQUENCY + playOffset), freq, context->Time });
-                ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)(REG_NOTE + playOffset), note, context->Time });
-            }
+        size_t nameLength = strlen(entry->Name);
+        if (nameLength > UINT32_MAX || entry->Size > UINT32_MAX) {
+            Log("Track '%s' is too large for an archive\n", entry->Name);
+            return OPBERR_LOGGED;
+        }
+        tracks[i].NameLength = (uint32_t)nameLength;
+        tracks[i].NameHash = Fnv1a((const uint8_t*)entry->Name, nameLength, FNV_OFFSET_BASIS);
+    }
 
-            break;
+    qsort(tracks, count, sizeof(ArchiveTrack), CompareArchiveTracks);
+    for (size_t i = 1; i < count; i++) {
+        if (!CompareArchiveTracks(tracks + i - 1, tracks + i)) {
+            Log("Archive has more than one track named '%s'\n", tracks[i].Entry->Name);
+            return OPBERR_LOGGED;
         }
+    }
 
-        case OPB_CMD_NOTEON:
-        case OPB_CMD_NOTEON + 1:
-        case OPB_CMD_NOTEON + 2:
-        case OPB_CMD_NOTEON + 3:
-        case OPB_CMD_NOTEON + 4:
-        case OPB_CMD_NOTEON + 5:
-        case OPB_CMD_NOTEON + 6:
-        case OPB_CMD_NOTEON + 7:
-        case OPB_CMD_NOTEON + 8: {
-            int channel = (baseAddr - 0xD7) + (mask != 0 ? 9 : 0);
+    // lay the archive out before writing anything, as the header and directory hold the offsets
+    void* dictionaryData = NULL;
+    size_t dictionarySize = 0;
+    if (DictionaryCount(dictionary) > 0) {
+        int ret = OPB_DictionaryToMemory(dictionary, &dictionaryData, &dictionarySize);
+        if (ret) return ret;
+    }
 
-            if (channel < 0 || channel >= NUM_CHANNELS) {
-                Log("Error reading OPB command: channel %d out of range\n", channel);
-                return OPBERR_LOGGED;
-            }
+    size_t namesOffset = ARCHIVE_HEADER_SIZE + count * ARCHIVE_ENTRY_SIZE;
+    size_t namesSize = 0;
+    for (size_t i = 0; i < count; i++) {
+        namesSize += tracks[i].NameLength + 1;
+    }
 
-            uint8_t freqNote[2];
-            READ(freqNote, sizeof(uint8_t), 2, context);
+    size_t dictionaryOffset = AlignArchiveOffset(namesOffset + namesSize);
+    uint64_t size = AlignArchiveOffset(dictionaryOffset + dictionarySize);
+    for (size_t i = 0; i < count; i++) {
+        tracks[i].Offset = (uint32_t)size;
+        size = AlignArchiveOffset((size_t)size + tracks[i].Entry->Size);
+        if (size > UINT32_MAX) {
+            free(dictionaryData);
+            Log("Archive is larger than 4 GB\n");
+            return OPBERR_LOGGED;
+        }
+    }
 
-            uint8_t freq = freqNote[0];
-            uint8_t note = freqNote[1];
+    uint8_t header[ARCHIVE_HEADER_SIZE] = { 0 };
+    memcpy(header, OPB_ArchiveHeader, OPB_HEADER_SIZE);
+    WriteBE32(header + 8, (uint32_t)size);
+    WriteBE32(header + 12, (uint32_t)count);
+    WriteBE32(header + 16, dictionarySize > 0 ? (uint32_t)dictionaryOffset : 0);
+    WriteBE32(header + 20, (uint32_t)dictionarySize);
+    WriteBE32(header + 24, (uint32_t)namesOffset);
+    WriteBE32(header + 28, (uint32_t)namesSize);
+
+    size_t position = 0;
+    int ret = WriteArchiveData(write, userData, header, ARCHIVE_HEADER_SIZE, &position);
+
+    uint32_t nameOffset = (uint32_t)namesOffset;
+    for (size_t i = 0; i < count && !ret; i++) {
+        uint8_t entry[ARCHIVE_ENTRY_SIZE] = { 0 };
+        WriteBE32(entry, tracks[i].NameHash);
+        WriteBE32(entry + 4, nameOffset);
+        WriteBE32(entry + 8, tracks[i].NameLength);
+        WriteBE32(entry + 12, tracks[i].Offset);
+        WriteBE32(entry + 16, (uint32_t)tracks[i].Entry->Size);
+        WriteBE32(entry + 20, tracks[i].Duration);
+        WriteBE32(entry + 24, tracks[i].Entry->LoopPoint);
+        ret = WriteArchiveData(write, userData, entry, ARCHIVE_ENTRY_SIZE, &position);
+        nameOffset += tracks[i].NameLength + 1;
+    }
 
-            ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)(addr - (OPB_CMD_NOTEON - REG_FREQUENCY)), freq, context->Time });
-            ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)(addr - (OPB_CMD_NOTEON - REG_NOTE)), (uint8_t)(note & 0b00111111), context->Time });
+    for (size_t i = 0; i < count && !ret; i++) {
+        ret = WriteArchiveData(write, userData, tracks[i].Entry->Name, tracks[i].NameLength + 1, &position);
+    }
 
-            if ((note & 0b01000000) != 0) {
-                // set modulator volume
-                uint8_t vol;
-                READ(&vol, sizeof(uint8_t), 1, context);
-                int reg = REG_LEVELS + OperatorOffsets[ChannelToOp[channel]];
-                ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)reg, vol, context->Time });
-            }
-            if ((note & 0b10000000) != 0) {
-                // set carrier volume
-                uint8_t vol;
-                READ(&vol, sizeof(uint8_t), 1, context);
-                int reg = REG_LEVELS + 3 + OperatorOffsets[ChannelToOp[channel]];
-                ADD_TO_BUFFER(context, buffer, bufferIndex, { (uint16_t)reg, vol, context->Time });
-            }
-            break;
+    if (!ret) ret = WriteArchivePadding(write, userData, &position);
+    if (!ret) ret = WriteArchiveData(write, userData, dictionaryData, dictionarySize, &position);
+    free(dictionaryData);
+
+    for (size_t i = 0; i < count && !ret; i++) {
+        if (!(ret = WriteArchivePadding(write, userData, &position))) {
+            ret = WriteArchiveData(write, userData, tracks[i].Entry->Data, tracks[i].Entry->Size, &position);
         }
     }
+    if (!ret) ret = WriteArchivePadding(write, userData, &position);
 
-    return 0;
+    if (ret) {
+        Log("OPB write error occurred while writing archive\n");
+    }
+    return ret;
 }
 
-static int ReadChunk(Context* context, OPB_Command* buffer, int* bufferIndex) {
-    int elapsed, loCount, hiCount;
-
-    READ_UINT7(elapsed, context);
-    READ_UINT7(loCount, context);
-    READ_UINT7(hiCount, context);
-
-    context->Time += elapsed / 1000.0;
+int OPB_WriteArchive(const OPB_ArchiveEntry* entries, size_t count, const OPB_Dictionary* dictionary,
+    OPB_StreamWriter write, void* userData) {
+    if (count > (UINT32_MAX - ARCHIVE_HEADER_SIZE) / ARCHIVE_ENTRY_SIZE) {
+        Log("Too many tracks for an archive\n");
+        return OPBERR_LOGGED;
+    }
 
-    for (int i = 0; i < loCount; i++) {
-        int ret = ReadCommand(context, buffer, bufferIndex, 0x0);
-        if (ret) return ret;
+    ArchiveTrack* tracks = (ArchiveTrack*)calloc(count > 0 ? count : 1, sizeof(ArchiveTrack));
+    if (tracks == NULL) {
+        return OPBERR_BUFFER_ERROR;
     }
-    for (int i = 0; i < hiCount; i++) {
-        int ret = ReadCommand(context, buffer, bufferIndex, 0x100);
-        if (ret) return ret;
+    for (size_t i = 0; i < count; i++) {
+        tracks[i].Entry = entries + i;
     }
 
-    return 0;
+    int ret = WriteArchiveTracks(tracks, count, dictionary, write, userData);
+    free(tracks);
+
+    if (ret && ret != OPBERR_LOGGED) {
+        Log("%s\n", OPB_GetErrorMessage(ret));
+    }
+    return ret;
 }
 
-static int ReadOpbDefault(Context* context) {
-    uint32_t header[3];
-    READ(header, sizeof(uint32_t), 3, context);
-    for (int i = 0; i < 3; i++) header[i] = FlipEndian32(header[i]);
+static int ArchiveFail(const char* error) {
+    Log("Invalid OPB archive: %s\n", error);
+    return OPBERR_INVALID_DATA;
+}
 
-    uint32_t instrumentCount = header[1];
-    uint32_t chunkCount = header[2];
+// checks everything the directory points at, so looking tracks up never needs bounds checks. the tracks themselves
+// aren't validated, use OPB_Validate on tracks from untrusted archives
+static int CheckArchive(OPB_Archive* archive) {
+    const uint8_t* data = archive->Data;
 
-    for (uint32_t i = 0; i < instrumentCount; i++) {
-        Instrument instr;
-        int ret = ReadInstrument(context, &instr);
-        if (ret) return ret;
-        Vector_Add(&context->Instruments, &instr);
+    if (archive->Size < ARCHIVE_HEADER_SIZE || memcmp(data, OPB_ArchiveHeader, OPB_VERSION_INDEX)) {
+        return OPBERR_NOT_AN_OPB_FILE;
+    }
+    if (data[OPB_VERSION_INDEX] != '1') {
+        return OPBERR_VERSION_UNSUPPORTED;
+    }
+    if (ReadBE32(data + 8) != archive->Size) {
+        return ArchiveFail("header size doesn't match the size of the data");
     }
 
-    OPB_Command buffer[DEFAULT_READBUFFER_SIZE];
-    int bufferIndex = 0;
+    uint32_t count = ReadBE32(data + 12);
+    if ((uint64_t)count * ARCHIVE_ENTRY_SIZE > archive->Size - ARCHIVE_HEADER_SIZE) {
+        return ArchiveFail("track count exceeds the size of the data");
+    }
 
-    for (uint32_t i = 0; i < chunkCount; i++) {
-        int ret = ReadChunk(context, buffer, &bufferIndex);
-        if (ret) return ret;
+    uint64_t namesOffset = ReadBE32(data + 24);
+    uint64_t namesEnd = namesOffset + ReadBE32(data + 28);
+    if (namesOffset < ARCHIVE_HEADER_SIZE + (uint64_t)count * ARCHIVE_ENTRY_SIZE || namesEnd > archive->Size) {
+        return ArchiveFail("names out of range");
     }
 
-    if (bufferIndex > 0) {
-        SUBMIT(buffer, bufferIndex, context);
+    uint32_t lastHash = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t* entry = data + ARCHIVE_HEADER_SIZE + (size_t)i * ARCHIVE_ENTRY_SIZE;
+        uint32_t hash = ReadBE32(entry);
+        uint64_t nameOffset = ReadBE32(entry + 4);
+        uint64_t nameLength = ReadBE32(entry + 8);
+        uint64_t offset = ReadBE32(entry + 12);
+
+        if (hash < lastHash) {
+            return ArchiveFail("directory isn't sorted");
+        }
+        if (nameOffset < namesOffset || nameOffset + nameLength >= namesEnd || data[nameOffset + nameLength] != '\0') {
+            return ArchiveFail("track name out of range");
+        }
+        if (offset % ARCHIVE_ALIGNMENT != 0 || offset + ReadBE32(entry + 16) > archive->Size) {
+            return ArchiveFail("track data out of range");
+        }
+        lastHash = hash;
     }
+    archive->TrackCount = count;
 
+    uint64_t dictionaryOffset = ReadBE32(data + 16);
+    uint64_t dictionarySize = ReadBE32(data + 20);
+    if (dictionarySize > 0) {
+        if (dictionaryOffset + dictionarySize > archive->Size) {
+            return ArchiveFail("dictionary out of range");
+        }
+        return OPB_DictionaryFromMemory(data + dictionaryOffset, (size_t)dictionarySize, &archive->Dictionary);
+    }
     return 0;
 }
 
-#define RAW_READBUFFER_SIZE 256
-#define RAW_ENTRY_SIZE 5
+int OPB_OpenArchive(const void* data, size_t size, OPB_Archive** archive) {
+    *archive = (OPB_Archive*)calloc(1, sizeof(OPB_Archive));
+    if (*archive == NULL) {
+        return OPBERR_BUFFER_ERROR;
+    }
+    (*archive)->Data = (const uint8_t*)data;
+    (*archive)->Size = data != NULL ? size : 0;
 
-static int ReadOpbRaw(Context* context) {
-    double time = 0;
-    uint8_t buffer[RAW_READBUFFER_SIZE * RAW_ENTRY_SIZE];
-    OPB_Command commandStream[RAW_READBUFFER_SIZE];
+    int ret = CheckArchive(*archive);
+    if (ret) {
+        OPB_CloseArchive(*archive);
+        *archive = NULL;
+        Log("%s\n", OPB_GetErrorMessage(ret));
+    }
+    return ret;
+}
 
-    size_t itemsRead;
-    while ((itemsRead = context->Read(buffer, RAW_ENTRY_SIZE, RAW_READBUFFER_SIZE, context->UserData)) > 0) {
-        uint8_t* value = buffer;
+static void UnmapArchive(void* mapping, size_t size) {
+#ifdef _WIN32
+    UnmapViewOfFile(mapping);
+#else
+    munmap(mapping, size);
+#endif
+}
 
-        for (int i = 0; i < itemsRead; i++, value += RAW_ENTRY_SIZE) {
-            uint16_t elapsed = (value[0] << 8) | value[1];
-            uint16_t addr = (value[2] << 8) | value[3];
-            uint8_t data = value[4];
+int OPB_MapArchive(const char* file, OPB_Archive** archive) {
+    void* mapping = NULL;
+    size_t size = 0;
+    *archive = NULL;
 
-            time += elapsed / 1000.0;
-            
-            OPB_Command cmd = {
-                addr,
-                data,
-                time
-            };
-            commandStream[i] = cmd;
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(file, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle != INVALID_HANDLE_VALUE) {
+        LARGE_INTEGER fileSize;
+        if (GetFileSizeEx(handle, &fileSize) && fileSize.QuadPart > 0 && (uint64_t)fileSize.QuadPart <= SIZE_MAX) {
+            // the view keeps the mapping and the file open, so both handles can be closed right away
+            HANDLE fileMapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (fileMapping != NULL) {
+                mapping = MapViewOfFile(fileMapping, FILE_MAP_READ, 0, 0, 0);
+                size = (size_t)fileSize.QuadPart;
+                CloseHandle(fileMapping);
+            }
+        }
+        CloseHandle(handle);
+    }
+#else
+    int fd = open(file, O_RDONLY);
+    if (fd >= 0) {
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            // the mapping keeps the file open, so the descriptor can be closed right away
+            size = (size_t)info.st_size;
+            mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping == MAP_FAILED) mapping = NULL;
         }
-        SUBMIT(commandStream, itemsRead, context);
+        close(fd);
+    }
+#endif
+
+    if (mapping == NULL) {
+        Log("Couldn't map file '%s' for reading\n", file);
+        return OPBERR_LOGGED;
+    }
+
+    int ret = OPB_OpenArchive(mapping, size, archive);
+    if (ret) {
+        UnmapArchive(mapping, size);
+        return ret;
     }
 
+    (*archive)->Mapping = mapping;
+    (*archive)->MappingSize = size;
     return 0;
 }
 
-static int ConvertFromOpb(Context* context) {
-    char id[OPB_HEADER_SIZE + 1] = { 0 };
-    READ(id, sizeof(char), OPB_HEADER_SIZE, context);
-
-    if (strncmp(id, "OPBin", 5)) {
-        return OPBERR_NOT_AN_OPB_FILE;
+void OPB_CloseArchive(OPB_Archive* archive) {
+    if (archive == NULL) {
+        return;
     }
-
-    switch (id[5]) {
-    case '1':
-        break;
-    default:
-        return OPBERR_VERSION_UNSUPPORTED;
+    if (archive->Mapping != NULL) {
+        UnmapArchive(archive->Mapping, archive->MappingSize);
     }
+    OPB_FreeDictionary(archive->Dictionary);
+    free(archive);
+}
 
-    if (id[6] != '\0') {
-        return OPBERR_NOT_AN_OPB_FILE;
-    }
+size_t OPB_ArchiveTrackCount(const OPB_Archive* archive) {
+    return archive->TrackCount;
+}
 
-    uint8_t fmt;
-    READ(&fmt, sizeof(uint8_t), 1, context);
+const OPB_Dictionary* OPB_ArchiveDictionary(const OPB_Archive* archive) {
+    return archive->Dictionary;
+}
 
-    switch (fmt) {
-    default:
-        Log("Error reading OPB file: unknown format %d\n", fmt);
-        return OPBERR_LOGGED;
-    case OPB_Format_Default:
-        return ReadOpbDefault(context);
-    case OPB_Format_Raw:
-        return ReadOpbRaw(context);
+int OPB_ArchiveGetTrack(const OPB_Archive* archive, size_t index, OPB_ArchiveTrack* track) {
+    if (index >= archive->TrackCount) {
+        return OPBERR_TRACK_NOT_FOUND;
     }
-}
 
-static size_t ReadFromFile(void* buffer, size_t elementSize, size_t elementCount, void* context) {
-    return fread(buffer, elementSize, elementCount, (FILE*)context);
+    const uint8_t* entry = archive->Data + ARCHIVE_HEADER_SIZE + index * ARCHIVE_ENTRY_SIZE;
+    track->Name = (const char*)archive->Data + ReadBE32(entry + 4);
+    track->Data = archive->Data + ReadBE32(entry + 12);
+    track->Size = ReadBE32(entry + 16);
+    track->Duration = ReadBE32(entry + 20);
+    track->LoopPoint = ReadBE32(entry + 24);
+    return 0;
 }
 
-int OPB_FileToOpl(const char* file, OPB_BufferReceiver receiver, void* receiverData) {
-    FILE* inFile;
-    if ((inFile = fopen(file, "rb")) == NULL) {
-        Log("Couldn't open file '%s' for reading\n", file);
-        return OPBERR_LOGGED;
+int OPB_ArchiveFindTrack(const OPB_Archive* archive, const char* name, OPB_ArchiveTrack* track) {
+    size_t nameLength = strlen(name);
+    uint32_t hash = Fnv1a((const uint8_t*)name, nameLength, FNV_OFFSET_BASIS);
+    const uint8_t* directory = archive->Data + ARCHIVE_HEADER_SIZE;
+
+    // first entry with this hash, then the names of every entry that shares it are compared
+    size_t first = 0, last = archive->TrackCount;
+    while (first < last) {
+        size_t middle = first + (last - first) / 2;
+        if (ReadBE32(directory + middle * ARCHIVE_ENTRY_SIZE) < hash) first = middle + 1;
+        else last = middle;
     }
-    int ret = OPB_BinaryToOpl(ReadFromFile, inFile, receiver, receiverData);
-    fclose(inFile);
-    return ret;
+
+    for (size_t i = first; i < archive->TrackCount; i++) {
+        const uint8_t* entry = directory + i * ARCHIVE_ENTRY_SIZE;
+        if (ReadBE32(entry) != hash) {
+            break;
+        }
+        if (ReadBE32(entry + 8) == nameLength && !memcmp(archive->Data + ReadBE32(entry + 4), name, nameLength)) {
+            return OPB_ArchiveGetTrack(archive, i, track);
+        }
+    }
+    return OPBERR_TRACK_NOT_FOUND;
 }
 
-int OPB_BinaryToOpl(OPB_StreamReader reader, void* readerData, OPB_BufferReceiver receiver, void* receiverData) {
+static int MemoryToTicks(const void* data, size_t size, OPB_TickReceiver receiver, void* receiverData,
+    const OPB_DecodeOptions* options, bool rawOnly) {
     Context context = { 0 };
+    Context source = { 0 };
 
-    context.Read = reader;
-    context.Submit = receiver;
-    context.UserData = readerData;
+    context.Memory = (const uint8_t*)data;
+    context.MemorySize = size;
+    context.SubmitTicks = receiver;
     context.ReceiverData = receiverData;
-    context.Instruments = Vector_New(sizeof(Instrument));
+    context.RawTicksOnly = rawOnly;
+    context.InstrumentData = Vector_New(INSTRUMENT_SIZE);
+    context.TickBuffer = Vector_New(sizeof(OPB_TickCommand));
+    context.History = Vector_New(sizeof(uint32_t));
+    context.HistoryChunks.Chunks = Vector_New(sizeof(HistoryChunk));
+    context.BatchSize = GetBatchSize(options);
+    context.Dictionary = options != NULL ? options->Dictionary : NULL;
+
+    if (options != NULL && options->Stats != NULL) {
+        memset(options->Stats, 0, sizeof(OPB_DecodeStats));
+        context.DecodeOptions = options;
+        context.StartTime = GetClock();
+
+        // raw records are counted as they're decoded in place, chunks count their reads through a reader
+        if (size <= OPB_HEADER_SIZE || ((const uint8_t*)data)[OPB_HEADER_SIZE] != OPB_Format_Raw) {
+            source.Memory = context.Memory;
+            source.MemorySize = size;
+            context.Memory = NULL;
+            context.SourceRead = ReadFromMemory;
+            context.SourceData = &source;
+            context.Read = ReadWithStats;
+            context.UserData = &context;
+        }
+    }
 
     int ret = ConvertFromOpb(&context);
+    if (context.DecodeOptions != NULL) {
+        options->Stats->TotalTime = GetClock() - context.StartTime;
+    }
     Context_Free(&context);
 
     if (ret) {
@@ -1477,6 +6531,103 @@ int OPB_BinaryToOpl(OPB_StreamReader reader, void* readerData, OPB_BufferReceive
     return ret;
 }
 
+int OPB_RawMemoryToTicks(const void* data, size_t size, OPB_TickReceiver receiver, void* receiverData,
+    const OPB_DecodeOptions* options) {
+    return MemoryToTicks(data, size, receiver, receiverData, options, true);
+}
+
+int OPB_MemoryToTicks(const void* data, size_t size, OPB_TickReceiver receiver, void* receiverData,
+    const OPB_DecodeOptions* options) {
+    return MemoryToTicks(data, size, receiver, receiverData, options, false);
+}
+
+int OPB_GetTimeBase(const void* data, size_t size, uint32_t* timeBase) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    if (bytes == NULL || size < OPB_HEADER_SIZE + 1 || memcmp(bytes, OPB_Header, 5) || bytes[6] != '\0') {
+        return OPBERR_NOT_AN_OPB_FILE;
+    }
+
+    char version = (char)bytes[OPB_VERSION_INDEX];
+    if (version != '1' && version != '2') {
+        return OPBERR_VERSION_UNSUPPORTED;
+    }
+
+    *timeBase = OPB_TIMEBASE_MS;
+    if (version == '1' || bytes[OPB_HEADER_SIZE] == OPB_Format_Raw) {
+        return 0;
+    }
+
+    // the time base is the last field of the header
+    const uint8_t* header = bytes + OPB_HEADER_SIZE + 1;
+    if (size - (OPB_HEADER_SIZE + 1) < OpbHeaderSize(version, 0)) {
+        return OPBERR_INVALID_DATA;
+    }
+    uint32_t flags = ReadBE32(header + 4);
+    size_t headerSize = OpbHeaderSize(version, flags);
+    if (size - (OPB_HEADER_SIZE + 1) < headerSize) {
+        return OPBERR_INVALID_DATA;
+    }
+    if (flags & OPB_FLAG_TIMEBASE) {
+        *timeBase = ReadBE32(header + headerSize - 4);
+    }
+    return *timeBase != 0 ? 0 : OPBERR_INVALID_DATA;
+}
+
+#ifdef OPB_SELF_TEST
+// encodes every value from first to last (at most 2^29 - 1) with the encoder's uint7+ writer and checks that the
+// reference and branch-reduced decoders all agree on the value and its length. this is a self-test for new compilers
+// and platforms, so it's only built with OPB_SELF_TEST
+int OPB_VerifyUint7(uint32_t first, uint32_t last) {
+    uint8_t encoded[16 + 4] = { 0 };
+    MemoryWriter writer = { encoded, sizeof(encoded), 0 };
+
+    Context context = { 0 };
+    context.Write = WriteToMemory;
+    context.UserData = &writer;
+
+    if (last > 0x1FFFFFFF) {
+        last = 0x1FFFFFFF;
+    }
+
+    for (uint64_t v = first; v <= last; v++) {
+        uint32_t value = (uint32_t)v;
+
+        // write the value three times over so the chunk header decoders can be checked as well
+        writer.Position = 0;
+        for (int i = 0; i < 3; i++) {
+            if (WriteUint7(&context, value)) return OPBERR_WRITE_ERROR;
+        }
+        int length = (int)(writer.Position / 3);
+        memset(encoded + writer.Position, 0xFF, sizeof(encoded) - writer.Position); // garbage past the end
+
+        Context reader = { 0 };
+        reader.Memory = encoded;
+        reader.MemorySize = length;
+        int reference = ReadUint7Reference(&reader);
+
+        int scalarLength;
+        uint32_t scalar = DecodeUint7Scalar(encoded, &scalarLength);
+
+        int fastLength;
+        uint32_t fast = DecodeUint7(encoded, &fastLength);
+
+        uint32_t header[3], headerScalar[3];
+        size_t headerSize = DecodeChunkHeader(encoded, header);
+        size_t headerScalarSize = DecodeChunkHeaderScalar(encoded, headerScalar);
+
+        if (reference != (int)value || scalar != value || fast != value || scalarLength != length || fastLength != length ||
+            headerSize != (size_t)length * 3 || headerScalarSize != (size_t)length * 3 ||
+            header[0] != value || header[1] != value || header[2] != value ||
+            headerScalar[0] != value || headerScalar[1] != value || headerScalar[2] != value) {
+            Log("uint7+ decoders disagree on value %u (reference %d, scalar %u, fast %u)\n", value, reference, scalar, fast);
+            return OPBERR_LOGGED;
+        }
+    }
+
+    return 0;
+}
+#endif
+
 const char* OPB_GetErrorMessage(int errCode) {
     switch (errCode) {
     case OPBERR_WRITE_ERROR:
@@ -1500,6 +6651,15 @@ const char* OPB_GetErrorMessage(int errCode) {
     case OPBERR_VERSION_UNSUPPORTED:
         return "Couldn't parse OPB file; invalid version or version unsupported";
         break;
+    case OPBERR_INVALID_DATA:
+        return "Couldn't parse OPB file; the data is corrupt or truncated";
+        break;
+    case OPBERR_DICTIONARY_MISMATCH:
+        return "Couldn't parse OPB file; the instrument dictionary it was encoded with is missing or different";
+        break;
+    case OPBERR_TRACK_NOT_FOUND:
+        return "The archive has no such track";
+        break;
     default:
         return "Unknown OPB error";
     }
@@ -22,6 +22,7 @@
 //  SOFTWARE.
 */
 #pragma once
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -39,6 +40,9 @@ extern "C" {
     #define OPBERR_BUFFER_ERROR 6
     #define OPBERR_NOT_AN_OPB_FILE 7
     #define OPBERR_VERSION_UNSUPPORTED 8
+    #define OPBERR_INVALID_DATA 9 // reported by OPB_Validate, which sends the offset and reason to OPB_Log
+    #define OPBERR_DICTIONARY_MISMATCH 10 // data encoded with an instrument dictionary was decoded without that dictionary
+    #define OPBERR_TRACK_NOT_FOUND 11
 
     typedef struct OPB_Command {
         uint16_t Addr;
@@ -46,11 +50,141 @@ extern "C" {
         double Time;
     } OPB_Command;
 
+    // OPL command with an integer time since the start of the stream, produced by OPB_RawMemoryToTicks and
+    // OPB_MemoryToTicks. The time is in units of the data's time base, see OPB_GetTimeBase
+    typedef struct OPB_TickCommand {
+        uint16_t Addr;
+        uint8_t Data;
+        int64_t Time;
+    } OPB_TickCommand;
+
+    // Address of raw format delay records, which only add their elapsed time and are skipped by the decoder
+    #define OPB_RAW_DELAY_ADDR 0xFFFF
+
+    // Time bases for OPB_EncodeOptions.TimeBase, in chunk time units per second: milliseconds, the default, or
+    // samples at the VGM sample rate or the OPL chip's own output rate
+    #define OPB_TIMEBASE_MS 1000
+    #define OPB_TIMEBASE_VGM 44100
+    #define OPB_TIMEBASE_OPL 49716
+
+    // loop point of archive tracks that don't loop
+    #define OPB_NO_LOOP 0xFFFFFFFF
+
+    // Instrument table shared by a set of OPB files, see OPB_NewDictionary and OPB_DictionaryFromMemory
+    typedef struct OPB_Dictionary OPB_Dictionary;
+
     typedef enum OPB_Format {
         OPB_Format_Default,
         OPB_Format_Raw,
+        OPB_Format_Compressed,  // the default format with entropy coded chunks
     } OPB_Format;
 
+    // Kinds of commands stored in OPB chunks, used by the encode and decode statistics
+    typedef enum OPB_CommandKind {
+        OPB_CommandKind_Plain,          // regular register write
+        OPB_CommandKind_SetInstrument,  // 0xD0 set instrument
+        OPB_CommandKind_PlayInstrument, // 0xD1 set instrument and play note
+        OPB_CommandKind_CombinedNote,   // 0xD7-0xDF combined note and frequency
+        OPB_CommandKind_BackReference,  // 0xD2 repeat earlier chunks
+        OPB_CommandKind_FourOpInstrument, // 0xD3-0xD4 set the instruments of a 4-op channel pair
+        OPB_CommandKind_RhythmInstrument, // 0xD5-0xD6 set a drum instrument and key the drums
+        OPB_CommandKind_GroupInstrument, // 0xD0-0xD1 set or play one instrument on several channels
+        OPB_CommandKind_DeltaFrequency, // 0xF6-0xFE move a channel's frequency by a small delta
+        OPB_CommandKind_Count
+    } OPB_CommandKind;
+
+    typedef struct OPB_CommandStats {
+        size_t Count;
+        size_t Bytes;
+    } OPB_CommandStats;
+
+    // Encoder statistics. Times are wall clock seconds.
+    typedef struct OPB_EncodeStats {
+        double SeparateTime;        // splitting the command stream into channels
+        double OptimizeTime;        // choosing the instrument table, see OPB_EncodeOptions.InstrumentEffort
+        double ProcessTime[19];     // per channel, the final entry holds writes that don't belong to a channel
+        double GroupTime;           // combining instrument commands of different channels
+        double SortTime;            // merging channels back into received order
+        double DeltaTime;           // replacing frequency changes with deltas
+        double BackReferenceTime;   // finding repeated runs of chunks
+        double EntropyTime;         // compressed format only: building entropy codes and coding the chunks
+        double MeasureTime;         // computing the output size and chunk count
+        double InstrumentTime;      // writing the instrument table
+        double ChunkTime;           // writing chunks
+        double TotalTime;
+        size_t Allocations;         // heap allocations made by the encoder
+        size_t InstrumentCount;
+        size_t InstrumentBytes;
+        size_t ChunkCount;
+        size_t ChunksReferenced;    // chunks replaced by back references
+        size_t CommandsCoalesced;   // commands moved to an earlier time by OPB_EncodeOptions.CoalesceWindow
+        size_t ChunkHeaderBytes;    // elapsed time and command counts at the start of each chunk
+        size_t EntropyBytes;        // compressed format only: code lengths and coded chunks, which replace the chunk
+                                    // and command bytes counted before coding
+        size_t TotalBytes;
+        OPB_CommandStats Commands[OPB_CommandKind_Count];
+    } OPB_EncodeStats;
+
+    // Optional encoder settings. Zero-initialize and set only the fields you need.
+    typedef struct OPB_EncodeOptions {
+        OPB_EncodeStats* Stats;     // filled in after encoding if not NULL
+        int RawDelayRecords;        // raw format only: split gaps of over 65535 ms with delay records instead of
+                                    // letting the uint16 elapsed time wrap. Older decoders see them as writes to 0xFFFF
+        const OPB_Dictionary* Dictionary; // default format only: dictionary instruments are referenced instead of
+                                    // stored in the file, which then needs the same dictionary to decode
+        int BackReferences;         // default format only: replace repeated runs of chunks with references to
+                                    // their earlier occurrence. Needs a decoder that supports version 2 files
+        uint32_t TimeBase;          // default and compressed formats: chunk time units per second, at most 1000000.
+                                    // 0 means OPB_TIMEBASE_MS. Any other time base is stored in the header and needs
+                                    // a decoder that supports version 2 files
+        double CoalesceWindow;      // default and compressed formats: seconds after the first write of an event
+                                    // within which later writes are moved to its time, so writes a real-time player
+                                    // made microseconds apart share a chunk and can be combined. 0 keeps exact times
+        int VoiceCommands;          // default and compressed formats: combine the instruments of 4-op channel pairs
+                                    // and of rhythm mode drums with the write to 0xBD that keys them into commands of
+                                    // their own. Needs a decoder that supports version 2 files
+        int GroupInstruments;       // default and compressed formats: store instrument commands that set the same
+                                    // instrument on several channels at the same time, like the notes of a chord, as
+                                    // one command. Needs a decoder that supports version 2 files
+        int DeltaFrequencies;       // default and compressed formats: store frequency changes of a few units, like
+                                    // the steps of pitch slides and vibrato, as deltas to the channel's previous
+                                    // frequency. Needs a decoder that supports version 2 files
+        int InstrumentEffort;       // default and compressed formats: 0 creates instruments in the order they are
+                                    // first needed. 1 to 3 gather every instrument the song needs first and choose a
+                                    // small table that covers them all, spending more encode time at higher levels.
+                                    // The output stays readable by every decoder
+    } OPB_EncodeOptions;
+
+    // Decoder statistics, updated while decoding. Times are wall clock seconds.
+    // For raw format files every batch of up to BatchSize entries counts as one chunk.
+    typedef struct OPB_DecodeStats {
+        size_t ReadCalls;                           // reader callbacks issued
+        size_t BytesRead;                           // bytes consumed from the reader
+        size_t Submissions;                         // receiver callbacks issued
+        size_t ChunksRead;
+        size_t CommandsEmitted;                     // OPL commands sent to the receiver
+        OPB_CommandStats Commands[OPB_CommandKind_Count]; // stored commands read and their size in bytes
+        size_t Emitted[OPB_CommandKind_Count];      // OPL commands each kind of stored command expanded into
+        size_t MaxChunkCommands;                    // most OPL commands emitted by a single chunk
+        double MaxChunkTime;                        // longest time spent on a single chunk, including receiver calls
+        size_t IntervalMaxChunkCommands;            // same as the above, but reset after every sample
+        double IntervalMaxChunkTime;
+        double TotalTime;
+    } OPB_DecodeStats;
+
+    // Receives the running decoder statistics during a decode, see OPB_DecodeOptions
+    typedef void (*OPB_DecodeSampler)(const OPB_DecodeStats* stats, void* context);
+
+    // Optional decoder settings. Zero-initialize and set only the fields you need.
+    typedef struct OPB_DecodeOptions {
+        OPB_DecodeStats* Stats;     // filled in while decoding if not NULL
+        OPB_DecodeSampler Sampler;  // called with the running Stats every SampleInterval chunks, requires Stats
+        uint32_t SampleInterval;    // chunks between samples, 0 samples every chunk
+        void* SamplerData;          // passed to Sampler as its context argument
+        size_t BatchSize;           // raw format entries per receiver call, 0 for the default of 256
+        const OPB_Dictionary* Dictionary; // required for data encoded with a dictionary, unused otherwise
+    } OPB_DecodeOptions;
+
     const char* OPB_GetErrorMessage(int errCode);
 
     const char* OPB_GetFormatName(OPB_Format fmt);
@@ -86,19 +220,178 @@ extern "C" {
     // Should return 0 if successful. Note that the array for `commandStream` is stack allocated and must be copied!
     typedef int(*OPB_BufferReceiver)(OPB_Command* commandStream, size_t commandCount, void* context);
 
+    // Same as OPB_BufferReceiver, for OPB_TickCommand items read by OPB_RawMemoryToTicks
+    typedef int(*OPB_TickReceiver)(OPB_TickCommand* commandStream, size_t commandCount, void* context);
+
     // OPL command stream to binary. Returns 0 if successful.
+    // The encoder writes strictly front to back, so seek and tell are no longer used and may be NULL.
     int OPB_OplToBinary(OPB_Format format, OPB_Command* commandStream, size_t commandCount,
         OPB_StreamWriter write, OPB_StreamSeeker seek, OPB_StreamTeller tell, void* userData);
 
+    // OPL command stream to binary through a write handler only. Output is written strictly front to back, so
+    // write may target non-seekable sinks such as pipes, sockets or streaming compressors. Returns 0 if successful.
+    int OPB_OplToStream(OPB_Format format, OPB_Command* commandStream, size_t commandCount,
+        OPB_StreamWriter write, void* userData);
+
+    // Same as OPB_OplToStream, with optional encoder settings. options may be NULL. Returns 0 if successful.
+    int OPB_OplToStreamEx(OPB_Format format, OPB_Command* commandStream, size_t commandCount,
+        OPB_StreamWriter write, void* userData, const OPB_EncodeOptions* options);
+
     // OPL command stream to file. Returns 0 if successful.
     int OPB_OplToFile(OPB_Format format, OPB_Command* commandStream, size_t commandCount, const char* file);
 
+    // Computes the exact size in bytes of the OPB binary for an OPL command stream, so callers can preflight
+    // buffers for OPB_OplToBuffer. This runs the full encoding analysis. Returns 0 if successful.
+    int OPB_EstimateSize(OPB_Format format, OPB_Command* commandStream, size_t commandCount, size_t* size);
+
+    // OPL command stream to a newly allocated buffer of exactly the right size, which must be released with free().
+    // Returns 0 if successful.
+    int OPB_OplToMemory(OPB_Format format, OPB_Command* commandStream, size_t commandCount, void** buffer, size_t* size);
+
+    // Same as OPB_OplToMemory, with optional encoder settings. options may be NULL. Returns 0 if successful.
+    int OPB_OplToMemoryEx(OPB_Format format, OPB_Command* commandStream, size_t commandCount, void** buffer, size_t* size,
+        const OPB_EncodeOptions* options);
+
+    // OPL command stream to a caller-provided buffer. Fails if the buffer is smaller than the size reported by
+    // OPB_EstimateSize. The number of bytes written is stored in size. Returns 0 if successful.
+    int OPB_OplToBuffer(OPB_Format format, OPB_Command* commandStream, size_t commandCount, void* buffer, size_t bufferSize, size_t* size);
+
     // OPB binary to OPL command stream. Returns 0 if successful.
     int OPB_BinaryToOpl(OPB_StreamReader reader, void* readerData, OPB_BufferReceiver receiver, void* receiverData);
 
+    // Same as OPB_BinaryToOpl, with optional decoder settings. options may be NULL. Returns 0 if successful.
+    int OPB_BinaryToOplEx(OPB_StreamReader reader, void* readerData, OPB_BufferReceiver receiver, void* receiverData,
+        const OPB_DecodeOptions* options);
+
+    // OPB data in memory to OPL command stream. This avoids reader callbacks and decodes uint7+ values with
+    // branch-reduced (SSE2 or BMI2 where the compiler targets them) decoders. Returns 0 if successful.
+    int OPB_MemoryToOpl(const void* data, size_t size, OPB_BufferReceiver receiver, void* receiverData);
+
+    // Same as OPB_MemoryToOpl, with optional decoder settings. options may be NULL. Returns 0 if successful.
+    int OPB_MemoryToOplEx(const void* data, size_t size, OPB_BufferReceiver receiver, void* receiverData,
+        const OPB_DecodeOptions* options);
+
+    // Checks that OPB data in memory is well formed without decoding it: the header and its size field, instrument
+    // indices, channels, chunk and command counts and truncation. Data that passes decodes without errors, given the
+    // dictionary it was encoded with if any. Runs in a single pass and never reads outside the buffer. Returns 0 if the data is valid, otherwise OPBERR_NOT_AN_OPB_FILE,
+    // OPBERR_VERSION_UNSUPPORTED or OPBERR_INVALID_DATA, and stores the offset of the offending byte in errorOffset
+    // if it isn't NULL.
+    int OPB_Validate(const void* data, size_t size, size_t* errorOffset);
+
+    // Raw format OPB data in memory (or a memory mapped file) to OPL commands with integer millisecond times. Records
+    // are decoded straight from data in batches of options->BatchSize without converting times to floating point.
+    // Fails for default format data. options may be NULL. Returns 0 if successful.
+    int OPB_RawMemoryToTicks(const void* data, size_t size, OPB_TickReceiver receiver, void* receiverData,
+        const OPB_DecodeOptions* options);
+
+    // OPB data of any format in memory to OPL commands with integer times in units of the data's time base, so
+    // players can schedule writes to the sample without floating point. Raw format data is decoded the same way as
+    // OPB_RawMemoryToTicks. options may be NULL. Returns 0 if successful.
+    int OPB_MemoryToTicks(const void* data, size_t size, OPB_TickReceiver receiver, void* receiverData,
+        const OPB_DecodeOptions* options);
+
+    // Reads the time base of OPB data from its header: the number of time units per second that chunk times and
+    // OPB_TickCommand times count. This is OPB_TIMEBASE_MS for raw format data and for data encoded without a time
+    // base. Returns 0 if successful.
+    int OPB_GetTimeBase(const void* data, size_t size, uint32_t* timeBase);
+
     // OPB file to OPL command stream. Returns 0 if successful.
     int OPB_FileToOpl(const char* file, OPB_BufferReceiver receiver, void* receiverData);
 
+    // VGM data to OPB binary. Supports YM3812, YM3526, Y8950 and YMF262 command streams from VGM version 1.51 and up.
+    // Gzip compressed (VGZ) data is detected and decompressed automatically. seek and tell are not used and may be NULL.
+    // Returns 0 if successful.
+    int OPB_VgmToBinary(OPB_Format format, const void* vgmData, size_t vgmSize,
+        OPB_StreamWriter write, OPB_StreamSeeker seek, OPB_StreamTeller tell, void* userData);
+
+    // Same as OPB_VgmToBinary through a write handler only, with optional encoder settings. options may be NULL.
+    // Returns 0 if successful.
+    int OPB_VgmToStreamEx(OPB_Format format, const void* vgmData, size_t vgmSize,
+        OPB_StreamWriter write, void* userData, const OPB_EncodeOptions* options);
+
+    // VGM or VGZ file to OPB file. Returns 0 if successful.
+    int OPB_VgmFileToFile(OPB_Format format, const char* vgmFile, const char* opbFile);
+
+    // Reads an entire file into a newly allocated buffer which must be released with free(). Errors are sent to
+    // OPB_Log. Returns 0 if successful.
+    int OPB_ReadFile(const char* file, void** data, size_t* size);
+
+    // Creates an empty instrument dictionary to be filled with OPB_DictionaryAddBinary and completed with
+    // OPB_FinishDictionary. Release it with OPB_FreeDictionary. Returns 0 if successful.
+    int OPB_NewDictionary(OPB_Dictionary** dictionary);
+
+    // Counts the instruments stored in default format OPB data towards a new dictionary. Data that was itself encoded
+    // with a dictionary only contributes its own instruments. Returns 0 if successful.
+    int OPB_DictionaryAddBinary(OPB_Dictionary* dictionary, const void* data, size_t size);
+
+    // Completes a new dictionary with the instruments found in at least minFiles of the added files, most widely
+    // shared first so the most common instruments get the shortest indices. Returns 0 if successful.
+    int OPB_FinishDictionary(OPB_Dictionary* dictionary, size_t minFiles);
+
+    // Loads a dictionary saved by OPB_DictionaryToMemory. Release it with OPB_FreeDictionary. Returns 0 if successful.
+    int OPB_DictionaryFromMemory(const void* data, size_t size, OPB_Dictionary** dictionary);
+
+    // Saves a dictionary to a newly allocated buffer, which must be released with free(). The result is a default
+    // format OPB file without chunks that holds the dictionary as its instrument table. Returns 0 if successful.
+    int OPB_DictionaryToMemory(const OPB_Dictionary* dictionary, void** buffer, size_t* size);
+
+    // Number of instruments in a dictionary
+    size_t OPB_DictionaryCount(const OPB_Dictionary* dictionary);
+
+    void OPB_FreeDictionary(OPB_Dictionary* dictionary);
+
+    // A track to store in an archive. Data is a complete OPB file and LoopPoint the time in milliseconds to loop back
+    // to, or OPB_NO_LOOP.
+    typedef struct OPB_ArchiveEntry {
+        const char* Name;
+        const void* Data;
+        size_t Size;
+        uint32_t LoopPoint;
+    } OPB_ArchiveEntry;
+
+    // A track in an open archive. Name and Data point into the archive and stay valid until it is closed.
+    typedef struct OPB_ArchiveTrack {
+        const char* Name;
+        const void* Data;
+        size_t Size;
+        uint32_t Duration; // milliseconds
+        uint32_t LoopPoint;
+    } OPB_ArchiveTrack;
+
+    typedef struct OPB_Archive OPB_Archive;
+
+    // Stores many OPB files in one archive with a sorted directory of tracks. Tracks encoded with an instrument
+    // dictionary must all use the given dictionary, which is stored in the archive once; dictionary may be NULL.
+    // Every track is validated and needs a unique name. Returns 0 if successful.
+    int OPB_WriteArchive(const OPB_ArchiveEntry* entries, size_t count, const OPB_Dictionary* dictionary,
+        OPB_StreamWriter write, void* userData);
+
+    // Opens an archive in memory without copying it. data must stay valid until the archive is closed. Checks the
+    // directory but not the tracks themselves, which OPB_Validate can do. Returns 0 if successful.
+    int OPB_OpenArchive(const void* data, size_t size, OPB_Archive** archive);
+
+    // Opens an archive file by memory mapping it. Returns 0 if successful.
+    int OPB_MapArchive(const char* file, OPB_Archive** archive);
+
+    void OPB_CloseArchive(OPB_Archive* archive);
+
+    size_t OPB_ArchiveTrackCount(const OPB_Archive* archive);
+
+    // The archive's instrument dictionary, for decoding its tracks, or NULL if it has none
+    const OPB_Dictionary* OPB_ArchiveDictionary(const OPB_Archive* archive);
+
+    // Gets a track by its index in the directory, which is sorted by name hash. Returns 0 if successful.
+    int OPB_ArchiveGetTrack(const OPB_Archive* archive, size_t index, OPB_ArchiveTrack* track);
+
+    // Looks a track up by name in O(log n) time. Returns 0 if successful or OPBERR_TRACK_NOT_FOUND.
+    int OPB_ArchiveFindTrack(const OPB_Archive* archive, const char* name, OPB_ArchiveTrack* track);
+
+#ifdef OPB_SELF_TEST
+    // Checks the uint7+ decoders against the reference decoder for every value from first to last (at most
+    // 2^29 - 1). Only built with OPB_SELF_TEST defined, as opb_bench does for --verify-uint7. Returns 0 if successful.
+    int OPB_VerifyUint7(uint32_t first, uint32_t last);
+#endif
+
     // OPBLib log function
     typedef void (*OPB_LogHandler)(const char* s);
     extern OPB_LogHandler OPB_Log;